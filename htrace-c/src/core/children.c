@@ -0,0 +1,185 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "core/span_id.h"
+#include "util/log.h"
+#include "util/rand.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file children.c
+ *
+ * Implementation of bulk child span creation.
+ *
+ * A group of child spans lives in a single allocation: the group header, then
+ * the array of children, then the shared description string.  Each child
+ * holds a reference to the group, and the last child to be closed frees it.
+ * Since children may be closed on any thread, the reference count is updated
+ * atomically.
+ */
+
+/**
+ * The maximum number of span ids to generate with one call to the random
+ * source.
+ */
+#define HTRACE_CHILD_ID_BURST 64
+
+struct htrace_child_group;
+
+struct htrace_child {
+    /**
+     * The group which this child belongs to.
+     */
+    struct htrace_child_group *group;
+
+    /**
+     * The child span.  Its description points into the group.
+     */
+    struct htrace_span span;
+};
+
+struct htrace_child_group {
+    /**
+     * The tracer.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The number of children which have not been closed yet.
+     */
+    int refcnt;
+
+    /**
+     * The children.  The description string follows this array.
+     */
+    struct htrace_child children[];
+};
+
+/**
+ * Generate the low halves of the children's span ids.
+ *
+ * @param tracer        The tracer.
+ * @param group         The group.
+ * @param num           The number of children.
+ */
+static void htrace_child_ids_generate(struct htracer *tracer,
+                                      struct htrace_child_group *group,
+                                      int num)
+{
+    uint64_t lows[HTRACE_CHILD_ID_BURST];
+    int i, j, burst;
+
+    for (i = 0; i < num; i += burst) {
+        burst = num - i;
+        if (burst > HTRACE_CHILD_ID_BURST) {
+            burst = HTRACE_CHILD_ID_BURST;
+        }
+        random_u64_fill(tracer->rnd, lows, burst);
+        for (j = 0; j < burst; j++) {
+            while (lows[j] == 0) {
+                lows[j] = random_u64(tracer->rnd);
+            }
+            group->children[i + j].span.span_id.low = lows[j];
+        }
+    }
+}
+
+int htrace_start_children(struct htracer *tracer,
+                          const struct htrace_span_id *parent,
+                          const char *desc, int num,
+                          struct htrace_child **out)
+{
+    struct htrace_child_group *group;
+    size_t desc_len;
+    uint64_t begin;
+    char *gdesc;
+    int i;
+
+    if (num <= 0) {
+        return 0;
+    }
+    if (parent == NULL || (!parent->high && !parent->low)) {
+        return 0;
+    }
+    // Validate the description string once for the whole group.  This
+    // ensures that it doesn't have anything silly in it like embedded double
+    // quotes, backslashes, or control characters.
+    if (!validate_json_string(tracer->lg, desc)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "htrace_start_children(desc=%s): invalid "
+                    "description string.\n", desc);
+        return 0;
+    }
+    desc_len = strlen(desc) + 1;
+    group = malloc(sizeof(*group) + (sizeof(struct htrace_child) * num) +
+                   desc_len);
+    if (!group) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_start_children(desc=%s, num=%d): "
+                    "OOM\n", desc, num);
+        return 0;
+    }
+    group->tracer = tracer;
+    group->refcnt = num;
+    gdesc = (char*)(group->children + num);
+    memcpy(gdesc, desc, desc_len);
+    begin = now_us(tracer->lg);
+    for (i = 0; i < num; i++) {
+        struct htrace_child *child = group->children + i;
+        child->group = group;
+        child->span.desc = gdesc;
+        child->span.begin_ms = begin;
+        child->span.end_ms = 0;
+        child->span.span_id.high = parent->high;
+        child->span.trid = NULL;
+        child->span.flags = 0;
+        child->span.num_parents = 1;
+        child->span.parent.single = *parent;
+        out[i] = child;
+    }
+    htrace_child_ids_generate(tracer, group, num);
+    return num;
+}
+
+void htrace_child_get_span_id(const struct htrace_child *child,
+                              struct htrace_span_id *id)
+{
+    htrace_span_id_copy(id, &child->span.span_id);
+}
+
+void htrace_child_close(struct htrace_child *child, uint64_t end)
+{
+    struct htrace_child_group *group = child->group;
+    struct htracer *tracer = group->tracer;
+
+    child->span.end_ms = end ? end : now_us(tracer->lg);
+    htracer_add_span(tracer, &child->span);
+    if (__atomic_sub_fetch(&group->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(group);
+    }
+}
+
+// vim:ts=4:sw=4:et
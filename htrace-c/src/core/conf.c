@@ -33,8 +33,39 @@
      ";" HTRACED_WRITE_TIMEO_MS_KEY "=60000"\
      ";" HTRACED_READ_TIMEO_MS_KEY "=60000"\
      ";" HTRACE_TRACER_ID "=%{tname}/%{ip}"\
+     ";" HTRACE_SPAN_ID_SCHEME_KEY "=random"\
+     ";" HTRACE_TRACER_LAZY_KEY "=false"\
+     ";" HTRACE_INFLIGHT_KEY "=false"\
+     ";" HTRACE_INFLIGHT_THRESHOLD_MS_KEY "=60000"\
+     ";" HTRACE_INFLIGHT_INTERVAL_MS_KEY "=10000"\
+     ";" HTRACE_FLIGHT_RECORDER_SLOTS_KEY "=256"\
+     ";" HTRACE_FLIGHT_RECORDER_THREADS_KEY "=64"\
+     ";" HTRACE_FLIGHT_RECORDER_SIGNAL_KEY "=false"\
+     ";" HTRACE_FLIGHT_RECORDER_UNSAMPLED_KEY "=false"\
+     ";" HTRACE_SIGSAFE_SLOTS_KEY "=0"\
+     ";" HTRACE_SIGSAFE_DRAIN_INTERVAL_MS_KEY "=100"\
+     ";" HTRACE_PROFILER_HZ_KEY "=0"\
+     ";" HTRACE_PROFILER_DEPTH_KEY "=32"\
+     ";" HTRACE_PROFILER_SAMPLES_KEY "=256"\
+     ";" HTRACE_PROFILER_AGGREGATE_KEY "=desc"\
+     ";" HTRACE_PROFILER_FLUSH_INTERVAL_MS_KEY "=1000"\
+     ";" HTRACE_LOCK_THRESHOLD_US_KEY "=1000"\
+     ";" HTRACE_LOCK_INTERPOSE_KEY "=false"\
      ";" HTRACED_ADDRESS_KEY "=localhost:9096"\
      ";" HTRACED_BUFFER_SEND_TRIGGER_FRACTION "=0.50"\
+     ";" HTRACED_BUFFER_HUGE_PAGES_KEY "=none"\
+     ";" HTRACE_FTRACE_DIR_KEY "=/sys/kernel/tracing"\
+     ";" HTRACE_FTRACE_RAW_KEY "=false"\
+     ";" HTRACE_PERFETTO_FORMAT_KEY "=proto"\
+     ";" HTRACE_ZIPKIN_PATH_KEY "=/api/v2/spans"\
+     ";" HTRACE_ZIPKIN_FLUSH_INTERVAL_MS_KEY "=1000"\
+     ";" HTRACE_ZIPKIN_TIMEO_MS_KEY "=30000"\
+     ";" HTRACE_ZIPKIN_BUFFER_SIZE_KEY "=8388608"\
+     ";" HTRACE_ZIPKIN_REQUEST_SIZE_KEY "=1048576"\
+     ";" HTRACED_BUFFER_PREFAULT_KEY "=none"\
+     ";" HTRACE_LOG_LEVEL_KEY "=info"\
+     ";" HTRACE_LOG_ASYNC_KEY "=false"\
+     ";" HTRACE_MEMORY_BUDGET_CGROUP_FRACTION_KEY "=0.1"\
     )
 
 static int parse_key_value(char *str, char **key, char **val)
@@ -131,6 +162,75 @@ static void htrace_tuple_free(void *ctx, void *key, void *val)
     free(val);
 }
 
+struct htrace_conf_copy_ctx {
+    struct htable *dst;
+    int ret;
+};
+
+static void htrace_tuple_copy(void *c, void *key, void *val)
+{
+    struct htrace_conf_copy_ctx *ctx = c;
+    char *nkey, *nval;
+
+    if (ctx->ret) {
+        return;
+    }
+    nkey = strdup(key);
+    nval = strdup(val);
+    if ((!nkey) || (!nval)) {
+        goto oom;
+    }
+    ctx->ret = htable_put(ctx->dst, nkey, nval);
+    if (ctx->ret) {
+        goto oom;
+    }
+    return;
+
+oom:
+    free(nkey);
+    free(nval);
+    ctx->ret = ENOMEM;
+}
+
+static struct htable *htable_copy(struct htable *src)
+{
+    struct htrace_conf_copy_ctx ctx;
+
+    ctx.dst = htable_alloc(8, ht_hash_string, ht_compare_string);
+    if (!ctx.dst) {
+        return NULL;
+    }
+    ctx.ret = 0;
+    htable_visit(src, htrace_tuple_copy, &ctx);
+    if (ctx.ret) {
+        htable_visit(ctx.dst, htrace_tuple_free, NULL);
+        htable_free(ctx.dst);
+        return NULL;
+    }
+    return ctx.dst;
+}
+
+struct htrace_conf *htrace_conf_copy(const struct htrace_conf *cnf)
+{
+    struct htrace_conf *ncnf;
+
+    ncnf = calloc(1, sizeof(*ncnf));
+    if (!ncnf) {
+        return NULL;
+    }
+    ncnf->values = htable_copy(cnf->values);
+    if (!ncnf->values) {
+        htrace_conf_free(ncnf);
+        return NULL;
+    }
+    ncnf->defaults = htable_copy(cnf->defaults);
+    if (!ncnf->defaults) {
+        htrace_conf_free(ncnf);
+        return NULL;
+    }
+    return ncnf;
+}
+
 void htrace_conf_free(struct htrace_conf *cnf)
 {
     if (!cnf) {
@@ -169,8 +269,9 @@ static int convert_double(struct htrace_log *log, const char *key,
     ret = strtod(in, &endptr);
     if (errno) {
         err = errno;
-        htrace_log(log, "error parsing %s for %s: %d (%s)\n",
-                   in, key, err, terror(err));
+        htrace_logl(log, HTRACE_LOG_ERROR,
+                    "error parsing %s for %s: %d (%s)\n", in, key, err,
+                    terror(err));
         return 0;
     }
     while (1) {
@@ -179,8 +280,9 @@ static int convert_double(struct htrace_log *log, const char *key,
             break;
         }
         if (!((c == ' ') || (c == '\t'))) {
-            htrace_log(log, "error parsing %s for %s: garbage at end "
-                       "of string.\n", in, key);
+            htrace_logl(log, HTRACE_LOG_ERROR,
+                        "error parsing %s for %s: garbage at end "
+                        "of string.\n", in, key);
             return 0;
         }
         endptr++;
@@ -221,8 +323,9 @@ static int convert_u64(struct htrace_log *log, const char *key,
     ret = strtoull(in, &endptr, 10);
     if (errno) {
         err = errno;
-        htrace_log(log, "error parsing %s for %s: %d (%s)\n",
-                   in, key, err, terror(err));
+        htrace_logl(log, HTRACE_LOG_ERROR,
+                    "error parsing %s for %s: %d (%s)\n", in, key, err,
+                    terror(err));
         return 0;
     }
     while (1) {
@@ -231,8 +334,9 @@ static int convert_u64(struct htrace_log *log, const char *key,
             break;
         }
         if (!((c == ' ') || (c == '\t'))) {
-            htrace_log(log, "error parsing %s for %s: garbage at end "
-                       "of string.\n", in, key);
+            htrace_logl(log, HTRACE_LOG_ERROR,
+                        "error parsing %s for %s: garbage at end "
+                        "of string.\n", in, key);
             return 0;
         }
         endptr++;
@@ -59,6 +59,17 @@ struct htrace_conf {
 struct htrace_conf *htrace_conf_from_strs(const char *values,
                                           const char *defaults);
 
+/**
+ * Make a copy of an HTrace configuration object.
+ *
+ * The copy must be later freed with htrace_conf_free.
+ *
+ * @param cnf       The configuration object to copy.
+ *
+ * @return          NULL on OOM; the copy otherwise.
+ */
+struct htrace_conf *htrace_conf_copy(const struct htrace_conf *cnf);
+
 /**
  * Free an HTrace configuration object.
  *
@@ -0,0 +1,199 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/flight_reader.h"
+#include "core/flight_recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @file flight_reader.c
+ *
+ * Implementation of the flight recorder file reader.
+ */
+
+static int fr_read_all(const char *path, struct fr_file *file,
+                       char *err, size_t err_len)
+{
+    struct stat st;
+    ssize_t res;
+    uint64_t off = 0;
+    int fd, ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ret = errno;
+        snprintf(err, err_len, "failed to open %s: %s", path, strerror(ret));
+        return ret;
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = errno;
+        snprintf(err, err_len, "failed to stat %s: %s", path, strerror(ret));
+        close(fd);
+        return ret;
+    }
+    file->len = st.st_size;
+    file->buf = malloc(file->len ? file->len : 1);
+    if (!file->buf) {
+        snprintf(err, err_len, "OOM while reading %s", path);
+        close(fd);
+        return ENOMEM;
+    }
+    while (off < file->len) {
+        res = read(fd, file->buf + off, file->len - off);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = errno;
+            snprintf(err, err_len, "failed to read %s: %s", path,
+                     strerror(ret));
+            close(fd);
+            return ret;
+        } else if (res == 0) {
+            // The file got shorter while we were reading it.
+            file->len = off;
+            break;
+        }
+        off += res;
+    }
+    close(fd);
+    return 0;
+}
+
+static int fr_span_compare(const void *a, const void *b)
+{
+    const struct fr_span *sa = a, *sb = b;
+
+    if (sa->begin_us < sb->begin_us) {
+        return -1;
+    } else if (sa->begin_us > sb->begin_us) {
+        return 1;
+    } else if (sa->end_us < sb->end_us) {
+        return -1;
+    } else if (sa->end_us > sb->end_us) {
+        return 1;
+    }
+    return 0;
+}
+
+int fr_file_read(const char *path, struct fr_file *file,
+                 char *err, size_t err_len)
+{
+    const struct fr_file_header *hdr;
+    const struct fr_ring_header *ring;
+    const struct fr_record *recs, *rec;
+    struct fr_desc *descs;
+    struct fr_span *span;
+    uint64_t max_spans, i, j;
+    int ret;
+
+    memset(file, 0, sizeof(*file));
+    ret = fr_read_all(path, file, err, err_len);
+    if (ret) {
+        goto error;
+    }
+    hdr = (const struct fr_file_header *)file->buf;
+    if ((file->len < sizeof(*hdr)) ||
+            memcmp(hdr->magic, FR_MAGIC, sizeof(hdr->magic))) {
+        snprintf(err, err_len, "%s is not a flight recorder file", path);
+        ret = EINVAL;
+        goto error;
+    }
+    if (hdr->version != FR_VERSION) {
+        snprintf(err, err_len, "%s has version %d, but only version %d is "
+                 "supported", path, (int)hdr->version, FR_VERSION);
+        ret = EINVAL;
+        goto error;
+    }
+    if ((hdr->descs_off + (sizeof(struct fr_desc) * hdr->num_descs) >
+                hdr->rings_off) ||
+            (hdr->ring_len < sizeof(struct fr_ring_header) +
+                (sizeof(struct fr_record) * (uint64_t)hdr->num_slots)) ||
+            (hdr->rings_off + (hdr->ring_len * hdr->num_rings) > file->len)) {
+        snprintf(err, err_len, "%s is truncated or corrupt", path);
+        ret = EINVAL;
+        goto error;
+    }
+    memcpy(file->trid, hdr->trid, sizeof(file->trid));
+    file->trid[sizeof(file->trid) - 1] = '\0';
+    file->pid = hdr->pid;
+    file->num_lost = hdr->num_lost;
+    max_spans = (uint64_t)hdr->num_rings * hdr->num_slots;
+    file->spans = calloc(max_spans ? max_spans : 1, sizeof(struct fr_span));
+    if (!file->spans) {
+        snprintf(err, err_len, "OOM while reading %s", path);
+        ret = ENOMEM;
+        goto error;
+    }
+    descs = (struct fr_desc *)(file->buf + hdr->descs_off);
+    for (i = 0; i < hdr->num_descs; i++) {
+        descs[i].str[FR_DESC_MAX_LEN] = '\0';
+    }
+    for (i = 0; i < hdr->num_rings; i++) {
+        ring = (const struct fr_ring_header *)(file->buf + hdr->rings_off +
+                                               (hdr->ring_len * i));
+        recs = (const struct fr_record *)(ring + 1);
+        for (j = 0; j < hdr->num_slots; j++) {
+            rec = recs + j;
+            if ((!rec->seq_begin) || (rec->seq_begin != rec->seq_end)) {
+                // Never written, or torn by a write in progress.
+                continue;
+            }
+            span = file->spans + file->num_spans++;
+            span->span_id_high = rec->span_id_high;
+            span->span_id_low = rec->span_id_low;
+            span->parent_high = rec->parent_high;
+            span->parent_low = rec->parent_low;
+            span->begin_us = rec->begin_us;
+            span->end_us = rec->end_us;
+            span->num_parents = rec->num_parents;
+            span->tid = ring->tid;
+            if ((rec->desc_id < hdr->num_descs) &&
+                    (descs[rec->desc_id].state == FR_DESC_STATE_READY)) {
+                span->desc = descs[rec->desc_id].str;
+            } else {
+                span->desc = "";
+            }
+        }
+    }
+    qsort(file->spans, file->num_spans, sizeof(struct fr_span),
+          fr_span_compare);
+    return 0;
+
+error:
+    fr_file_free(file);
+    return ret;
+}
+
+void fr_file_free(struct fr_file *file)
+{
+    free(file->spans);
+    free(file->buf);
+    memset(file, 0, sizeof(*file));
+}
+
+// vim:ts=4:sw=4:et
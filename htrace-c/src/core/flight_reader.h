@@ -0,0 +1,118 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_CORE_FLIGHT_READER_H
+#define APACHE_HTRACE_CORE_FLIGHT_READER_H
+
+/**
+ * @file flight_reader.h
+ *
+ * Reads the spans out of a flight recorder file.
+ *
+ * The reader only uses libc, so that the file can be examined on a machine
+ * which doesn't have the rest of HTrace installed.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A span read from a flight recorder file.
+ */
+struct fr_span {
+    uint64_t span_id_high;
+    uint64_t span_id_low;
+    uint64_t parent_high;
+    uint64_t parent_low;
+    uint64_t begin_us;
+    uint64_t end_us;
+
+    /**
+     * The description.  Points into the fr_file's description table, or to
+     * an empty string if the description wasn't interned.
+     */
+    const char *desc;
+
+    /**
+     * The number of parents.  Only the first is recorded.
+     */
+    uint32_t num_parents;
+
+    /**
+     * The thread which closed the span.
+     */
+    uint32_t tid;
+};
+
+/**
+ * The contents of a flight recorder file.
+ */
+struct fr_file {
+    /**
+     * The tracer ID.
+     */
+    char trid[128];
+
+    /**
+     * The process which wrote the file.
+     */
+    uint64_t pid;
+
+    /**
+     * The number of spans which couldn't be recorded.
+     */
+    uint64_t num_lost;
+
+    /**
+     * The complete records in the file, sorted by begin time.
+     */
+    struct fr_span *spans;
+    uint64_t num_spans;
+
+    /**
+     * The contents of the file.
+     */
+    char *buf;
+    uint64_t len;
+};
+
+/**
+ * Read a flight recorder file.
+ *
+ * @param path          The path to read.
+ * @param file          (out param) The contents of the file.
+ * @param err           A buffer for an error message.
+ * @param err_len       The length of the error message buffer.
+ *
+ * @return              0 on success; an error code otherwise.
+ */
+int fr_file_read(const char *path, struct fr_file *file,
+                 char *err, size_t err_len);
+
+/**
+ * Free the memory held by an fr_file.
+ *
+ * @param file          The file.
+ */
+void fr_file_free(struct fr_file *file);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,650 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/flight_recorder.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "util/log.h"
+#include "util/membudget.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * @file flight_recorder.c
+ *
+ * Implementation of the flight recorder.
+ */
+
+/**
+ * The number of entries in the description table.
+ */
+#define FR_NUM_DESCS 1024
+
+/**
+ * Bounds on the configurable sizes.
+ */
+#define FR_NUM_SLOTS_MIN 1
+#define FR_NUM_SLOTS_MAX (1024 * 1024)
+#define FR_NUM_RINGS_MIN 1
+#define FR_NUM_RINGS_MAX 65536
+
+/**
+ * The maximum number of flight recorders which can be dumped on SIGUSR2.
+ */
+#define FR_MAX_SIGNAL_RECORDERS 8
+
+/**
+ * The thread-specific value for a thread which couldn't get a ring.
+ */
+#define FR_NO_RING ((void*)1)
+
+/**
+ * The minimum interval between rate-limited log messages.
+ */
+#define FR_LOG_INTERVAL_MS 60000
+
+struct flight_recorder {
+    /**
+     * The tracer.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The path of the file.  Malloced.
+     */
+    char *path;
+
+    /**
+     * The path to copy the file to on SIGUSR2.  Malloced.
+     */
+    char *dump_path;
+
+    /**
+     * The mapping of the file.
+     */
+    void *base;
+    uint64_t len;
+
+    /**
+     * Pointers into the mapping.
+     */
+    struct fr_file_header *hdr;
+    struct fr_desc *descs;
+
+    /**
+     * Key for the current thread's ring.
+     */
+    pthread_key_t key;
+
+    /**
+     * Our index in g_fr_signal_recorders, or -1 if we aren't dumped on
+     * SIGUSR2.
+     */
+    int signal_idx;
+
+    /**
+     * Nonzero if spans which the sampler didn't pick are recorded too.
+     */
+    int unsampled;
+};
+
+/**
+ * The flight recorders to dump on SIGUSR2.  Written under g_fr_signal_lock;
+ * read atomically by the signal handler.
+ */
+static struct flight_recorder *g_fr_signal_recorders[FR_MAX_SIGNAL_RECORDERS];
+
+/**
+ * The number of signal handlers which are currently running.
+ */
+static int g_fr_signal_active;
+
+/**
+ * Protects g_fr_signal_recorders, g_fr_signal_handler_installed and
+ * g_fr_signal_old_action.
+ */
+static pthread_mutex_t g_fr_signal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Nonzero once our SIGUSR2 handler has been installed.  It is never
+ * uninstalled: a SIGUSR2 may arrive after the last flight recorder is freed,
+ * and the default action would kill the process.  With no recorders
+ * registered, the handler only passes the signal on.
+ */
+static int g_fr_signal_handler_installed;
+
+/**
+ * The SIGUSR2 action which was in place before our handler.  This is only
+ * written before the handler is installed, so the handler can read it
+ * without a lock.
+ */
+static struct sigaction g_fr_signal_old_action;
+
+static uint32_t fr_gettid(void)
+{
+#if defined(__linux__) && defined(SYS_gettid)
+    return (uint32_t)syscall(SYS_gettid);
+#else
+    static uint32_t next_tid = 1;
+    return __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static struct fr_ring_header *fr_ring(struct flight_recorder *fr, uint32_t idx)
+{
+    return (struct fr_ring_header *)((char *)fr->base +
+            fr->hdr->rings_off + (fr->hdr->ring_len * idx));
+}
+
+static void fr_ring_release(void *data)
+{
+    struct fr_ring_header *ring = data;
+
+    if (ring != FR_NO_RING) {
+        __atomic_store_n(&ring->owner, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Get the current thread's ring, claiming a free one if necessary.
+ *
+ * @return              The ring, or NULL if there were none free.
+ */
+static struct fr_ring_header *fr_ring_get(struct flight_recorder *fr)
+{
+    struct fr_ring_header *ring;
+    uint32_t i, tid, expected;
+
+    ring = pthread_getspecific(fr->key);
+    if (ring == FR_NO_RING) {
+        return NULL;
+    } else if (ring) {
+        return ring;
+    }
+    tid = fr_gettid();
+    for (i = 0; i < fr->hdr->num_rings; i++) {
+        ring = fr_ring(fr, i);
+        expected = 0;
+        if (__atomic_compare_exchange_n(&ring->owner, &expected, tid, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            ring->tid = tid;
+            pthread_setspecific(fr->key, ring);
+            return ring;
+        }
+    }
+    // Don't look again every time this thread closes a span.
+    pthread_setspecific(fr->key, FR_NO_RING);
+    HTRACE_LOG_RATE_LIMITED(fr->tracer->lg, HTRACE_LOG_WARN,
+               FR_LOG_INTERVAL_MS, "flight_recorder: all %" PRId32 " rings "
+               "are taken.  Spans closed by thread %" PRId32 " won't be "
+               "recorded.\n", fr->hdr->num_rings, tid);
+    return NULL;
+}
+
+static uint32_t fr_hash(const char *str)
+{
+    uint32_t hash = 2166136261U;
+    int i;
+
+    // FNV-1a, over the part of the string which fits in the table.
+    for (i = 0; str[i] && (i < FR_DESC_MAX_LEN); i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Find or add a description in the description table.
+ *
+ * @return              The description ID, or FR_DESC_ID_NONE if the table is
+ *                          full.
+ */
+static uint32_t fr_intern(struct flight_recorder *fr, const char *str)
+{
+    uint32_t hash, idx, i, num_descs = fr->hdr->num_descs, state;
+    struct fr_desc *desc;
+
+    hash = fr_hash(str);
+    idx = hash % num_descs;
+    for (i = 0; i < num_descs; i++) {
+        desc = fr->descs + idx;
+        state = __atomic_load_n(&desc->state, __ATOMIC_ACQUIRE);
+        if (state == FR_DESC_STATE_EMPTY) {
+            if (__atomic_compare_exchange_n(&desc->state, &state,
+                        FR_DESC_STATE_BUSY, 0, __ATOMIC_ACQUIRE,
+                        __ATOMIC_ACQUIRE)) {
+                strncpy(desc->str, str, FR_DESC_MAX_LEN);
+                desc->str[FR_DESC_MAX_LEN] = '\0';
+                desc->hash = hash;
+                __atomic_store_n(&desc->state, FR_DESC_STATE_READY,
+                                 __ATOMIC_RELEASE);
+                return idx;
+            }
+        }
+        // If another thread is adding an entry here, we may end up adding
+        // the same description twice.  That's harmless.
+        if ((state == FR_DESC_STATE_READY) && (desc->hash == hash) &&
+                (!strncmp(desc->str, str, FR_DESC_MAX_LEN))) {
+            return idx;
+        }
+        idx = (idx + 1) % num_descs;
+    }
+    return FR_DESC_ID_NONE;
+}
+
+/**
+ * Write a record to the current thread's ring.
+ *
+ * @param fr            The flight recorder.
+ * @param span_id       The span ID.
+ * @param parent        The first parent's span ID, or NULL if there are no
+ *                          parents.
+ * @param num_parents   The number of parents.
+ * @param begin_us      The begin time.
+ * @param end_us        The end time.
+ * @param desc_id       The description ID.
+ */
+static void fr_write(struct flight_recorder *fr,
+                     const struct htrace_span_id *span_id,
+                     const struct htrace_span_id *parent,
+                     uint32_t num_parents, uint64_t begin_us,
+                     uint64_t end_us, uint32_t desc_id)
+{
+    struct fr_ring_header *ring;
+    struct fr_record *rec;
+    uint64_t seq;
+
+    ring = fr_ring_get(fr);
+    if (!ring) {
+        __atomic_add_fetch(&fr->hdr->num_lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    seq = ring->head + 1;
+    rec = ((struct fr_record *)(ring + 1)) + (ring->head % fr->hdr->num_slots);
+    __atomic_store_n(&rec->seq_begin, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->seq_end, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->span_id_high = span_id->high;
+    rec->span_id_low = span_id->low;
+    rec->parent_high = parent ? parent->high : 0;
+    rec->parent_low = parent ? parent->low : 0;
+    rec->begin_us = begin_us;
+    rec->end_us = end_us;
+    rec->desc_id = desc_id;
+    rec->num_parents = num_parents;
+    __atomic_store_n(&rec->seq_end, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->seq_begin, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, seq, __ATOMIC_RELEASE);
+}
+
+void flight_recorder_add(struct flight_recorder *fr,
+                         const struct htrace_span *span)
+{
+    const struct htrace_span_id *parent = NULL;
+
+    if (span->flags & HTRACE_SPAN_FLAG_INFLIGHT) {
+        // Snapshots of open spans aren't closed spans.
+        return;
+    }
+    if (span->num_parents == 1) {
+        parent = &span->parent.single;
+    } else if (span->num_parents > 1) {
+        parent = &span->parent.list[0];
+    }
+    fr_write(fr, &span->span_id, parent, span->num_parents, span->begin_ms,
+             span->end_ms, fr_intern(fr, span->desc));
+}
+
+int flight_recorder_unsampled(const struct flight_recorder *fr)
+{
+    return fr->unsampled;
+}
+
+uint32_t flight_recorder_intern(struct flight_recorder *fr, const char *desc)
+{
+    return fr_intern(fr, desc);
+}
+
+void flight_recorder_add_unsampled(struct flight_recorder *fr,
+                                   const struct fr_open_span *fs, uint64_t end_us)
+{
+    fr_write(fr, &fs->span_id, fs->num_parents ? &fs->parent : NULL,
+             fs->num_parents, fs->begin_us, end_us, fs->desc_id);
+}
+
+int flight_recorder_dump(struct flight_recorder *fr, const char *path)
+{
+    const char *buf = fr->base;
+    uint64_t rem = fr->len;
+    ssize_t res;
+    int fd, ret = 0;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return errno;
+    }
+    while (rem > 0) {
+        res = write(fd, buf, rem);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = errno;
+            break;
+        }
+        buf += res;
+        rem -= res;
+    }
+    if (close(fd) && (!ret)) {
+        ret = errno;
+    }
+    return ret;
+}
+
+static void fr_signal_handler(int sig, siginfo_t *info, void *uc)
+{
+    struct flight_recorder *fr;
+    int i, err = errno;
+
+    // Both of these must be sequentially consistent, pairing with the store
+    // to g_fr_signal_recorders and the load of g_fr_signal_active in
+    // fr_signal_unregister.  Otherwise we could load a recorder while
+    // fr_signal_unregister sees no active handlers, and dump it after it was
+    // unmapped.
+    __atomic_add_fetch(&g_fr_signal_active, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < FR_MAX_SIGNAL_RECORDERS; i++) {
+        fr = __atomic_load_n(&g_fr_signal_recorders[i], __ATOMIC_SEQ_CST);
+        if (fr) {
+            flight_recorder_dump(fr, fr->dump_path);
+        }
+    }
+    __atomic_sub_fetch(&g_fr_signal_active, 1, __ATOMIC_ACQ_REL);
+    errno = err;
+    // We can't tell whether the signal was meant for us or for whoever had
+    // SIGUSR2 before, so pass it on to their handler too.  Don't chain to the
+    // default action, since that would kill the process.
+    if (g_fr_signal_old_action.sa_flags & SA_SIGINFO) {
+        g_fr_signal_old_action.sa_sigaction(sig, info, uc);
+    } else if ((g_fr_signal_old_action.sa_handler != SIG_DFL) &&
+               (g_fr_signal_old_action.sa_handler != SIG_IGN)) {
+        g_fr_signal_old_action.sa_handler(sig);
+    }
+}
+
+/**
+ * Arrange for a flight recorder to be dumped on SIGUSR2.
+ */
+static void fr_signal_register(struct flight_recorder *fr)
+{
+    struct sigaction act;
+    int i;
+
+    pthread_mutex_lock(&g_fr_signal_lock);
+    for (i = 0; i < FR_MAX_SIGNAL_RECORDERS; i++) {
+        if (!g_fr_signal_recorders[i]) {
+            break;
+        }
+    }
+    if (i == FR_MAX_SIGNAL_RECORDERS) {
+        pthread_mutex_unlock(&g_fr_signal_lock);
+        htrace_logl(fr->tracer->lg, HTRACE_LOG_WARN,
+                    "flight_recorder_alloc: there are already %d flight "
+                    "recorders dumped on SIGUSR2.  Not dumping %s.\n",
+                    FR_MAX_SIGNAL_RECORDERS, fr->path);
+        return;
+    }
+    if (!g_fr_signal_handler_installed) {
+        memset(&act, 0, sizeof(act));
+        act.sa_sigaction = fr_signal_handler;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&act.sa_mask);
+        // Read the old action before installing ours, so that the handler
+        // never sees it half-written.
+        if (sigaction(SIGUSR2, NULL, &g_fr_signal_old_action) ||
+                sigaction(SIGUSR2, &act, NULL)) {
+            pthread_mutex_unlock(&g_fr_signal_lock);
+            htrace_logl(fr->tracer->lg, HTRACE_LOG_ERROR,
+                        "flight_recorder_alloc: failed to "
+                        "install the SIGUSR2 handler: %s\n", terror(errno));
+            return;
+        }
+        g_fr_signal_handler_installed = 1;
+    }
+    fr->signal_idx = i;
+    __atomic_store_n(&g_fr_signal_recorders[i], fr, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_fr_signal_lock);
+}
+
+static void fr_signal_unregister(struct flight_recorder *fr)
+{
+    if (fr->signal_idx < 0) {
+        return;
+    }
+    pthread_mutex_lock(&g_fr_signal_lock);
+    __atomic_store_n(&g_fr_signal_recorders[fr->signal_idx], NULL,
+                     __ATOMIC_SEQ_CST);
+    // The SIGUSR2 handler stays installed.  See g_fr_signal_handler_installed.
+    pthread_mutex_unlock(&g_fr_signal_lock);
+    // Wait for any signal handler which might still be using the recorder.
+    while (__atomic_load_n(&g_fr_signal_active, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+    fr->signal_idx = -1;
+}
+
+/**
+ * Expand %{pid} in the configured path.
+ */
+static char *fr_expand_path(const char *path)
+{
+    const char *var;
+    char *out;
+
+    var = strstr(path, "%{pid}");
+    if (!var) {
+        return strdup(path);
+    }
+    if (asprintf(&out, "%.*s%lld%s", (int)(var - path), path,
+                 (long long)getpid(), var + strlen("%{pid}")) < 0) {
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * Create the file and map it.
+ *
+ * @return              1 on success; 0 on failure.  Errors will be logged.
+ */
+static int fr_map(struct flight_recorder *fr, uint32_t num_rings,
+                  uint32_t num_slots)
+{
+    struct htrace_log *lg = fr->tracer->lg;
+    struct fr_file_header *hdr;
+    const char *trid;
+    uint64_t descs_off, rings_off, ring_len;
+    int fd, ret;
+
+    descs_off = sizeof(struct fr_file_header);
+    rings_off = descs_off + (sizeof(struct fr_desc) * FR_NUM_DESCS);
+    ring_len = sizeof(struct fr_ring_header) +
+        (sizeof(struct fr_record) * (uint64_t)num_slots);
+    fr->len = rings_off + (ring_len * num_rings);
+    if (!membudget_reserve(fr->len)) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "flight_recorder_alloc: %" PRId64 " bytes for %s "
+                    "would put tracing over its memory budget.\n", fr->len,
+                    fr->path);
+        fr->len = 0;
+        return 0;
+    }
+    fd = open(fr->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ret = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "flight_recorder_alloc: failed to open %s: %s\n",
+                    fr->path, terror(ret));
+        goto error;
+    }
+    if (ftruncate(fd, fr->len) < 0) {
+        ret = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "flight_recorder_alloc: failed to size %s to %"
+                    PRId64 " bytes: %s\n", fr->path, fr->len, terror(ret));
+        close(fd);
+        goto error;
+    }
+    fr->base = mmap(NULL, fr->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ret = errno;
+    close(fd);
+    if (fr->base == MAP_FAILED) {
+        fr->base = NULL;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "flight_recorder_alloc: failed to map %s: %s\n", fr->path,
+                    terror(ret));
+        goto error;
+    }
+    // The file was truncated, so everything starts out zeroed.
+    hdr = fr->base;
+    hdr->version = FR_VERSION;
+    hdr->num_descs = FR_NUM_DESCS;
+    hdr->num_rings = num_rings;
+    hdr->num_slots = num_slots;
+    hdr->pid = getpid();
+    hdr->descs_off = descs_off;
+    hdr->rings_off = rings_off;
+    hdr->ring_len = ring_len;
+    trid = fr->tracer->trid ? fr->tracer->trid : fr->tracer->tname;
+    snprintf(hdr->trid, sizeof(hdr->trid), "%s", trid);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, FR_MAGIC, sizeof(hdr->magic));
+    fr->hdr = hdr;
+    fr->descs = (struct fr_desc *)((char *)fr->base + descs_off);
+    return 1;
+
+error:
+    membudget_release(fr->len);
+    fr->len = 0;
+    return 0;
+}
+
+struct flight_recorder *flight_recorder_alloc(struct htracer *tracer,
+                                              const struct htrace_conf *cnf)
+{
+    struct htrace_log *lg = tracer->lg;
+    struct flight_recorder *fr;
+    const char *path, *sig, *unsampled;
+    uint64_t num_rings, num_slots;
+    int ret;
+
+    path = htrace_conf_get(cnf, HTRACE_FLIGHT_RECORDER_PATH_KEY);
+    if ((!path) || (!path[0])) {
+        return NULL;
+    }
+    fr = calloc(1, sizeof(*fr));
+    if (!fr) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "flight_recorder_alloc: OOM\n");
+        return NULL;
+    }
+    fr->tracer = tracer;
+    fr->signal_idx = -1;
+    fr->path = fr_expand_path(path);
+    if (!fr->path || (asprintf(&fr->dump_path, "%s.dump", fr->path) < 0)) {
+        fr->dump_path = NULL;
+        htrace_logl(lg, HTRACE_LOG_ERROR, "flight_recorder_alloc: OOM\n");
+        goto error;
+    }
+    num_rings = htrace_conf_get_u64(lg, cnf,
+                                    HTRACE_FLIGHT_RECORDER_THREADS_KEY);
+    if ((num_rings < FR_NUM_RINGS_MIN) || (num_rings > FR_NUM_RINGS_MAX)) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "flight_recorder_alloc: %s must be between %d and "
+                    "%d.\n", HTRACE_FLIGHT_RECORDER_THREADS_KEY,
+                    FR_NUM_RINGS_MIN, FR_NUM_RINGS_MAX);
+        goto error;
+    }
+    num_slots = htrace_conf_get_u64(lg, cnf, HTRACE_FLIGHT_RECORDER_SLOTS_KEY);
+    if ((num_slots < FR_NUM_SLOTS_MIN) || (num_slots > FR_NUM_SLOTS_MAX)) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "flight_recorder_alloc: %s must be between %d and "
+                    "%d.\n", HTRACE_FLIGHT_RECORDER_SLOTS_KEY,
+                    FR_NUM_SLOTS_MIN, FR_NUM_SLOTS_MAX);
+        goto error;
+    }
+    ret = pthread_key_create(&fr->key, fr_ring_release);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "flight_recorder_alloc: pthread_key_create failed: "
+                    "%s\n", terror(ret));
+        goto error;
+    }
+    if (!fr_map(fr, num_rings, num_slots)) {
+        pthread_key_delete(fr->key);
+        goto error;
+    }
+    sig = htrace_conf_get(cnf, HTRACE_FLIGHT_RECORDER_SIGNAL_KEY);
+    if (sig && (!strcmp(sig, "true"))) {
+        fr_signal_register(fr);
+    }
+    unsampled = htrace_conf_get(cnf, HTRACE_FLIGHT_RECORDER_UNSAMPLED_KEY);
+    fr->unsampled = unsampled && (!strcmp(unsampled, "true"));
+    htrace_logl(lg, HTRACE_LOG_INFO, "flight_recorder_alloc: recording the "
+                "last %" PRId64 " span(s) of up to %" PRId64 " thread(s) in "
+                "%s\n", num_slots, num_rings, fr->path);
+    return fr;
+
+error:
+    free(fr->path);
+    free(fr->dump_path);
+    free(fr);
+    return NULL;
+}
+
+void flight_recorder_free(struct flight_recorder *fr)
+{
+    if (!fr) {
+        return;
+    }
+    fr_signal_unregister(fr);
+    pthread_key_delete(fr->key);
+    if (munmap(fr->base, fr->len)) {
+        htrace_logl(fr->tracer->lg, HTRACE_LOG_ERROR,
+                    "flight_recorder_free: munmap of %s "
+                    "failed: %s\n", fr->path, terror(errno));
+    }
+    membudget_release(fr->len);
+    free(fr->path);
+    free(fr->dump_path);
+    free(fr);
+}
+
+// vim:ts=4:sw=4:et
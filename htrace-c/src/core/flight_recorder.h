@@ -0,0 +1,327 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_CORE_FLIGHT_RECORDER_H
+#define APACHE_HTRACE_CORE_FLIGHT_RECORDER_H
+
+/**
+ * @file flight_recorder.h
+ *
+ * The flight recorder keeps the most recent spans closed by each thread in a
+ * ring buffer inside a memory-mapped file.  Nothing is sent anywhere.  Since
+ * the file outlives the process, the recent history of every thread can be
+ * reconstructed after a crash, or from a copy taken with
+ * flight_recorder_dump.
+ *
+ * The file layout is:
+ *
+ *      struct fr_file_header
+ *      struct fr_desc          [num_descs]
+ *      (struct fr_ring_header, struct fr_record [num_slots]) [num_rings]
+ *
+ * All integers are in host byte order.
+ *
+ * Each ring has a single writer, the thread which owns it, so writing a record
+ * takes no locks.  Readers may see a record which is being overwritten.  To
+ * detect that, the writer zeroes seq_begin and seq_end before changing the
+ * record, and sets seq_end and then seq_begin to the record's sequence number
+ * afterwards.  A record whose seq_begin and seq_end are equal and nonzero is
+ * complete.
+ *
+ * Span descriptions are interned in a fixed-size, open-addressed table, so
+ * that each record only needs a small description ID.  Descriptions longer
+ * than FR_DESC_MAX_LEN are truncated.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include "core/htrace.h" /* for struct htrace_span_id */
+
+#include <stdint.h>
+
+struct htrace_conf;
+struct htrace_span;
+struct htracer;
+
+/**
+ * The magic number at the start of a flight recorder file.
+ */
+#define FR_MAGIC "HTRACEFR"
+
+/**
+ * The version of the file layout.
+ */
+#define FR_VERSION 1
+
+/**
+ * The maximum length of an interned description, not including the
+ * terminating null.
+ */
+#define FR_DESC_MAX_LEN 55
+
+/**
+ * The maximum length of the tracer ID in the file header, not including the
+ * terminating null.
+ */
+#define FR_TRID_MAX_LEN 127
+
+/**
+ * The description ID of a span whose description couldn't be interned
+ * because the table was full.
+ */
+#define FR_DESC_ID_NONE 0xffffffffU
+
+/**
+ * Values of fr_desc::state.
+ */
+#define FR_DESC_STATE_EMPTY 0
+#define FR_DESC_STATE_BUSY 1
+#define FR_DESC_STATE_READY 2
+
+struct fr_file_header {
+    /**
+     * FR_MAGIC, without the terminating null.  This is written last, once
+     * the rest of the file has been set up.
+     */
+    char magic[8];
+
+    /**
+     * FR_VERSION.
+     */
+    uint32_t version;
+
+    /**
+     * The number of entries in the description table.
+     */
+    uint32_t num_descs;
+
+    /**
+     * The number of rings.
+     */
+    uint32_t num_rings;
+
+    /**
+     * The number of records in each ring.
+     */
+    uint32_t num_slots;
+
+    /**
+     * The ID of the process which wrote the file.
+     */
+    uint64_t pid;
+
+    /**
+     * The number of spans which couldn't be recorded because every ring was
+     * taken.  Updated atomically.
+     */
+    uint64_t num_lost;
+
+    /**
+     * The offset of the description table from the start of the file.
+     */
+    uint64_t descs_off;
+
+    /**
+     * The offset of the first ring from the start of the file.
+     */
+    uint64_t rings_off;
+
+    /**
+     * The length of each ring, including its header.
+     */
+    uint64_t ring_len;
+
+    /**
+     * The tracer ID, or the tracer name if the tracer ID wasn't known when
+     * the file was created.  Null-terminated.
+     */
+    char trid[FR_TRID_MAX_LEN + 1];
+};
+
+struct fr_desc {
+    /**
+     * FR_DESC_STATE_*.  Updated atomically.
+     */
+    uint32_t state;
+
+    /**
+     * The hash of the description.
+     */
+    uint32_t hash;
+
+    /**
+     * The description.  Null-terminated.
+     */
+    char str[FR_DESC_MAX_LEN + 1];
+};
+
+struct fr_ring_header {
+    /**
+     * The ID of the thread which owns the ring, or 0 if it is free.  Once a
+     * thread exits, the ring is free to be reused, but keeps its records
+     * until then.  Updated atomically.
+     */
+    uint32_t owner;
+
+    /**
+     * The ID of the thread which last wrote to the ring.
+     */
+    uint32_t tid;
+
+    /**
+     * The sequence number of the next record to write.  Record n is kept in
+     * slot (n - 1) % num_slots.
+     */
+    uint64_t head;
+};
+
+struct fr_record {
+    uint64_t seq_begin;
+    uint64_t span_id_high;
+    uint64_t span_id_low;
+    uint64_t parent_high;
+    uint64_t parent_low;
+
+    /**
+     * The begin and end times, in microseconds since the epoch.
+     */
+    uint64_t begin_us;
+    uint64_t end_us;
+
+    /**
+     * The description ID, or FR_DESC_ID_NONE.
+     */
+    uint32_t desc_id;
+
+    /**
+     * The number of parents.  Only the first one is recorded.
+     */
+    uint32_t num_parents;
+    uint64_t seq_end;
+};
+
+/**
+ * An open span which the sampler didn't pick.  Since it only goes to the
+ * flight recorder, it is kept in its scope as a fixed-size record with an
+ * interned description, rather than as a struct htrace_span.
+ */
+struct fr_open_span {
+    struct htrace_span_id span_id;
+
+    /**
+     * The parent's span ID.  Only valid if num_parents is 1.
+     */
+    struct htrace_span_id parent;
+
+    /**
+     * The begin time, in microseconds since the epoch.
+     */
+    uint64_t begin_us;
+
+    /**
+     * The description ID, or FR_DESC_ID_NONE.
+     */
+    uint32_t desc_id;
+
+    /**
+     * The number of parents: 0 or 1.
+     */
+    uint32_t num_parents;
+};
+
+struct flight_recorder;
+
+/**
+ * Create a flight recorder, if the configuration asks for one.
+ *
+ * @param tracer        The tracer.  The recorder will hold on to this pointer.
+ * @param cnf           The configuration.
+ *
+ * @return              NULL if the flight recorder is disabled, or couldn't be
+ *                          created; the flight recorder otherwise.  Errors
+ *                          will be logged.
+ */
+struct flight_recorder *flight_recorder_alloc(struct htracer *tracer,
+                                              const struct htrace_conf *cnf);
+
+/**
+ * Free a flight recorder.  The file is left in place.
+ *
+ * No other thread may be closing spans with the tracer, or exiting, at the
+ * same time.
+ *
+ * @param fr            The flight recorder, or NULL.
+ */
+void flight_recorder_free(struct flight_recorder *fr);
+
+/**
+ * Record a closed span in the current thread's ring.
+ *
+ * @param fr            The flight recorder.
+ * @param span          The span.
+ */
+void flight_recorder_add(struct flight_recorder *fr,
+                         const struct htrace_span *span);
+
+/**
+ * Check whether the flight recorder records spans which the sampler didn't
+ * pick.
+ *
+ * @param fr            The flight recorder.
+ *
+ * @return              1 if it does; 0 otherwise.
+ */
+int flight_recorder_unsampled(const struct flight_recorder *fr);
+
+/**
+ * Find or add a span description in the flight recorder's description table.
+ *
+ * @param fr            The flight recorder.
+ * @param desc          The description.
+ *
+ * @return              The description ID, or FR_DESC_ID_NONE if the table is
+ *                          full.
+ */
+uint32_t flight_recorder_intern(struct flight_recorder *fr, const char *desc);
+
+/**
+ * Record a closed span which the sampler didn't pick in the current thread's
+ * ring.
+ *
+ * @param fr            The flight recorder.
+ * @param fs            The span.
+ * @param end_us        The end time, in microseconds since the epoch.
+ */
+void flight_recorder_add_unsampled(struct flight_recorder *fr,
+                                   const struct fr_open_span *fs, uint64_t end_us);
+
+/**
+ * Copy the flight recorder file to another file.
+ *
+ * This only uses async-signal-safe functions.
+ *
+ * @param fr            The flight recorder.
+ * @param path          The path to write the copy to.
+ *
+ * @return              0 on success; the error code otherwise.
+ */
+int flight_recorder_dump(struct flight_recorder *fr, const char *path);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -19,6 +19,7 @@
 #ifndef APACHE_HTRACE_HTRACE_H
 #define APACHE_HTRACE_HTRACE_H
 
+#include <pthread.h> /* for pthread_mutex_t, etc. */
 #include <stdint.h> /* for uint64_t, etc. */
 #include <unistd.h> /* for size_t, etc. */
 
@@ -94,6 +95,51 @@ extern  "C" {
  */
 #define HTRACE_LOG_PATH_KEY "log.path"
 
+/**
+ * The minimum severity of htrace client log messages to write.
+ *
+ * Possible values, from most to least severe:
+ *   error, warn, info, debug
+ *
+ * Defaults to info.
+ */
+#define HTRACE_LOG_LEVEL_KEY "log.level"
+
+/**
+ * If true, htrace client log messages are written by a background thread.
+ * Threads which log copy their messages into per-thread ring buffers and never
+ * block on the log file.  If a ring buffer is full, the message is dropped,
+ * and the number of dropped messages is logged later.
+ *
+ * Defaults to false.
+ */
+#define HTRACE_LOG_ASYNC_KEY "log.async"
+
+/**
+ * The maximum number of bytes of memory that tracing may use for buffers in
+ * this process.  This budget is shared by every tracer in the process.  If
+ * several tracers set it, the smallest value among the live tracers is used.
+ * It is recomputed when tracers are reconfigured or freed.
+ *
+ * When the budget is nearly used up, new traces are not started, and span
+ * receivers release the buffer memory they are not using.  Spans which
+ * would exceed the budget are dropped.
+ *
+ * If this is unset or 0, the budget is a fraction of the memory limit of the
+ * process's cgroup.  See HTRACE_MEMORY_BUDGET_CGROUP_FRACTION_KEY.
+ */
+#define HTRACE_MEMORY_BUDGET_KEY "memory.budget"
+
+/**
+ * The fraction of the cgroup memory limit to use as the memory budget, if
+ * HTRACE_MEMORY_BUDGET_KEY is unset.  If the process is not in a cgroup with
+ * a memory limit, there is no budget.
+ *
+ * Defaults to 0.1.
+ */
+#define HTRACE_MEMORY_BUDGET_CGROUP_FRACTION_KEY \
+    "memory.budget.cgroup.fraction"
+
 /**
  * The span receiver implementation to use.
  *
@@ -101,6 +147,11 @@ extern  "C" {
  *   noop            The "no op" span receiver, which discards all spans.
  *   local.file      A receiver which writes spans to local files.
  *   htraced         The htraced span receiver, which sends spans to htraced.
+ *   ftrace          A receiver which writes a marker for each span into the
+ *                   kernel's ftrace buffer.
+ *   perfetto        A receiver which writes spans to a local trace file that
+ *                   can be opened in ui.perfetto.dev.
+ *   zipkin          A receiver which sends spans to a Zipkin collector.
  */
 #define HTRACE_SPAN_RECEIVER_KEY "span.receiver"
 
@@ -142,6 +193,155 @@ extern  "C" {
 #define HTRACED_BUFFER_SEND_TRIGGER_FRACTION \
     "htraced.buffer.send.trigger.fraction"
 
+/**
+ * Whether the htraced span receiver should back its buffers with huge pages.
+ *
+ * Possible values:
+ *   none           Use normal pages.
+ *   transparent    Ask for transparent huge pages.
+ *   explicit       Use pages from the hugetlbfs pool, falling back to
+ *                      transparent huge pages if the pool is empty.
+ *
+ * Defaults to none.
+ */
+#define HTRACED_BUFFER_HUGE_PAGES_KEY "htraced.buffer.huge.pages"
+
+/**
+ * Whether the htraced span receiver should fault its buffer pages in when the
+ * buffers are allocated, rather than when spans are first written to them.
+ *
+ * Possible values:
+ *   none           Fault pages in on first use.
+ *   populate       Fault pages in when the buffers are allocated.
+ *   lock           Fault pages in when the buffers are allocated, and lock
+ *                      them in memory.  This is subject to RLIMIT_MEMLOCK.
+ *
+ * When prefaulting, the full htraced.buffer.size is allocated when the
+ * receiver is created, and is kept until the receiver is freed, unless the
+ * memory budget comes under pressure.  Prefaulting stops short of the memory
+ * budget's high watermark; the rest is allocated on demand.  Otherwise,
+ * buffer memory is allocated as spans arrive, and freed after it has been
+ * idle for a while.
+ *
+ * Defaults to none.
+ */
+#define HTRACED_BUFFER_PREFAULT_KEY "htraced.buffer.prefault"
+
+/**
+ * The NUMA node which the htraced span receiver should allocate its buffers
+ * on.  This is usually the node where the threads which create spans run.
+ * If this is unset, the default memory policy is used.
+ */
+#define HTRACED_BUFFER_NUMA_NODE_KEY "htraced.buffer.numa.node"
+
+/**
+ * The CPUs which the htraced span receiver's transmitter thread should run on,
+ * as a comma-separated list of CPU numbers and ranges, like "0-3,8".  If this
+ * is unset, the thread may run on any CPU.  Only supported on Linux.
+ */
+#define HTRACED_XMIT_CPUS_KEY "htraced.xmit.cpus"
+
+/**
+ * A directory for the htraced span receiver to write spans to when they
+ * can't be sent, for example because htracer_shutdown ran out of time.  Each
+ * file holds the msgpack body of one WriteSpans request.  If this is unset,
+ * such spans are dropped.
+ */
+#define HTRACED_SPILL_DIR_KEY "htraced.spill.dir"
+
+/**
+ * The tracefs directory which the ftrace span receiver should write markers
+ * into.  If this is the default and doesn't exist, /sys/kernel/debug/tracing
+ * is tried instead.
+ *
+ * Defaults to /sys/kernel/tracing.
+ */
+#define HTRACE_FTRACE_DIR_KEY "ftrace.tracing.dir"
+
+/**
+ * If true, the ftrace span receiver writes compact binary markers to
+ * trace_marker_raw, falling back to text markers in trace_marker if that
+ * can't be opened.  Binary markers don't carry the description, so use them
+ * together with ftrace.metadata.path.
+ *
+ * Defaults to false.
+ */
+#define HTRACE_FTRACE_RAW_KEY "ftrace.raw"
+
+/**
+ * A file which the ftrace span receiver should append each span to, in the
+ * same format as the local file receiver.  htrace_ftrace_merge uses it to
+ * fill in the details which don't fit in a marker.  If this is unset, only
+ * the markers are written.
+ */
+#define HTRACE_FTRACE_METADATA_PATH_KEY "ftrace.metadata.path"
+
+/**
+ * The path which the perfetto span receiver should write its trace to.  The
+ * trace is appended to if the file already exists.
+ */
+#define HTRACE_PERFETTO_PATH_KEY "perfetto.path"
+
+/**
+ * The format of the trace which the perfetto span receiver writes.
+ *
+ * Possible values:
+ *   proto          A Perfetto protobuf trace.  Descriptions are only written
+ *                      once, rather than once per span.
+ *   json           A Chrome JSON trace event array, for tools which can't
+ *                      read protobuf traces.
+ *
+ * Defaults to proto.
+ */
+#define HTRACE_PERFETTO_FORMAT_KEY "perfetto.format"
+
+/**
+ * The hostname and port of the Zipkin collector which the zipkin span receiver
+ * should send its spans to.  This is in the format "hostname:port".  The port
+ * defaults to 9411.
+ */
+#define HTRACE_ZIPKIN_ADDRESS_KEY "zipkin.address"
+
+/**
+ * The HTTP path which the zipkin span receiver should post spans to.
+ *
+ * Defaults to /api/v2/spans.
+ */
+#define HTRACE_ZIPKIN_PATH_KEY "zipkin.path"
+
+/**
+ * The maximum length of time to go before sending spans to the Zipkin
+ * collector.
+ *
+ * Defaults to 1000.
+ */
+#define HTRACE_ZIPKIN_FLUSH_INTERVAL_MS_KEY "zipkin.flush.interval.ms"
+
+/**
+ * The TCP read and write timeout to use when communicating with the Zipkin
+ * collector.
+ *
+ * Defaults to 30000.
+ */
+#define HTRACE_ZIPKIN_TIMEO_MS_KEY "zipkin.timeo.ms"
+
+/**
+ * The total size of the two send buffers in the zipkin span receiver.  The
+ * buffers only use as much memory as the spans in them need.
+ *
+ * Defaults to 8 MB.
+ */
+#define HTRACE_ZIPKIN_BUFFER_SIZE_KEY "zipkin.buffer.size"
+
+/**
+ * The maximum size of the body of one request to the Zipkin collector.  A
+ * larger batch of spans is sent as several requests, which are pipelined on
+ * one connection.
+ *
+ * Defaults to 1 MB.
+ */
+#define HTRACE_ZIPKIN_REQUEST_SIZE_KEY "zipkin.request.size"
+
 /**
  * The process ID string to use.
  *
@@ -170,15 +370,265 @@ extern  "C" {
  */
 #define HTRACE_PROB_SAMPLER_FRACTION_KEY "prob.sampler.fraction"
 
+/**
+ * The scheme to use when generating the span IDs of new traces.
+ *
+ * Possible values:
+ *   random         Every bit of the span ID is random.
+ *   time-ordered   The upper 16 bits of the trace ID are the current time in
+ *                      minutes since the epoch, modulo 2^16; the other 48
+ *                      bits are random.  This keeps spans from the same time
+ *                      window close together in the htraced key space.
+ *                      Traces which start in the same minute are likely to
+ *                      collide once there are about 16 million of them, and
+ *                      a collision merges two traces.  The zipkin receiver
+ *                      uses the trace ID as the Zipkin traceId.
+ *
+ * Defaults to random.
+ */
+#define HTRACE_SPAN_ID_SCHEME_KEY "span.id.scheme"
+
+/**
+ * The path of a configuration file to watch.  Whenever the file is rewritten
+ * or renamed into place, the tracer is reconfigured from its contents, as if
+ * htracer_reconfigure had been called.  The file uses the same format as
+ * htrace_conf_from_str, except that newlines may also separate entries.
+ *
+ * If this is unset, no file is watched.
+ */
+#define HTRACE_CONF_WATCH_PATH_KEY "conf.watch.path"
+
+/**
+ * If true, the tracer puts off the expensive parts of starting up until the
+ * first sampled span is closed.  These are working out the tracer ID, which
+ * may mean looking up the IP address, and creating the span receiver, which
+ * may start threads and allocate buffers.  Processes which never trace
+ * anything never pay for them.
+ *
+ * Defaults to false.
+ */
+#define HTRACE_TRACER_LAZY_KEY "tracer.lazy"
+
+/**
+ * If true, the tracer keeps track of the spans which have been opened but not
+ * closed yet, so that operations which hang can still be traced.  See
+ * htracer_dump_inflight.  This costs an uncontended lock each time a span is
+ * opened or closed.  It can't be changed by htracer_reconfigure.
+ *
+ * Defaults to false.
+ */
+#define HTRACE_INFLIGHT_KEY "inflight.spans"
+
+/**
+ * When open spans are tracked, a watchdog thread sends a snapshot of every
+ * span which has been open for at least this many milliseconds to the span
+ * receiver.  Each open span is sent this way at most once.  The snapshot's end
+ * time is the time it was taken, and it carries the annotation inflight=true.
+ * Once the span is closed, it is sent again as usual.  0 turns the watchdog
+ * off.
+ *
+ * Defaults to 60000.
+ */
+#define HTRACE_INFLIGHT_THRESHOLD_MS_KEY "inflight.threshold.ms"
+
+/**
+ * How often the in-flight span watchdog looks for spans which have been open
+ * for too long, in milliseconds.
+ *
+ * Defaults to 10000.
+ */
+#define HTRACE_INFLIGHT_INTERVAL_MS_KEY "inflight.interval.ms"
+
+/**
+ * The path of the flight recorder file.  If this is set, the most recent
+ * spans closed by each thread are kept in a memory-mapped file, whether or
+ * not the span receiver sends them anywhere.  The file survives a crash, and
+ * can be read with htrace_frdump.  The string %{pid} is replaced by the
+ * process ID.  The flight recorder can't be changed by htracer_reconfigure.
+ *
+ * Defaults to empty, which turns the flight recorder off.
+ */
+#define HTRACE_FLIGHT_RECORDER_PATH_KEY "flight.recorder.path"
+
+/**
+ * The number of spans the flight recorder keeps for each thread.
+ *
+ * Defaults to 256.
+ */
+#define HTRACE_FLIGHT_RECORDER_SLOTS_KEY "flight.recorder.slots"
+
+/**
+ * The number of threads the flight recorder has room for.  A thread's slot is
+ * reused once it exits.  Spans closed by other threads are counted, but not
+ * recorded.
+ *
+ * Defaults to 64.
+ */
+#define HTRACE_FLIGHT_RECORDER_THREADS_KEY "flight.recorder.threads"
+
+/**
+ * If true, SIGUSR2 copies the flight recorder file to the same path with
+ * .dump appended.  A SIGUSR2 handler installed before the tracer is created
+ * is still called after the copy is made.  Our handler stays installed once
+ * the tracer is freed, so that a late SIGUSR2 can't kill the process; it then
+ * only calls the earlier handler.
+ *
+ * Defaults to false.
+ */
+#define HTRACE_FLIGHT_RECORDER_SIGNAL_KEY "flight.recorder.signal"
+
+/**
+ * If true, the flight recorder also records spans which the sampler didn't
+ * pick.  htrace_start_span and htrace_start_spanf then return a scope for
+ * such a span, rather than NULL.  The scope's span isn't traced: it has no
+ * span ID, it can't be detached, and it is only written to the flight
+ * recorder when the scope is closed.  This costs a scope allocation for every
+ * span, so it is off by default.
+ *
+ * Defaults to false.
+ */
+#define HTRACE_FLIGHT_RECORDER_UNSAMPLED_KEY "flight.recorder.unsampled"
+
+/**
+ * The number of spans which can be buffered by htrace_sigsafe_end before
+ * they are sent to the span receiver.  The buffer is allocated up front.  0
+ * turns off signal-safe spans.  This can't be changed by htracer_reconfigure.
+ *
+ * Defaults to 0.
+ */
+#define HTRACE_SIGSAFE_SLOTS_KEY "sigsafe.slots"
+
+/**
+ * How often buffered signal-safe spans are sent to the span receiver, in
+ * milliseconds.
+ *
+ * Defaults to 100.
+ */
+#define HTRACE_SIGSAFE_DRAIN_INTERVAL_MS_KEY "sigsafe.drain.interval.ms"
+
+/**
+ * How many times per second of CPU time each thread is sampled by the
+ * profiler.  Samples taken while the thread is in a span are charged to that
+ * span, and written to profiler.path as folded stacks.  The profiler uses
+ * SIGPROF, so only one tracer in a process can use it, and the application
+ * must not use SIGPROF itself.  The SIGPROF handler stays installed, doing
+ * nothing, once the tracer is freed, since a timer signal may still be
+ * queued.  Stacks are found by following frame pointers, so code built with
+ * -fomit-frame-pointer may only show its innermost frame.
+ * The profiler can't be changed by htracer_reconfigure.
+ *
+ * Defaults to 0, which turns the profiler off.
+ */
+#define HTRACE_PROFILER_HZ_KEY "profiler.hz"
+
+/**
+ * The file the profiler appends folded stacks to.  Each line is the span
+ * description, the frames from outermost to innermost, and the number of
+ * samples, which is the format flamegraph.pl reads.  The string %{pid} is
+ * replaced by the process ID.
+ *
+ * There is no default.  The profiler needs this to be set.
+ */
+#define HTRACE_PROFILER_PATH_KEY "profiler.path"
+
+/**
+ * The maximum number of stack frames in each profiler sample.  At most 64.
+ *
+ * Defaults to 32.
+ */
+#define HTRACE_PROFILER_DEPTH_KEY "profiler.depth"
+
+/**
+ * The number of samples each thread can buffer until the profiler writes
+ * them out.  Samples taken while the buffer is full are dropped.
+ *
+ * Defaults to 256.
+ */
+#define HTRACE_PROFILER_SAMPLES_KEY "profiler.samples"
+
+/**
+ * How the profiler groups samples.  "desc" counts samples by span
+ * description.  "span" counts them by span, adding the span ID after the
+ * description.
+ *
+ * Defaults to desc.
+ */
+#define HTRACE_PROFILER_AGGREGATE_KEY "profiler.aggregate"
+
+/**
+ * How often the profiler writes out samples, in milliseconds.
+ *
+ * Defaults to 1000.
+ */
+#define HTRACE_PROFILER_FLUSH_INTERVAL_MS_KEY "profiler.flush.interval.ms"
+
+/**
+ * How long a traced lock acquisition has to wait, in microseconds, before it
+ * is recorded as a span.  The span is a child of the current span, and is
+ * only recorded if there is one.  Acquisitions which don't have to wait are
+ * never timed.  See htrace_mutex_lock.
+ *
+ * Defaults to 1000.
+ */
+#define HTRACE_LOCK_THRESHOLD_US_KEY "lock.threshold.us"
+
+/**
+ * If true, lock waits reported by the libhtrace_lockwait.so interposer are
+ * recorded with this tracer.  Running a program with
+ * LD_PRELOAD=libhtrace_lockwait.so times every pthread_mutex_lock call which
+ * has to wait, without changing the program.  Only one tracer in a process
+ * can receive interposed lock waits.  This can't be changed by
+ * htracer_reconfigure.
+ *
+ * Defaults to false.
+ */
+#define HTRACE_LOCK_INTERPOSE_KEY "lock.interpose"
+
 /**
  * The length of an HTrace span ID in hexadecimal string form.
  */
 #define HTRACE_SPAN_ID_STRING_LENGTH 32
 
+/**
+ * The version of the trace context encoding which we produce.
+ */
+#define HTRACE_CONTEXT_VERSION 0
+
+/**
+ * The length of a trace context in binary form.
+ *
+ * The binary form is laid out as follows.  All integers are big-endian.
+ *   byte 0         The version.
+ *   bytes 1-16     The trace ID.  The first 8 bytes are always zero; the last
+ *                      8 bytes are the high half of the span ID.
+ *   bytes 17-24    The low half of the span ID.
+ *   byte 25        Flags.
+ *
+ * This is the same layout as the W3C traceparent header, with HTrace's 64-bit
+ * trace IDs left-padded with zeroes.
+ */
+#define HTRACE_CONTEXT_BINARY_LENGTH 26
+
+/**
+ * The length of a trace context in text form, not including the terminating
+ * null.
+ *
+ * The text form is the binary form written as lowercase hexadecimal, with
+ * dashes between the fields:
+ *   vv-tttttttttttttttttttttttttttttttt-ssssssssssssssss-ff
+ */
+#define HTRACE_CONTEXT_TEXT_LENGTH 55
+
+/**
+ * The trace context flag which indicates that the span is being sampled.
+ */
+#define HTRACE_CONTEXT_FLAG_SAMPLED 0x01
+
     // Forward declarations
     struct htrace_conf;
     struct htracer;
     struct htrace_scope;
+    struct htrace_child;
 
     /**
      * The HTrace span id.
@@ -188,6 +638,94 @@ extern  "C" {
         uint64_t low;
     };
 
+    /**
+     * A trace span which was timed outside of HTrace.
+     *
+     * See htrace_record_spans.
+     */
+    struct htrace_span_record {
+        /**
+         * The span id of the parent span.  If this is the invalid span id,
+         * the span will be the root of a new trace.
+         */
+        struct htrace_span_id parent;
+
+        /**
+         * The description of the trace span.  This is not copied, so it
+         * must remain valid until htrace_record_spans returns.
+         */
+        const char *desc;
+
+        /**
+         * The beginning time, in microseconds since the epoch.
+         */
+        uint64_t begin;
+
+        /**
+         * The end time, in microseconds since the epoch.
+         */
+        uint64_t end;
+
+        /**
+         * (out param) The span id which was assigned to this span.  This will
+         * be set to the invalid span id if the span could not be recorded.
+         */
+        struct htrace_span_id span_id;
+    };
+
+    /**
+     * A trace span recorded with the async-signal-safe API.
+     *
+     * This is owned by the caller, typically on the stack.  See
+     * htrace_sigsafe_start.
+     */
+    struct htrace_sigsafe_span {
+        /**
+         * The span id, or the invalid span id if signal-safe spans are
+         * turned off.  Pass a pointer to this as the parent of nested
+         * spans.
+         */
+        struct htrace_span_id span_id;
+
+        /**
+         * The span id of the parent span.
+         */
+        struct htrace_span_id parent;
+
+        /**
+         * The description.  This is copied when the span ends; descriptions
+         * longer than 63 bytes are truncated.
+         */
+        const char *desc;
+
+        /**
+         * The beginning time, in microseconds since the epoch.
+         */
+        uint64_t begin;
+    };
+
+    /**
+     * A mutex which records long waits as trace spans.
+     *
+     * See htrace_mutex_init.  The fields should not be used directly.
+     */
+    struct htrace_mutex {
+        pthread_mutex_t mutex;
+        struct htracer *tracer;
+        const char *name;
+    };
+
+    /**
+     * A reader-writer lock which records long waits as trace spans.
+     *
+     * See htrace_rwlock_init.  The fields should not be used directly.
+     */
+    struct htrace_rwlock {
+        pthread_rwlock_t rwlock;
+        struct htracer *tracer;
+        const char *name;
+    };
+
     /**
      * Create an HTrace conf object from a string.
      *
@@ -261,6 +799,137 @@ extern  "C" {
      */
     void htracer_free(struct htracer *tracer);
 
+    /**
+     * Shut down and free an HTracer, spending no more than a given amount of
+     * time on it.
+     *
+     * This is like htracer_free, except that it gives up on sending buffered
+     * spans once the time is up.  Any network I/O still in progress is
+     * interrupted.  Spans which haven't been sent by then are written to the
+     * spill directory, if the receiver has one, or dropped.
+     *
+     * The same restrictions apply as for htracer_free.
+     *
+     * @param tracer        The tracer to shut down.
+     * @param timeout_ms    The maximum number of milliseconds to spend.
+     *
+     * @return              The number of buffered spans which couldn't be
+     *                          sent in time.
+     */
+    uint64_t htracer_shutdown(struct htracer *tracer, uint64_t timeout_ms);
+
+    /**
+     * Reconfigure an HTracer.
+     *
+     * A new span receiver is created from the configuration and swapped in
+     * atomically.  Threads which are creating spans never block on the swap.
+     * Spans already handed to the old receiver are flushed before it is shut
+     * down.  The span ID scheme and the parameters of any samplers created
+     * with this tracer are updated as well.  The type of an existing sampler
+     * can't be changed; create a new sampler for that.
+     *
+     * The tracer name, tracer ID, and log settings are not changed.
+     *
+     * Only one reconfiguration runs at a time; concurrent calls are
+     * serialized.
+     *
+     * @param tracer        The tracer.
+     * @param cnf           The new configuration.  You may free this
+     *                          configuration object after calling this
+     *                          function.
+     *
+     * @return              1 on success.  0 if the new span receiver could
+     *                          not be created, in which case the tracer is
+     *                          left unchanged.  Errors will be logged to the
+     *                          htracer log.
+     */
+    int htracer_reconfigure(struct htracer *tracer,
+                            const struct htrace_conf *cnf);
+
+    /**
+     * Start flushing the spans which have been closed so far, without waiting
+     * for the flush to finish.
+     *
+     * The callback is invoked once every span closed before this call has
+     * been acknowledged by the span receiver's backing store, or given up on.
+     * Spans closed after this call don't hold it up.  The callback may run
+     * on an internal HTrace thread, or on this thread before this function
+     * returns.  It must not block for long, and must not free the tracer.
+     *
+     * @param tracer        The tracer.
+     * @param cb            The callback.  err is 0 if all the spans were
+     *                          delivered, or EIO if some of them had to be
+     *                          dropped or spilled to disk.
+     * @param arg           The argument to pass to the callback.
+     *
+     * @return              0 on success.  An error code if the flush couldn't
+     *                          be started, in which case the callback will not
+     *                          be invoked.
+     */
+    int htracer_flush_async(struct htracer *tracer,
+                            void (*cb)(void *arg, int err), void *arg);
+
+    /**
+     * Start flushing the spans which have been closed so far, and signal a
+     * file descriptor when the flush is done.
+     *
+     * This is like htracer_flush_async, except that completion is signalled by
+     * writing the 8-byte integer 1 to the file descriptor.  This is meant for
+     * an eventfd, which can then be waited on with poll or epoll alongside
+     * other events.  The file descriptor must stay open until the flush is
+     * done.
+     *
+     * @param tracer        The tracer.
+     * @param fd            The file descriptor to signal.
+     *
+     * @return              0 on success; an error code otherwise.
+     */
+    int htracer_flush_async_fd(struct htracer *tracer, int fd);
+
+    /**
+     * Write a snapshot of every span which is currently open to a file
+     * descriptor.
+     *
+     * Each span is written as one line of JSON, in the same format that the
+     * local file span receiver uses.  The end time of each span is the time
+     * the snapshot was taken, and it carries the annotation inflight=true.
+     * Open spans are only tracked if inflight.spans is set.
+     *
+     * @param tracer        The tracer.
+     * @param fd            The file descriptor to write to.
+     *
+     * @return              The number of spans written.  0 if open spans
+     *                          aren't tracked.
+     */
+    int htracer_dump_inflight(struct htracer *tracer, int fd);
+
+    /**
+     * Copy the flight recorder file.
+     *
+     * Only async-signal-safe functions are used, so this may be called from a
+     * signal handler, such as a handler for SIGSEGV.
+     *
+     * @param tracer        The tracer.
+     * @param path          The path to write the copy to.
+     *
+     * @return              0 on success; EINVAL if the tracer has no flight
+     *                          recorder; another error code otherwise.
+     */
+    int htracer_flight_recorder_dump(struct htracer *tracer,
+                                     const char *path);
+
+    /**
+     * Send the buffered signal-safe spans to the span receiver now, rather
+     * than waiting for the background thread.
+     *
+     * This is not async-signal-safe.
+     *
+     * @param tracer        The tracer.
+     *
+     * @return              The number of spans which were sent.
+     */
+    int htracer_sigsafe_drain(struct htracer *tracer);
+
     /**
      * Create an htrace configuration sample from a configuration.
      *
@@ -315,11 +984,40 @@ extern  "C" {
      * @param desc      The description of the trace span.  Will be deep-copied.
      *
      * @return          The trace scope.  NULL if we ran out of memory, or if we
-     *                      are not tracing.
+     *                      are not tracing, unless
+     *                      HTRACE_FLIGHT_RECORDER_UNSAMPLED_KEY is set.
      */
     struct htrace_scope* htrace_start_span(struct htracer *tracer,
                         struct htrace_sampler *sampler, const char *desc);
 
+    /**
+     * Start a new trace span if necessary, with a printf-style description.
+     *
+     * The sampling decision is made before the description is formatted, so
+     * callers that are not sampled do not pay any formatting cost.  This
+     * makes it unnecessary to snprintf the description before calling
+     * htrace_start_span.
+     *
+     * You must call htrace_close_span on the scope object returned by this
+     * function.
+     *
+     * @param tracer    The htracer to use.  Must remain valid for the
+     *                      duration of the scope.
+     * @param sampler   The sampler to use, or NULL for no sampler.
+     *                      If no sampler is used, we will create a new span
+     *                      only if there is a current active span.
+     * @param fmt       A printf-style format string for the description of
+     *                      the trace span.
+     * @param ...       Arguments for the format string.
+     *
+     * @return          The trace scope.  NULL if we ran out of memory, or if we
+     *                      are not tracing, unless
+     *                      HTRACE_FLIGHT_RECORDER_UNSAMPLED_KEY is set.
+     */
+    struct htrace_scope* htrace_start_spanf(struct htracer *tracer,
+                        struct htrace_sampler *sampler, const char *fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+
     /**
      * Start a new trace span with a given parent span.
      *
@@ -340,6 +1038,264 @@ extern  "C" {
                         struct htrace_span_id *parent,
                         const char *desc);
 
+    /**
+     * Record a trace span which was timed outside of HTrace.
+     *
+     * The span is sent directly to the span receiver.  No trace scope is
+     * created, and the current thread's trace scopes are not consulted or
+     * modified.  No sampler is consulted either; the caller has already
+     * decided that this span should be recorded.
+     *
+     * @param tracer    The htracer to use.
+     * @param parent_id The span id of the parent span, or NULL.  If this is
+     *                      NULL or invalid, the span will be the root of a new
+     *                      trace.
+     * @param desc      The description of the trace span.  It is not copied.
+     * @param begin     The beginning time, in microseconds since the epoch.
+     *                      This is the same clock that htrace_start_span uses.
+     * @param end       The end time, in microseconds since the epoch.
+     *
+     * @return          1 if the span was handed to the span receiver;
+     *                      0 if the description was invalid.
+     */
+    int htrace_record_span(struct htracer *tracer,
+                           const struct htrace_span_id *parent_id,
+                           const char *desc, uint64_t begin, uint64_t end);
+
+    /**
+     * Record several trace spans which were timed outside of HTrace.
+     *
+     * This is equivalent to calling htrace_record_span on each record, except
+     * that the whole batch is handed to the span receiver at once.  That
+     * allows the receiver to take its locks once per batch, rather than once
+     * per span.
+     *
+     * @param tracer    The htracer to use.
+     * @param recs      An array of span records.  The span_id field of each
+     *                      record will be filled in.
+     * @param num_recs  The number of records in the array.
+     *
+     * @return          The number of spans which were handed to the span
+     *                      receiver.
+     */
+    int htrace_record_spans(struct htracer *tracer,
+                            struct htrace_span_record *recs, int num_recs);
+
+    /**
+     * Start a trace span from a signal handler.
+     *
+     * Unlike htrace_start_span, this is async-signal-safe: it doesn't
+     * allocate memory, take locks, or touch the current thread's trace
+     * scopes.  That also makes it safe to use from inside malloc hooks.  No
+     * sampler is consulted.
+     *
+     * Signal-safe spans are only recorded if sigsafe.slots is set.
+     *
+     * @param tracer    The htracer to use.
+     * @param parent    The span id of the parent span, or NULL.  This can
+     *                      be the span_id of another signal-safe span, or any
+     *                      other span id.
+     * @param desc      The description of the trace span.  It must remain
+     *                      valid until htrace_sigsafe_end is called.
+     * @param span      (out param) The span.
+     */
+    void htrace_sigsafe_start(struct htracer *tracer,
+                              const struct htrace_span_id *parent,
+                              const char *desc,
+                              struct htrace_sigsafe_span *span);
+
+    /**
+     * End a trace span started by htrace_sigsafe_start.
+     *
+     * This is async-signal-safe.  The span is buffered, and a background
+     * thread sends it to the span receiver later.  If the buffer is full, the
+     * span is dropped.
+     *
+     * @param tracer    The htracer to use.
+     * @param span      The span.
+     *
+     * @return          1 if the span was buffered; 0 if it was dropped, or
+     *                      signal-safe spans are turned off.
+     */
+    int htrace_sigsafe_end(struct htracer *tracer,
+                           struct htrace_sigsafe_span *span);
+
+    /**
+     * Initialize a traced mutex.
+     *
+     * Locking a traced mutex first tries pthread_mutex_trylock, so an
+     * acquisition which doesn't have to wait costs no more than an ordinary
+     * one.  If the mutex is taken, the wait is timed.  A wait longer than
+     * lock.threshold.us is recorded as a child span of the current span,
+     * with the description "mutex wait: <name>".
+     *
+     * @param mutex     The mutex.
+     * @param tracer    The htracer to record waits with, or NULL to record
+     *                      nothing.
+     * @param name      The name of the mutex.  It is not copied, so it must
+     *                      remain valid until the mutex is destroyed.
+     * @param attr      The mutex attributes, or NULL for the defaults.
+     *
+     * @return          0 on success; the error code from pthread_mutex_init
+     *                      otherwise.
+     */
+    int htrace_mutex_init(struct htrace_mutex *mutex, struct htracer *tracer,
+                          const char *name, const pthread_mutexattr_t *attr);
+
+    /**
+     * Lock a traced mutex.
+     *
+     * @param mutex     The mutex.
+     *
+     * @return          0 on success; the error code from pthread_mutex_lock
+     *                      otherwise.
+     */
+    int htrace_mutex_lock(struct htrace_mutex *mutex);
+
+    /**
+     * Unlock a traced mutex.
+     *
+     * @param mutex     The mutex.
+     *
+     * @return          0 on success; the error code from pthread_mutex_unlock
+     *                      otherwise.
+     */
+    int htrace_mutex_unlock(struct htrace_mutex *mutex);
+
+    /**
+     * Destroy a traced mutex.
+     *
+     * @param mutex     The mutex.
+     *
+     * @return          0 on success; the error code from
+     *                      pthread_mutex_destroy otherwise.
+     */
+    int htrace_mutex_destroy(struct htrace_mutex *mutex);
+
+    /**
+     * Initialize a traced reader-writer lock.
+     *
+     * Waits are recorded as for htrace_mutex_init, with the description
+     * "rwlock wait: <name>".
+     *
+     * @param rwlock    The lock.
+     * @param tracer    The htracer to record waits with, or NULL to record
+     *                      nothing.
+     * @param name      The name of the lock.  It is not copied, so it must
+     *                      remain valid until the lock is destroyed.
+     * @param attr      The lock attributes, or NULL for the defaults.
+     *
+     * @return          0 on success; the error code from pthread_rwlock_init
+     *                      otherwise.
+     */
+    int htrace_rwlock_init(struct htrace_rwlock *rwlock,
+                           struct htracer *tracer, const char *name,
+                           const pthread_rwlockattr_t *attr);
+
+    /**
+     * Lock a traced reader-writer lock for reading.
+     *
+     * @param rwlock    The lock.
+     *
+     * @return          0 on success; the error code from
+     *                      pthread_rwlock_rdlock otherwise.
+     */
+    int htrace_rwlock_rdlock(struct htrace_rwlock *rwlock);
+
+    /**
+     * Lock a traced reader-writer lock for writing.
+     *
+     * @param rwlock    The lock.
+     *
+     * @return          0 on success; the error code from
+     *                      pthread_rwlock_wrlock otherwise.
+     */
+    int htrace_rwlock_wrlock(struct htrace_rwlock *rwlock);
+
+    /**
+     * Unlock a traced reader-writer lock.
+     *
+     * @param rwlock    The lock.
+     *
+     * @return          0 on success; the error code from
+     *                      pthread_rwlock_unlock otherwise.
+     */
+    int htrace_rwlock_unlock(struct htrace_rwlock *rwlock);
+
+    /**
+     * Destroy a traced reader-writer lock.
+     *
+     * @param rwlock    The lock.
+     *
+     * @return          0 on success; the error code from
+     *                      pthread_rwlock_destroy otherwise.
+     */
+    int htrace_rwlock_destroy(struct htrace_rwlock *rwlock);
+
+    /**
+     * Report a lock acquisition which had to wait.
+     *
+     * This is called by the libhtrace_lockwait.so interposer, and records
+     * the wait with the tracer which has lock.interpose set, if there is
+     * one.  Since the lock has no name, the description identifies it by a
+     * hash of its address and by the code which locked it:
+     * "mutex wait: <hash> at <function>".
+     *
+     * @param lock      The address of the lock.
+     * @param call_site The address the lock function was called from.
+     * @param wait_ns   How long the acquisition waited, in nanoseconds.
+     */
+    void htrace_interposed_lock_wait(const void *lock, const void *call_site,
+                                     uint64_t wait_ns);
+
+    /**
+     * Start a group of child spans of the same parent.
+     *
+     * This is intended for fan-out, where one operation sends many requests in
+     * parallel and each request should get its own span.  All the children
+     * share one description and one beginning time.  Their span ids are
+     * generated together and their memory is allocated in one piece.
+     *
+     * The child spans are not pushed on to the current thread's trace scope
+     * stack.  Each one must later be closed with htrace_child_close, which may
+     * happen on any thread.  The memory for the group is released when the
+     * last child is closed.
+     *
+     * @param tracer    The tracer to use.
+     * @param parent    The parent span id.  Must be valid.
+     * @param desc      The description of the child spans.  Will be copied.
+     * @param num       The number of child spans to start.
+     * @param out       (out param) An array of num entries which will be
+     *                      filled in with the child spans.
+     *
+     * @return          num on success; 0 if the parent or the description was
+     *                      invalid, or we ran out of memory.
+     */
+    int htrace_start_children(struct htracer *tracer,
+                              const struct htrace_span_id *parent,
+                              const char *desc, int num,
+                              struct htrace_child **out);
+
+    /**
+     * Get the span id of a child span.
+     *
+     * This is the id which should be sent along with the child's request.
+     *
+     * @param child     The child span.
+     * @param id        (out param) The span id.
+     */
+    void htrace_child_get_span_id(const struct htrace_child *child,
+                                  struct htrace_span_id *id);
+
+    /**
+     * Close a child span and send it to the span receiver.
+     *
+     * @param child     The child span.  It may not be used after this call.
+     * @param end       The end time in microseconds since the epoch, or 0 to
+     *                      use the current time.
+     */
+    void htrace_child_close(struct htrace_child *child, uint64_t end);
+
     /**
      * Detach the trace span from the given trace scope.
      *
@@ -417,8 +1373,7 @@ extern  "C" {
      * @param str           Where to put the string.
      * @param len           The length of the string buffer.
      *
-     * @return              1 on success; 0 if the length was not long enough, or
-     *                          there was an internal snprintf error.
+     * @return              1 on success; 0 if the length was not long enough.
      */
     int htrace_span_id_to_str(const struct htrace_span_id *id,
                               char *str, size_t len);
@@ -434,6 +1389,77 @@ extern  "C" {
     void htrace_span_id_copy(struct htrace_span_id *dst,
                              const struct htrace_span_id *src);
 
+    /**
+     * Encode a span ID and flags as a binary trace context.
+     *
+     * This function does not allocate memory.
+     *
+     * @param id            The HTrace span ID.
+     * @param flags         The trace context flags.
+     * @param buf           Where to put the encoded trace context.
+     * @param len           The length of buf.  Must be at least
+     *                          HTRACE_CONTEXT_BINARY_LENGTH.
+     *
+     * @return              The number of bytes written; 0 if the buffer was
+     *                          too short.
+     */
+    int htrace_context_encode(const struct htrace_span_id *id, uint8_t flags,
+                              void *buf, size_t len);
+
+    /**
+     * Decode a binary trace context.
+     *
+     * This function does not allocate memory.
+     *
+     * @param id            (out param) The HTrace span ID.
+     * @param flags         (out param) The trace context flags.
+     * @param buf           The encoded trace context.
+     * @param len           The length of buf.
+     *
+     * @return              1 on success; 0 if the buffer was too short, the
+     *                          version is unknown, the trace ID does not fit
+     *                          in 64 bits, or the span ID is invalid.
+     */
+    int htrace_context_decode(struct htrace_span_id *id, uint8_t *flags,
+                              const void *buf, size_t len);
+
+    /**
+     * Encode a span ID and flags as a text trace context.
+     *
+     * The output is suitable for use as an RPC or HTTP header value.  This
+     * function does not allocate memory.
+     *
+     * @param id            The HTrace span ID.
+     * @param flags         The trace context flags.
+     * @param str           Where to put the encoded trace context.  It will be
+     *                          null-terminated.
+     * @param len           The length of str.  Must be at least
+     *                          HTRACE_CONTEXT_TEXT_LENGTH + 1.
+     *
+     * @return              1 on success; 0 if the buffer was too short.
+     */
+    int htrace_context_encode_text(const struct htrace_span_id *id,
+                                   uint8_t flags, char *str, size_t len);
+
+    /**
+     * Decode a text trace context.
+     *
+     * This function does not allocate memory.  Upper and lower case
+     * hexadecimal digits are both accepted.
+     *
+     * @param id            (out param) The HTrace span ID.
+     * @param flags         (out param) The trace context flags.
+     * @param str           The encoded trace context.
+     * @param len           The length of str.  Characters past
+     *                          HTRACE_CONTEXT_TEXT_LENGTH are ignored.
+     *
+     * @return              1 on success; 0 if the string was malformed, the
+     *                          version is unknown, the trace ID does not fit
+     *                          in 64 bits, or the span ID is invalid.
+     */
+    int htrace_context_decode_text(struct htrace_span_id *id, uint8_t *flags,
+                                   const char *str, size_t len);
+
     /**
      * Get the span id of an HTrace scope.
      *
@@ -145,6 +145,7 @@ namespace htrace {
 
   private:
     friend class Scope;
+    friend class Tracer;
     struct htrace_span_id id_;
   };
 
@@ -230,6 +231,25 @@ namespace htrace {
       return std::string(htracer_tname(tracer_));
     }
 
+    /**
+     * Record a trace span which was timed outside of HTrace.
+     *
+     * See htrace_record_span for details.
+     *
+     * @param parent  The parent span id.  If this is invalid, the span will
+     *                  be the root of a new trace.
+     * @param desc    The description of the span.
+     * @param begin   The beginning time, in microseconds since the epoch.
+     * @param end     The end time, in microseconds since the epoch.
+     *
+     * @return        true if the span was recorded.
+     */
+    bool RecordSpan(const SpanId &parent, const std::string &desc,
+                    uint64_t begin, uint64_t end) {
+      return htrace_record_span(tracer_, &parent.id_, desc.c_str(),
+                                begin, end) != 0;
+    }
+
     /**
      * Free the Tracer.
      *
@@ -17,31 +17,199 @@
  */
 
 #include "core/conf.h"
+#include "core/flight_recorder.h"
 #include "core/htrace.h"
 #include "core/htracer.h"
+#include "core/inflight.h"
+#include "core/lock.h"
+#include "core/profiler.h"
 #include "core/scope.h"
+#include "core/sigsafe.h"
 #include "core/span.h"
 #include "receiver/receiver.h"
+#include "sampler/sampler.h"
+#include "util/epoch.h"
+#include "util/file_watch.h"
 #include "util/log.h"
+#include "util/membudget.h"
 #include "util/rand.h"
 #include "util/string.h"
+#include "util/time.h"
 #include "util/tracer_id.h"
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * @file htracer.c
  *
  * Implementation of the Tracer object.
+ *
+ * The span receiver can be replaced at runtime by htracer_reconfigure.  Threads
+ * which close spans read tracer->rcv inside an epoch read section, so the
+ * reconfiguring thread can swap in the new receiver with a single atomic
+ * exchange, wait for the readers of the old receiver to leave, and then shut
+ * the old receiver down.  Span creation never takes a lock on this path.
+ *
+ * A lazy tracer starts out with no receiver and no tracer ID.  The first span
+ * which reaches htracer_add_span starts the tracer, under reconf_lock, before
+ * entering the epoch read section.
+ */
+
+/**
+ * The maximum size of a watched configuration file.
+ */
+#define HTRACER_MAX_CONF_FILE_SIZE (1024 * 1024)
+
+static enum htrace_span_id_scheme htracer_parse_id_scheme(
+        struct htracer *tracer, const struct htrace_conf *cnf)
+{
+    enum htrace_span_id_scheme scheme;
+    const char *str;
+
+    str = htrace_conf_get(cnf, HTRACE_SPAN_ID_SCHEME_KEY);
+    if (!str) {
+        return HTRACE_SPAN_ID_SCHEME_RANDOM;
+    }
+    if (!htrace_span_id_scheme_parse(str, &scheme)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "htracer: unknown %s '%s'.  Valid "
+                    "schemes are: random, time-ordered.  Using random.\n",
+                    HTRACE_SPAN_ID_SCHEME_KEY, str);
+        return HTRACE_SPAN_ID_SCHEME_RANDOM;
+    }
+    return scheme;
+}
+
+/**
+ * Reconfigure the tracer from the watched configuration file.
+ */
+static void htracer_conf_file_changed(void *ctx, const char *path)
+{
+    struct htracer *tracer = ctx;
+    struct htrace_conf *cnf;
+    char *buf, *c;
+    size_t len;
+    FILE *fp;
+    int ret;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        ret = errno;
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_conf_file_changed: failed to open "
+                    "%s: %s\n", path, terror(ret));
+        return;
+    }
+    buf = malloc(HTRACER_MAX_CONF_FILE_SIZE + 1);
+    if (!buf) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_conf_file_changed: OOM\n");
+        fclose(fp);
+        return;
+    }
+    len = fread(buf, 1, HTRACER_MAX_CONF_FILE_SIZE + 1, fp);
+    if (ferror(fp)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_conf_file_changed: error reading "
+                    "%s\n", path);
+        goto done;
+    }
+    if (len > HTRACER_MAX_CONF_FILE_SIZE) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "htracer_conf_file_changed: %s is larger "
+                    "than the maximum of %d bytes.\n", path,
+                    HTRACER_MAX_CONF_FILE_SIZE);
+        goto done;
+    }
+    buf[len] = '\0';
+    for (c = buf; *c; c++) {
+        if ((*c == '\n') || (*c == '\r')) {
+            *c = ';';
+        }
+    }
+    cnf = htrace_conf_from_str(buf);
+    if (!cnf) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_conf_file_changed: OOM\n");
+        goto done;
+    }
+    htracer_reconfigure(tracer, cnf);
+    htrace_conf_free(cnf);
+done:
+    free(buf);
+    fclose(fp);
+}
+
+/**
+ * Work out the tracer ID.
+ *
+ * @return          1 on success; 0 on failure.
+ */
+static int htracer_init_trid(struct htracer *tracer,
+                             const struct htrace_conf *cnf)
+{
+    tracer->trid = calculate_tracer_id(tracer->lg,
+            htrace_conf_get(cnf, HTRACE_TRACER_ID), tracer->tname);
+    if (!tracer->trid) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_init_trid: failed to "
+                    "create process id string.\n");
+        return 0;
+    }
+    if (!validate_json_string(tracer->lg, tracer->trid)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "htracer_init_trid: process ID string '%s' is "
+                    "problematic.\n", tracer->trid);
+        free(tracer->trid);
+        tracer->trid = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Start a lazy tracer, if nobody has started it yet.
+ *
+ * If we can't work out the tracer ID or create the receiver, spans are
+ * discarded until the tracer is successfully reconfigured.
  */
+static void htracer_start(struct htracer *tracer)
+{
+    struct htrace_rcv *rcv = NULL;
+
+    pthread_mutex_lock(&tracer->reconf_lock);
+    if (__atomic_load_n(&tracer->rcv, __ATOMIC_RELAXED)) {
+        pthread_mutex_unlock(&tracer->reconf_lock);
+        return;
+    }
+    if (htracer_init_trid(tracer, tracer->lazy_cnf)) {
+        rcv = htrace_rcv_create(tracer, tracer->lazy_cnf);
+    }
+    if (!rcv) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_start: failed to start tracer %s.  "
+                    "Its spans will be discarded.\n", tracer->tname);
+        rcv = g_noop_rcv_ty.create(tracer, tracer->lazy_cnf);
+    }
+    htrace_conf_free(tracer->lazy_cnf);
+    tracer->lazy_cnf = NULL;
+    __atomic_store_n(&tracer->rcv, rcv, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tracer->reconf_lock);
+    htrace_logl(tracer->lg, HTRACE_LOG_INFO, "htracer_start: started "
+                "tracer %s with span receiver %s.\n", tracer->tname,
+                rcv->ty->name);
+}
 
 struct htracer *htracer_create(const char *tname,
                                const struct htrace_conf *cnf)
 {
     struct htracer *tracer;
+    const char *watch_path, *lazy;
     int ret;
 
     tracer = calloc(1, sizeof(*tracer));
@@ -53,48 +221,85 @@ struct htracer *htracer_create(const char *tname,
         free(tracer);
         return NULL;
     }
+    pthread_mutex_init(&tracer->reconf_lock, NULL);
+    tracer->mem_limit = membudget_configure(tracer->lg, cnf);
     ret = pthread_key_create(&tracer->tls, NULL);
     if (ret) {
-        htrace_log(tracer->lg, "htracer_create: pthread_key_create "
-                   "failed: %s.\n", terror(ret));
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_create: pthread_key_create "
+                    "failed: %s.\n", terror(ret));
+        membudget_unconfigure(tracer->lg, tracer->mem_limit);
         htrace_log_free(tracer->lg);
         return NULL;
     }
     tracer->tname = strdup(tname);
     if (!tracer->tname) {
-        htrace_log(tracer->lg, "htracer_create: failed to "
-                   "duplicate name string.\n");
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_create: failed to "
+                    "duplicate name string.\n");
         htracer_free(tracer);
         return NULL;
     }
-    tracer->trid = calculate_tracer_id(tracer->lg,
-            htrace_conf_get(cnf, HTRACE_TRACER_ID), tname);
-    if (!tracer->trid) {
-        htrace_log(tracer->lg, "htracer_create: failed to "
-                   "create process id string.\n");
-        htracer_free(tracer);
-        return NULL;
-    }
-    if (!validate_json_string(tracer->lg, tracer->trid)) {
-        htrace_log(tracer->lg, "htracer_create: process ID string '%s' is "
-                   "problematic.\n", tracer->trid);
+    lazy = htrace_conf_get(cnf, HTRACE_TRACER_LAZY_KEY);
+    if (lazy && (!strcmp(lazy, "true"))) {
+        tracer->lazy_cnf = htrace_conf_copy(cnf);
+        if (!tracer->lazy_cnf) {
+            htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                        "htracer_create: OOM while copying "
+                        "the configuration.\n");
+            htracer_free(tracer);
+            return NULL;
+        }
+    } else if (!htracer_init_trid(tracer, cnf)) {
         htracer_free(tracer);
         return NULL;
     }
+    tracer->id_scheme = htracer_parse_id_scheme(tracer, cnf);
+    tracer->lock_threshold_us = htrace_conf_get_u64(tracer->lg, cnf,
+                                            HTRACE_LOCK_THRESHOLD_US_KEY);
     tracer->rnd = random_src_alloc(tracer->lg);
     if (!tracer->rnd) {
-        htrace_log(tracer->lg, "htracer_create: failed to "
-                   "allocate a random source.\n");
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_create: failed to "
+                    "allocate a random source.\n");
         htracer_free(tracer);
         return NULL;
     }
-    tracer->rcv = htrace_rcv_create(tracer, cnf);
-    if (!tracer->rcv) {
-        htrace_log(tracer->lg, "htracer_create: failed to "
-                   "create a receiver.\n");
+    tracer->ed = epoch_domain_alloc();
+    if (!tracer->ed) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_create: failed to "
+                    "allocate an epoch domain.\n");
         htracer_free(tracer);
         return NULL;
     }
+    if (!tracer->lazy_cnf) {
+        tracer->rcv = htrace_rcv_create(tracer, cnf);
+        if (!tracer->rcv) {
+            htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                        "htracer_create: failed to "
+                        "create a receiver.\n");
+            htracer_free(tracer);
+            return NULL;
+        }
+    }
+    tracer->inflight = inflight_reg_alloc(tracer, cnf);
+    tracer->fr = flight_recorder_alloc(tracer, cnf);
+    tracer->sigsafe = sigsafe_buf_alloc(tracer, cnf);
+    tracer->prof = profiler_alloc(tracer, cnf);
+    lock_interpose_register(tracer, cnf);
+    watch_path = htrace_conf_get(cnf, HTRACE_CONF_WATCH_PATH_KEY);
+    if (watch_path && watch_path[0]) {
+        tracer->watch = file_watch_alloc(tracer->lg, watch_path,
+                                         htracer_conf_file_changed, tracer);
+        if (!tracer->watch) {
+            htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                        "htracer_create: failed to "
+                        "watch %s.\n", watch_path);
+            htracer_free(tracer);
+            return NULL;
+        }
+    }
     return tracer;
 }
 
@@ -103,23 +308,292 @@ const char *htracer_tname(const struct htracer *tracer)
     return tracer->tname;
 }
 
-void htracer_free(struct htracer *tracer)
+int htracer_reconfigure(struct htracer *tracer,
+                        const struct htrace_conf *cnf)
+{
+    struct htrace_rcv *rcv, *old_rcv;
+    struct htrace_sampler *smp;
+    struct htrace_conf *lazy_cnf;
+    uint64_t mem_limit;
+
+    pthread_mutex_lock(&tracer->reconf_lock);
+    if (tracer->lazy_cnf) {
+        // The tracer hasn't started yet.  Start it with the new
+        // configuration when it does.
+        lazy_cnf = htrace_conf_copy(cnf);
+        if (!lazy_cnf) {
+            pthread_mutex_unlock(&tracer->reconf_lock);
+            htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                        "htracer_reconfigure: OOM while copying "
+                        "the configuration.  Keeping the old "
+                        "configuration.\n");
+            return 0;
+        }
+        htrace_conf_free(tracer->lazy_cnf);
+        tracer->lazy_cnf = lazy_cnf;
+        mem_limit = membudget_configure(tracer->lg, cnf);
+        membudget_unconfigure(tracer->lg, tracer->mem_limit);
+        tracer->mem_limit = mem_limit;
+        __atomic_store_n(&tracer->id_scheme,
+                     htracer_parse_id_scheme(tracer, cnf), __ATOMIC_RELAXED);
+        __atomic_store_n(&tracer->lock_threshold_us,
+                     htrace_conf_get_u64(tracer->lg, cnf,
+                         HTRACE_LOCK_THRESHOLD_US_KEY), __ATOMIC_RELAXED);
+        for (smp = tracer->samplers; smp; smp = smp->reconf_next) {
+            smp->ty->reconfigure(smp, cnf);
+        }
+        pthread_mutex_unlock(&tracer->reconf_lock);
+        return 1;
+    }
+    if ((!tracer->trid) && (!htracer_init_trid(tracer, cnf))) {
+        // We failed to work out the tracer ID when the tracer started.
+        pthread_mutex_unlock(&tracer->reconf_lock);
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_reconfigure: failed to create the "
+                    "tracer ID.  Keeping the old configuration.\n");
+        return 0;
+    }
+    // Apply the new budget before creating the receiver, since the receiver
+    // may allocate its buffers against it.
+    mem_limit = membudget_configure(tracer->lg, cnf);
+    rcv = htrace_rcv_create(tracer, cnf);
+    if (!rcv) {
+        membudget_unconfigure(tracer->lg, mem_limit);
+        pthread_mutex_unlock(&tracer->reconf_lock);
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_reconfigure: failed to create a "
+                    "receiver.  Keeping the old configuration.\n");
+        return 0;
+    }
+    __atomic_store_n(&tracer->id_scheme,
+                     htracer_parse_id_scheme(tracer, cnf), __ATOMIC_RELAXED);
+    __atomic_store_n(&tracer->lock_threshold_us,
+                     htrace_conf_get_u64(tracer->lg, cnf,
+                         HTRACE_LOCK_THRESHOLD_US_KEY), __ATOMIC_RELAXED);
+    membudget_unconfigure(tracer->lg, tracer->mem_limit);
+    tracer->mem_limit = mem_limit;
+    old_rcv = __atomic_exchange_n(&tracer->rcv, rcv, __ATOMIC_ACQ_REL);
+    // Wait for every thread which might be using the old receiver to finish
+    // with it.  Freeing the receiver flushes its buffered spans.
+    epoch_synchronize(tracer->ed);
+    old_rcv->ty->free(old_rcv);
+    for (smp = tracer->samplers; smp; smp = smp->reconf_next) {
+        smp->ty->reconfigure(smp, cnf);
+    }
+    pthread_mutex_unlock(&tracer->reconf_lock);
+    htrace_logl(tracer->lg, HTRACE_LOG_INFO, "htracer_reconfigure: "
+                "reconfigured tracer %s with span receiver %s.\n",
+                tracer->tname, rcv->ty->name);
+    return 1;
+}
+
+void htracer_add_span(struct htracer *tracer, struct htrace_span *span)
 {
     struct htrace_rcv *rcv;
+    int token;
+
+    if (!__atomic_load_n(&tracer->rcv, __ATOMIC_ACQUIRE)) {
+        htracer_start(tracer);
+    }
+    if (tracer->fr) {
+        flight_recorder_add(tracer->fr, span);
+    }
+    token = epoch_enter(tracer->ed);
+    rcv = __atomic_load_n(&tracer->rcv, __ATOMIC_ACQUIRE);
+    rcv->ty->add_span(rcv, span);
+    epoch_exit(tracer->ed, token);
+}
+
+void htracer_add_spans(struct htracer *tracer, struct htrace_span *spans,
+                       int num_spans)
+{
+    struct htrace_rcv *rcv;
+    int i, token;
+
+    if (!__atomic_load_n(&tracer->rcv, __ATOMIC_ACQUIRE)) {
+        htracer_start(tracer);
+    }
+    if (tracer->fr) {
+        for (i = 0; i < num_spans; i++) {
+            flight_recorder_add(tracer->fr, spans + i);
+        }
+    }
+    token = epoch_enter(tracer->ed);
+    rcv = __atomic_load_n(&tracer->rcv, __ATOMIC_ACQUIRE);
+    rcv->ty->add_spans(rcv, spans, num_spans);
+    epoch_exit(tracer->ed, token);
+}
+
+int htracer_flush_async(struct htracer *tracer,
+                        void (*cb)(void *arg, int err), void *arg)
+{
+    struct htrace_rcv *rcv;
+    int token, ret;
+
+    token = epoch_enter(tracer->ed);
+    rcv = __atomic_load_n(&tracer->rcv, __ATOMIC_ACQUIRE);
+    if (rcv && rcv->ty->flush_async) {
+        ret = rcv->ty->flush_async(rcv, cb, arg);
+        epoch_exit(tracer->ed, token);
+        return ret;
+    }
+    // Either the tracer hasn't started, in which case no spans have been
+    // closed, or the receiver can flush without blocking for long.
+    if (rcv) {
+        rcv->ty->flush(rcv);
+    }
+    epoch_exit(tracer->ed, token);
+    cb(arg, 0);
+    return 0;
+}
+
+static void htracer_flush_fd_cb(void *arg, int err)
+{
+    uint64_t one = 1;
+    int fd = (int)(intptr_t)arg;
+
+    while ((write(fd, &one, sizeof(one)) < 0) && (errno == EINTR)) {
+        ;
+    }
+}
+
+int htracer_flush_async_fd(struct htracer *tracer, int fd)
+{
+    return htracer_flush_async(tracer, htracer_flush_fd_cb,
+                               (void *)(intptr_t)fd);
+}
+
+int htracer_dump_inflight(struct htracer *tracer, int fd)
+{
+    if (!tracer->inflight) {
+        return 0;
+    }
+    return inflight_dump(tracer->inflight, fd);
+}
+
+int htracer_flight_recorder_dump(struct htracer *tracer, const char *path)
+{
+    if (!tracer->fr) {
+        return EINVAL;
+    }
+    return flight_recorder_dump(tracer->fr, path);
+}
+
+int htracer_sigsafe_drain(struct htracer *tracer)
+{
+    if (!tracer->sigsafe) {
+        return 0;
+    }
+    return sigsafe_buf_drain(tracer->sigsafe);
+}
+
+enum htrace_span_id_scheme htracer_id_scheme(struct htracer *tracer)
+{
+    return __atomic_load_n(&tracer->id_scheme, __ATOMIC_RELAXED);
+}
+
+void htracer_register_sampler(struct htracer *tracer,
+                              struct htrace_sampler *smp)
+{
+    pthread_mutex_lock(&tracer->reconf_lock);
+    smp->tracer = tracer;
+    smp->reconf_next = tracer->samplers;
+    tracer->samplers = smp;
+    pthread_mutex_unlock(&tracer->reconf_lock);
+}
+
+void htracer_unregister_sampler(struct htrace_sampler *smp)
+{
+    struct htracer *tracer = smp->tracer;
+    struct htrace_sampler **prev;
 
     if (!tracer) {
         return;
     }
+    pthread_mutex_lock(&tracer->reconf_lock);
+    for (prev = &tracer->samplers; *prev; prev = &(*prev)->reconf_next) {
+        if (*prev == smp) {
+            *prev = smp->reconf_next;
+            break;
+        }
+    }
+    smp->tracer = NULL;
+    smp->reconf_next = NULL;
+    pthread_mutex_unlock(&tracer->reconf_lock);
+}
+
+/**
+ * Free a tracer.
+ *
+ * @param tracer        The tracer.
+ * @param deadline_ms   The monotonic-clock time by which the receiver must
+ *                          be shut down, or 0 if there is no deadline.
+ *
+ * @return              The number of buffered spans which the receiver
+ *                          couldn't deliver.
+ */
+static uint64_t htracer_free_impl(struct htracer *tracer, uint64_t deadline_ms)
+{
+    struct htrace_rcv *rcv;
+    struct htrace_sampler *smp;
+    uint64_t num_abandoned = 0;
+
+    // Interposed lock waits may be reported from any thread, so stop them
+    // before anything else.
+    lock_interpose_unregister(tracer);
+    // Stop the watch thread, so that it can't reconfigure the tracer
+    // while we are tearing it down.
+    file_watch_free(tracer->watch);
+    // The watchdog sends spans to the receiver, so stop it before freeing
+    // the receiver.
+    inflight_reg_free(tracer->inflight);
+    // The profiler's signal handler reads the thread-local scopes, so stop
+    // it before deleting the key.
+    profiler_free(tracer->prof);
+    // Draining the signal-safe spans sends them to the receiver and the
+    // flight recorder.
+    sigsafe_buf_free(tracer->sigsafe);
+    flight_recorder_free(tracer->fr);
     pthread_key_delete(tracer->tls);
     rcv = tracer->rcv;
     if (rcv) {
-        rcv->ty->free(rcv);
+        if (deadline_ms && rcv->ty->shutdown) {
+            num_abandoned = rcv->ty->shutdown(rcv, deadline_ms);
+        } else {
+            rcv->ty->free(rcv);
+        }
+    }
+    epoch_domain_free(tracer->ed);
+    for (smp = tracer->samplers; smp; smp = smp->reconf_next) {
+        smp->tracer = NULL;
     }
+    pthread_mutex_destroy(&tracer->reconf_lock);
     random_src_free(tracer->rnd);
+    htrace_conf_free(tracer->lazy_cnf);
     free(tracer->tname);
     free(tracer->trid);
+    // The receiver's memory has been released, so the budget can go too.
+    membudget_unconfigure(tracer->lg, tracer->mem_limit);
     htrace_log_free(tracer->lg);
     free(tracer);
+    return num_abandoned;
+}
+
+void htracer_free(struct htracer *tracer)
+{
+    if (!tracer) {
+        return;
+    }
+    htracer_free_impl(tracer, 0);
+}
+
+uint64_t htracer_shutdown(struct htracer *tracer, uint64_t timeout_ms)
+{
+    if (!tracer) {
+        return 0;
+    }
+    return htracer_free_impl(tracer,
+                monotonic_now_ms(tracer->lg) + timeout_ms);
 }
 
 struct htrace_scope *htracer_cur_scope(struct htracer *tracer)
@@ -134,10 +608,17 @@ int htracer_push_scope(struct htracer *tracer, struct htrace_scope *cur,
     next->parent = cur;
     ret = pthread_setspecific(tracer->tls, next);
     if (ret) {
-        htrace_log(tracer->lg, "htracer_push_scope: pthread_setspecific "
-                   "failed: %s\n", terror(ret));
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_push_scope: pthread_setspecific "
+                    "failed: %s\n", terror(ret));
         return EIO;
     }
+    if (tracer->inflight) {
+        inflight_set_top(tracer->inflight, next);
+    }
+    if (tracer->prof) {
+        profiler_thread_start(tracer->prof);
+    }
     return 0;
 }
 
@@ -148,19 +629,24 @@ int htracer_pop_scope(struct htracer *tracer, struct htrace_scope *scope)
 
     cur_scope = pthread_getspecific(tracer->tls);
     if (cur_scope != scope) {
-        htrace_log(tracer->lg, "htracer_pop_scope: attempted to pop a scope "
-                   "that wasn't the top of the stack.  Current top of stack: "
-                   "%s.  Attempted to pop: %s.\n",
-                   (cur_scope->span ? cur_scope->span->desc : "(detached)"),
-                   (scope->span ? scope->span->desc : "(detached)"));
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_pop_scope: attempted to pop a scope "
+                    "that wasn't the top of the stack.  Current top of stack: "
+                    "%s.  Attempted to pop: %s.\n",
+                    (cur_scope->span ? cur_scope->span->desc : "(detached)"),
+                    (scope->span ? scope->span->desc : "(detached)"));
         return EIO;
     }
     ret = pthread_setspecific(tracer->tls, scope->parent);
     if (ret) {
-        htrace_log(tracer->lg, "htracer_pop_scope: pthread_setspecific "
-                   "failed: %s\n", terror(ret));
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htracer_pop_scope: pthread_setspecific "
+                    "failed: %s\n", terror(ret));
         return EIO;
     }
+    if (tracer->inflight) {
+        inflight_set_top(tracer->inflight, scope->parent);
+    }
     return 0;
 }
 
@@ -19,6 +19,8 @@
 #ifndef APACHE_HTRACE_CORE_TRACER_H
 #define APACHE_HTRACE_CORE_TRACER_H
 
+#include "core/span_id.h" /* for enum htrace_span_id_scheme */
+
 #include <pthread.h> /* for pthread_key_t */
 
 /**
@@ -29,9 +31,18 @@
  * This is an internal header, not intended for external use.
  */
 
+struct epoch_domain;
+struct file_watch;
+struct flight_recorder;
+struct htrace_conf;
 struct htrace_log;
 struct htrace_rcv;
+struct htrace_sampler;
+struct htrace_span;
+struct inflight_reg;
+struct profiler;
 struct random_src;
+struct sigsafe_buf;
 
 struct htracer {
     /**
@@ -50,7 +61,8 @@ struct htracer {
     char *tname;
 
     /**
-     * The tracer id of this context.
+     * The tracer id of this context.  This is NULL until a lazy tracer is
+     * started.
      */
     char *trid;
 
@@ -60,11 +72,123 @@ struct htracer {
     struct random_src *rnd;
 
     /**
-     * The span receiver to use.
+     * The span receiver to use.  This may be replaced by
+     * htracer_reconfigure, so it must only be used inside an epoch read
+     * section.  See htracer_add_span.  This is NULL until a lazy tracer is
+     * started.
      */
     struct htrace_rcv *rcv;
+
+    /**
+     * How to generate the span IDs of new traces.  Accessed atomically, since
+     * it may be changed by htracer_reconfigure.
+     */
+    enum htrace_span_id_scheme id_scheme;
+
+    /**
+     * The epoch domain which protects rcv.
+     */
+    struct epoch_domain *ed;
+
+    /**
+     * Serializes calls to htracer_reconfigure, and protects samplers.
+     */
+    pthread_mutex_t reconf_lock;
+
+    /**
+     * The samplers which should be reconfigured along with this tracer.
+     */
+    struct htrace_sampler *samplers;
+
+    /**
+     * Watches the configuration file, or NULL if there is none.
+     */
+    struct file_watch *watch;
+
+    /**
+     * The configuration to start a lazy tracer with, or NULL if the tracer
+     * has been started.  Protected by reconf_lock.
+     */
+    struct htrace_conf *lazy_cnf;
+
+    /**
+     * The registry of open spans, or NULL if open spans aren't tracked.
+     */
+    struct inflight_reg *inflight;
+
+    /**
+     * The flight recorder, or NULL if there is none.
+     */
+    struct flight_recorder *fr;
+
+    /**
+     * The buffer for signal-safe spans, or NULL if they are turned off.
+     */
+    struct sigsafe_buf *sigsafe;
+
+    /**
+     * The CPU profiler, or NULL if there is none.
+     */
+    struct profiler *prof;
+
+    /**
+     * How long a traced lock acquisition must wait before it is recorded,
+     * in microseconds.  Accessed atomically, since it may be changed by
+     * htracer_reconfigure.
+     */
+    uint64_t lock_threshold_us;
+
+    /**
+     * The memory budget this tracer added with membudget_configure.
+     * Protected by reconf_lock.
+     */
+    uint64_t mem_limit;
 };
 
+/**
+ * Pass a span to the tracer's current span receiver.
+ *
+ * @param tracer            The tracer.
+ * @param span              The span.
+ */
+void htracer_add_span(struct htracer *tracer, struct htrace_span *span);
+
+/**
+ * Pass several spans to the tracer's current span receiver.
+ *
+ * @param tracer            The tracer.
+ * @param spans             An array of spans.
+ * @param num_spans         The number of spans in the array.
+ */
+void htracer_add_spans(struct htracer *tracer, struct htrace_span *spans,
+                       int num_spans);
+
+/**
+ * Get the scheme to use when generating the span IDs of new traces.
+ *
+ * @param tracer            The tracer.
+ *
+ * @return                  The span ID scheme.
+ */
+enum htrace_span_id_scheme htracer_id_scheme(struct htracer *tracer);
+
+/**
+ * Register a sampler to be reconfigured along with the tracer.
+ *
+ * @param tracer            The tracer.
+ * @param smp               The sampler.  Its type must have a reconfigure
+ *                              callback.
+ */
+void htracer_register_sampler(struct htracer *tracer,
+                              struct htrace_sampler *smp);
+
+/**
+ * Unregister a sampler registered with htracer_register_sampler.
+ *
+ * @param smp               The sampler.
+ */
+void htracer_unregister_sampler(struct htrace_sampler *smp);
+
 /**
  * Get the current scope in a given context.
  *
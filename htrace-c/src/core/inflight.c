@@ -0,0 +1,532 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/inflight.h"
+#include "core/scope.h"
+#include "core/span.h"
+#include "util/log.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file inflight.c
+ *
+ * Implementation of the in-flight span registry.
+ */
+
+/**
+ * The minimum interval between watchdog scans.
+ */
+#define INFLIGHT_INTERVAL_MS_MIN 10
+
+/**
+ * The minimum interval between rate-limited log messages.
+ */
+#define INFLIGHT_LOG_INTERVAL_MS 60000
+
+/**
+ * The in-flight state of one thread.
+ */
+struct inflight_thread {
+    /**
+     * The next thread in the registry.  Protected by the registry lock.
+     */
+    struct inflight_thread *next;
+
+    /**
+     * The registry.
+     */
+    struct inflight_reg *reg;
+
+    /**
+     * Protects top, and the spans of the scopes on the stack.  Only the
+     * thread itself and snapshots take this lock.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The top of the thread's scope stack, or NULL if it is empty.
+     */
+    struct htrace_scope *top;
+};
+
+struct inflight_reg {
+    /**
+     * The tracer.
+     */
+    struct htracer *tracer;
+
+    /**
+     * Key for the current thread's struct inflight_thread.
+     */
+    pthread_key_t key;
+
+    /**
+     * Protects threads and shutdown.  Taken before any thread lock.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Used to wake up the watchdog thread when we shut down.
+     */
+    pthread_cond_t cond;
+
+    /**
+     * All the threads which have opened spans.
+     */
+    struct inflight_thread *threads;
+
+    /**
+     * Spans which have been open for at least this long are sent to the
+     * span receiver by the watchdog, once each.  0 if there is no watchdog.
+     */
+    uint64_t threshold_ms;
+
+    /**
+     * How often the watchdog looks for spans which have been open for too
+     * long.
+     */
+    uint64_t interval_ms;
+
+    /**
+     * Nonzero if the watchdog thread should exit.
+     */
+    int shutdown;
+
+    /**
+     * The watchdog thread.
+     */
+    pthread_t watchdog;
+};
+
+/**
+ * Copies of the open spans.
+ */
+struct inflight_snap {
+    struct htrace_span *spans;
+    int num_spans;
+    int max_spans;
+};
+
+static void inflight_thread_free(void *data)
+{
+    struct inflight_thread *thr = data;
+    struct inflight_reg *reg = thr->reg;
+    struct inflight_thread **prev;
+
+    pthread_mutex_lock(&reg->lock);
+    for (prev = &reg->threads; *prev; prev = &(*prev)->next) {
+        if (*prev == thr) {
+            *prev = thr->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reg->lock);
+    pthread_mutex_destroy(&thr->lock);
+    free(thr);
+}
+
+/**
+ * Get the current thread's in-flight state, creating it if necessary.
+ *
+ * @return              The thread state, or NULL on OOM.
+ */
+static struct inflight_thread *inflight_thread_get(struct inflight_reg *reg)
+{
+    struct inflight_thread *thr;
+    int ret;
+
+    thr = pthread_getspecific(reg->key);
+    if (thr) {
+        return thr;
+    }
+    thr = calloc(1, sizeof(*thr));
+    if (!thr) {
+        goto oom;
+    }
+    thr->reg = reg;
+    pthread_mutex_init(&thr->lock, NULL);
+    ret = pthread_setspecific(reg->key, thr);
+    if (ret) {
+        pthread_mutex_destroy(&thr->lock);
+        free(thr);
+        goto oom;
+    }
+    pthread_mutex_lock(&reg->lock);
+    thr->next = reg->threads;
+    reg->threads = thr;
+    pthread_mutex_unlock(&reg->lock);
+    return thr;
+
+oom:
+    HTRACE_LOG_RATE_LIMITED(reg->tracer->lg, HTRACE_LOG_WARN,
+               INFLIGHT_LOG_INTERVAL_MS, "inflight_thread_get: OOM.  The "
+               "open spans of this thread won't be tracked.\n");
+    return NULL;
+}
+
+void inflight_set_top(struct inflight_reg *reg, struct htrace_scope *top)
+{
+    struct inflight_thread *thr;
+
+    if (top) {
+        thr = inflight_thread_get(reg);
+    } else {
+        thr = pthread_getspecific(reg->key);
+    }
+    if (!thr) {
+        return;
+    }
+    pthread_mutex_lock(&thr->lock);
+    thr->top = top;
+    pthread_mutex_unlock(&thr->lock);
+}
+
+struct htrace_span *inflight_detach(struct inflight_reg *reg,
+                                    struct htrace_scope *scope)
+{
+    struct inflight_thread *thr;
+    struct htrace_span *span;
+
+    thr = pthread_getspecific(reg->key);
+    if (!thr) {
+        span = scope->span;
+        scope->span = NULL;
+        return span;
+    }
+    pthread_mutex_lock(&thr->lock);
+    span = scope->span;
+    scope->span = NULL;
+    pthread_mutex_unlock(&thr->lock);
+    return span;
+}
+
+/**
+ * Add a copy of an open span to a snapshot.
+ *
+ * @param snap          The snapshot.
+ * @param span          The open span.
+ * @param now           The current time in microseconds.
+ *
+ * @return              1 on success; 0 on OOM.
+ */
+static int inflight_snap_add(struct inflight_snap *snap,
+                             const struct htrace_span *span, uint64_t now)
+{
+    struct htrace_span *copy, *nspans;
+    int max_spans;
+
+    if (snap->num_spans == snap->max_spans) {
+        max_spans = snap->max_spans ? (snap->max_spans * 2) : 16;
+        nspans = realloc(snap->spans, sizeof(*nspans) * max_spans);
+        if (!nspans) {
+            return 0;
+        }
+        snap->spans = nspans;
+        snap->max_spans = max_spans;
+    }
+    copy = snap->spans + snap->num_spans;
+    copy->desc = strdup(span->desc);
+    if (!copy->desc) {
+        return 0;
+    }
+    copy->begin_ms = span->begin_ms;
+    copy->end_ms = now;
+    copy->span_id = span->span_id;
+    copy->trid = NULL;
+    copy->flags = HTRACE_SPAN_FLAG_INFLIGHT;
+    copy->num_parents = span->num_parents;
+    if (span->num_parents > 1) {
+        copy->parent.list = malloc(sizeof(struct htrace_span_id) *
+                                   span->num_parents);
+        if (!copy->parent.list) {
+            free(copy->desc);
+            return 0;
+        }
+        memcpy(copy->parent.list, span->parent.list,
+               sizeof(struct htrace_span_id) * span->num_parents);
+    } else {
+        copy->parent.single = span->parent.single;
+    }
+    snap->num_spans++;
+    return 1;
+}
+
+static void inflight_snap_free(struct inflight_snap *snap)
+{
+    int i;
+
+    for (i = 0; i < snap->num_spans; i++) {
+        free(snap->spans[i].desc);
+        if (snap->spans[i].num_parents > 1) {
+            free(snap->spans[i].parent.list);
+        }
+    }
+    free(snap->spans);
+}
+
+/**
+ * Take a snapshot of the open spans.
+ *
+ * @param reg           The registry.
+ * @param min_age_ms    The minimum number of milliseconds for which a span
+ *                          must have been open to be included.
+ * @param report        If nonzero, leave out spans which an earlier report
+ *                          included, and mark the ones included now as
+ *                          reported.
+ * @param snap          (out param) The snapshot.  Must be freed with
+ *                          inflight_snap_free.
+ */
+static void inflight_snap_take(struct inflight_reg *reg, uint64_t min_age_ms,
+                               int report, struct inflight_snap *snap)
+{
+    struct inflight_thread *thr;
+    struct htrace_scope *scope;
+    struct htrace_span *span;
+    uint64_t now, num_oom = 0;
+
+    memset(snap, 0, sizeof(*snap));
+    now = now_us(reg->tracer->lg);
+    pthread_mutex_lock(&reg->lock);
+    for (thr = reg->threads; thr; thr = thr->next) {
+        pthread_mutex_lock(&thr->lock);
+        for (scope = thr->top; scope; scope = scope->parent) {
+            span = scope->span;
+            if ((!span) || (span->begin_ms + (min_age_ms * 1000) > now)) {
+                continue;
+            }
+            if (report && scope->inflight_reported) {
+                continue;
+            }
+            if (!inflight_snap_add(snap, span, now)) {
+                num_oom++;
+            } else if (report) {
+                scope->inflight_reported = 1;
+            }
+        }
+        pthread_mutex_unlock(&thr->lock);
+    }
+    pthread_mutex_unlock(&reg->lock);
+    if (num_oom) {
+        HTRACE_LOG_RATE_LIMITED(reg->tracer->lg, HTRACE_LOG_WARN,
+                   INFLIGHT_LOG_INTERVAL_MS, "inflight_snap_take: OOM.  "
+                   "Left %" PRId64 " open span(s) out of the snapshot.\n",
+                   num_oom);
+    }
+}
+
+static void *inflight_watchdog(void *data)
+{
+    struct inflight_reg *reg = data;
+    struct htracer *tracer = reg->tracer;
+    struct inflight_snap snap;
+    struct timespec wakeup_ts;
+
+    pthread_mutex_lock(&reg->lock);
+    while (1) {
+        ms_to_timespec(monotonic_now_ms(tracer->lg) + reg->interval_ms,
+                       &wakeup_ts);
+        while (!reg->shutdown) {
+            if (pthread_cond_timedwait(&reg->cond, &reg->lock,
+                                       &wakeup_ts) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (reg->shutdown) {
+            break;
+        }
+        pthread_mutex_unlock(&reg->lock);
+        inflight_snap_take(reg, reg->threshold_ms, 1, &snap);
+        if (snap.num_spans) {
+            htrace_logl(tracer->lg, HTRACE_LOG_INFO, "inflight_watchdog: "
+                        "%d span(s) have been open for more than %" PRId64
+                        " ms.\n", snap.num_spans, reg->threshold_ms);
+            htracer_add_spans(tracer, snap.spans, snap.num_spans);
+        }
+        inflight_snap_free(&snap);
+        pthread_mutex_lock(&reg->lock);
+    }
+    pthread_mutex_unlock(&reg->lock);
+    return NULL;
+}
+
+struct inflight_reg *inflight_reg_alloc(struct htracer *tracer,
+                                        const struct htrace_conf *cnf)
+{
+    struct inflight_reg *reg;
+    const char *enable;
+    int ret;
+
+    enable = htrace_conf_get(cnf, HTRACE_INFLIGHT_KEY);
+    if ((!enable) || strcmp(enable, "true")) {
+        return NULL;
+    }
+    reg = calloc(1, sizeof(*reg));
+    if (!reg) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR, "inflight_reg_alloc: OOM\n");
+        return NULL;
+    }
+    reg->tracer = tracer;
+    reg->threshold_ms = htrace_conf_get_u64(tracer->lg, cnf,
+                                            HTRACE_INFLIGHT_THRESHOLD_MS_KEY);
+    reg->interval_ms = htrace_conf_get_u64(tracer->lg, cnf,
+                                           HTRACE_INFLIGHT_INTERVAL_MS_KEY);
+    if (reg->interval_ms < INFLIGHT_INTERVAL_MS_MIN) {
+        reg->interval_ms = INFLIGHT_INTERVAL_MS_MIN;
+    }
+    ret = pthread_key_create(&reg->key, inflight_thread_free);
+    if (ret) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "inflight_reg_alloc: pthread_key_create "
+                    "failed: %s\n", terror(ret));
+        free(reg);
+        return NULL;
+    }
+    pthread_mutex_init(&reg->lock, NULL);
+    ret = monotonic_cond_init(&reg->cond);
+    if (ret) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "inflight_reg_alloc: pthread_cond_init "
+                    "failed: %s\n", terror(ret));
+        goto error;
+    }
+    if (reg->threshold_ms) {
+        ret = pthread_create(&reg->watchdog, NULL, inflight_watchdog, reg);
+        if (ret) {
+            htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                        "inflight_reg_alloc: failed to create "
+                        "the watchdog thread: %s\n", terror(ret));
+            pthread_cond_destroy(&reg->cond);
+            goto error;
+        }
+    }
+    htrace_logl(tracer->lg, HTRACE_LOG_INFO, "inflight_reg_alloc: tracking "
+                "open spans.  threshold_ms=%" PRId64 ", interval_ms=%"
+                PRId64 "\n", reg->threshold_ms, reg->interval_ms);
+    return reg;
+
+error:
+    pthread_mutex_destroy(&reg->lock);
+    pthread_key_delete(reg->key);
+    free(reg);
+    return NULL;
+}
+
+void inflight_reg_free(struct inflight_reg *reg)
+{
+    struct inflight_thread *thr;
+    int ret;
+
+    if (!reg) {
+        return;
+    }
+    if (reg->threshold_ms) {
+        pthread_mutex_lock(&reg->lock);
+        reg->shutdown = 1;
+        pthread_cond_signal(&reg->cond);
+        pthread_mutex_unlock(&reg->lock);
+        ret = pthread_join(reg->watchdog, NULL);
+        if (ret) {
+            htrace_logl(reg->tracer->lg, HTRACE_LOG_ERROR,
+                        "inflight_reg_free: pthread_join "
+                        "failed: %s\n", terror(ret));
+        }
+    }
+    // Deleting the key doesn't run the destructors, so free the state of the
+    // threads which are still around.
+    pthread_key_delete(reg->key);
+    while ((thr = reg->threads)) {
+        reg->threads = thr->next;
+        pthread_mutex_destroy(&thr->lock);
+        free(thr);
+    }
+    pthread_cond_destroy(&reg->cond);
+    pthread_mutex_destroy(&reg->lock);
+    free(reg);
+}
+
+/**
+ * Write a whole buffer to a file descriptor.
+ *
+ * @return              0 on success; the error code otherwise.
+ */
+static int inflight_write_fully(int fd, const char *buf, size_t len)
+{
+    ssize_t res;
+
+    while (len > 0) {
+        res = write(fd, buf, len);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+int inflight_dump(struct inflight_reg *reg, int fd)
+{
+    struct htracer *tracer = reg->tracer;
+    struct inflight_snap snap;
+    struct htrace_span *span;
+    int i, len, ret, num_written = 0;
+    char *buf;
+
+    inflight_snap_take(reg, 0, 0, &snap);
+    for (i = 0; i < snap.num_spans; i++) {
+        span = snap.spans + i;
+        span->trid = tracer->trid;
+        len = span_json_size(span);
+        buf = malloc(len);
+        if (!buf) {
+            span->trid = NULL;
+            htrace_logl(tracer->lg, HTRACE_LOG_ERROR, "inflight_dump: OOM\n");
+            break;
+        }
+        span_json_sprintf(span, len, buf);
+        span->trid = NULL;
+        buf[len - 1] = '\n';
+        ret = inflight_write_fully(fd, buf, len);
+        free(buf);
+        if (ret) {
+            htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                        "inflight_dump: write error: %d (%s)\n", ret,
+                        terror(ret));
+            break;
+        }
+        num_written++;
+    }
+    inflight_snap_free(&snap);
+    return num_written;
+}
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,109 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_CORE_INFLIGHT_H
+#define APACHE_HTRACE_CORE_INFLIGHT_H
+
+/**
+ * @file inflight.h
+ *
+ * A registry of the spans which are open but haven't been closed yet.
+ *
+ * A span receiver only sees spans once they are closed, so an operation which
+ * hangs never shows up in tracing.  The registry keeps track of the open
+ * spans of every thread, so that we can take snapshots of them.  A watchdog
+ * thread periodically sends snapshots of the spans which have been open for
+ * too long to the span receiver, flagged with HTRACE_SPAN_FLAG_INFLIGHT.
+ *
+ * Each thread's scope stack is already a linked list, through the parent
+ * pointers of the scopes.  The registry just remembers the top of each
+ * thread's stack.  Each thread has its own lock for this, so threads never
+ * contend with each other when they open and close spans; only a snapshot
+ * briefly holds up the threads it is looking at.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+struct htrace_conf;
+struct htrace_scope;
+struct htrace_span;
+struct htracer;
+struct inflight_reg;
+
+/**
+ * Create an in-flight span registry, if the configuration asks for one.
+ *
+ * @param tracer        The tracer.  The registry will hold on to this pointer.
+ * @param cnf           The configuration.
+ *
+ * @return              NULL if the registry is disabled, or couldn't be
+ *                          created; the registry otherwise.  Errors will be
+ *                          logged.
+ */
+struct inflight_reg *inflight_reg_alloc(struct htracer *tracer,
+                                        const struct htrace_conf *cnf);
+
+/**
+ * Free an in-flight span registry.
+ *
+ * Stops the watchdog thread.  No other thread may be opening or closing spans
+ * with the tracer, or exiting, at the same time.
+ *
+ * @param reg           The registry, or NULL.
+ */
+void inflight_reg_free(struct inflight_reg *reg);
+
+/**
+ * Record the new top of the current thread's scope stack.
+ *
+ * This must be called whenever a scope is pushed or popped, before a popped
+ * scope is freed.
+ *
+ * @param reg           The registry.
+ * @param top           The new top of the stack, or NULL if it is empty.
+ */
+void inflight_set_top(struct inflight_reg *reg, struct htrace_scope *top);
+
+/**
+ * Detach the span from a scope on the current thread's scope stack.
+ *
+ * @param reg           The registry.
+ * @param scope         The scope.
+ *
+ * @return              The span which was detached, or NULL if there was
+ *                          none.
+ */
+struct htrace_span *inflight_detach(struct inflight_reg *reg,
+                                    struct htrace_scope *scope);
+
+/**
+ * Write a snapshot of every open span to a file descriptor, one JSON object
+ * per line.
+ *
+ * @param reg           The registry.
+ * @param fd            The file descriptor.
+ *
+ * @return              The number of spans written.
+ */
+int inflight_dump(struct inflight_reg *reg, int fd);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,324 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/lock.h"
+#include "core/scope.h"
+#include "core/span.h"
+#include "util/log.h"
+#include "util/time.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @file lock.c
+ *
+ * Implementation of lock wait tracing.
+ */
+
+/**
+ * The maximum length of a lock wait description, including the terminating
+ * null.
+ */
+#define LOCK_DESC_MAX 256
+
+/**
+ * The tracer which records interposed lock waits, or NULL.  Updated
+ * atomically.
+ */
+static struct htracer *g_lock_tracer;
+
+/**
+ * The number of interposed lock waits being reported.  Updated atomically.
+ */
+static uint32_t g_lock_active;
+
+/**
+ * Read the clock used to time waits.  This is only read once we know that
+ * the lock is taken, so it doesn't need to be cheaper than the vDSO.
+ */
+static uint64_t lock_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * Record a lock wait as a child span of the current span, if it was long
+ * enough and there is a current span.
+ *
+ * @param tracer        The tracer.
+ * @param desc          The span description.
+ * @param wait_ns       How long the acquisition waited, in nanoseconds.
+ */
+static void lock_wait_record(struct htracer *tracer, const char *desc,
+                             uint64_t wait_ns)
+{
+    struct htrace_scope *scope;
+    uint64_t wait_us, end;
+
+    wait_us = wait_ns / 1000;
+    if (wait_us < __atomic_load_n(&tracer->lock_threshold_us,
+                                  __ATOMIC_RELAXED)) {
+        return;
+    }
+    scope = htracer_cur_scope(tracer);
+    if ((!scope) || (!scope->span)) {
+        return;
+    }
+    end = now_us(tracer->lg);
+    htrace_record_span(tracer, &scope->span->span_id, desc,
+                       end - wait_us, end);
+}
+
+/**
+ * Record a wait for a named lock.
+ */
+static void lock_wait_named(struct htracer *tracer, const char *kind,
+                            const char *name, uint64_t wait_ns)
+{
+    char desc[LOCK_DESC_MAX];
+
+    snprintf(desc, sizeof(desc), "%s wait: %s", kind, name ? name : "");
+    lock_wait_record(tracer, desc, wait_ns);
+}
+
+int htrace_mutex_init(struct htrace_mutex *mutex, struct htracer *tracer,
+                      const char *name, const pthread_mutexattr_t *attr)
+{
+    mutex->tracer = tracer;
+    mutex->name = name;
+    return pthread_mutex_init(&mutex->mutex, attr);
+}
+
+int htrace_mutex_lock(struct htrace_mutex *mutex)
+{
+    uint64_t begin;
+    int ret;
+
+    ret = pthread_mutex_trylock(&mutex->mutex);
+    if (ret != EBUSY) {
+        return ret;
+    }
+    begin = lock_now_ns();
+    ret = pthread_mutex_lock(&mutex->mutex);
+    if ((!ret) && mutex->tracer) {
+        lock_wait_named(mutex->tracer, "mutex", mutex->name,
+                        lock_now_ns() - begin);
+    }
+    return ret;
+}
+
+int htrace_mutex_unlock(struct htrace_mutex *mutex)
+{
+    return pthread_mutex_unlock(&mutex->mutex);
+}
+
+int htrace_mutex_destroy(struct htrace_mutex *mutex)
+{
+    return pthread_mutex_destroy(&mutex->mutex);
+}
+
+int htrace_rwlock_init(struct htrace_rwlock *rwlock, struct htracer *tracer,
+                       const char *name, const pthread_rwlockattr_t *attr)
+{
+    rwlock->tracer = tracer;
+    rwlock->name = name;
+    return pthread_rwlock_init(&rwlock->rwlock, attr);
+}
+
+int htrace_rwlock_rdlock(struct htrace_rwlock *rwlock)
+{
+    uint64_t begin;
+    int ret;
+
+    ret = pthread_rwlock_tryrdlock(&rwlock->rwlock);
+    if (ret != EBUSY) {
+        return ret;
+    }
+    begin = lock_now_ns();
+    ret = pthread_rwlock_rdlock(&rwlock->rwlock);
+    if ((!ret) && rwlock->tracer) {
+        lock_wait_named(rwlock->tracer, "rwlock", rwlock->name,
+                        lock_now_ns() - begin);
+    }
+    return ret;
+}
+
+int htrace_rwlock_wrlock(struct htrace_rwlock *rwlock)
+{
+    uint64_t begin;
+    int ret;
+
+    ret = pthread_rwlock_trywrlock(&rwlock->rwlock);
+    if (ret != EBUSY) {
+        return ret;
+    }
+    begin = lock_now_ns();
+    ret = pthread_rwlock_wrlock(&rwlock->rwlock);
+    if ((!ret) && rwlock->tracer) {
+        lock_wait_named(rwlock->tracer, "rwlock", rwlock->name,
+                        lock_now_ns() - begin);
+    }
+    return ret;
+}
+
+int htrace_rwlock_unlock(struct htrace_rwlock *rwlock)
+{
+    return pthread_rwlock_unlock(&rwlock->rwlock);
+}
+
+int htrace_rwlock_destroy(struct htrace_rwlock *rwlock)
+{
+    return pthread_rwlock_destroy(&rwlock->rwlock);
+}
+
+/**
+ * Hash a lock address, so that waits for the same lock can be grouped
+ * without putting raw addresses in span descriptions.
+ */
+static uint32_t lock_hash(const void *lock)
+{
+    uint64_t x = (uintptr_t)lock;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (uint32_t)(x ^ (x >> 31));
+}
+
+/**
+ * Describe the code a lock function was called from, as a symbol name if
+ * there is one, or a module and offset otherwise.
+ *
+ * @param call_site     The address the lock function was called from.
+ * @param info          The result of dladdr on call_site, or NULL if dladdr
+ *                          failed.
+ */
+static void lock_call_site(const void *call_site, const Dl_info *info,
+                           char *buf, size_t len)
+{
+    const char *mod;
+
+    if ((!info) || (!info->dli_fname)) {
+        snprintf(buf, len, "0x%" PRIxPTR, (uintptr_t)call_site);
+    } else if (info->dli_sname) {
+        snprintf(buf, len, "%s", info->dli_sname);
+    } else {
+        mod = strrchr(info->dli_fname, '/');
+        snprintf(buf, len, "%s+0x%" PRIxPTR, mod ? mod + 1 : info->dli_fname,
+                 (uintptr_t)call_site - (uintptr_t)info->dli_fbase);
+    }
+}
+
+/**
+ * Check whether a module is the one HTrace itself is in.
+ *
+ * Waits for HTrace's own locks are never recorded.  Recording a span can
+ * take the same lock again; for example, a receiver's lock may be held when
+ * a thread closes a span and waits for it.
+ */
+static int lock_module_is_ours(const Dl_info *info)
+{
+    Dl_info ours;
+
+    memset(&ours, 0, sizeof(ours));
+    if (!dladdr((void *)htrace_interposed_lock_wait, &ours)) {
+        return 0;
+    }
+    return ours.dli_fbase == info->dli_fbase;
+}
+
+void htrace_interposed_lock_wait(const void *lock, const void *call_site,
+                                 uint64_t wait_ns)
+{
+    struct htracer *tracer;
+    char site[LOCK_DESC_MAX / 2], desc[LOCK_DESC_MAX];
+    Dl_info info;
+    int found;
+
+    // Both of these must be sequentially consistent, pairing with the
+    // exchange of g_lock_tracer and the load of g_lock_active in
+    // lock_interpose_unregister.  Otherwise we could load the old tracer
+    // while the unregister sees no active reports.
+    __atomic_add_fetch(&g_lock_active, 1, __ATOMIC_SEQ_CST);
+    tracer = __atomic_load_n(&g_lock_tracer, __ATOMIC_SEQ_CST);
+    if (tracer && ((wait_ns / 1000) >=
+            __atomic_load_n(&tracer->lock_threshold_us, __ATOMIC_RELAXED))) {
+        memset(&info, 0, sizeof(info));
+        found = dladdr(call_site, &info);
+        if ((!found) || (!lock_module_is_ours(&info))) {
+            lock_call_site(call_site, found ? &info : NULL, site,
+                           sizeof(site));
+            snprintf(desc, sizeof(desc), "mutex wait: %08" PRIx32 " at %s",
+                     lock_hash(lock), site);
+            lock_wait_record(tracer, desc, wait_ns);
+        }
+    }
+    __atomic_sub_fetch(&g_lock_active, 1, __ATOMIC_ACQ_REL);
+}
+
+void lock_interpose_register(struct htracer *tracer,
+                             const struct htrace_conf *cnf)
+{
+    struct htracer *expected = NULL;
+    const char *val;
+
+    val = htrace_conf_get(cnf, HTRACE_LOCK_INTERPOSE_KEY);
+    if ((!val) || strcmp(val, "true")) {
+        return;
+    }
+    if (!__atomic_compare_exchange_n(&g_lock_tracer, &expected, tracer, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "lock_interpose_register: another tracer "
+                    "already receives interposed lock waits.  Ignoring %s for "
+                    "%s.\n", HTRACE_LOCK_INTERPOSE_KEY, tracer->tname);
+        return;
+    }
+    htrace_logl(tracer->lg, HTRACE_LOG_INFO, "lock_interpose_register: "
+                "recording interposed lock waits of at least %" PRId64
+                " us.\n", tracer->lock_threshold_us);
+}
+
+void lock_interpose_unregister(struct htracer *tracer)
+{
+    struct htracer *expected = tracer;
+
+    if (!__atomic_compare_exchange_n(&g_lock_tracer, &expected, NULL, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    // Wait for any report which might still be using the tracer.
+    while (__atomic_load_n(&g_lock_active, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+}
+
+// vim: ts=4:sw=4:tw=79:et
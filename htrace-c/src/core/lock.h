@@ -0,0 +1,59 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_CORE_LOCK_H
+#define APACHE_HTRACE_CORE_LOCK_H
+
+/**
+ * @file lock.h
+ *
+ * Tracing of lock waits.
+ *
+ * The public wrappers, htrace_mutex and htrace_rwlock, know which tracer to
+ * use.  Waits reported by the libhtrace_lockwait.so interposer don't, so
+ * they go to the one tracer which has lock.interpose set.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+struct htrace_conf;
+struct htracer;
+
+/**
+ * Make a tracer the one which records interposed lock waits, if the
+ * configuration asks for it.
+ *
+ * @param tracer        The tracer.
+ * @param cnf           The configuration.
+ */
+void lock_interpose_register(struct htracer *tracer,
+                             const struct htrace_conf *cnf);
+
+/**
+ * Stop recording interposed lock waits with a tracer.
+ *
+ * Waits for any report which might still be using the tracer.
+ *
+ * @param tracer        The tracer.  Nothing happens unless it was
+ *                          registered.
+ */
+void lock_interpose_unregister(struct htracer *tracer);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,1070 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/profiler.h"
+#include "core/scope.h"
+#include "core/span.h"
+#include "util/htable.h"
+#include "util/log.h"
+#include "util/membudget.h"
+#include "util/time.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/**
+ * @file profiler.c
+ *
+ * Implementation of the span-attributed CPU profiler.
+ */
+
+/**
+ * The maximum number of frames in a sample.
+ */
+#define PROF_MAX_DEPTH 64
+
+/**
+ * The maximum number of samples each thread can buffer.
+ */
+#define PROF_MAX_SAMPLES (64 * 1024)
+
+/**
+ * The maximum sampling frequency.
+ */
+#define PROF_MAX_HZ 10000
+
+/**
+ * The maximum length of a sampled description, not including the
+ * terminating null.  Longer descriptions are truncated.
+ */
+#define PROF_DESC_MAX_LEN 63
+
+/**
+ * The minimum flush interval.
+ */
+#define PROF_FLUSH_INTERVAL_MS_MIN 10
+
+/**
+ * The maximum length of a folded stack.  Stacks which are longer lose their
+ * innermost frames.
+ */
+#define PROF_FOLDED_MAX_LEN 8192
+
+/**
+ * The minimum interval between rate-limited log messages.
+ */
+#define PROF_LOG_INTERVAL_MS 60000
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/**
+ * The stack walk reads stack memory which the compiler doesn't know about.
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define PROF_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define PROF_NO_SANITIZE
+#endif
+
+enum prof_aggregate {
+    PROF_AGGREGATE_DESC = 0,
+    PROF_AGGREGATE_SPAN,
+};
+
+struct prof_sample {
+    struct htrace_span_id span_id;
+
+    /**
+     * The number of entries in pcs.
+     */
+    uint32_t depth;
+
+    char desc[PROF_DESC_MAX_LEN + 1];
+
+    /**
+     * The interrupted program counter, followed by the return addresses of
+     * its callers, innermost first.
+     */
+    uintptr_t pcs[PROF_MAX_DEPTH];
+};
+
+struct prof_thread {
+    /**
+     * The profiler which is sampling this thread, or NULL once that
+     * profiler has been freed.  Updated atomically, under g_prof_lock.
+     */
+    struct profiler *prof;
+
+    /**
+     * The number of samples written so far.  Only the signal handler
+     * writes this.  Updated atomically.
+     */
+    uint64_t head;
+
+    /**
+     * The number of samples read so far.  Only the aggregator writes this.
+     * Updated atomically.
+     */
+    uint64_t tail;
+
+    /**
+     * The ring of samples.
+     */
+    struct prof_sample *samples;
+    uint32_t num_slots;
+
+    /**
+     * The number of bytes reserved against the memory budget.
+     */
+    uint64_t reserved;
+
+    /**
+     * The top of the thread's stack.  Frame pointers must be below this.
+     */
+    uintptr_t stack_hi;
+
+    /**
+     * The CPU time timer, and whether it was created.
+     */
+    timer_t timer;
+    int armed;
+
+    /**
+     * Nonzero once the thread has exited.  Protected by g_prof_lock.
+     */
+    int dead;
+
+    /**
+     * The next thread sampled by the same profiler.  Protected by
+     * g_prof_lock.
+     */
+    struct prof_thread *next;
+};
+
+struct profiler {
+    /**
+     * The tracer.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The file the folded stacks are appended to.
+     */
+    char *path;
+
+    /**
+     * The CPU time between samples, in nanoseconds.
+     */
+    uint64_t period_ns;
+
+    /**
+     * The maximum number of frames to keep in each sample.
+     */
+    uint32_t depth;
+
+    /**
+     * The number of samples each thread can buffer.
+     */
+    uint32_t num_slots;
+
+    /**
+     * Whether samples are grouped by description or by span.
+     */
+    enum prof_aggregate aggregate;
+
+    /**
+     * The threads being sampled.  Protected by g_prof_lock.
+     */
+    struct prof_thread *threads;
+
+    /**
+     * The number of samples which weren't kept because the thread wasn't
+     * in a span, and because the thread's ring was full.  Updated
+     * atomically.
+     */
+    uint64_t num_idle;
+    uint64_t num_dropped;
+
+    /**
+     * Serializes flushes, and protects shutdown.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Signalled to stop the aggregation thread.
+     */
+    pthread_cond_t cond;
+
+    /**
+     * Nonzero once the aggregation thread should exit.
+     */
+    int shutdown;
+
+    /**
+     * How often the aggregation thread flushes.
+     */
+    uint64_t interval_ms;
+
+    /**
+     * The aggregation thread.
+     */
+    pthread_t aggregator;
+};
+
+/**
+ * Protects the globals below, and the thread lists of every profiler.
+ */
+static pthread_mutex_t g_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The profiler which the signal handler records samples for, or NULL.
+ * Updated atomically.
+ */
+static struct profiler *g_prof;
+
+/**
+ * Nonzero while a profiler owns the SIGPROF handler.  This stays set after
+ * g_prof is cleared, until the profiler has finished shutting down.
+ */
+static int g_prof_busy;
+
+/**
+ * The number of signal handlers running.  Updated atomically.
+ */
+static uint32_t g_prof_active;
+
+/**
+ * Nonzero once our SIGPROF handler has been installed.  It is never
+ * uninstalled: a timer signal may still be queued after the profiler's
+ * timers are deleted, and the default action for SIGPROF would kill the
+ * process.  With g_prof cleared, the handler ignores such signals.
+ * Protected by g_prof_lock.
+ */
+static int g_prof_handler_installed;
+
+/**
+ * The key for each thread's struct prof_thread.  It is created once, and
+ * never deleted, since a thread may outlive the profiler which sampled it.
+ */
+static pthread_once_t g_prof_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_prof_key;
+static int g_prof_key_err;
+
+static void prof_thread_free(struct prof_thread *t)
+{
+    free(t->samples);
+    membudget_release(t->reserved);
+    free(t);
+}
+
+/**
+ * Stop a thread's timer.  Must be called with g_prof_lock held.
+ */
+static void prof_thread_disarm(struct prof_thread *t)
+{
+    if (t->armed) {
+        timer_delete(t->timer);
+        t->armed = 0;
+    }
+}
+
+/**
+ * The thread-specific data destructor.  Runs when a sampled thread exits.
+ */
+static void prof_thread_exit(void *data)
+{
+    struct prof_thread *t = data;
+    sigset_t set;
+
+    // A signal which is already on its way would find the thread-specific
+    // data gone, and be ignored.  Block it anyway, so that it is never
+    // delivered while the thread is being torn down.
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_mutex_lock(&g_prof_lock);
+    if (t->prof) {
+        // The aggregator still has to read the ring.  It will free the
+        // thread once it has.
+        prof_thread_disarm(t);
+        t->dead = 1;
+        pthread_mutex_unlock(&g_prof_lock);
+        return;
+    }
+    pthread_mutex_unlock(&g_prof_lock);
+    prof_thread_free(t);
+}
+
+static void prof_key_init(void)
+{
+    g_prof_key_err = pthread_key_create(&g_prof_key, prof_thread_exit);
+}
+
+/**
+ * Copy a description, truncating it if necessary.  We never cut a UTF-8
+ * sequence in half, since that would make the description invalid.
+ */
+static void prof_copy_desc(char *dst, const char *src)
+{
+    size_t len;
+
+    for (len = 0; src[len] && (len < PROF_DESC_MAX_LEN); len++) {
+        ;
+    }
+    if (src[len]) {
+        while ((len > 0) && ((((uint8_t)src[len]) & 0xc0) == 0x80)) {
+            len--;
+        }
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+/**
+ * Walk the frame pointer chain of the interrupted code.
+ *
+ * Every frame pointer must lie between the interrupted stack pointer and the
+ * top of the stack, and each must be above the last, so a function which
+ * doesn't keep a frame pointer can end the walk early, but can't make it
+ * read outside the stack or loop forever.
+ *
+ * @return              The number of program counters written to pcs.
+ */
+static PROF_NO_SANITIZE uint32_t prof_walk(const struct prof_thread *t,
+                    const ucontext_t *uc, uintptr_t *pcs, uint32_t max)
+{
+    uintptr_t pc, fp, sp, next;
+    uint32_t depth = 0;
+
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+    sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+    sp = uc->uc_mcontext.sp;
+#else
+    return 0;
+#endif
+    pcs[depth++] = pc;
+    while (depth < max) {
+        if ((fp < sp) || (fp > t->stack_hi - (2 * sizeof(uintptr_t))) ||
+                (fp & (sizeof(uintptr_t) - 1))) {
+            break;
+        }
+        next = ((const uintptr_t *)fp)[0];
+        pc = ((const uintptr_t *)fp)[1];
+        if (!pc) {
+            break;
+        }
+        pcs[depth++] = pc;
+        if (next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+    return depth;
+}
+
+/**
+ * Record a sample for the current thread.  Runs in the signal handler.
+ */
+static void prof_take_sample(struct profiler *prof, struct prof_thread *t,
+                             const ucontext_t *uc)
+{
+    struct htrace_scope *scope;
+    struct htrace_span *span;
+    struct prof_sample *sample;
+    uint64_t head, tail;
+
+    scope = pthread_getspecific(prof->tracer->tls);
+    span = scope ? scope->span : NULL;
+    if (!span) {
+        __atomic_add_fetch(&prof->num_idle, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    head = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= t->num_slots) {
+        __atomic_add_fetch(&prof->num_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    sample = t->samples + (head % t->num_slots);
+    sample->span_id = span->span_id;
+    prof_copy_desc(sample->desc, span->desc ? span->desc : "");
+    sample->depth = prof_walk(t, uc, sample->pcs, prof->depth);
+    __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void prof_signal_handler(int sig, siginfo_t *info, void *uc)
+{
+    struct profiler *prof;
+    struct prof_thread *t;
+    int err = errno;
+
+    if (info->si_code != SI_TIMER) {
+        return;
+    }
+    // Both of these must be sequentially consistent, pairing with the store
+    // to g_prof and the load of g_prof_active in profiler_free.  Otherwise
+    // we could load the old g_prof while profiler_free sees no active
+    // handlers.
+    __atomic_add_fetch(&g_prof_active, 1, __ATOMIC_SEQ_CST);
+    prof = __atomic_load_n(&g_prof, __ATOMIC_SEQ_CST);
+    if (prof) {
+        t = pthread_getspecific(g_prof_key);
+        if (t && (__atomic_load_n(&t->prof, __ATOMIC_ACQUIRE) == prof)) {
+            prof_take_sample(prof, t, uc);
+        }
+    }
+    __atomic_sub_fetch(&g_prof_active, 1, __ATOMIC_ACQ_REL);
+    errno = err;
+}
+
+/**
+ * Find the top of the calling thread's stack.
+ *
+ * @return              The top of the stack, or 0 if it isn't known, in
+ *                          which case only the interrupted program counter
+ *                          is sampled.
+ */
+static uintptr_t prof_stack_hi(void)
+{
+#if defined(__linux__)
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    uintptr_t hi = 0;
+
+    if (pthread_getattr_np(pthread_self(), &attr)) {
+        return 0;
+    }
+    if (!pthread_attr_getstack(&attr, &addr, &size)) {
+        hi = ((uintptr_t)addr) + size;
+    }
+    pthread_attr_destroy(&attr);
+    return hi;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Create and start the calling thread's CPU time timer.
+ *
+ * @return              0 on success; the error code otherwise.
+ */
+static int prof_thread_arm(struct profiler *prof, struct prof_thread *t)
+{
+#if defined(__linux__) && defined(SIGEV_THREAD_ID) && defined(SYS_gettid)
+    struct sigevent sev;
+    struct itimerspec its;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &t->timer)) {
+        return errno;
+    }
+    t->armed = 1;
+    its.it_interval.tv_sec = prof->period_ns / 1000000000ULL;
+    its.it_interval.tv_nsec = prof->period_ns % 1000000000ULL;
+    its.it_value = its.it_interval;
+    if (timer_settime(t->timer, 0, &its, NULL)) {
+        return errno;
+    }
+    return 0;
+#else
+    return ENOTSUP;
+#endif
+}
+
+void profiler_thread_start(struct profiler *prof)
+{
+    struct prof_thread *t;
+    int ret;
+
+    t = pthread_getspecific(g_prof_key);
+    if (t && (__atomic_load_n(&t->prof, __ATOMIC_RELAXED) == prof)) {
+        return;
+    }
+    if (t) {
+        if (__atomic_load_n(&t->prof, __ATOMIC_RELAXED)) {
+            // Another tracer's profiler is sampling this thread.
+            return;
+        }
+        // The thread was sampled by a profiler which has since been freed.
+        pthread_setspecific(g_prof_key, NULL);
+        prof_thread_free(t);
+    }
+    t = calloc(1, sizeof(*t));
+    if (!t) {
+        HTRACE_LOG_RATE_LIMITED(prof->tracer->lg, HTRACE_LOG_WARN,
+                   PROF_LOG_INTERVAL_MS, "profiler_thread_start: OOM\n");
+        return;
+    }
+    t->reserved = sizeof(struct prof_sample) * (uint64_t)prof->num_slots;
+    if (!membudget_reserve(t->reserved)) {
+        HTRACE_LOG_RATE_LIMITED(prof->tracer->lg, HTRACE_LOG_WARN,
+                   PROF_LOG_INTERVAL_MS, "profiler_thread_start: %" PRId64
+                   " bytes would put tracing over its memory budget.  Not "
+                   "sampling thread %lld.\n", t->reserved,
+                   (long long)syscall(SYS_gettid));
+        t->reserved = 0;
+    } else {
+        t->samples = calloc(prof->num_slots, sizeof(struct prof_sample));
+        if (t->samples) {
+            t->num_slots = prof->num_slots;
+        }
+    }
+    t->stack_hi = prof_stack_hi();
+    // The thread is registered even if it can't be sampled, so that we don't
+    // try again each time it opens a scope.
+    ret = pthread_setspecific(g_prof_key, t);
+    if (ret) {
+        HTRACE_LOG_RATE_LIMITED(prof->tracer->lg, HTRACE_LOG_WARN,
+                   PROF_LOG_INTERVAL_MS, "profiler_thread_start: "
+                   "pthread_setspecific failed: %s\n", terror(ret));
+        prof_thread_free(t);
+        return;
+    }
+    pthread_mutex_lock(&g_prof_lock);
+    __atomic_store_n(&t->prof, prof, __ATOMIC_RELEASE);
+    t->next = prof->threads;
+    prof->threads = t;
+    if (t->num_slots) {
+        ret = prof_thread_arm(prof, t);
+        if (ret) {
+            prof_thread_disarm(t);
+            HTRACE_LOG_RATE_LIMITED(prof->tracer->lg, HTRACE_LOG_WARN,
+                       PROF_LOG_INTERVAL_MS, "profiler_thread_start: failed "
+                       "to create a CPU time timer: %s\n", terror(ret));
+        }
+    }
+    pthread_mutex_unlock(&g_prof_lock);
+}
+
+/**
+ * Append a string to a folded stack.
+ *
+ * @param sep           Nonzero if the string is a separator.  Otherwise,
+ *                          semicolons and newlines are replaced, since they
+ *                          would end the frame or the line.
+ */
+static void prof_put_str(char *buf, size_t *off, const char *str, int sep)
+{
+    char c;
+
+    for (; *str; str++) {
+        if (*off + 1 >= PROF_FOLDED_MAX_LEN) {
+            break;
+        }
+        c = *str;
+        if ((!sep) && ((c == ';') || (c == '\n') || (c == '\r'))) {
+            c = '_';
+        }
+        buf[(*off)++] = c;
+    }
+    buf[*off] = '\0';
+}
+
+/**
+ * Append a frame to a folded stack.
+ *
+ * @param pc            The program counter.
+ * @param ret           Nonzero if pc is a return address.  A return address
+ *                          points after the call, which may be the start of
+ *                          the next function, so we look up the address
+ *                          before it.
+ */
+static void prof_put_frame(char *buf, size_t *off, uintptr_t pc, int ret)
+{
+    Dl_info info;
+    const char *mod;
+    char tmp[64];
+
+    if (ret) {
+        pc--;
+    }
+    memset(&info, 0, sizeof(info));
+    if (dladdr((void *)pc, &info) && info.dli_sname) {
+        prof_put_str(buf, off, info.dli_sname, 0);
+        return;
+    }
+    if (info.dli_fname && info.dli_fname[0]) {
+        mod = strrchr(info.dli_fname, '/');
+        prof_put_str(buf, off, mod ? mod + 1 : info.dli_fname, 0);
+        snprintf(tmp, sizeof(tmp), "+0x%" PRIxPTR,
+                 pc - (uintptr_t)info.dli_fbase);
+    } else {
+        snprintf(tmp, sizeof(tmp), "0x%" PRIxPTR, pc);
+    }
+    prof_put_str(buf, off, tmp, 0);
+}
+
+/**
+ * Fold a sample into a string of frames separated by semicolons, with the
+ * span first and the innermost frame last.
+ */
+static void prof_fold(const struct profiler *prof,
+                      const struct prof_sample *sample, char *buf)
+{
+    char id_str[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    size_t off = 0;
+    uint32_t i;
+
+    buf[0] = '\0';
+    prof_put_str(buf, &off, sample->desc[0] ? sample->desc : "(none)", 0);
+    if ((prof->aggregate == PROF_AGGREGATE_SPAN) &&
+            htrace_span_id_to_str(&sample->span_id, id_str, sizeof(id_str))) {
+        prof_put_str(buf, &off, " [", 1);
+        prof_put_str(buf, &off, id_str, 1);
+        prof_put_str(buf, &off, "]", 1);
+    }
+    for (i = sample->depth; i > 0; i--) {
+        prof_put_str(buf, &off, ";", 1);
+        prof_put_frame(buf, &off, sample->pcs[i - 1], i > 1);
+    }
+}
+
+/**
+ * Count a sample in the table of folded stacks.
+ *
+ * @return              1 if the sample was counted; 0 on OOM.
+ */
+static int prof_count(struct htable *counts, const char *folded)
+{
+    uint64_t *count;
+    char *key;
+
+    count = htable_get(counts, folded);
+    if (count) {
+        (*count)++;
+        return 1;
+    }
+    key = strdup(folded);
+    count = malloc(sizeof(*count));
+    if ((!key) || (!count) || htable_put(counts, key, count)) {
+        free(key);
+        free(count);
+        return 0;
+    }
+    *count = 1;
+    return 1;
+}
+
+struct prof_write_ctx {
+    FILE *fp;
+    uint64_t num_written;
+};
+
+static void prof_write_count(void *data, void *key, void *val)
+{
+    struct prof_write_ctx *ctx = data;
+    uint64_t *count = val;
+
+    if (ctx->fp) {
+        fprintf(ctx->fp, "%s %" PRIu64 "\n", (char *)key, *count);
+        ctx->num_written += *count;
+    }
+    free(key);
+    free(val);
+}
+
+/**
+ * Read the samples in every thread's ring into the table of folded stacks,
+ * and free the threads which have exited.  Must be called with prof->lock
+ * held.
+ *
+ * @return              The number of samples which couldn't be counted.
+ */
+static uint64_t prof_drain(struct profiler *prof, struct htable *counts)
+{
+    struct prof_thread *t, **prev;
+    uint64_t head, tail, num_lost = 0;
+    char *folded;
+
+    folded = malloc(PROF_FOLDED_MAX_LEN);
+    pthread_mutex_lock(&g_prof_lock);
+    prev = &prof->threads;
+    while ((t = *prev)) {
+        head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        for (tail = t->tail; tail != head; tail++) {
+            if (!folded) {
+                num_lost++;
+                continue;
+            }
+            prof_fold(prof, t->samples + (tail % t->num_slots), folded);
+            if (!prof_count(counts, folded)) {
+                num_lost++;
+            }
+        }
+        __atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+        if (t->dead) {
+            *prev = t->next;
+            prof_thread_free(t);
+        } else {
+            prev = &t->next;
+        }
+    }
+    pthread_mutex_unlock(&g_prof_lock);
+    free(folded);
+    return num_lost;
+}
+
+uint64_t profiler_flush(struct profiler *prof)
+{
+    struct htrace_log *lg = prof->tracer->lg;
+    struct prof_write_ctx ctx;
+    struct htable *counts;
+    uint64_t num_lost, num_dropped, num_idle;
+    int ret;
+
+    memset(&ctx, 0, sizeof(ctx));
+    pthread_mutex_lock(&prof->lock);
+    counts = htable_alloc(128, ht_hash_string, ht_compare_string);
+    if (!counts) {
+        pthread_mutex_unlock(&prof->lock);
+        htrace_logl(lg, HTRACE_LOG_ERROR, "profiler_flush: OOM\n");
+        return 0;
+    }
+    num_lost = prof_drain(prof, counts);
+    if (htable_used(counts) > 0) {
+        ctx.fp = fopen(prof->path, "a");
+        if (!ctx.fp) {
+            ret = errno;
+            HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN,
+                       PROF_LOG_INTERVAL_MS, "profiler_flush: failed to "
+                       "open %s: %s\n", prof->path, terror(ret));
+        }
+    }
+    htable_visit(counts, prof_write_count, &ctx);
+    htable_free(counts);
+    if (ctx.fp && fclose(ctx.fp)) {
+        ret = errno;
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN,
+                   PROF_LOG_INTERVAL_MS, "profiler_flush: failed to "
+                   "write %s: %s\n", prof->path, terror(ret));
+    }
+    pthread_mutex_unlock(&prof->lock);
+    if (num_lost) {
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, PROF_LOG_INTERVAL_MS,
+                   "profiler_flush: discarded %" PRId64 " sample(s) because "
+                   "we ran out of memory.\n", num_lost);
+    }
+    num_dropped = __atomic_exchange_n(&prof->num_dropped, 0,
+                                      __ATOMIC_RELAXED);
+    if (num_dropped) {
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, PROF_LOG_INTERVAL_MS,
+                   "profiler_flush: dropped %" PRId64 " sample(s) because "
+                   "a thread's buffer was full.  Consider raising %s.\n",
+                   num_dropped, HTRACE_PROFILER_SAMPLES_KEY);
+    }
+    num_idle = __atomic_exchange_n(&prof->num_idle, 0, __ATOMIC_RELAXED);
+    htrace_logl(lg, HTRACE_LOG_DEBUG, "profiler_flush: wrote %" PRId64
+                " sample(s) to %s, and skipped %" PRId64 " taken outside of "
+                "any span.\n", ctx.num_written, prof->path, num_idle);
+    return ctx.num_written;
+}
+
+static void *prof_aggregator(void *data)
+{
+    struct profiler *prof = data;
+    struct timespec wakeup_ts;
+    int shutdown;
+
+    while (1) {
+        pthread_mutex_lock(&prof->lock);
+        ms_to_timespec(monotonic_now_ms(prof->tracer->lg) +
+                       prof->interval_ms, &wakeup_ts);
+        while (!prof->shutdown) {
+            if (pthread_cond_timedwait(&prof->cond, &prof->lock,
+                                       &wakeup_ts) == ETIMEDOUT) {
+                break;
+            }
+        }
+        shutdown = prof->shutdown;
+        pthread_mutex_unlock(&prof->lock);
+        if (shutdown) {
+            break;
+        }
+        profiler_flush(prof);
+    }
+    return NULL;
+}
+
+/**
+ * Expand %{pid} in the configured path.
+ */
+static char *prof_expand_path(const char *path)
+{
+    const char *var;
+    char *out;
+
+    var = strstr(path, "%{pid}");
+    if (!var) {
+        return strdup(path);
+    }
+    if (asprintf(&out, "%.*s%lld%s", (int)(var - path), path,
+                 (long long)getpid(), var + strlen("%{pid}")) < 0) {
+        return NULL;
+    }
+    return out;
+}
+
+static int prof_parse_aggregate(struct htrace_log *lg, const char *str,
+                                enum prof_aggregate *aggregate)
+{
+    if (!str || !strcmp(str, "desc")) {
+        *aggregate = PROF_AGGREGATE_DESC;
+    } else if (!strcmp(str, "span")) {
+        *aggregate = PROF_AGGREGATE_SPAN;
+    } else {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "profiler_alloc: invalid value '%s' for %s.  Valid "
+                    "values are desc and span.\n", str,
+                    HTRACE_PROFILER_AGGREGATE_KEY);
+        return EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Make the profiler the one the SIGPROF handler records samples for.
+ *
+ * @return              1 on success; 0 on failure.  Errors will be logged.
+ */
+static int prof_signal_register(struct profiler *prof)
+{
+    struct htrace_log *lg = prof->tracer->lg;
+    struct sigaction act;
+    int ret;
+
+    pthread_once(&g_prof_key_once, prof_key_init);
+    if (g_prof_key_err) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "profiler_alloc: pthread_key_create failed: %s\n",
+                    terror(g_prof_key_err));
+        return 0;
+    }
+    pthread_mutex_lock(&g_prof_lock);
+    if (g_prof_busy) {
+        pthread_mutex_unlock(&g_prof_lock);
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "profiler_alloc: another tracer is already being "
+                    "profiled.  Only one profiler can run at a time.\n");
+        return 0;
+    }
+    if (!g_prof_handler_installed) {
+        memset(&act, 0, sizeof(act));
+        act.sa_sigaction = prof_signal_handler;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&act.sa_mask);
+        if (sigaction(SIGPROF, &act, NULL)) {
+            ret = errno;
+            pthread_mutex_unlock(&g_prof_lock);
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "profiler_alloc: failed to install the SIGPROF "
+                        "handler: %s\n", terror(ret));
+            return 0;
+        }
+        g_prof_handler_installed = 1;
+    }
+    g_prof_busy = 1;
+    __atomic_store_n(&g_prof, prof, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_prof_lock);
+    return 1;
+}
+
+struct profiler *profiler_alloc(struct htracer *tracer,
+                                const struct htrace_conf *cnf)
+{
+    struct htrace_log *lg = tracer->lg;
+    struct profiler *prof;
+    const char *path;
+    uint64_t hz, depth, num_slots;
+    int ret;
+
+    hz = htrace_conf_get_u64(lg, cnf, HTRACE_PROFILER_HZ_KEY);
+    if (hz == 0) {
+        return NULL;
+    }
+    if (hz > PROF_MAX_HZ) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "profiler_alloc: %s can't be more than %d.  Using "
+                    "%d.\n", HTRACE_PROFILER_HZ_KEY, PROF_MAX_HZ, PROF_MAX_HZ);
+        hz = PROF_MAX_HZ;
+    }
+    path = htrace_conf_get(cnf, HTRACE_PROFILER_PATH_KEY);
+    if (!path || !path[0]) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "profiler_alloc: %s is set, but %s is not.  Not "
+                    "profiling.\n", HTRACE_PROFILER_HZ_KEY,
+                    HTRACE_PROFILER_PATH_KEY);
+        return NULL;
+    }
+    prof = calloc(1, sizeof(*prof));
+    if (!prof) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "profiler_alloc: OOM\n");
+        return NULL;
+    }
+    prof->tracer = tracer;
+    if (prof_parse_aggregate(lg, htrace_conf_get(cnf,
+                HTRACE_PROFILER_AGGREGATE_KEY), &prof->aggregate)) {
+        free(prof);
+        return NULL;
+    }
+    prof->path = prof_expand_path(path);
+    if (!prof->path) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "profiler_alloc: OOM\n");
+        free(prof);
+        return NULL;
+    }
+    prof->period_ns = 1000000000ULL / hz;
+    depth = htrace_conf_get_u64(lg, cnf, HTRACE_PROFILER_DEPTH_KEY);
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > PROF_MAX_DEPTH) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "profiler_alloc: %s can't be more than %d.  Using "
+                    "%d.\n", HTRACE_PROFILER_DEPTH_KEY, PROF_MAX_DEPTH,
+                    PROF_MAX_DEPTH);
+        depth = PROF_MAX_DEPTH;
+    }
+    prof->depth = depth;
+    num_slots = htrace_conf_get_u64(lg, cnf, HTRACE_PROFILER_SAMPLES_KEY);
+    if (num_slots < 1) {
+        num_slots = 1;
+    } else if (num_slots > PROF_MAX_SAMPLES) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "profiler_alloc: %s can't be more than %d.  Using "
+                    "%d.\n", HTRACE_PROFILER_SAMPLES_KEY, PROF_MAX_SAMPLES,
+                    PROF_MAX_SAMPLES);
+        num_slots = PROF_MAX_SAMPLES;
+    }
+    prof->num_slots = num_slots;
+    prof->interval_ms = htrace_conf_get_u64(lg, cnf,
+                                    HTRACE_PROFILER_FLUSH_INTERVAL_MS_KEY);
+    if (prof->interval_ms < PROF_FLUSH_INTERVAL_MS_MIN) {
+        prof->interval_ms = PROF_FLUSH_INTERVAL_MS_MIN;
+    }
+    pthread_mutex_init(&prof->lock, NULL);
+    ret = monotonic_cond_init(&prof->cond);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "profiler_alloc: pthread_cond_init failed: %s\n",
+                    terror(ret));
+        goto error;
+    }
+    if (!prof_signal_register(prof)) {
+        pthread_cond_destroy(&prof->cond);
+        goto error;
+    }
+    ret = pthread_create(&prof->aggregator, NULL, prof_aggregator, prof);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "profiler_alloc: failed to create the aggregation "
+                    "thread: %s\n", terror(ret));
+        // No thread has been armed yet, so there is nothing else to undo.
+        pthread_mutex_lock(&g_prof_lock);
+        __atomic_store_n(&g_prof, NULL, __ATOMIC_SEQ_CST);
+        g_prof_busy = 0;
+        pthread_mutex_unlock(&g_prof_lock);
+        pthread_cond_destroy(&prof->cond);
+        goto error;
+    }
+    htrace_logl(lg, HTRACE_LOG_INFO, "profiler_alloc: sampling threads in "
+                "spans %" PRId64 " times per CPU second, and writing folded "
+                "stacks to %s\n", hz, prof->path);
+    return prof;
+
+error:
+    pthread_mutex_destroy(&prof->lock);
+    free(prof->path);
+    free(prof);
+    return NULL;
+}
+
+void profiler_free(struct profiler *prof)
+{
+    struct prof_thread *t, *next;
+
+    if (!prof) {
+        return;
+    }
+    pthread_mutex_lock(&prof->lock);
+    prof->shutdown = 1;
+    pthread_cond_signal(&prof->cond);
+    pthread_mutex_unlock(&prof->lock);
+    pthread_join(prof->aggregator, NULL);
+
+    // Stop taking samples, and wait for any signal handler which might
+    // still be writing one.
+    pthread_mutex_lock(&g_prof_lock);
+    __atomic_store_n(&g_prof, NULL, __ATOMIC_SEQ_CST);
+    for (t = prof->threads; t; t = t->next) {
+        prof_thread_disarm(t);
+    }
+    pthread_mutex_unlock(&g_prof_lock);
+    while (__atomic_load_n(&g_prof_active, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+    profiler_flush(prof);
+
+    // Threads which are still running keep their struct prof_thread until
+    // they exit, since it is still their thread-specific data.
+    pthread_mutex_lock(&g_prof_lock);
+    for (t = prof->threads; t; t = next) {
+        next = t->next;
+        if (t->dead) {
+            prof_thread_free(t);
+        } else {
+            t->next = NULL;
+            __atomic_store_n(&t->prof, NULL, __ATOMIC_RELEASE);
+        }
+    }
+    prof->threads = NULL;
+    // The SIGPROF handler stays installed.  See g_prof_handler_installed.
+    g_prof_busy = 0;
+    pthread_mutex_unlock(&g_prof_lock);
+    pthread_cond_destroy(&prof->cond);
+    pthread_mutex_destroy(&prof->lock);
+    free(prof->path);
+    free(prof);
+}
+
+// vim: ts=4:sw=4:tw=79:et
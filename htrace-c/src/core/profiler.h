@@ -0,0 +1,100 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_CORE_PROFILER_H
+#define APACHE_HTRACE_CORE_PROFILER_H
+
+/**
+ * @file profiler.h
+ *
+ * A sampling CPU profiler which charges each sample to the span the thread
+ * was in.
+ *
+ * Each thread which opens a scope gets a timer which measures the thread's
+ * own CPU time, and raises SIGPROF on that thread every 1/profiler.hz seconds
+ * of it.  The signal handler looks up the thread's current scope, walks the
+ * frame pointers of the interrupted code, and writes the span ID, the
+ * description and the return addresses into a ring which belongs to the
+ * thread.  The handler takes no locks and allocates nothing.  Samples taken
+ * outside of any span are counted, but not kept.
+ *
+ * An aggregation thread empties the rings, symbolizes the stacks, and counts
+ * identical stacks.  Every profiler.flush.interval.ms it appends them to
+ * profiler.path as folded stacks, one per line:
+ *
+ *      <span>;<outermost frame>;...;<innermost frame> <count>
+ *
+ * which flamegraph.pl and most other flame graph tools read directly.
+ *
+ * Only one profiler can be active in a process at a time, since there is only
+ * one SIGPROF handler.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+struct htrace_conf;
+struct htracer;
+struct profiler;
+
+/**
+ * Create a profiler, if the configuration asks for one.
+ *
+ * @param tracer        The tracer.  The profiler will hold on to this pointer.
+ * @param cnf           The configuration.
+ *
+ * @return              NULL if the profiler is disabled, or couldn't be
+ *                          created; the profiler otherwise.  Errors will be
+ *                          logged.
+ */
+struct profiler *profiler_alloc(struct htracer *tracer,
+                                const struct htrace_conf *cnf);
+
+/**
+ * Free a profiler.
+ *
+ * Stops every thread's timer, and writes out any samples which haven't been
+ * written yet.
+ *
+ * @param prof          The profiler, or NULL.
+ */
+void profiler_free(struct profiler *prof);
+
+/**
+ * Start sampling the calling thread, if it isn't being sampled already.
+ *
+ * This is called each time the thread opens a scope, so it is cheap once the
+ * thread has been set up.
+ *
+ * @param prof          The profiler.
+ */
+void profiler_thread_start(struct profiler *prof);
+
+/**
+ * Write out the samples taken so far.
+ *
+ * @param prof          The profiler.
+ *
+ * @return              The number of samples which were written.
+ */
+uint64_t profiler_flush(struct profiler *prof);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,134 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "util/log.h"
+#include "util/string.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file record.c
+ *
+ * Implementation of retroactive span recording.
+ *
+ * Retroactive spans are timed by the caller, so they never touch the trace
+ * scope stack.  The spans are built directly in caller-owned or batch-owned
+ * memory and handed to the span receiver.  Receivers serialize spans during
+ * add_span, so the description string can be borrowed rather than copied.
+ */
+
+/**
+ * Fill in a span from its retroactive description.
+ *
+ * @param tracer        The tracer.
+ * @param span          (out param) The span to fill in.
+ * @param parent        The parent span id, or NULL.
+ * @param desc          The span description.  Will not be copied.
+ * @param begin         The beginning time in microseconds.
+ * @param end           The end time in microseconds.
+ *
+ * @return              1 on success; 0 if the description was invalid.
+ */
+static int htrace_record_fill(struct htracer *tracer, struct htrace_span *span,
+                              const struct htrace_span_id *parent,
+                              const char *desc, uint64_t begin, uint64_t end)
+{
+    // Validate the description string.  This ensures that it doesn't have
+    // anything silly in it like embedded double quotes, backslashes, or control
+    // characters.
+    if (!validate_json_string(tracer->lg, desc)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "htrace_record_span(desc=%s): invalid "
+                    "description string.\n", desc);
+        return 0;
+    }
+    if (parent && (!parent->high && !parent->low)) {
+        parent = NULL;
+    }
+    // The receivers never modify or free the description.
+    span->desc = (char*)desc;
+    span->begin_ms = begin;
+    span->end_ms = end;
+    htrace_span_id_generate(&span->span_id, tracer->rnd, parent,
+                            htracer_id_scheme(tracer));
+    span->trid = NULL;
+    span->flags = 0;
+    if (parent) {
+        span->num_parents = 1;
+        span->parent.single = *parent;
+    } else {
+        span->num_parents = 0;
+        htrace_span_id_clear(&span->parent.single);
+    }
+    return 1;
+}
+
+int htrace_record_span(struct htracer *tracer,
+                       const struct htrace_span_id *parent_id,
+                       const char *desc, uint64_t begin, uint64_t end)
+{
+    struct htrace_span span;
+
+    if (!htrace_record_fill(tracer, &span, parent_id, desc, begin, end)) {
+        return 0;
+    }
+    htracer_add_span(tracer, &span);
+    return 1;
+}
+
+int htrace_record_spans(struct htracer *tracer,
+                        struct htrace_span_record *recs, int num_recs)
+{
+    struct htrace_span *spans;
+    int i, num_spans = 0;
+
+    if (num_recs <= 0) {
+        return 0;
+    }
+    spans = malloc(sizeof(*spans) * num_recs);
+    if (!spans) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_record_spans(num_recs=%d): OOM\n", num_recs);
+        for (i = 0; i < num_recs; i++) {
+            htrace_span_id_clear(&recs[i].span_id);
+        }
+        return 0;
+    }
+    for (i = 0; i < num_recs; i++) {
+        struct htrace_span_record *rec = recs + i;
+        if (!htrace_record_fill(tracer, spans + num_spans, &rec->parent,
+                                rec->desc, rec->begin, rec->end)) {
+            htrace_span_id_clear(&rec->span_id);
+            continue;
+        }
+        rec->span_id = spans[num_spans].span_id;
+        num_spans++;
+    }
+    if (num_spans > 0) {
+        htracer_add_spans(tracer, spans, num_spans);
+    }
+    free(spans);
+    return num_spans;
+}
+
+// vim:ts=4:sw=4:et
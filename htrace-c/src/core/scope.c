@@ -16,19 +16,24 @@
  * limitations under the License.
  */
 
+#include "core/flight_recorder.h"
 #include "core/htrace.h"
 #include "core/htracer.h"
+#include "core/inflight.h"
 #include "core/scope.h"
 #include "core/span.h"
-#include "receiver/receiver.h"
 #include "sampler/sampler.h"
 #include "util/log.h"
+#include "util/membudget.h"
+#include "util/probe.h"
 #include "util/rand.h"
 #include "util/string.h"
 #include "util/time.h"
 
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -38,44 +43,35 @@
  * Implementation of HTrace scopes.
  */
 
-struct htrace_scope* htrace_start_span(struct htracer *tracer,
-        struct htrace_sampler *sampler, const char *desc)
+/**
+ * Wrap a newly created span in a trace scope and push it on to the current
+ * thread's scope stack.
+ *
+ * The parent of the span will be the span of the innermost enclosing trace
+ * scope which hasn't disowned its span, if there is one.
+ *
+ * @param tracer        The tracer.
+ * @param cur_scope     The current scope, or NULL.
+ * @param span          The new span.  Will be freed on failure.
+ *
+ * @return              The new trace scope, or NULL on failure.
+ */
+static struct htrace_scope *htrace_push_new_span(struct htracer *tracer,
+        struct htrace_scope *cur_scope, struct htrace_span *span)
 {
-    struct htrace_scope *cur_scope, *scope = NULL, *pscope;
-    struct htrace_span *span = NULL;
-    struct htrace_span_id span_id;
+    struct htrace_scope *scope, *pscope;
 
-    // Validate the description string.  This ensures that it doesn't have
-    // anything silly in it like embedded double quotes, backslashes, or control
-    // characters.
-    if (!validate_json_string(tracer->lg, desc)) {
-        htrace_log(tracer->lg, "htrace_span_alloc(desc=%s): invalid "
-                   "description string.\n", desc);
-        return NULL;
-    }
-    cur_scope = htracer_cur_scope(tracer);
-    if ((!cur_scope) || (!cur_scope->span)) {
-        if (!sampler->ty->next(sampler)) {
-            return NULL;
-        }
-        htrace_span_id_generate(&span_id, tracer->rnd, NULL);
-    } else {
-        htrace_span_id_generate(&span_id, tracer->rnd,
-                                &cur_scope->span->span_id);
-    }
-    span = htrace_span_alloc(desc, now_us(tracer->lg), &span_id);
-    if (!span) {
-        htrace_log(tracer->lg, "htrace_span_alloc(desc=%s): OOM\n", desc);
-        return NULL;
-    }
     scope = malloc(sizeof(*scope));
     if (!scope) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_start_span(desc=%s): OOM\n", span->desc);
         htrace_span_free(span);
-        htrace_log(tracer->lg, "htrace_start_span(desc=%s): OOM\n", desc);
         return NULL;
     }
     scope->tracer = tracer;
     scope->span = span;
+    scope->fr_unsampled = 0;
+    scope->inflight_reported = 0;
 
     // Search enclosing trace scopes for the first one that hasn't disowned
     // its trace span.
@@ -86,7 +82,6 @@ struct htrace_scope* htrace_start_span(struct htracer *tracer,
             span->num_parents = 1;
             break;
         }
-        pscope = pscope->parent;
     }
     if (htracer_push_scope(tracer, cur_scope, scope) != 0) {
         htrace_span_free(span);
@@ -96,6 +91,199 @@ struct htrace_scope* htrace_start_span(struct htracer *tracer,
     return scope;
 }
 
+/**
+ * Decide whether we should start a new span, and pick its span ID.
+ *
+ * @param tracer        The tracer.
+ * @param sampler       The sampler, or NULL.
+ * @param cur_scope     The current scope, or NULL.
+ * @param span_id       (out param) The span ID for the new span.
+ *
+ * @return              1 if we should start a new span; 0 otherwise.
+ */
+static int htrace_should_start_span(struct htracer *tracer,
+        struct htrace_sampler *sampler, struct htrace_scope *cur_scope,
+        struct htrace_span_id *span_id)
+{
+    if ((!cur_scope) || (!cur_scope->span)) {
+        if ((!sampler) || (!sampler->ty->next(sampler))) {
+            return 0;
+        }
+        // Don't start new traces while tracing is short of memory.  Spans
+        // in traces which have already started are still created, so that
+        // those traces stay complete.
+        if (membudget_throttle()) {
+            return 0;
+        }
+        htrace_span_id_generate(span_id, tracer->rnd, NULL,
+                                htracer_id_scheme(tracer));
+    } else {
+        htrace_span_id_generate(span_id, tracer->rnd,
+                                &cur_scope->span->span_id,
+                                htracer_id_scheme(tracer));
+    }
+    return 1;
+}
+
+/**
+ * Check whether spans which the sampler didn't pick should be recorded by
+ * the flight recorder.
+ */
+static int htrace_fr_unsampled(struct htracer *tracer)
+{
+    return tracer->fr && flight_recorder_unsampled(tracer->fr);
+}
+
+/**
+ * Push a scope for a span which the sampler didn't pick, so that the flight
+ * recorder still gets the span when the scope is closed.  The span is only
+ * a fixed-size record in the scope, with an interned description.
+ *
+ * The parent of the span will be the innermost enclosing span, whether it
+ * was sampled or not.
+ *
+ * @param tracer        The tracer.  Must have a flight recorder.
+ * @param cur_scope     The current scope, or NULL.
+ * @param desc          The description.
+ *
+ * @return              The new trace scope, or NULL on failure.
+ */
+static struct htrace_scope *htrace_push_fr_span(struct htracer *tracer,
+        struct htrace_scope *cur_scope, const char *desc)
+{
+    struct htrace_scope *scope, *pscope;
+    const struct htrace_span_id *parent = NULL;
+    struct fr_open_span *fs;
+
+    scope = malloc(sizeof(*scope));
+    if (!scope) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_push_fr_span(desc=%s): OOM\n", desc);
+        return NULL;
+    }
+    scope->tracer = tracer;
+    scope->span = NULL;
+    scope->fr_unsampled = 1;
+    scope->inflight_reported = 0;
+    fs = &scope->fr_span;
+    for (pscope = cur_scope; pscope; pscope = pscope->parent) {
+        if (pscope->span) {
+            parent = &pscope->span->span_id;
+            break;
+        } else if (pscope->fr_unsampled) {
+            parent = &pscope->fr_span.span_id;
+            break;
+        }
+    }
+    if (parent) {
+        fs->parent = *parent;
+        fs->num_parents = 1;
+    } else {
+        htrace_span_id_clear(&fs->parent);
+        fs->num_parents = 0;
+    }
+    htrace_span_id_generate(&fs->span_id, tracer->rnd, parent,
+                            htracer_id_scheme(tracer));
+    fs->desc_id = flight_recorder_intern(tracer->fr, desc);
+    fs->begin_us = now_us(tracer->lg);
+    if (htracer_push_scope(tracer, cur_scope, scope) != 0) {
+        free(scope);
+        return NULL;
+    }
+    return scope;
+}
+
+struct htrace_scope* htrace_start_span(struct htracer *tracer,
+        struct htrace_sampler *sampler, const char *desc)
+{
+    struct htrace_scope *cur_scope;
+    struct htrace_span *span = NULL;
+    struct htrace_span_id span_id;
+
+    // Validate the description string.  This ensures that it doesn't have
+    // anything silly in it like embedded double quotes, backslashes, or control
+    // characters.
+    if (!validate_json_string(tracer->lg, desc)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "htrace_span_alloc(desc=%s): invalid "
+                    "description string.\n", desc);
+        return NULL;
+    }
+    cur_scope = htracer_cur_scope(tracer);
+    if (!htrace_should_start_span(tracer, sampler, cur_scope, &span_id)) {
+        HTRACE_PROBE1(span__unsampled, desc);
+        if (htrace_fr_unsampled(tracer)) {
+            return htrace_push_fr_span(tracer, cur_scope, desc);
+        }
+        return NULL;
+    }
+    span = htrace_span_alloc(desc, now_us(tracer->lg), &span_id);
+    if (!span) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_span_alloc(desc=%s): OOM\n", desc);
+        return NULL;
+    }
+    HTRACE_PROBE4(span__start, span->span_id.high, span->span_id.low,
+                  span->desc, span->begin_ms);
+    return htrace_push_new_span(tracer, cur_scope, span);
+}
+
+struct htrace_scope* htrace_start_spanf(struct htracer *tracer,
+        struct htrace_sampler *sampler, const char *fmt, ...)
+{
+    struct htrace_scope *cur_scope;
+    struct htrace_span *span = NULL;
+    struct htrace_span_id span_id;
+    uint64_t begin_us;
+    char *desc, fr_desc[FR_DESC_MAX_LEN + 1];
+    va_list ap;
+    int ret;
+
+    // Make the sampling decision before doing any formatting.  Most callers
+    // are not sampled, and they should not pay for building a description
+    // that will never be used.
+    cur_scope = htracer_cur_scope(tracer);
+    if (!htrace_should_start_span(tracer, sampler, cur_scope, &span_id)) {
+        HTRACE_PROBE1(span__unsampled, fmt);
+        if (!htrace_fr_unsampled(tracer)) {
+            return NULL;
+        }
+        // The flight recorder truncates descriptions anyway, so there is no
+        // need to allocate the whole thing.
+        va_start(ap, fmt);
+        vsnprintf(fr_desc, sizeof(fr_desc), fmt, ap);
+        va_end(ap);
+        return htrace_push_fr_span(tracer, cur_scope, fr_desc);
+    }
+    begin_us = now_us(tracer->lg);
+    va_start(ap, fmt);
+    ret = vasprintf(&desc, fmt, ap);
+    va_end(ap);
+    if (ret < 0) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_start_spanf(fmt=%s): OOM\n", fmt);
+        return NULL;
+    }
+    if (!validate_json_string(tracer->lg, desc)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "htrace_start_spanf(desc=%s): invalid "
+                    "description string.\n", desc);
+        free(desc);
+        return NULL;
+    }
+    // The span takes ownership of the formatted description, so there is no
+    // need to copy it again.
+    span = htrace_span_alloc_desc(desc, begin_us, &span_id);
+    if (!span) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_start_spanf(fmt=%s): OOM\n", fmt);
+        return NULL;
+    }
+    HTRACE_PROBE4(span__start, span->span_id.high, span->span_id.low,
+                  span->desc, span->begin_ms);
+    return htrace_push_new_span(tracer, cur_scope, span);
+}
+
 struct htrace_scope* htrace_start_span_from_parent(struct htracer *tracer,
         struct htrace_span_id *parent, const char *desc)
 {
@@ -107,8 +295,9 @@ struct htrace_scope* htrace_start_span_from_parent(struct htracer *tracer,
     // anything silly in it like embedded double quotes, backslashes, or control
     // characters.
     if (!validate_json_string(tracer->lg, desc)) {
-        htrace_log(tracer->lg, "htrace_start_span_from_parent(desc=%s): "
-                   "invalid description string.\n", desc);
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "htrace_start_span_from_parent(desc=%s): "
+                    "invalid description string.\n", desc);
         return NULL;
     }
 
@@ -116,26 +305,33 @@ struct htrace_scope* htrace_start_span_from_parent(struct htracer *tracer,
         return NULL;
     }
 
-    htrace_span_id_generate(&span_id, tracer->rnd, parent);
+    htrace_span_id_generate(&span_id, tracer->rnd, parent,
+                            htracer_id_scheme(tracer));
 
     span = htrace_span_alloc(desc, now_us(tracer->lg), &span_id);
     if (!span) {
-        htrace_log(tracer->lg, "htrace_start_span(desc=%s): OOM\n", desc);
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_start_span(desc=%s): OOM\n", desc);
         return NULL;
     }
 
     scope = malloc(sizeof(*scope));
     if (!scope) {
         htrace_span_free(span);
-        htrace_log(tracer->lg, "htrace_start_span_from_parent(desc=%s): "
-                               "OOM\n", desc);
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_start_span_from_parent(desc=%s): "
+                    "OOM\n", desc);
         return NULL;
     }
 
     scope->tracer = tracer;
     scope->span = span;
+    scope->fr_unsampled = 0;
+    scope->inflight_reported = 0;
     span->parent.single = *parent;
     span->num_parents = 1;
+    HTRACE_PROBE4(span__start, span->span_id.high, span->span_id.low,
+                  span->desc, span->begin_ms);
 
     cur_scope = htracer_cur_scope(tracer);
     if (htracer_push_scope(tracer, cur_scope, scope) != 0) {
@@ -151,10 +347,19 @@ struct htrace_span *htrace_scope_detach(struct htrace_scope *scope)
     struct htrace_span *span = scope->span;
 
     if (span == NULL) {
-        htrace_log(scope->tracer->lg, "htrace_scope_detach: attempted to "
-                   "detach a scope which was already detached.\n");
+        if (scope->fr_unsampled) {
+            // The span isn't traced.  It stays with the scope, and goes to
+            // the flight recorder when the scope is closed.
+            return NULL;
+        }
+        htrace_logl(scope->tracer->lg, HTRACE_LOG_WARN,
+                    "htrace_scope_detach: attempted to "
+                    "detach a scope which was already detached.\n");
         return NULL;
     }
+    if (scope->tracer->inflight) {
+        return inflight_detach(scope->tracer->inflight, scope);
+    }
     scope->span = NULL;
     return span;
 }
@@ -168,14 +373,17 @@ struct htrace_scope* htrace_restart_span(struct htracer *tracer,
     scope = malloc(sizeof(*scope));
     if (!scope) {
         htrace_span_id_to_str(&span->span_id, buf, sizeof(buf));
-        htrace_log(tracer->lg, "htrace_start_span(desc=%s, parent_id=%s"
-                   "): OOM\n", span->desc, buf);
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_start_span(desc=%s, parent_id=%s"
+                    "): OOM\n", span->desc, buf);
         htrace_span_free(span);
         return NULL;
     }
     scope->tracer = tracer;
     scope->parent = NULL;
     scope->span = span;
+    scope->fr_unsampled = 0;
+    scope->inflight_reported = 0;
     cur_scope = htracer_cur_scope(tracer);
     if (htracer_push_scope(tracer, cur_scope, scope) != 0) {
         htrace_span_free(span);
@@ -213,10 +421,14 @@ void htrace_scope_close(struct htrace_scope *scope)
     if (htracer_pop_scope(tracer, scope) == 0) {
         struct htrace_span *span = scope->span;
         if (span) {
-            struct htrace_rcv *rcv = tracer->rcv;
             span->end_ms = now_us(tracer->lg);
-            rcv->ty->add_span(rcv, span);
+            HTRACE_PROBE5(span__close, span->span_id.high, span->span_id.low,
+                          span->desc, span->begin_ms, span->end_ms);
+            htracer_add_span(tracer, span);
             htrace_span_free(span);
+        } else if (scope->fr_unsampled) {
+            flight_recorder_add_unsampled(tracer->fr, &scope->fr_span,
+                                          now_us(tracer->lg));
         }
         free(scope);
     }
@@ -27,7 +27,7 @@
  * This is an internal header, not intended for external use.
  */
 
-struct htrace_span_id;
+#include "core/flight_recorder.h"
 
 #include <stdint.h>
 
@@ -53,6 +53,25 @@ struct htrace_scope {
      * The span object associated with this scope, or NULL if there is none.
      */
     struct htrace_span *span;
+
+    /**
+     * Nonzero if fr_span holds a span which the sampler didn't pick, kept
+     * only for the flight recorder.  span is always NULL when this is set,
+     * so that the rest of the library sees the scope as untraced.
+     */
+    int fr_unsampled;
+
+    /**
+     * The untraced span.  Only valid if fr_unsampled is set.
+     */
+    struct fr_open_span fr_span;
+
+    /**
+     * Nonzero if the in-flight watchdog has already sent a copy of this
+     * scope's span to the span receiver.  Protected by the in-flight lock of
+     * the thread which owns the scope.
+     */
+    int inflight_reported;
 };
 
 #endif
@@ -0,0 +1,530 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/sigsafe.h"
+#include "core/span.h"
+#include "util/log.h"
+#include "util/membudget.h"
+#include "util/rand.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @file sigsafe.c
+ *
+ * Implementation of the signal-safe span buffer.
+ */
+
+/**
+ * The maximum length of a buffered description, not including the
+ * terminating null.  Longer descriptions are truncated.
+ */
+#define SIGSAFE_DESC_MAX_LEN 63
+
+/**
+ * The maximum number of shards.
+ */
+#define SIGSAFE_MAX_SHARDS 16
+
+/**
+ * The maximum number of slots.
+ */
+#define SIGSAFE_MAX_SLOTS (1024 * 1024)
+
+/**
+ * The minimum drain interval.
+ */
+#define SIGSAFE_DRAIN_INTERVAL_MS_MIN 1
+
+/**
+ * The number of spans the drainer hands to the receiver at once.
+ */
+#define SIGSAFE_DRAIN_BATCH 64
+
+/**
+ * The minimum interval between rate-limited log messages.
+ */
+#define SIGSAFE_LOG_INTERVAL_MS 60000
+
+/**
+ * Values of sigsafe_rec::state.
+ */
+#define SIGSAFE_STATE_FREE 0
+#define SIGSAFE_STATE_WRITING 1
+#define SIGSAFE_STATE_READY 2
+
+struct sigsafe_rec {
+    /**
+     * SIGSAFE_STATE_*.  Updated atomically.
+     */
+    uint32_t state;
+    struct htrace_span_id span_id;
+    struct htrace_span_id parent;
+    uint64_t begin;
+    uint64_t end;
+    char desc[SIGSAFE_DESC_MAX_LEN + 1];
+};
+
+struct sigsafe_shard {
+    /**
+     * The number of slots claimed so far.  Updated atomically.
+     */
+    uint64_t tail;
+
+    /**
+     * The records.
+     */
+    struct sigsafe_rec *recs;
+} __attribute__((aligned(64)));
+
+struct sigsafe_buf {
+    /**
+     * The tracer.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The shards.
+     */
+    struct sigsafe_shard shards[SIGSAFE_MAX_SHARDS];
+    uint32_t num_shards;
+
+    /**
+     * The number of slots in each shard.
+     */
+    uint32_t slots_per_shard;
+
+    /**
+     * The memory for the records of every shard.
+     */
+    struct sigsafe_rec *recs;
+
+    /**
+     * The number of bytes reserved against the memory budget.
+     */
+    uint64_t reserved;
+
+    /**
+     * A random seed for span IDs, and a counter which is mixed with it.
+     */
+    uint64_t id_seed;
+    uint64_t id_ctr;
+
+    /**
+     * The number of spans dropped because a shard was full.  Updated
+     * atomically.
+     */
+    uint64_t num_dropped;
+
+    /**
+     * Serializes drains, and protects shutdown.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Signalled to stop the drain thread.
+     */
+    pthread_cond_t cond;
+
+    /**
+     * Nonzero once the drain thread should exit.
+     */
+    int shutdown;
+
+    /**
+     * How often the drain thread runs.
+     */
+    uint64_t interval_ms;
+
+    /**
+     * The drain thread.
+     */
+    pthread_t drainer;
+};
+
+/**
+ * The splitmix64 finalizer.  A cheap, well-mixed function of a counter,
+ * which needs no locks or state.
+ */
+static uint64_t sigsafe_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t sigsafe_rand(struct sigsafe_buf *buf)
+{
+    uint64_t ctr, val;
+
+    do {
+        ctr = __atomic_fetch_add(&buf->id_ctr, 1, __ATOMIC_RELAXED);
+        val = sigsafe_mix(buf->id_seed + (ctr * 0x9e3779b97f4a7c15ULL));
+    } while (val == 0);
+    return val;
+}
+
+void sigsafe_span_id_generate(struct sigsafe_buf *buf,
+                              const struct htrace_span_id *parent,
+                              struct htrace_span_id *id)
+{
+    if (parent && (parent->high || parent->low)) {
+        id->high = parent->high;
+    } else if (htracer_id_scheme(buf->tracer) ==
+               HTRACE_SPAN_ID_SCHEME_TIME_ORDERED) {
+        // See htrace_span_id_generate.
+        do {
+            id->high = htrace_span_id_time_prefix() |
+                (sigsafe_rand(buf) >> HTRACE_SPAN_ID_TIME_BITS);
+        } while (id->high == 0);
+    } else {
+        id->high = sigsafe_rand(buf);
+    }
+    id->low = sigsafe_rand(buf);
+}
+
+static uint32_t sigsafe_shard_idx(struct sigsafe_buf *buf)
+{
+#if defined(__linux__) && defined(SYS_gettid)
+    return ((uint32_t)syscall(SYS_gettid)) % buf->num_shards;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Copy a description, truncating it if necessary.  We never cut a UTF-8
+ * sequence in half, since that would make the description invalid.
+ */
+static void sigsafe_copy_desc(char *dst, const char *src)
+{
+    size_t len;
+
+    for (len = 0; src[len] && (len < SIGSAFE_DESC_MAX_LEN); len++) {
+        ;
+    }
+    if (src[len]) {
+        while ((len > 0) && ((((uint8_t)src[len]) & 0xc0) == 0x80)) {
+            len--;
+        }
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+int sigsafe_buf_add(struct sigsafe_buf *buf,
+                    const struct htrace_span_id *span_id,
+                    const struct htrace_span_id *parent,
+                    const char *desc, uint64_t begin, uint64_t end)
+{
+    struct sigsafe_shard *shard;
+    struct sigsafe_rec *rec;
+    uint64_t slot;
+    uint32_t state = SIGSAFE_STATE_FREE;
+
+    shard = buf->shards + sigsafe_shard_idx(buf);
+    slot = __atomic_fetch_add(&shard->tail, 1, __ATOMIC_RELAXED);
+    rec = shard->recs + (slot % buf->slots_per_shard);
+    if (!__atomic_compare_exchange_n(&rec->state, &state,
+                SIGSAFE_STATE_WRITING, 0, __ATOMIC_ACQUIRE,
+                __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&buf->num_dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    rec->span_id = *span_id;
+    if (parent) {
+        rec->parent = *parent;
+    } else {
+        rec->parent.high = 0;
+        rec->parent.low = 0;
+    }
+    rec->begin = begin;
+    rec->end = end;
+    sigsafe_copy_desc(rec->desc, desc);
+    __atomic_store_n(&rec->state, SIGSAFE_STATE_READY, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Hand a batch of drained spans to the span receiver.
+ */
+static void sigsafe_flush_batch(struct sigsafe_buf *buf,
+                                struct htrace_span *spans, int num_spans)
+{
+    if (num_spans > 0) {
+        htracer_add_spans(buf->tracer, spans, num_spans);
+    }
+}
+
+int sigsafe_buf_drain(struct sigsafe_buf *buf)
+{
+    struct htrace_span spans[SIGSAFE_DRAIN_BATCH];
+    char descs[SIGSAFE_DRAIN_BATCH][SIGSAFE_DESC_MAX_LEN + 1];
+    struct htrace_span *span;
+    struct sigsafe_rec *rec;
+    uint64_t num_dropped;
+    uint32_t i, j;
+    int num_spans = 0, num_sent = 0, num_invalid = 0;
+
+    pthread_mutex_lock(&buf->lock);
+    for (i = 0; i < buf->num_shards; i++) {
+        for (j = 0; j < buf->slots_per_shard; j++) {
+            rec = buf->shards[i].recs + j;
+            if (__atomic_load_n(&rec->state, __ATOMIC_ACQUIRE) !=
+                    SIGSAFE_STATE_READY) {
+                continue;
+            }
+            span = spans + num_spans;
+            memcpy(descs[num_spans], rec->desc, sizeof(rec->desc));
+            span->desc = descs[num_spans];
+            span->begin_ms = rec->begin;
+            span->end_ms = rec->end;
+            span->span_id = rec->span_id;
+            span->trid = NULL;
+            span->flags = 0;
+            if (rec->parent.high || rec->parent.low) {
+                span->num_parents = 1;
+                span->parent.single = rec->parent;
+            } else {
+                span->num_parents = 0;
+                htrace_span_id_clear(&span->parent.single);
+            }
+            __atomic_store_n(&rec->state, SIGSAFE_STATE_FREE,
+                             __ATOMIC_RELEASE);
+            // The description was written by a signal handler, so it
+            // couldn't be checked until now.
+            if (!validate_json_string(NULL, span->desc)) {
+                num_invalid++;
+                continue;
+            }
+            if (++num_spans == SIGSAFE_DRAIN_BATCH) {
+                sigsafe_flush_batch(buf, spans, num_spans);
+                num_sent += num_spans;
+                num_spans = 0;
+            }
+        }
+    }
+    sigsafe_flush_batch(buf, spans, num_spans);
+    num_sent += num_spans;
+    pthread_mutex_unlock(&buf->lock);
+    if (num_invalid) {
+        HTRACE_LOG_RATE_LIMITED(buf->tracer->lg, HTRACE_LOG_WARN,
+                   SIGSAFE_LOG_INTERVAL_MS, "sigsafe_buf_drain: discarded "
+                   "%d span(s) with invalid descriptions.\n", num_invalid);
+    }
+    num_dropped = __atomic_exchange_n(&buf->num_dropped, 0,
+                                      __ATOMIC_RELAXED);
+    if (num_dropped) {
+        HTRACE_LOG_RATE_LIMITED(buf->tracer->lg, HTRACE_LOG_WARN,
+                   SIGSAFE_LOG_INTERVAL_MS, "sigsafe_buf_drain: dropped %"
+                   PRId64 " span(s) because the buffer was full.  Consider "
+                   "raising %s.\n", num_dropped, HTRACE_SIGSAFE_SLOTS_KEY);
+    }
+    return num_sent;
+}
+
+static void *sigsafe_drainer(void *data)
+{
+    struct sigsafe_buf *buf = data;
+    struct timespec wakeup_ts;
+    int shutdown;
+
+    while (1) {
+        pthread_mutex_lock(&buf->lock);
+        ms_to_timespec(monotonic_now_ms(buf->tracer->lg) + buf->interval_ms,
+                       &wakeup_ts);
+        while (!buf->shutdown) {
+            if (pthread_cond_timedwait(&buf->cond, &buf->lock,
+                                       &wakeup_ts) == ETIMEDOUT) {
+                break;
+            }
+        }
+        shutdown = buf->shutdown;
+        pthread_mutex_unlock(&buf->lock);
+        if (shutdown) {
+            break;
+        }
+        sigsafe_buf_drain(buf);
+    }
+    return NULL;
+}
+
+struct sigsafe_buf *sigsafe_buf_alloc(struct htracer *tracer,
+                                      const struct htrace_conf *cnf)
+{
+    struct sigsafe_buf *buf;
+    uint64_t num_slots;
+    uint32_t i;
+    int ret;
+
+    num_slots = htrace_conf_get_u64(tracer->lg, cnf, HTRACE_SIGSAFE_SLOTS_KEY);
+    if (num_slots == 0) {
+        return NULL;
+    }
+    if (num_slots > SIGSAFE_MAX_SLOTS) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "sigsafe_buf_alloc: %s can't be more than "
+                    "%d.  Using %d.\n", HTRACE_SIGSAFE_SLOTS_KEY,
+                    SIGSAFE_MAX_SLOTS, SIGSAFE_MAX_SLOTS);
+        num_slots = SIGSAFE_MAX_SLOTS;
+    }
+    buf = calloc(1, sizeof(*buf));
+    if (!buf) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR, "sigsafe_buf_alloc: OOM\n");
+        return NULL;
+    }
+    buf->tracer = tracer;
+    buf->num_shards = (num_slots < SIGSAFE_MAX_SHARDS) ?
+        num_slots : SIGSAFE_MAX_SHARDS;
+    buf->slots_per_shard = (num_slots + buf->num_shards - 1) /
+        buf->num_shards;
+    buf->interval_ms = htrace_conf_get_u64(tracer->lg, cnf,
+                                           HTRACE_SIGSAFE_DRAIN_INTERVAL_MS_KEY);
+    if (buf->interval_ms < SIGSAFE_DRAIN_INTERVAL_MS_MIN) {
+        buf->interval_ms = SIGSAFE_DRAIN_INTERVAL_MS_MIN;
+    }
+    buf->reserved = sizeof(struct sigsafe_rec) * (uint64_t)buf->num_shards *
+        buf->slots_per_shard;
+    if (!membudget_reserve(buf->reserved)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "sigsafe_buf_alloc: %" PRId64 " bytes would "
+                    "put tracing over its memory budget.\n", buf->reserved);
+        free(buf);
+        return NULL;
+    }
+    // calloc leaves every record in SIGSAFE_STATE_FREE.
+    buf->recs = calloc((uint64_t)buf->num_shards * buf->slots_per_shard,
+                       sizeof(struct sigsafe_rec));
+    if (!buf->recs) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR, "sigsafe_buf_alloc: OOM\n");
+        goto error;
+    }
+    for (i = 0; i < buf->num_shards; i++) {
+        buf->shards[i].recs = buf->recs + (i * buf->slots_per_shard);
+    }
+    buf->id_seed = random_u64(tracer->rnd);
+    pthread_mutex_init(&buf->lock, NULL);
+    ret = monotonic_cond_init(&buf->cond);
+    if (ret) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "sigsafe_buf_alloc: pthread_cond_init "
+                    "failed: %s\n", terror(ret));
+        pthread_mutex_destroy(&buf->lock);
+        goto error;
+    }
+    ret = pthread_create(&buf->drainer, NULL, sigsafe_drainer, buf);
+    if (ret) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "sigsafe_buf_alloc: failed to create the "
+                    "drain thread: %s\n", terror(ret));
+        pthread_cond_destroy(&buf->cond);
+        pthread_mutex_destroy(&buf->lock);
+        goto error;
+    }
+    htrace_logl(tracer->lg, HTRACE_LOG_INFO, "sigsafe_buf_alloc: buffering "
+                "up to %" PRId32 " signal-safe span(s) in %" PRId32
+                " shard(s).  interval_ms=%" PRId64 "\n",
+                buf->num_shards * buf->slots_per_shard, buf->num_shards,
+                buf->interval_ms);
+    return buf;
+
+error:
+    free(buf->recs);
+    membudget_release(buf->reserved);
+    free(buf);
+    return NULL;
+}
+
+void htrace_sigsafe_start(struct htracer *tracer,
+                          const struct htrace_span_id *parent,
+                          const char *desc, struct htrace_sigsafe_span *span)
+{
+    struct sigsafe_buf *buf = tracer->sigsafe;
+    int err = errno;
+
+    span->desc = desc;
+    span->begin = now_us(NULL);
+    if (buf) {
+        sigsafe_span_id_generate(buf, parent, &span->span_id);
+    } else {
+        htrace_span_id_clear(&span->span_id);
+    }
+    if (parent) {
+        span->parent = *parent;
+    } else {
+        htrace_span_id_clear(&span->parent);
+    }
+    errno = err;
+}
+
+int htrace_sigsafe_end(struct htracer *tracer,
+                       struct htrace_sigsafe_span *span)
+{
+    struct sigsafe_buf *buf = tracer->sigsafe;
+    uint64_t end;
+    int err = errno, ret;
+
+    if ((!buf) || ((!span->span_id.high) && (!span->span_id.low))) {
+        return 0;
+    }
+    end = now_us(NULL);
+    ret = sigsafe_buf_add(buf, &span->span_id, &span->parent, span->desc,
+                          span->begin, end);
+    errno = err;
+    return ret;
+}
+
+void sigsafe_buf_free(struct sigsafe_buf *buf)
+{
+    int ret;
+
+    if (!buf) {
+        return;
+    }
+    pthread_mutex_lock(&buf->lock);
+    buf->shutdown = 1;
+    pthread_cond_signal(&buf->cond);
+    pthread_mutex_unlock(&buf->lock);
+    ret = pthread_join(buf->drainer, NULL);
+    if (ret) {
+        htrace_logl(buf->tracer->lg, HTRACE_LOG_ERROR,
+                    "sigsafe_buf_free: pthread_join "
+                    "failed: %s\n", terror(ret));
+    }
+    sigsafe_buf_drain(buf);
+    pthread_cond_destroy(&buf->cond);
+    pthread_mutex_destroy(&buf->lock);
+    free(buf->recs);
+    membudget_release(buf->reserved);
+    free(buf);
+}
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,117 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_CORE_SIGSAFE_H
+#define APACHE_HTRACE_CORE_SIGSAFE_H
+
+/**
+ * @file sigsafe.h
+ *
+ * Buffering for spans recorded from signal handlers.
+ *
+ * Code running in a signal handler, or inside a malloc hook, can't call
+ * malloc, take locks, or use pthread_setspecific.  So spans recorded there
+ * are written as fixed-size records into an array which was allocated when
+ * the tracer was created, using only atomic operations.  A drain thread
+ * periodically turns the records into ordinary spans and hands them to the
+ * span receiver.
+ *
+ * The array is split into shards, and each thread writes to the shard chosen
+ * by its kernel thread ID.  Each record has a state word.  A writer claims
+ * the next slot of its shard with an atomic increment, and moves it from FREE
+ * to WRITING with a compare-and-swap.  If the slot hasn't been drained yet,
+ * the span is dropped and counted, rather than waiting.  Once the record is
+ * written, it is published by setting it to READY.  The drainer copies out
+ * the READY records and sets them back to FREE.
+ *
+ * A signal handler which interrupts a writer on the same thread just claims
+ * a different slot, so writers never wait for each other.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+struct htrace_conf;
+struct htrace_span_id;
+struct htracer;
+struct sigsafe_buf;
+
+/**
+ * Create a signal-safe span buffer, if the configuration asks for one.
+ *
+ * @param tracer        The tracer.  The buffer will hold on to this pointer.
+ * @param cnf           The configuration.
+ *
+ * @return              NULL if the buffer is disabled, or couldn't be
+ *                          created; the buffer otherwise.  Errors will be
+ *                          logged.
+ */
+struct sigsafe_buf *sigsafe_buf_alloc(struct htracer *tracer,
+                                      const struct htrace_conf *cnf);
+
+/**
+ * Free a signal-safe span buffer.
+ *
+ * Stops the drain thread, and sends any spans which are still buffered to
+ * the span receiver.  No other thread may be recording spans with the tracer
+ * at the same time.
+ *
+ * @param buf           The buffer, or NULL.
+ */
+void sigsafe_buf_free(struct sigsafe_buf *buf);
+
+/**
+ * Generate a new span ID.
+ *
+ * This is async-signal-safe.
+ *
+ * @param buf           The buffer.
+ * @param parent        The parent span ID, or NULL.
+ * @param id            (out param) The new span ID.
+ */
+void sigsafe_span_id_generate(struct sigsafe_buf *buf,
+                              const struct htrace_span_id *parent,
+                              struct htrace_span_id *id);
+
+/**
+ * Add a span to the buffer.
+ *
+ * This is async-signal-safe.
+ *
+ * @return              1 if the span was buffered; 0 if the shard was full.
+ */
+int sigsafe_buf_add(struct sigsafe_buf *buf,
+                    const struct htrace_span_id *span_id,
+                    const struct htrace_span_id *parent,
+                    const char *desc, uint64_t begin, uint64_t end);
+
+/**
+ * Send the buffered spans to the span receiver.
+ *
+ * This may not be called from a signal handler.
+ *
+ * @param buf           The buffer.
+ *
+ * @return              The number of spans which were sent.
+ */
+int sigsafe_buf_drain(struct sigsafe_buf *buf);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -40,22 +40,32 @@
 
 struct htrace_span *htrace_span_alloc(const char *desc,
                 uint64_t begin_ms, struct htrace_span_id *span_id)
+{
+    char *ndesc;
+
+    ndesc = strdup(desc);
+    if (!ndesc) {
+        return NULL;
+    }
+    return htrace_span_alloc_desc(ndesc, begin_ms, span_id);
+}
+
+struct htrace_span *htrace_span_alloc_desc(char *desc,
+                uint64_t begin_ms, struct htrace_span_id *span_id)
 {
     struct htrace_span *span;
 
     span = malloc(sizeof(*span));
     if (!span) {
+        free(desc);
         return NULL;
     }
-    span->desc = strdup(desc);
-    if (!span->desc) {
-        free(span);
-        return NULL;
-    }
+    span->desc = desc;
     span->begin_ms = begin_ms;
     span->end_ms = 0;
     htrace_span_id_copy(&span->span_id, span_id);
     span->trid = NULL;
+    span->flags = 0;
     span->num_parents = 0;
     htrace_span_id_clear(&span->parent.single);
     span->parent.list = NULL;
@@ -165,6 +175,9 @@ static int span_json_sprintf_impl(const struct htrace_span *span,
         }
         ret += fwdprintf(&buf, &max, "]");
     }
+    if (span->flags & HTRACE_SPAN_FLAG_INFLIGHT) {
+        ret += fwdprintf(&buf, &max, ",\"n\":{\"inflight\":\"true\"}");
+    }
     ret += fwdprintf(&buf, &max, "}");
     // Add one to 'ret' to take into account the terminating null that we
     // need to write.
@@ -197,6 +210,9 @@ int span_write_msgpack(const struct htrace_span *span, cmp_ctx_t *ctx)
     if (num_parents > 0) {
         map_size++;
     }
+    if (span->flags & HTRACE_SPAN_FLAG_INFLIGHT) {
+        map_size++;
+    }
     if (!cmp_write_map16(ctx, map_size)) {
         return 0;
     }
@@ -251,6 +267,20 @@ int span_write_msgpack(const struct htrace_span *span, cmp_ctx_t *ctx)
             }
         }
     }
+    if (span->flags & HTRACE_SPAN_FLAG_INFLIGHT) {
+        if (!cmp_write_fixstr(ctx, "n", 1)) {
+            return 0;
+        }
+        if (!cmp_write_map16(ctx, 1)) {
+            return 0;
+        }
+        if (!cmp_write_fixstr(ctx, "inflight", 8)) {
+            return 0;
+        }
+        if (!cmp_write_fixstr(ctx, "true", 4)) {
+            return 0;
+        }
+    }
     return 1;
 }
 
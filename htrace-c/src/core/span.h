@@ -35,6 +35,12 @@
 struct cmp_ctx_s;
 struct htracer;
 
+/**
+ * Set on a snapshot of a span which hasn't been closed yet.  The end time of
+ * such a snapshot is the time it was taken.
+ */
+#define HTRACE_SPAN_FLAG_INFLIGHT 0x1
+
 struct htrace_span {
     /**
      * The name of this trace scope.
@@ -63,6 +69,11 @@ struct htrace_span {
      */
     char *trid;
 
+    /**
+     * HTRACE_SPAN_FLAG_* flags.
+     */
+    int flags;
+
     /**
      * The number of parents.
      */
@@ -94,6 +105,20 @@ struct htrace_span {
 struct htrace_span *htrace_span_alloc(const char *desc,
                 uint64_t begin_ms, struct htrace_span_id *span_id);
 
+/**
+ * Allocate an htrace span, taking ownership of a description string.
+ *
+ * @param desc          The span name to use.  Must have been allocated with
+ *                          malloc.  The span takes ownership of it; it will
+ *                          be freed even if this function fails.
+ * @param begin_ms      The value to use for begin_ms.
+ * @param span_id       The span ID to use.
+ *
+ * @return              NULL on OOM; the span otherwise.
+ */
+struct htrace_span *htrace_span_alloc_desc(char *desc,
+                uint64_t begin_ms, struct htrace_span_id *span_id);
+
 /**
  * Free the memory associated with an htrace span.
  *
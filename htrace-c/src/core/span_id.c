@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /**
  * @file span_id.c
@@ -43,6 +44,84 @@
 
 const struct htrace_span_id INVALID_SPAN_ID;
 
+static const char HEX_DIGITS[16] = "0123456789abcdef";
+
+/**
+ * Maps each byte to its value as a hexadecimal digit, or to 0xff if it is not
+ * a hexadecimal digit.
+ */
+static const uint8_t HEX_VALUES[256] = {
+    [0 ... 255] = 0xff,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+/**
+ * Write a 64-bit number as 16 lowercase hexadecimal digits.  No null
+ * terminator is written.
+ */
+static void hex_encode_u64(uint64_t val, char *out)
+{
+    int i;
+
+    for (i = 15; i >= 0; i--) {
+        out[i] = HEX_DIGITS[val & 0xf];
+        val >>= 4;
+    }
+}
+
+/**
+ * Read a number from a fixed number of hexadecimal digits.
+ *
+ * Rather than branching on each character, we OR together all the digit
+ * values.  Since invalid characters map to 0xff, any invalid character will
+ * set the high bits of *bad.
+ *
+ * @param str           The digits.
+ * @param ndigits       The number of digits to read.  At most 16.
+ * @param bad           (inout param) Will have bits above 0xf set if any of
+ *                          the characters were not hexadecimal digits.
+ *
+ * @return              The number.
+ */
+static uint64_t hex_decode_u64(const char *str, int ndigits, uint8_t *bad)
+{
+    uint64_t val = 0;
+    uint8_t acc = 0;
+    int i;
+
+    for (i = 0; i < ndigits; i++) {
+        uint8_t v = HEX_VALUES[(uint8_t)str[i]];
+        acc |= v;
+        val = (val << 4) | (v & 0xf);
+    }
+    *bad |= acc;
+    return val;
+}
+
+static void put_be64(uint8_t *buf, uint64_t val)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        buf[i] = val & 0xff;
+        val >>= 8;
+    }
+}
+
+static uint64_t get_be64(const uint8_t *buf)
+{
+    uint64_t val = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        val = (val << 8) | buf[i];
+    }
+    return val;
+}
+
 static uint64_t parse_hex_range(const char *str, int start, int end,
                                 char *err, size_t err_len)
 {
@@ -112,13 +191,118 @@ void htrace_span_id_parse(struct htrace_span_id *id, const char *str,
 int htrace_span_id_to_str(const struct htrace_span_id *id,
                           char *str, size_t len)
 {
-    int res = snprintf(str, len,
-        "%08"PRIx32"%08"PRIx32"%08"PRIx32"%08"PRIx32,
-        (uint32_t)(0xffffffffUL & (id->high >> 32)),
-        (uint32_t)(0xffffffffUL & id->high),
-        (uint32_t)(0xffffffffUL & (id->low >> 32)),
-        (uint32_t)(0xffffffffUL & id->low));
-    return (res == HTRACE_SPAN_ID_STRING_LENGTH);
+    if (len < HTRACE_SPAN_ID_STRING_LENGTH + 1) {
+        if (len > 0) {
+            str[0] = '\0';
+        }
+        return 0;
+    }
+    hex_encode_u64(id->high, str);
+    hex_encode_u64(id->low, str + 16);
+    str[HTRACE_SPAN_ID_STRING_LENGTH] = '\0';
+    return 1;
+}
+
+int htrace_context_encode(const struct htrace_span_id *id, uint8_t flags,
+                          void *buf, size_t len)
+{
+    uint8_t *b = buf;
+
+    if (len < HTRACE_CONTEXT_BINARY_LENGTH) {
+        return 0;
+    }
+    b[0] = HTRACE_CONTEXT_VERSION;
+    memset(b + 1, 0, 8);
+    put_be64(b + 9, id->high);
+    put_be64(b + 17, id->low);
+    b[25] = flags;
+    return HTRACE_CONTEXT_BINARY_LENGTH;
+}
+
+int htrace_context_decode(struct htrace_span_id *id, uint8_t *flags,
+                          const void *buf, size_t len)
+{
+    const uint8_t *b = buf;
+    struct htrace_span_id nid;
+
+    if (len < HTRACE_CONTEXT_BINARY_LENGTH) {
+        return 0;
+    }
+    if (b[0] != HTRACE_CONTEXT_VERSION) {
+        return 0;
+    }
+    if (get_be64(b + 1) != 0) {
+        // This trace ID was generated by something other than HTrace, and
+        // does not fit into our span IDs.
+        return 0;
+    }
+    nid.high = get_be64(b + 9);
+    nid.low = get_be64(b + 17);
+    if ((nid.high == 0) || (nid.low == 0)) {
+        return 0;
+    }
+    *id = nid;
+    *flags = b[25];
+    return 1;
+}
+
+int htrace_context_encode_text(const struct htrace_span_id *id,
+                               uint8_t flags, char *str, size_t len)
+{
+    if (len < HTRACE_CONTEXT_TEXT_LENGTH + 1) {
+        if (len > 0) {
+            str[0] = '\0';
+        }
+        return 0;
+    }
+    // vv-
+    str[0] = HEX_DIGITS[(HTRACE_CONTEXT_VERSION >> 4) & 0xf];
+    str[1] = HEX_DIGITS[HTRACE_CONTEXT_VERSION & 0xf];
+    str[2] = '-';
+    // tttttttttttttttttttttttttttttttt-
+    memset(str + 3, '0', 16);
+    hex_encode_u64(id->high, str + 19);
+    str[35] = '-';
+    // ssssssssssssssss-
+    hex_encode_u64(id->low, str + 36);
+    str[52] = '-';
+    // ff
+    str[53] = HEX_DIGITS[(flags >> 4) & 0xf];
+    str[54] = HEX_DIGITS[flags & 0xf];
+    str[HTRACE_CONTEXT_TEXT_LENGTH] = '\0';
+    return 1;
+}
+
+int htrace_context_decode_text(struct htrace_span_id *id, uint8_t *flags,
+                               const char *str, size_t len)
+{
+    struct htrace_span_id nid;
+    uint8_t bad = 0;
+    uint64_t version, trace_hi, nflags;
+
+    if (len < HTRACE_CONTEXT_TEXT_LENGTH) {
+        return 0;
+    }
+    if ((str[2] != '-') | (str[35] != '-') | (str[52] != '-')) {
+        return 0;
+    }
+    version = hex_decode_u64(str, 2, &bad);
+    trace_hi = hex_decode_u64(str + 3, 16, &bad);
+    nid.high = hex_decode_u64(str + 19, 16, &bad);
+    nid.low = hex_decode_u64(str + 36, 16, &bad);
+    nflags = hex_decode_u64(str + 53, 2, &bad);
+    if (bad & 0xf0) {
+        return 0;
+    }
+    if ((version != HTRACE_CONTEXT_VERSION) || (trace_hi != 0)) {
+        return 0;
+    }
+    if ((nid.high == 0) || (nid.low == 0)) {
+        return 0;
+    }
+    *id = nid;
+    *flags = (uint8_t)nflags;
+    return 1;
 }
 
 void htrace_span_id_copy(struct htrace_span_id *dst,
@@ -184,10 +368,20 @@ int htrace_span_id_read_msgpack(struct htrace_span_id *id,
 }
 
 void htrace_span_id_generate(struct htrace_span_id *id, struct random_src *rnd,
-                             const struct htrace_span_id *parent)
+                             const struct htrace_span_id *parent,
+                             enum htrace_span_id_scheme scheme)
 {
     if (parent) {
         id->high = parent->high;
+    } else if (scheme == HTRACE_SPAN_ID_SCHEME_TIME_ORDERED) {
+        // Put a coarse timestamp in the upper bits, so that traces started
+        // around the same time sort together.  The timestamp is kept short,
+        // so that 48 bits are left to avoid collisions between traces
+        // started in the same minute.
+        do {
+            id->high = htrace_span_id_time_prefix() |
+                (random_u64(rnd) >> HTRACE_SPAN_ID_TIME_BITS);
+        } while (id->high == 0);
     } else {
         do {
             id->high = random_u64(rnd);
@@ -198,6 +392,26 @@ void htrace_span_id_generate(struct htrace_span_id *id, struct random_src *rnd,
     } while (id->low == 0);
 }
 
+uint64_t htrace_span_id_time_prefix(void)
+{
+    uint64_t minutes = ((uint64_t)time(NULL)) / 60;
+
+    return minutes << (64 - HTRACE_SPAN_ID_TIME_BITS);
+}
+
+int htrace_span_id_scheme_parse(const char *str,
+                                enum htrace_span_id_scheme *scheme)
+{
+    if (!strcmp(str, "random")) {
+        *scheme = HTRACE_SPAN_ID_SCHEME_RANDOM;
+        return 1;
+    } else if (!strcmp(str, "time-ordered")) {
+        *scheme = HTRACE_SPAN_ID_SCHEME_TIME_ORDERED;
+        return 1;
+    }
+    return 0;
+}
+
 void htrace_span_id_clear(struct htrace_span_id *id)
 {
     memset(id, 0, sizeof(*id));
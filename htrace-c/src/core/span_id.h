@@ -38,6 +38,22 @@ struct random_src;
  */
 #define HTRACE_SPAN_ID_NUM_BYTES 16
 
+/**
+ * The ways we can generate the span IDs of new traces.
+ */
+enum htrace_span_id_scheme {
+    /**
+     * All 128 bits are random.
+     */
+    HTRACE_SPAN_ID_SCHEME_RANDOM = 0,
+
+    /**
+     * The upper 16 bits are the time in minutes since the epoch, modulo
+     * 2^16.  The rest is random.  See HTRACE_SPAN_ID_TIME_BITS.
+     */
+    HTRACE_SPAN_ID_SCHEME_TIME_ORDERED,
+};
+
 /**
  * The invalid span ID, which is all zeroes.
  */
@@ -71,9 +87,46 @@ int htrace_span_id_read_msgpack(struct htrace_span_id *id,
  * @param id            The span ID to alter.
  * @param rnd           The random source.
  * @param parent        The parent span ID, or null if there is none.
+ * @param scheme        The scheme to use if there is no parent.  Child spans
+ *                          always inherit the upper 64 bits of their parent.
  */
 void htrace_span_id_generate(struct htrace_span_id *id, struct random_src *rnd,
-                             const struct htrace_span_id *parent);
+                             const struct htrace_span_id *parent,
+                             enum htrace_span_id_scheme scheme);
+
+/**
+ * The number of upper bits of a time-ordered trace ID which hold the time.
+ *
+ * The remaining 48 bits of the trace ID are random.  Traces which start in
+ * the same minute only differ in those bits, so by the birthday bound, two
+ * of them are likely to share a trace ID once about 2^24 (16 million)
+ * traces start in one minute.  At 100,000 traces per second, the chance of
+ * any collision in a given minute is about 10^-4.  The random scheme, with
+ * 64 random bits, is the one to use when that matters more than locality.
+ */
+#define HTRACE_SPAN_ID_TIME_BITS 16
+
+/**
+ * Get the time prefix of a new time-ordered trace ID.
+ *
+ * This is async-signal-safe.
+ *
+ * @return              The time in minutes since the epoch, modulo 2^16,
+ *                          shifted into the upper HTRACE_SPAN_ID_TIME_BITS
+ *                          bits.
+ */
+uint64_t htrace_span_id_time_prefix(void);
+
+/**
+ * Parse a span ID scheme name.
+ *
+ * @param str           The scheme name.
+ * @param scheme        (out param) The scheme.
+ *
+ * @return              1 on success; 0 if the name was not recognized.
+ */
+int htrace_span_id_scheme_parse(const char *str,
+                                enum htrace_span_id_scheme *scheme);
 
 #endif
 
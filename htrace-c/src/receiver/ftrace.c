@@ -0,0 +1,491 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/ftrace.h"
+#include "receiver/receiver.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file ftrace.c
+ *
+ * A span receiver that writes a marker for each span into the kernel's
+ * ftrace buffer, so that spans show up in trace-cmd and perf captures
+ * alongside scheduler, block I/O and network events.
+ *
+ * Each thread writes through its own file descriptor, so threads never
+ * contend for a lock on the way into the kernel.  The descriptors are cached
+ * in a process-wide thread-specific slot, rather than one per receiver, so
+ * that a thread which exits after its receiver has been freed doesn't touch
+ * freed memory.
+ */
+
+/**
+ * The tracing directory to try if the default one doesn't exist.  Older
+ * kernels only expose tracefs under debugfs.
+ */
+#define FTRACE_DEBUGFS_DIR "/sys/kernel/debug/tracing"
+
+/**
+ * The minimum interval between rate-limited log messages.
+ */
+#define FTRACE_LOG_INTERVAL_MS 60000
+
+/**
+ * The maximum length of a text marker.
+ */
+#define FTRACE_MAX_TEXT_LEN (FTRACE_MAX_DESC_LEN + 256)
+
+struct ftrace_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The marker file.  Malloced.
+     */
+    char *path;
+
+    /**
+     * Nonzero if we are writing raw markers.
+     */
+    int raw;
+
+    /**
+     * The metadata file, or NULL if there is none.
+     */
+    FILE *meta_fp;
+
+    /**
+     * The path of the metadata file.  Malloced.
+     */
+    char *meta_path;
+
+    /**
+     * Protects meta_fp.
+     */
+    pthread_mutex_t meta_lock;
+};
+
+/**
+ * A thread's cached marker file descriptor.
+ */
+struct ftrace_tls {
+    /**
+     * The path which fd refers to.  Malloced.
+     */
+    char *path;
+
+    /**
+     * The file descriptor.
+     */
+    int fd;
+};
+
+static pthread_key_t g_ftrace_tls_key;
+
+static pthread_once_t g_ftrace_tls_once = PTHREAD_ONCE_INIT;
+
+static int g_ftrace_tls_key_err;
+
+static void ftrace_tls_free(void *data)
+{
+    struct ftrace_tls *tls = data;
+
+    close(tls->fd);
+    free(tls->path);
+    free(tls);
+}
+
+static void ftrace_tls_key_init(void)
+{
+    g_ftrace_tls_key_err = pthread_key_create(&g_ftrace_tls_key,
+                                              ftrace_tls_free);
+}
+
+/**
+ * Get the current thread's file descriptor for the receiver's marker file.
+ *
+ * @return              The file descriptor, or -1 on error.  Errors will be
+ *                          logged.
+ */
+static int ftrace_get_fd(struct ftrace_rcv *rcv)
+{
+    struct ftrace_tls *tls;
+    int fd, err;
+
+    tls = pthread_getspecific(g_ftrace_tls_key);
+    if (tls && (!strcmp(tls->path, rcv->path))) {
+        return tls->fd;
+    }
+    fd = open(rcv->path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err = errno;
+        HTRACE_LOG_RATE_LIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                   FTRACE_LOG_INTERVAL_MS, "ftrace_rcv: failed to open %s: "
+                   "%s\n", rcv->path, terror(err));
+        return -1;
+    }
+    if (tls) {
+        // Another receiver was using this slot.  Switch it over.
+        close(tls->fd);
+        free(tls->path);
+    } else {
+        tls = calloc(1, sizeof(*tls));
+        if (!tls) {
+            close(fd);
+            HTRACE_LOG_RATE_LIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                       FTRACE_LOG_INTERVAL_MS, "ftrace_rcv: OOM\n");
+            return -1;
+        }
+    }
+    tls->fd = fd;
+    tls->path = strdup(rcv->path);
+    if ((!tls->path) || pthread_setspecific(g_ftrace_tls_key, tls)) {
+        pthread_setspecific(g_ftrace_tls_key, NULL);
+        ftrace_tls_free(tls);
+        HTRACE_LOG_RATE_LIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                   FTRACE_LOG_INTERVAL_MS, "ftrace_rcv: OOM\n");
+        return -1;
+    }
+    return fd;
+}
+
+static void ftrace_rcv_free(struct htrace_rcv *r);
+
+/**
+ * Check that we can write to a marker file.
+ */
+static int ftrace_can_write(const char *path)
+{
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Choose the marker file to write to.
+ *
+ * @return              1 on success; 0 on failure.  Errors will be logged.
+ */
+static int ftrace_choose_path(struct ftrace_rcv *rcv,
+                              const struct htrace_conf *conf)
+{
+    struct htrace_log *lg = rcv->tracer->lg;
+    const char *dir, *raw;
+    int ret;
+
+    dir = htrace_conf_get(conf, HTRACE_FTRACE_DIR_KEY);
+    if (!dir) {
+        dir = "";
+    }
+    if ((!strcmp(dir, "/sys/kernel/tracing")) &&
+            (access(dir, F_OK) < 0) && (access(FTRACE_DEBUGFS_DIR, F_OK) == 0)) {
+        dir = FTRACE_DEBUGFS_DIR;
+    }
+    raw = htrace_conf_get(conf, HTRACE_FTRACE_RAW_KEY);
+    if (raw && (!strcmp(raw, "true"))) {
+        if (asprintf(&rcv->path, "%s/trace_marker_raw", dir) < 0) {
+            rcv->path = NULL;
+            htrace_logl(lg, HTRACE_LOG_ERROR, "ftrace_rcv_create: OOM\n");
+            return 0;
+        }
+        ret = ftrace_can_write(rcv->path);
+        if (!ret) {
+            rcv->raw = 1;
+            return 1;
+        }
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "ftrace_rcv_create: can't write to %s: %s.  Using "
+                    "text markers.\n", rcv->path, terror(ret));
+        free(rcv->path);
+    }
+    if (asprintf(&rcv->path, "%s/trace_marker", dir) < 0) {
+        rcv->path = NULL;
+        htrace_logl(lg, HTRACE_LOG_ERROR, "ftrace_rcv_create: OOM\n");
+        return 0;
+    }
+    ret = ftrace_can_write(rcv->path);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "ftrace_rcv_create: can't write to %s: %s.  Is "
+                    "tracefs mounted, and do we have permission to write "
+                    "to it?\n", rcv->path, terror(ret));
+        return 0;
+    }
+    return 1;
+}
+
+static struct htrace_rcv *ftrace_rcv_create(struct htracer *tracer,
+                                            const struct htrace_conf *conf)
+{
+    struct ftrace_rcv *rcv;
+    const char *meta_path;
+    int ret;
+
+    pthread_once(&g_ftrace_tls_once, ftrace_tls_key_init);
+    if (g_ftrace_tls_key_err) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "ftrace_rcv_create: pthread_key_create "
+                    "failed: %s\n", terror(g_ftrace_tls_key_err));
+        return NULL;
+    }
+    rcv = calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "ftrace_rcv_create: OOM while "
+                    "allocating ftrace_rcv.\n");
+        return NULL;
+    }
+    rcv->base.ty = &g_ftrace_rcv_ty;
+    rcv->tracer = tracer;
+    ret = pthread_mutex_init(&rcv->meta_lock, NULL);
+    if (ret) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "ftrace_rcv_create: failed to create mutex: "
+                    "error %d (%s)\n", ret, terror(ret));
+        free(rcv);
+        return NULL;
+    }
+    if (!ftrace_choose_path(rcv, conf)) {
+        ftrace_rcv_free((struct htrace_rcv*)rcv);
+        return NULL;
+    }
+    meta_path = htrace_conf_get(conf, HTRACE_FTRACE_METADATA_PATH_KEY);
+    if (meta_path && meta_path[0]) {
+        rcv->meta_path = strdup(meta_path);
+        if (!rcv->meta_path) {
+            htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                        "ftrace_rcv_create: OOM\n");
+            ftrace_rcv_free((struct htrace_rcv*)rcv);
+            return NULL;
+        }
+        rcv->meta_fp = fopen(meta_path, "a");
+        if (!rcv->meta_fp) {
+            ret = errno;
+            htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                        "ftrace_rcv_create: failed to open '%s' "
+                        "for write: error %d (%s)\n", meta_path, ret,
+                        terror(ret));
+            ftrace_rcv_free((struct htrace_rcv*)rcv);
+            return NULL;
+        }
+    }
+    htrace_log(tracer->lg, "Initialized ftrace receiver with %s markers in "
+               "%s.\n", (rcv->raw ? "raw" : "text"), rcv->path);
+    return (struct htrace_rcv*)rcv;
+}
+
+/**
+ * Format a span as a text marker.
+ *
+ * @return              The length of the marker.
+ */
+static int ftrace_format_text(const struct htrace_span *span, char *buf)
+{
+    char sid[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char pid[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    int len;
+
+    htrace_span_id_to_str(&span->span_id, sid, sizeof(sid));
+    if (span->num_parents == 1) {
+        htrace_span_id_to_str(&span->parent.single, pid, sizeof(pid));
+    } else if (span->num_parents > 1) {
+        htrace_span_id_to_str(&span->parent.list[0], pid, sizeof(pid));
+    } else {
+        strcpy(pid, "-");
+    }
+    len = snprintf(buf, FTRACE_MAX_TEXT_LEN, FTRACE_TEXT_PREFIX "%s %s %"
+                   PRId64 " %" PRId64 " %.*s\n", sid, pid, span->begin_ms,
+                   span->end_ms, FTRACE_MAX_DESC_LEN, span->desc);
+    if (len >= FTRACE_MAX_TEXT_LEN) {
+        len = FTRACE_MAX_TEXT_LEN - 1;
+        buf[len - 1] = '\n';
+    }
+    return len;
+}
+
+static void ftrace_format_raw(const struct htrace_span *span,
+                              struct ftrace_raw_marker *marker)
+{
+    memset(marker, 0, sizeof(*marker));
+    marker->id = FTRACE_RAW_ID;
+    marker->version = FTRACE_RAW_VERSION;
+    marker->span_id_high = span->span_id.high;
+    marker->span_id_low = span->span_id.low;
+    if (span->num_parents == 1) {
+        marker->parent_high = span->parent.single.high;
+        marker->parent_low = span->parent.single.low;
+    } else if (span->num_parents > 1) {
+        marker->parent_high = span->parent.list[0].high;
+        marker->parent_low = span->parent.list[0].low;
+    }
+    marker->begin_us = span->begin_ms;
+    marker->end_us = span->end_ms;
+}
+
+static void ftrace_write_meta(struct ftrace_rcv *rcv, struct htrace_span *span)
+{
+    int len, res, err;
+    char *buf;
+
+    span->trid = rcv->tracer->trid;
+    len = span_json_size(span);
+    buf = malloc(len + 1);
+    if (!buf) {
+        span->trid = NULL;
+        HTRACE_LOG_RATE_LIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                   FTRACE_LOG_INTERVAL_MS, "ftrace_rcv_add_span: OOM\n");
+        return;
+    }
+    span_json_sprintf(span, len, buf);
+    span->trid = NULL;
+    buf[len - 1] = '\n';
+    buf[len] = '\0';
+    pthread_mutex_lock(&rcv->meta_lock);
+    res = fwrite(buf, 1, len, rcv->meta_fp);
+    err = errno;
+    pthread_mutex_unlock(&rcv->meta_lock);
+    if (res < len) {
+        HTRACE_LOG_RATE_LIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                   FTRACE_LOG_INTERVAL_MS, "ftrace_rcv_add_span(%s): fwrite "
+                   "error: %d (%s)\n", rcv->meta_path, err, terror(err));
+    }
+    free(buf);
+}
+
+static void ftrace_rcv_add_span(struct htrace_rcv *r,
+                                struct htrace_span *span)
+{
+    struct ftrace_rcv *rcv = (struct ftrace_rcv *)r;
+    struct ftrace_raw_marker marker;
+    char text[FTRACE_MAX_TEXT_LEN];
+    const void *buf;
+    ssize_t res;
+    size_t len;
+    int fd, err;
+
+    fd = ftrace_get_fd(rcv);
+    if (fd >= 0) {
+        if (rcv->raw) {
+            ftrace_format_raw(span, &marker);
+            buf = &marker;
+            len = sizeof(marker);
+        } else {
+            len = ftrace_format_text(span, text);
+            buf = text;
+        }
+        // Each write is one marker, so we can't split it up.
+        res = write(fd, buf, len);
+        if (res < 0) {
+            err = errno;
+            HTRACE_LOG_RATE_LIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                       FTRACE_LOG_INTERVAL_MS, "ftrace_rcv_add_span(%s): "
+                       "write error: %d (%s)\n", rcv->path, err, terror(err));
+        }
+    }
+    if (rcv->meta_fp) {
+        ftrace_write_meta(rcv, span);
+    }
+}
+
+static void ftrace_rcv_add_spans(struct htrace_rcv *r,
+                                 struct htrace_span *spans, int num_spans)
+{
+    int i;
+
+    for (i = 0; i < num_spans; i++) {
+        ftrace_rcv_add_span(r, spans + i);
+    }
+}
+
+static void ftrace_rcv_flush(struct htrace_rcv *r)
+{
+    struct ftrace_rcv *rcv = (struct ftrace_rcv *)r;
+    int err;
+
+    if (!rcv->meta_fp) {
+        return;
+    }
+    pthread_mutex_lock(&rcv->meta_lock);
+    if (fflush(rcv->meta_fp) < 0) {
+        err = errno;
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "ftrace_rcv_flush(path=%s): fflush "
+                    "error: %s\n", rcv->meta_path, terror(err));
+    }
+    pthread_mutex_unlock(&rcv->meta_lock);
+}
+
+static void ftrace_rcv_free(struct htrace_rcv *r)
+{
+    struct ftrace_rcv *rcv = (struct ftrace_rcv *)r;
+    struct htrace_log *lg;
+
+    if (!rcv) {
+        return;
+    }
+    lg = rcv->tracer->lg;
+    if (rcv->path) {
+        htrace_log(lg, "Shutting down ftrace receiver with path=%s\n",
+                   rcv->path);
+    }
+    if (rcv->meta_fp && fclose(rcv->meta_fp)) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "ftrace_rcv_free: fclose(%s) error: %s\n", rcv->meta_path,
+                    terror(errno));
+    }
+    pthread_mutex_destroy(&rcv->meta_lock);
+    free(rcv->meta_path);
+    free(rcv->path);
+    free(rcv);
+}
+
+const struct htrace_rcv_ty g_ftrace_rcv_ty = {
+    "ftrace",
+    ftrace_rcv_create,
+    ftrace_rcv_add_span,
+    ftrace_rcv_add_spans,
+    ftrace_rcv_flush,
+    ftrace_rcv_free,
+    NULL,
+    NULL,
+};
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,111 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_RECEIVER_FTRACE_H
+#define APACHE_HTRACE_RECEIVER_FTRACE_H
+
+/**
+ * @file ftrace.h
+ *
+ * The marker formats written by the ftrace span receiver, and the converter
+ * which merges them with the rest of a kernel trace.
+ *
+ * The receiver only sees a span once it has been closed, so it writes one
+ * marker per span, right after the span ends.  The kernel timestamps the
+ * marker, so the end of the span sits at the marker's position in the kernel
+ * trace, and its beginning is the marker's timestamp minus the span's
+ * duration.
+ *
+ * Text markers, written to trace_marker, look like:
+ *
+ *      htrace: <span id> <parent id or -> <begin us> <end us> <description>
+ *
+ * Raw markers, written to trace_marker_raw, are a struct ftrace_raw_marker.
+ * The kernel takes the first 4 bytes as the marker ID, and prints the rest
+ * as hex bytes.  Raw markers leave out the description; the converter takes
+ * it from the metadata file, if there is one.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * The prefix of a text marker.
+ */
+#define FTRACE_TEXT_PREFIX "htrace: "
+
+/**
+ * The ID of a raw marker.
+ */
+#define FTRACE_RAW_ID 0x48545243U
+
+/**
+ * The version of the raw marker format.
+ */
+#define FTRACE_RAW_VERSION 1
+
+/**
+ * The maximum length of the description in a text marker.  Longer
+ * descriptions are truncated.
+ */
+#define FTRACE_MAX_DESC_LEN 512
+
+/**
+ * A raw marker.  All integers are in host byte order.
+ */
+struct ftrace_raw_marker {
+    uint32_t id;
+    uint32_t version;
+    uint64_t span_id_high;
+    uint64_t span_id_low;
+
+    /**
+     * The first parent, or all zeroes if there are none.
+     */
+    uint64_t parent_high;
+    uint64_t parent_low;
+    uint64_t begin_us;
+    uint64_t end_us;
+};
+
+/**
+ * Merge the htrace markers in a kernel trace with span metadata.
+ *
+ * The trace is read in the text format of the kernel's trace and trace_pipe
+ * files.  Every line is copied to the output, ordered by timestamp, except
+ * that each htrace marker is replaced by an htrace_begin line at the time the
+ * span began, and an htrace_end line at the time it ended.  Lines without a
+ * timestamp, like the header, come first.
+ *
+ * @param trace         The kernel trace.
+ * @param meta          The metadata file written by the receiver, or NULL.
+ * @param out           Where to write the merged trace.
+ * @param err           A buffer for an error message.
+ * @param err_len       The length of the error message buffer.
+ *
+ * @return              0 on success; an error code otherwise.
+ */
+int ftrace_merge(FILE *trace, FILE *meta, FILE *out,
+                 char *err, size_t err_len);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
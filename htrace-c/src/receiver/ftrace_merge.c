@@ -0,0 +1,546 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "receiver/ftrace.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file ftrace_merge.c
+ *
+ * Merges the markers written by the ftrace span receiver into a kernel trace.
+ *
+ * This only uses libc, so that it can be built into a standalone tool.
+ */
+
+/**
+ * The length of a span ID string.
+ */
+#define FM_ID_LEN 32
+
+/**
+ * The number of nanoseconds in a second.
+ */
+#define FM_NS_PER_SEC ((uint64_t)1000000000)
+
+/**
+ * Span metadata read from the metadata file.
+ */
+struct fm_meta {
+    char id[FM_ID_LEN + 1];
+    char *desc;
+    char *trid;
+};
+
+/**
+ * A line of the merged trace.
+ */
+struct fm_line {
+    /**
+     * Nonzero if the line has a timestamp.
+     */
+    int has_ts;
+
+    /**
+     * The timestamp in nanoseconds.
+     */
+    uint64_t ts_ns;
+
+    /**
+     * The position of the line in the output before sorting.
+     */
+    uint64_t seq;
+
+    /**
+     * The text of the line, without a newline.  Malloced.
+     */
+    char *text;
+};
+
+struct fm_ctx {
+    struct fm_meta *metas;
+    size_t num_metas;
+    size_t metas_cap;
+
+    struct fm_line *lines;
+    size_t num_lines;
+    size_t lines_cap;
+
+    char *err;
+    size_t err_len;
+};
+
+/**
+ * A parsed kernel trace line.
+ */
+struct fm_parsed {
+    /**
+     * Everything before the timestamp.
+     */
+    const char *prefix;
+    int prefix_len;
+
+    /**
+     * The timestamp.
+     */
+    uint64_t ts_ns;
+
+    /**
+     * The number of digits after the decimal point in the timestamp.
+     */
+    int decimals;
+
+    /**
+     * Everything after the timestamp and its colon.
+     */
+    const char *msg;
+};
+
+/**
+ * Find a JSON string field in one of our own JSON spans.  The strings we
+ * write never contain escapes, so the value ends at the next quote.
+ *
+ * @return              A malloced copy of the value, or NULL if the field
+ *                          wasn't found or we ran out of memory.
+ */
+static char *fm_json_str(const char *line, const char *field)
+{
+    char key[16];
+    const char *start, *end;
+
+    snprintf(key, sizeof(key), "\"%s\":\"", field);
+    start = strstr(line, key);
+    if (!start) {
+        return NULL;
+    }
+    start += strlen(key);
+    end = strchr(start, '"');
+    if (!end) {
+        return NULL;
+    }
+    return strndup(start, end - start);
+}
+
+static int fm_meta_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct fm_meta *)a)->id,
+                  ((const struct fm_meta *)b)->id);
+}
+
+static int fm_read_meta(struct fm_ctx *ctx, FILE *meta)
+{
+    struct fm_meta *m, *nmetas;
+    char *line = NULL, *id;
+    size_t line_cap = 0;
+
+    while (getline(&line, &line_cap, meta) > 0) {
+        id = fm_json_str(line, "a");
+        if ((!id) || (strlen(id) != FM_ID_LEN)) {
+            free(id);
+            continue;
+        }
+        if (ctx->num_metas == ctx->metas_cap) {
+            ctx->metas_cap = ctx->metas_cap ? (ctx->metas_cap * 2) : 64;
+            nmetas = realloc(ctx->metas, ctx->metas_cap * sizeof(*nmetas));
+            if (!nmetas) {
+                free(id);
+                free(line);
+                snprintf(ctx->err, ctx->err_len, "OOM");
+                return ENOMEM;
+            }
+            ctx->metas = nmetas;
+        }
+        m = ctx->metas + ctx->num_metas++;
+        memcpy(m->id, id, FM_ID_LEN + 1);
+        free(id);
+        m->desc = fm_json_str(line, "d");
+        m->trid = fm_json_str(line, "r");
+    }
+    free(line);
+    if (ferror(meta)) {
+        snprintf(ctx->err, ctx->err_len, "error reading the metadata file");
+        return EIO;
+    }
+    qsort(ctx->metas, ctx->num_metas, sizeof(struct fm_meta),
+          fm_meta_compare);
+    return 0;
+}
+
+static const struct fm_meta *fm_find_meta(struct fm_ctx *ctx, const char *id)
+{
+    struct fm_meta key;
+
+    if (strlen(id) != FM_ID_LEN) {
+        return NULL;
+    }
+    memcpy(key.id, id, FM_ID_LEN + 1);
+    return bsearch(&key, ctx->metas, ctx->num_metas, sizeof(struct fm_meta),
+                   fm_meta_compare);
+}
+
+/**
+ * Parse a timestamp token like "12345.678901:".
+ *
+ * @return              1 if the token was a timestamp; 0 otherwise.
+ */
+static int fm_parse_ts(const char *tok, int tok_len, uint64_t *ts_ns,
+                       int *decimals)
+{
+    uint64_t secs = 0, frac = 0;
+    int i = 0, num_frac = 0;
+
+    if ((tok_len < 4) || (tok[tok_len - 1] != ':')) {
+        return 0;
+    }
+    for (; (i < tok_len) && isdigit((unsigned char)tok[i]); i++) {
+        secs = (secs * 10) + (tok[i] - '0');
+    }
+    if ((i == 0) || (tok[i] != '.')) {
+        return 0;
+    }
+    for (i++; (i < tok_len) && isdigit((unsigned char)tok[i]); i++) {
+        if (num_frac < 9) {
+            frac = (frac * 10) + (tok[i] - '0');
+            num_frac++;
+        }
+    }
+    if ((num_frac == 0) || (i != tok_len - 1)) {
+        return 0;
+    }
+    *decimals = num_frac;
+    for (; num_frac < 9; num_frac++) {
+        frac *= 10;
+    }
+    *ts_ns = (secs * FM_NS_PER_SEC) + frac;
+    return 1;
+}
+
+/**
+ * Find the timestamp in a line of kernel trace output.  It is the first
+ * token after the CPU number which looks like a timestamp.
+ */
+static int fm_parse_line(const char *line, struct fm_parsed *parsed)
+{
+    const char *cur, *tok;
+    int tok_len;
+
+    if (line[0] == '#') {
+        return 0;
+    }
+    cur = strchr(line, ']');
+    if (!cur) {
+        return 0;
+    }
+    cur++;
+    while (*cur) {
+        while (*cur == ' ') {
+            cur++;
+        }
+        tok = cur;
+        while (*cur && (*cur != ' ')) {
+            cur++;
+        }
+        tok_len = cur - tok;
+        if (tok_len == 0) {
+            break;
+        }
+        if (fm_parse_ts(tok, tok_len, &parsed->ts_ns, &parsed->decimals)) {
+            parsed->prefix = line;
+            parsed->prefix_len = tok - line;
+            parsed->msg = cur;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int fm_add_line(struct fm_ctx *ctx, int has_ts, uint64_t ts_ns,
+                       char *text)
+{
+    struct fm_line *nlines, *l;
+
+    if (!text) {
+        snprintf(ctx->err, ctx->err_len, "OOM");
+        return ENOMEM;
+    }
+    if (ctx->num_lines == ctx->lines_cap) {
+        ctx->lines_cap = ctx->lines_cap ? (ctx->lines_cap * 2) : 256;
+        nlines = realloc(ctx->lines, ctx->lines_cap * sizeof(*nlines));
+        if (!nlines) {
+            free(text);
+            snprintf(ctx->err, ctx->err_len, "OOM");
+            return ENOMEM;
+        }
+        ctx->lines = nlines;
+    }
+    l = ctx->lines + ctx->num_lines;
+    l->has_ts = has_ts;
+    l->ts_ns = ts_ns;
+    l->seq = ctx->num_lines++;
+    l->text = text;
+    return 0;
+}
+
+static void fm_format_ts(uint64_t ts_ns, int decimals, char *buf,
+                         size_t buf_len)
+{
+    if (decimals > 6) {
+        snprintf(buf, buf_len, "%" PRIu64 ".%09" PRIu64,
+                 ts_ns / FM_NS_PER_SEC, ts_ns % FM_NS_PER_SEC);
+    } else {
+        snprintf(buf, buf_len, "%" PRIu64 ".%06" PRIu64,
+                 ts_ns / FM_NS_PER_SEC, (ts_ns % FM_NS_PER_SEC) / 1000);
+    }
+}
+
+/**
+ * Replace a marker by an htrace_begin and an htrace_end line.
+ */
+static int fm_add_span(struct fm_ctx *ctx, const struct fm_parsed *p,
+                       const char *sid, const char *pid, uint64_t begin_us,
+                       uint64_t end_us, const char *desc)
+{
+    const struct fm_meta *meta;
+    const char *trid = "-";
+    uint64_t dur_us, begin_ns;
+    char ts[64];
+    char *text;
+    int ret;
+
+    meta = fm_find_meta(ctx, sid);
+    if (meta) {
+        if ((!desc) && meta->desc) {
+            desc = meta->desc;
+        }
+        if (meta->trid) {
+            trid = meta->trid;
+        }
+    }
+    if (!desc) {
+        desc = "-";
+    }
+    dur_us = (end_us > begin_us) ? (end_us - begin_us) : 0;
+    begin_ns = (p->ts_ns > dur_us * 1000ULL) ?
+        (p->ts_ns - (dur_us * 1000ULL)) : 0;
+    fm_format_ts(begin_ns, p->decimals, ts, sizeof(ts));
+    if (asprintf(&text, "%.*s%s: htrace_begin: span=%s parent=%s desc=%s "
+                 "trid=%s", p->prefix_len, p->prefix, ts, sid, pid, desc,
+                 trid) < 0) {
+        text = NULL;
+    }
+    ret = fm_add_line(ctx, 1, begin_ns, text);
+    if (ret) {
+        return ret;
+    }
+    fm_format_ts(p->ts_ns, p->decimals, ts, sizeof(ts));
+    if (asprintf(&text, "%.*s%s: htrace_end: span=%s duration_us=%" PRIu64,
+                 p->prefix_len, p->prefix, ts, sid, dur_us) < 0) {
+        text = NULL;
+    }
+    return fm_add_line(ctx, 1, p->ts_ns, text);
+}
+
+/**
+ * Handle a text marker.
+ *
+ * @return              1 if the line was a text marker; 0 if it wasn't; a
+ *                          negative error code on error.
+ */
+static int fm_text_marker(struct fm_ctx *ctx, const struct fm_parsed *p)
+{
+    char sid[FM_ID_LEN + 1], pid[FM_ID_LEN + 1];
+    const char *marker;
+    uint64_t begin_us, end_us;
+    char *desc;
+    int off = 0, ret;
+
+    marker = strstr(p->msg, FTRACE_TEXT_PREFIX);
+    if (!marker) {
+        return 0;
+    }
+    if ((sscanf(marker + strlen(FTRACE_TEXT_PREFIX), "%32s %32s %" SCNu64
+                " %" SCNu64 " %n", sid, pid, &begin_us, &end_us, &off) < 4) ||
+            (off == 0)) {
+        return 0;
+    }
+    desc = strdup(marker + strlen(FTRACE_TEXT_PREFIX) + off);
+    if (!desc) {
+        snprintf(ctx->err, ctx->err_len, "OOM");
+        return -ENOMEM;
+    }
+    ret = fm_add_span(ctx, p, sid, pid, begin_us, end_us,
+                      desc[0] ? desc : NULL);
+    free(desc);
+    return ret ? -ret : 1;
+}
+
+static void fm_id_to_str(uint64_t high, uint64_t low, char *buf)
+{
+    snprintf(buf, FM_ID_LEN + 1, "%016" PRIx64 "%016" PRIx64, high, low);
+}
+
+/**
+ * Handle a raw marker.  The kernel prints these as "# <id> buf: <bytes>".
+ *
+ * @return              1 if the line was a raw marker; 0 if it wasn't; a
+ *                          negative error code on error.
+ */
+static int fm_raw_marker(struct fm_ctx *ctx, const struct fm_parsed *p)
+{
+    struct ftrace_raw_marker marker;
+    uint8_t *bytes = ((uint8_t *)&marker) + sizeof(marker.id);
+    char key[32], sid[FM_ID_LEN + 1], pid[FM_ID_LEN + 1];
+    const char *cur;
+    unsigned int byte;
+    size_t i, num_bytes = sizeof(marker) - sizeof(marker.id);
+    int off, ret;
+
+    snprintf(key, sizeof(key), "# %x buf:", FTRACE_RAW_ID);
+    cur = strstr(p->msg, key);
+    if (!cur) {
+        return 0;
+    }
+    cur += strlen(key);
+    for (i = 0; i < num_bytes; i++) {
+        if (sscanf(cur, " %2x%n", &byte, &off) < 1) {
+            return 0;
+        }
+        bytes[i] = byte;
+        cur += off;
+    }
+    marker.id = FTRACE_RAW_ID;
+    if (marker.version != FTRACE_RAW_VERSION) {
+        return 0;
+    }
+    fm_id_to_str(marker.span_id_high, marker.span_id_low, sid);
+    if (marker.parent_high || marker.parent_low) {
+        fm_id_to_str(marker.parent_high, marker.parent_low, pid);
+    } else {
+        strcpy(pid, "-");
+    }
+    ret = fm_add_span(ctx, p, sid, pid, marker.begin_us, marker.end_us, NULL);
+    return ret ? -ret : 1;
+}
+
+static int fm_line_compare(const void *a, const void *b)
+{
+    const struct fm_line *la = a, *lb = b;
+
+    if (la->has_ts != lb->has_ts) {
+        return la->has_ts - lb->has_ts;
+    } else if (la->ts_ns < lb->ts_ns) {
+        return -1;
+    } else if (la->ts_ns > lb->ts_ns) {
+        return 1;
+    } else if (la->seq < lb->seq) {
+        return -1;
+    } else if (la->seq > lb->seq) {
+        return 1;
+    }
+    return 0;
+}
+
+static int fm_read_trace(struct fm_ctx *ctx, FILE *trace)
+{
+    struct fm_parsed parsed;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int ret = 0, has_ts;
+
+    while ((len = getline(&line, &line_cap, trace)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        has_ts = fm_parse_line(line, &parsed);
+        if (has_ts) {
+            ret = fm_text_marker(ctx, &parsed);
+            if (ret == 0) {
+                ret = fm_raw_marker(ctx, &parsed);
+            }
+            if (ret < 0) {
+                ret = -ret;
+                break;
+            } else if (ret > 0) {
+                ret = 0;
+                continue;
+            }
+        }
+        ret = fm_add_line(ctx, has_ts, has_ts ? parsed.ts_ns : 0,
+                          strdup(line));
+        if (ret) {
+            break;
+        }
+    }
+    free(line);
+    if ((!ret) && ferror(trace)) {
+        snprintf(ctx->err, ctx->err_len, "error reading the trace");
+        ret = EIO;
+    }
+    return ret;
+}
+
+int ftrace_merge(FILE *trace, FILE *meta, FILE *out,
+                 char *err, size_t err_len)
+{
+    struct fm_ctx ctx;
+    size_t i;
+    int ret = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.err = err;
+    ctx.err_len = err_len;
+    if (meta) {
+        ret = fm_read_meta(&ctx, meta);
+        if (ret) {
+            goto done;
+        }
+    }
+    ret = fm_read_trace(&ctx, trace);
+    if (ret) {
+        goto done;
+    }
+    qsort(ctx.lines, ctx.num_lines, sizeof(struct fm_line), fm_line_compare);
+    for (i = 0; i < ctx.num_lines; i++) {
+        if (fprintf(out, "%s\n", ctx.lines[i].text) < 0) {
+            ret = errno ? errno : EIO;
+            snprintf(err, err_len, "error writing the merged trace");
+            goto done;
+        }
+    }
+
+done:
+    for (i = 0; i < ctx.num_lines; i++) {
+        free(ctx.lines[i].text);
+    }
+    free(ctx.lines);
+    for (i = 0; i < ctx.num_metas; i++) {
+        free(ctx.metas[i].desc);
+        free(ctx.metas[i].trid);
+    }
+    free(ctx.metas);
+    return ret;
+}
+
+// vim:ts=4:sw=4:et
@@ -18,12 +18,14 @@
 
 #include "receiver/hrpc.h"
 #include "util/log.h"
+#include "util/net.h"
 #include "util/string.h"
 #include "util/time.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
@@ -60,8 +62,6 @@
 
 #define DEFAULT_HTRACED_HRPC_PORT 9075
 
-#define ADDR_STR_MAX (2 + INET6_ADDRSTRLEN + sizeof(":65536"))
-
 struct hrpc_client {
     /**
      * The HTrace log object.
@@ -95,10 +95,24 @@ struct hrpc_client {
 
     /**
      * Socket of current open connection, or -1 if there is no currently open
-     * connection.
+     * connection.  This is also set while the connection is being made, so
+     * that hrpc_client_interrupt can abort the connect.  Changes are made
+     * with the lock held.
      */
     int sock;
 
+    /**
+     * Nonzero if hrpc_client_interrupt has been called.  Protected by the
+     * lock.
+     */
+    int interrupted;
+
+    /**
+     * Lock which keeps hrpc_client_interrupt from shutting down a socket
+     * which is being closed.
+     */
+    pthread_mutex_t lock;
+
     /**
      * The sequence number on the connection.
      */
@@ -107,7 +121,7 @@ struct hrpc_client {
     /**
      * The remote IP address.
      */
-    char addr_str[ADDR_STR_MAX];
+    char addr_str[NET_ADDR_STR_MAX];
 };
 
 struct hrpc_req_header {
@@ -127,11 +141,8 @@ struct hrpc_resp_header {
 
 static int hrpc_client_open_conn(struct hrpc_client *hcli);
 static int try_connect(struct hrpc_client *hcli, struct addrinfo *p);
-static int set_socket_read_and_write_timeout(struct hrpc_client *hcli,
-                                             int sock);
 static int hrpc_client_send_req(struct hrpc_client *hcli, uint32_t method_id,
-                    const void *buf1, size_t buf1_len,
-                    const void *buf2, size_t buf2_len, uint64_t *seq);
+                    const struct iovec *body, int body_cnt, uint64_t *seq);
 static int hrpc_client_rcv_resp(struct hrpc_client *hcli, uint32_t method_id,
                        uint64_t seq, char **err, void **resp,
                        size_t *resp_len);
@@ -144,16 +155,19 @@ struct hrpc_client *hrpc_client_alloc(struct htrace_log *lg,
 
     hcli = calloc(1, sizeof(*hcli));
     if (!hcli) {
-        htrace_log(lg, "Failed to allocate memory for the HRPC client.\n");
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "Failed to allocate memory for the HRPC client.\n");
         goto error;
     }
     hcli->lg = lg;
     hcli->write_timeo_ms = write_timeo_ms;
     hcli->read_timeo_ms = read_timeo_ms;
     hcli->sock = -1;
+    pthread_mutex_init(&hcli->lock, NULL);
     hcli->endpoint = strdup(endpoint);
     if (!hcli->endpoint) {
-        htrace_log(lg, "Failed to allocate memory for the endpoint string.\n");
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "Failed to allocate memory for the endpoint string.\n");
         goto error;
     }
     if (!parse_endpoint(lg, endpoint, DEFAULT_HTRACED_HRPC_PORT,
@@ -164,6 +178,7 @@ struct hrpc_client *hrpc_client_alloc(struct htrace_log *lg,
 
 error:
     if (hcli) {
+        pthread_mutex_destroy(&hcli->lock);
         free(hcli->host);
         free(hcli->endpoint);
         free(hcli);
@@ -171,51 +186,80 @@ error:
     return NULL;
 }
 
-void hrpc_client_free(struct hrpc_client *hcli)
+/**
+ * Close the current connection, if there is one.
+ */
+static void hrpc_client_close_conn(struct hrpc_client *hcli)
 {
-    if (!hcli) {
-        return;
-    }
+    pthread_mutex_lock(&hcli->lock);
     if (hcli->sock >= 0) {
         close(hcli->sock);
         hcli->sock = -1;
     }
+    pthread_mutex_unlock(&hcli->lock);
+}
+
+void hrpc_client_free(struct hrpc_client *hcli)
+{
+    if (!hcli) {
+        return;
+    }
+    hrpc_client_close_conn(hcli);
+    pthread_mutex_destroy(&hcli->lock);
     free(hcli->host);
     free(hcli->endpoint);
     free(hcli);
 }
 
 int hrpc_client_call(struct hrpc_client *hcli, uint32_t method_id,
-                    const void *buf1, size_t buf1_len,
-                    const void *buf2, size_t buf2_len,
+                    const struct iovec *body, int body_cnt,
                     char **err, void **resp, size_t *resp_len)
 {
     uint64_t seq;
-
+    int interrupted;
+
+    pthread_mutex_lock(&hcli->lock);
+    interrupted = hcli->interrupted;
+    pthread_mutex_unlock(&hcli->lock);
+    if (interrupted) {
+        htrace_logl(hcli->lg, HTRACE_LOG_DEBUG,
+                    "hrpc_client_call: the client has been interrupted.\n");
+        goto error;
+    }
     if (hcli->sock < 0) {
         if (!hrpc_client_open_conn(hcli)) {
             goto error;
         }
         htrace_log(hcli->lg, "hrpc_client_call: successfully opened connection\n");
     } else {
-        htrace_log(hcli->lg, "hrpc_client_call: connection was already open\n");
+        htrace_logl(hcli->lg, HTRACE_LOG_DEBUG,
+                    "hrpc_client_call: connection was already open\n");
     }
-    if (!hrpc_client_send_req(hcli, method_id,
-                              buf1, buf1_len, buf2, buf2_len, &seq)) {
+    if (!hrpc_client_send_req(hcli, method_id, body, body_cnt, &seq)) {
         goto error;
     }
-    htrace_log(hcli->lg, "hrpc_client_call: waiting for response\n");
+    htrace_logl(hcli->lg, HTRACE_LOG_DEBUG,
+                "hrpc_client_call: waiting for response\n");
     if (!hrpc_client_rcv_resp(hcli, method_id, seq, err, resp, resp_len)) {
         goto error;
     }
     return 1;
 
 error:
+    hrpc_client_close_conn(hcli);
+    return 0;
+}
+
+void hrpc_client_interrupt(struct hrpc_client *hcli)
+{
+    pthread_mutex_lock(&hcli->lock);
+    hcli->interrupted = 1;
     if (hcli->sock >= 0) {
-        close(hcli->sock);
-        hcli->sock = -1;
+        // This wakes up any thread blocked sending, receiving, or connecting
+        // on the socket.  The socket is closed by the thread using it.
+        shutdown(hcli->sock, SHUT_RDWR);
     }
-    return 0;
+    pthread_mutex_unlock(&hcli->lock);
 }
 
 static int hrpc_client_open_conn(struct hrpc_client *hcli)
@@ -228,9 +272,10 @@ static int hrpc_client_open_conn(struct hrpc_client *hcli)
     hints.ai_socktype = SOCK_STREAM;
     res = getaddrinfo(hcli->host, NULL, &hints, &list);
     if (res) {
-        htrace_log(hcli->lg, "hrpc_client_open_conn: "
-                   "getaddrinfo(%s) error %d: %s\n",
-                   hcli->host, res, gai_strerror(res));
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_open_conn: "
+                    "getaddrinfo(%s) error %d: %s\n", hcli->host, res,
+                    gai_strerror(res));
         return 0;
     }
     for (info = list; info; info = info->ai_next) {
@@ -241,157 +286,86 @@ static int hrpc_client_open_conn(struct hrpc_client *hcli)
     }
     freeaddrinfo(list);
     if (!info) {
-        htrace_log(hcli->lg, "hrpc_client_open_conn(%s): failed to connect.\n",
-                   hcli->host);
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_open_conn(%s): failed to connect.\n",
+                    hcli->host);
         return 0;
     }
-    hcli->sock = sock;
     return 1;
 }
 
-static int set_port(struct hrpc_client *hcli, struct sockaddr *addr,
-                    int ai_family)
-{
-    switch (ai_family) {
-    case AF_INET: {
-        struct sockaddr_in *in4 = (struct sockaddr_in*)addr;
-        in4->sin_port = htons(hcli->port);
-        return 1;
-    }
-    case AF_INET6: {
-        struct sockaddr_in6 *in6 = (struct sockaddr_in6*)addr;
-        in6->sin6_port = htons(hcli->port);
-        return 1;
-    }
-    default:
-        htrace_log(hcli->lg, "try_connect(%s): set_port %d failed: unknown "
-                   "ai_family %d\n", hcli->addr_str, hcli->port, ai_family);
-        return 0;
-    }
-}
-
 static int try_connect(struct hrpc_client *hcli, struct addrinfo *p)
 {
-    int e, sock = -1;
-    char ip[INET6_ADDRSTRLEN];
-
-    e = getnameinfo(p->ai_addr, p->ai_addrlen,
-                ip, sizeof(ip), 0, 0, NI_NUMERICHOST);
-    if (e) {
-        htrace_log(hcli->lg, "try_connect: getnameinfo failed.  error "
-                   "%d: %s\n", e, gai_strerror(e));
-        return 0;
-    }
-    snprintf(hcli->addr_str, ADDR_STR_MAX, "%s:%d", ip, hcli->port);
-    if (!set_port(hcli, p->ai_addr, p->ai_family)) {
-        goto error;
-    }
-    sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    int e, sock;
+
+    sock = net_socket_create(hcli->lg, p, hcli->port, hcli->write_timeo_ms,
+                             hcli->read_timeo_ms, hcli->addr_str,
+                             sizeof(hcli->addr_str));
     if (sock < 0) {
-        e = errno;
-        htrace_log(hcli->lg, "try_connect(%s): failed to create new "
-                   "socket: error %d (%s)\n", hcli->addr_str, e, terror(e));
-        goto error;
+        return -1;
     }
-    if (fcntl(sock, F_SETFD, FD_CLOEXEC) < 0) {
-        e = errno;
-        htrace_log(hcli->lg, "try_connect(%s): fcntl(FD_CLOEXEC) "
-                   "failed: error %d (%s)\n", hcli->addr_str, e, terror(e));
-        goto error;
-    }
-    if (!set_socket_read_and_write_timeout(hcli, sock)) {
-        goto error;
+    pthread_mutex_lock(&hcli->lock);
+    if (hcli->interrupted) {
+        pthread_mutex_unlock(&hcli->lock);
+        close(sock);
+        return -1;
     }
+    hcli->sock = sock;
+    pthread_mutex_unlock(&hcli->lock);
     if (connect(sock, p->ai_addr, p->ai_addrlen) < 0) {
         e = errno;
-        htrace_log(hcli->lg, "try_connect(%s): connect "
-                   "failed: error %d (%s)\n", hcli->addr_str, e, terror(e));
-        goto error;
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "try_connect(%s): connect "
+                    "failed: error %d (%s)\n", hcli->addr_str, e, terror(e));
+        hrpc_client_close_conn(hcli);
+        return -1;
     }
     return sock;
-
-error:
-    if (sock >= 0) {
-        close(sock);
-    }
-    return -1;
 }
 
-static int set_socket_read_and_write_timeout(struct hrpc_client *hcli,
-                                             int sock)
+static int hrpc_client_send_req(struct hrpc_client *hcli, uint32_t method_id,
+                    const struct iovec *body, int body_cnt, uint64_t *seq)
 {
-    struct timeval tv;
+    // We use scatter/gather I/O here in order to avoid sending
+    // multiple packets when TCP_NODELAY is turned on, and to avoid copying the
+    // body buffers into one contiguous buffer.
+    struct hrpc_req_header hdr;
+    struct iovec *iov;
+    uint64_t length = 0;
+    int i, ret;
 
-    ms_to_timeval(hcli->read_timeo_ms, &tv);
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        int e = errno;
-        htrace_log(hcli->lg, "setsockopt(%d, SO_RCVTIMEO, %"PRId64") failed: "
-                  "error %d (%s)\n", sock, hcli->read_timeo_ms, e, terror(e));
+    iov = malloc(sizeof(*iov) * (body_cnt + 1));
+    if (!iov) {
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR, "hrpc_client_send_req: OOM\n");
         return 0;
     }
-
-    ms_to_timeval(hcli->write_timeo_ms, &tv);
-    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
-        int e = errno;
-        htrace_log(hcli->lg, "setsockopt(%d, SO_SNDTIMEO, %"PRId64") failed: "
-                  "error %d (%s)\n", sock, hcli->write_timeo_ms, e, terror(e));
+    for (i = 0; i < body_cnt; i++) {
+        iov[i + 1] = body[i];
+        length += body[i].iov_len;
+    }
+    if (length > 0xffffffffULL) {
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_send_req: request body length "
+                    "%"PRId64" is too long.\n", length);
+        free(iov);
         return 0;
     }
-    return 1;
-}
-
-static int hrpc_client_send_req(struct hrpc_client *hcli, uint32_t method_id,
-                    const void *buf1, size_t buf1_len,
-                    const void *buf2, size_t buf2_len, uint64_t *seq)
-{
-    // We use writev (scatter/gather I/O) here in order to avoid sending
-    // multiple packets when TCP_NODELAY is turned on.
-    struct hrpc_req_header hdr;
-    struct iovec iov[3];
-
     hdr.magic = htole64(HRPC_MAGIC);
     hdr.method_id = htole32(method_id);
     *seq = hcli->seq++;
     hdr.seq = htole64(*seq);
-    hdr.length = htole32(buf1_len + buf2_len);
+    hdr.length = htole32(length);
     iov[0].iov_base = &hdr;
     iov[0].iov_len = sizeof(hdr);
-    iov[1].iov_base = (void*)buf1;
-    iov[1].iov_len = buf1_len;
-    iov[2].iov_base = (void*)buf2;
-    iov[2].iov_len = buf2_len;
-
-    while (1) {
-        ssize_t res = writev(hcli->sock, iov, sizeof(iov)/sizeof(iov[0]));
-        int i;
-        if (res < 0) {
-            int e = errno;
-            if (e == EINTR) {
-                continue;
-            }
-            htrace_log(hcli->lg, "hrpc_client_send_req: writev error: "
-                       "error %d: %s\n", e, terror(e));
-            return 0;
-        }
-        i = 0;
-        while (res > 0) {
-            if (iov[i].iov_len < res) {
-                res -= iov[i].iov_len;
-                iov[i].iov_len = 0;
-            } else {
-                iov[i].iov_len -= res;
-                res = 0;
-            }
-            if (++i >= (sizeof(iov)/sizeof(iov[0]))) {
-                if (res == 0) {
-                    return 1;
-                }
-                htrace_log(hcli->lg, "hrpc_client_send_req: unexpectedly "
-                           "large writev return.\n");
-                return 0;
-            }
-        }
+    ret = net_writev_fully(hcli->sock, iov, body_cnt + 1);
+    free(iov);
+    if (ret) {
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_send_req(%s): sendmsg error: "
+                    "error %d: %s\n", hcli->addr_str, ret, terror(ret));
+        return 0;
     }
+    return 1;
 }
 
 static int safe_read(int fd, void *buf, size_t amt)
@@ -430,71 +404,81 @@ static int hrpc_client_rcv_resp(struct hrpc_client *hcli, uint32_t method_id,
 
     res = safe_read(hcli->sock, &hdr, sizeof(hdr));
     if (res < 0) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error reading "
-                   "response header: %d (%s)\n", hcli->addr_str, -res,
-                   terror(-res));
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_rcv_resp(%s): error reading "
+                    "response header: %d (%s)\n", hcli->addr_str, -res,
+                    terror(-res));
         goto error;
     }
     if (res != sizeof(hdr)) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): unexpected EOF "
-                   "reading response header.\n", hcli->addr_str);
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_rcv_resp(%s): unexpected EOF "
+                    "reading response header.\n", hcli->addr_str);
         goto error;
     }
     resp_seq = le64toh(hdr.seq);
     if (resp_seq != seq) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): expected sequence "
-                   "ID 0x%"PRIx64", but got sequence ID 0x%"PRId64".\n",
-                   hcli->addr_str, seq, resp_seq);
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_rcv_resp(%s): expected sequence "
+                    "ID 0x%"PRIx64", but got sequence ID 0x%"PRId64".\n",
+                    hcli->addr_str, seq, resp_seq);
         goto error;
     }
     resp_method_id = le32toh(hdr.method_id);
     if (resp_method_id != method_id) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): expected method "
-                   "ID 0x%"PRIx32", but got method ID 0x%"PRId32".\n",
-                   hcli->addr_str, method_id, resp_method_id);
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_rcv_resp(%s): expected method "
+                    "ID 0x%"PRIx32", but got method ID 0x%"PRId32".\n",
+                    hcli->addr_str, method_id, resp_method_id);
         goto error;
     }
     err_length = le32toh(hdr.err_length);
     if (err_length > MAX_HRPC_ERROR_LENGTH) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error length was "
-                   "%"PRId32", but the maximum error length is %"PRId32".",
-                   hcli->addr_str, err_length, MAX_HRPC_ERROR_LENGTH);
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_rcv_resp(%s): error length was "
+                    "%"PRId32", but the maximum error length is %"PRId32".",
+                    hcli->addr_str, err_length, MAX_HRPC_ERROR_LENGTH);
         goto error;
     }
     if (err_length > 0) {
         err = malloc(err_length + 1);
         res = safe_read(hcli->sock, err, err_length);
         if (res < 0) {
-            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error reading "
-                       "error string: %d (%s)\n", hcli->addr_str, -res,
-                       terror(-res));
+            htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                        "hrpc_client_rcv_resp(%s): error reading "
+                        "error string: %d (%s)\n", hcli->addr_str, -res,
+                        terror(-res));
             goto error;
         }
         if (res != err_length) {
-            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): unexpected EOF "
-                       "reading error string.\n", hcli->addr_str);
+            htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                        "hrpc_client_rcv_resp(%s): unexpected EOF "
+                        "reading error string.\n", hcli->addr_str);
             goto error;
         }
         err[err_length] = '\0';
     }
     length = le32toh(hdr.length);
     if (length > MAX_HRPC_BODY_LENGTH) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): body length was "
-                   "%"PRId32", but the maximum body length is %"PRId32".",
-                   hcli->addr_str, length, MAX_HRPC_BODY_LENGTH);
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "hrpc_client_rcv_resp(%s): body length was "
+                    "%"PRId32", but the maximum body length is %"PRId32".",
+                    hcli->addr_str, length, MAX_HRPC_BODY_LENGTH);
         goto error;
     }
     if (length > 0) {
         resp = malloc(length);
         res = safe_read(hcli->sock, resp, length);
         if (res < 0) {
-            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error reading "
-                       "body: %d (%s)\n", hcli->addr_str, -res, terror(-res));
+            htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                        "hrpc_client_rcv_resp(%s): error reading "
+                        "body: %d (%s)\n", hcli->addr_str, -res, terror(-res));
             goto error;
         }
         if (res != length) {
-            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): unexpected EOF "
-                       "reading body.\n", hcli->addr_str);
+            htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                        "hrpc_client_rcv_resp(%s): unexpected EOF "
+                        "reading body.\n", hcli->addr_str);
             goto error;
         }
     }
@@ -28,6 +28,7 @@
  */
 
 #include <stdint.h>
+#include <sys/uio.h> /* for struct iovec */
 #include <unistd.h>
 
 #define METHOD_ID_WRITE_SPANS 0x1
@@ -60,10 +61,10 @@ void hrpc_client_free(struct hrpc_client *hcli);
  *
  * @param hcli              The HRPC client.
  * @param method_id         The method ID to use.
- * @param buf1              The first buffer to send.
- * @param buf1_len          The size of the first buffer to send.
- * @param buf2              The second buffer to send.
- * @param buf2_len          The size of the second buffer to send.
+ * @param body              The buffers which make up the request body.  They
+ *                              are sent in order with writev, so the caller
+ *                              does not need to copy them into one buffer.
+ * @param body_cnt          The number of buffers in the request body.
  * @param err               (out param) Will be set to a malloced
  *                              NULL-terminated string if the server returned an
  *                              error response.  NULL otherwise.
@@ -74,10 +75,20 @@ void hrpc_client_free(struct hrpc_client *hcli);
  * @return                  0 on failure, 1 on success.
  */
 int hrpc_client_call(struct hrpc_client *hcli, uint32_t method_id,
-                     const void *buf1, size_t buf1_len,
-                     const void *buf2, size_t buf2_len,
+                     const struct iovec *body, int body_cnt,
                      char **err, void **resp, size_t *resp_len);
 
+/**
+ * Interrupt the HRPC client.
+ *
+ * Any call which is blocked sending, receiving, or connecting fails right
+ * away, and all later calls fail without doing anything.  Name lookups can't
+ * be interrupted.  This may be called from any thread.
+ *
+ * @param hcli              The HRPC client.
+ */
+void hrpc_client_interrupt(struct hrpc_client *hcli);
+
 /**
  * Get the endpoint for this HRPC client.
  *
@@ -23,20 +23,26 @@
 #include "receiver/hrpc.h"
 #include "receiver/receiver.h"
 #include "test/test.h"
+#include "util/bufmem.h"
 #include "util/cmp.h"
 #include "util/cmp_util.h"
 #include "util/log.h"
+#include "util/membudget.h"
+#include "util/probe.h"
 #include "util/string.h"
 #include "util/time.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * @file htraced.c
@@ -62,6 +68,12 @@
  * buffer, except that we have to add a short "prequel" to it containing the
  * other WriteSpansReq fields.
  *
+ * All the htraced receivers in a process which send to the same endpoint share
+ * a single transport: one connection, one transmitter thread, and one set of
+ * buffers.  The transport sends the ID of the tracer which created it as the
+ * DefaultTrid of each WriteSpans request.  Spans from other tracers carry their
+ * tracer ID in the span itself.
+ *
  * Note that we may change the serialization in the future if we discover better
  * alternatives.  Sending spans over HTTP as JSON will always be supported
  * as a fallback.
@@ -134,22 +146,108 @@
  */
 #define HTRACED_SEND_RETRY_SLEEP_MS 5000
 
+/**
+ * The minimum number of milliseconds between repeated warnings about dropped
+ * spans or failed sends.  During an htraced outage these would otherwise be
+ * logged for every span.
+ */
+#define HTRACED_LOG_INTERVAL_MS 10000
+
 /**
  * The number of buffers used by htraced.
  */
 #define HTRACED_NUM_BUFS 2
 
+/**
+ * The size of the chunks which send buffers are made of, including the chunk
+ * header.  Spans which don't fit in a chunk get a chunk of their own.
+ */
+#define HTRACED_CHUNK_SIZE (256ULL * 1024ULL)
+
+/**
+ * The size of the slabs which chunks are carved out of.  This is the usual
+ * huge page size, so that a slab can be backed by a single huge page.
+ */
+#define HTRACED_SLAB_SIZE (2ULL * 1024ULL * 1024ULL)
+
+/**
+ * The number of chunks in a slab.
+ */
+#define HTRACED_CHUNKS_PER_SLAB (HTRACED_SLAB_SIZE / HTRACED_CHUNK_SIZE)
+
+/**
+ * The number of milliseconds that pooled chunks may go unused before we free
+ * them.
+ */
+#define HTRACED_CHUNK_IDLE_MS 60000ULL
+
+/**
+ * A chunk of serialized span data.
+ */
+struct htraced_chunk {
+    /**
+     * The next chunk in the send buffer or pool.
+     */
+    struct htraced_chunk *next;
+
+    /**
+     * Current offset within the chunk.
+     */
+    uint64_t off;
+
+    /**
+     * Length of the chunk.
+     */
+    uint64_t len;
+
+    /**
+     * The chunk data.  This field actually has size 'len,' not size 1.
+     */
+    char buf[1];
+};
+
+/**
+ * The number of data bytes in a chunk carved out of a slab.
+ */
+#define HTRACED_CHUNK_DATA_LEN \
+    (HTRACED_CHUNK_SIZE - offsetof(struct htraced_chunk, buf))
+
+/**
+ * A slab of memory which chunks are carved out of.
+ */
+struct htraced_slab {
+    /**
+     * The next slab.
+     */
+    struct htraced_slab *next;
+
+    /**
+     * The slab memory, allocated with bufmem_alloc.
+     */
+    void *mem;
+
+    /**
+     * The number of this slab's chunks which are in the pool.  Only valid
+     * while trimming the pool.
+     */
+    uint64_t num_pooled;
+};
+
 /**
  * An HTraced send buffer.
+ *
+ * Rather than allocating the whole buffer up front, we keep a list of chunks
+ * which are taken from the receiver's chunk pool as spans are added.  This
+ * keeps idle processes from paying for buffer space they never use.
  */
 struct htraced_sbuf {
     /**
-     * Current offset within the buffer.
+     * The number of bytes of span data in the buffer.
      */
     uint64_t off;
 
     /**
-     * Length of the buffer.
+     * The maximum number of bytes of span data the buffer may hold.
      */
     uint64_t len;
 
@@ -159,26 +257,95 @@ struct htraced_sbuf {
     uint64_t num_spans;
 
     /**
-     * The buffer data.  This field actually has size 'len,' not size 1.
+     * The sequence number of the first span in the buffer.  Only meaningful
+     * when num_spans is nonzero.
      */
-    char buf[1];
+    uint64_t first_seq;
+
+    /**
+     * The number of chunks in the buffer.
+     */
+    int num_chunks;
+
+    /**
+     * The first and last chunks in the buffer, or NULL if there are none.
+     */
+    struct htraced_chunk *head;
+    struct htraced_chunk *tail;
 };
 
-/*
- * A span receiver that writes spans to htraced.
+/**
+ * A request to be called back once the spans added to a transport up to a
+ * certain point have been sent.
  */
-struct htraced_rcv {
-    struct htrace_rcv base;
+struct htraced_flush_waiter {
+    /**
+     * The next waiter in the list.
+     */
+    struct htraced_flush_waiter *next;
 
     /**
-     * Nonzero if the receiver should shut down.
+     * We are done once every span with a sequence number below this one has
+     * been sent or given up on.
      */
-    int shutdown;
+    uint64_t target_seq;
 
     /**
-     * The htracer object associated with this receciver.
+     * The value of htraced_xprt_num_abandoned when the waiter was added.
      */
-    struct htracer *tracer;
+    uint64_t num_abandoned;
+
+    /**
+     * The callback and its argument.
+     */
+    void (*cb)(void *arg, int err);
+    void *arg;
+};
+
+/**
+ * A connection to an htraced daemon, shared by all the htraced receivers in
+ * the process which send to the same endpoint.
+ *
+ * Each transport has its own transmitter thread, HRPC client, send buffers and
+ * chunk pool.  It is configured by the receiver which creates it.  Receivers
+ * which come along later take a reference if they ask for the same settings,
+ * and otherwise start a transport of their own.
+ */
+struct htraced_xprt {
+    /**
+     * The next transport in g_htraced_xprts.
+     */
+    struct htraced_xprt *next;
+
+    /**
+     * The number of receivers using this transport.  Protected by
+     * g_htraced_xprts_lock.
+     */
+    int refcnt;
+
+    /**
+     * The endpoint, as configured.  This is the key we look transports up by.
+     * Malloced.
+     */
+    char *endpoint;
+
+    /**
+     * The tracer ID we send as the DefaultTrid of each WriteSpans request.
+     * This is the ID of the tracer which created the transport.  Spans from
+     * tracers with other IDs carry their own.  Malloced.
+     */
+    char *trid;
+
+    /**
+     * The log to use.  The transport may outlive the tracer which created it,
+     * so it can't borrow that tracer's log.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * Nonzero if the transport should shut down.
+     */
+    int shutdown;
 
     /**
      * Buffered span data becomes eligible to be sent even if there isn't much
@@ -198,11 +365,36 @@ struct htraced_rcv {
      */
     struct hrpc_client *hcli;
 
+    /**
+     * The write and read timeouts the HRPC client was created with.
+     */
+    uint64_t write_timeo_ms;
+    uint64_t read_timeo_ms;
+
     /**
      * The monotonic-clock time at which we last did a send operation.
      */
     uint64_t last_send_ms;
 
+    /**
+     * The sequence number to give the next span added to a send buffer.
+     * Spans are numbered in the order they are added, starting from 0.
+     */
+    uint64_t next_seq;
+
+    /**
+     * Someone is waiting for the spans with sequence numbers below this one
+     * to be sent.  Buffers holding any of those spans are sent without
+     * waiting for flush_interval_ms.
+     */
+    uint64_t flush_seq;
+
+    /**
+     * Asynchronous flush requests which haven't completed yet.  They are
+     * completed by the transmitter thread.
+     */
+    struct htraced_flush_waiter *waiters;
+
     /**
      * The index of the active buffer.
      */
@@ -211,7 +403,43 @@ struct htraced_rcv {
     /**
      * The two send buffers.
      */
-    struct htraced_sbuf *sbuf[HTRACED_NUM_BUFS];
+    struct htraced_sbuf sbuf[HTRACED_NUM_BUFS];
+
+    /**
+     * How to allocate slabs.
+     */
+    struct bufmem_opts mem_opts;
+
+    /**
+     * The CPUs to run the transmitter thread on, or NULL to let the
+     * scheduler decide.  Malloced.
+     */
+    char *xmit_cpus;
+
+    /**
+     * All the slabs we have allocated.
+     */
+    struct htraced_slab *slabs;
+
+    /**
+     * The total number of chunks in all the slabs.
+     */
+    uint64_t num_slab_chunks;
+
+    /**
+     * Chunks which are not in use by either send buffer.
+     */
+    struct htraced_chunk *pool;
+
+    /**
+     * The number of chunks in the pool.
+     */
+    uint64_t pool_len;
+
+    /**
+     * The monotonic-clock time at which a chunk was last taken from the pool.
+     */
+    uint64_t pool_last_used_ms;
 
     /**
      * Lock protecting the buffers from concurrent writes.
@@ -232,214 +460,988 @@ struct htraced_rcv {
      * Background transmitter thread.
      */
     pthread_t xmit_thread;
+
+    /**
+     * Nonzero once the transmitter thread has finished.  Protected by the
+     * lock.
+     */
+    int exited;
+
+    /**
+     * The monotonic-clock time by which the transport must be shut down, or
+     * 0 if there is no deadline.  Once the deadline passes, we stop trying to
+     * send spans.  Accessed atomically.
+     */
+    uint64_t deadline_ms;
+
+    /**
+     * The directory to write span data which couldn't be sent to, or NULL
+     * to drop it.  Malloced.
+     */
+    char *spill_dir;
+
+    /**
+     * The number of spill files written so far.  Accessed atomically.
+     */
+    uint64_t spill_seq;
+
+    /**
+     * The number of spans which couldn't be sent and were written to the
+     * spill directory.  Accessed atomically.
+     */
+    uint64_t num_spilled;
+
+    /**
+     * The number of spans which couldn't be sent and were dropped.  Accessed
+     * atomically.
+     */
+    uint64_t num_dropped;
 };
 
-void* run_htraced_xmit_manager(void *data);
-static int should_xmit(struct htraced_rcv *rcv, uint64_t now);
-static void htraced_xmit(struct htraced_rcv *rcv, uint64_t now);
+/*
+ * A span receiver that writes spans to htraced.
+ */
+struct htraced_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receciver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The transport we send spans through.
+     */
+    struct htraced_xprt *xprt;
+
+    /**
+     * Nonzero if our tracer ID differs from the transport's DefaultTrid, so
+     * that each span has to carry it.
+     */
+    int own_trid;
+};
+
+/**
+ * Lock protecting g_htraced_xprts and the transport reference counts.
+ */
+static pthread_mutex_t g_htraced_xprts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * All the transports in the process.
+ */
+static struct htraced_xprt *g_htraced_xprts;
 
-static int htraced_sbufs_empty(struct htraced_rcv *rcv)
+void* run_htraced_xmit_manager(void *data);
+static int should_xmit(struct htraced_xprt *xprt, uint64_t now);
+static void htraced_xmit(struct htraced_xprt *xprt, uint64_t now);
+static int htraced_past_deadline(struct htraced_xprt *xprt);
+static uint64_t htraced_xprt_num_abandoned(struct htraced_xprt *xprt);
+static void htraced_sbuf_abandon(struct htraced_xprt *xprt,
+                                 struct htraced_sbuf *sbuf);
+
+static int htraced_sbufs_empty(struct htraced_xprt *xprt)
 {
     int i;
     for (i = 0; i < HTRACED_NUM_BUFS; i++) {
-        if (rcv->sbuf[i]->off) {
+        if (xprt->sbuf[i].off) {
             return 0;
         }
     }
     return 1;
 }
 
-static struct htraced_sbuf *htraced_sbuf_alloc(uint64_t len)
+/**
+ * Get the sequence number of the oldest span which hasn't been sent or given
+ * up on yet.
+ *
+ * Every span with a lower sequence number is done.  This doesn't depend on the
+ * order in which the buffers are sent.
+ *
+ * This function must be called with the lock held.
+ */
+static uint64_t htraced_xprt_done_seq(struct htraced_xprt *xprt)
 {
-    struct htraced_sbuf *sbuf;
+    uint64_t done = xprt->next_seq;
+    int i;
 
-    // The final field of the htraced_sbuf structure is declared as having size
-    // 1, but really it has size 'len'.  This avoids a pointer dereference when
-    // accessing data in the sbuf.
-    sbuf = malloc(offsetof(struct htraced_sbuf, buf) + len);
-    if (!sbuf) {
-        return NULL;
+    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
+        if (xprt->sbuf[i].num_spans && (xprt->sbuf[i].first_seq < done)) {
+            done = xprt->sbuf[i].first_seq;
+        }
     }
-    sbuf->off = 0;
-    sbuf->len = len;
-    sbuf->num_spans = 0;
-    return sbuf;
+    return done;
 }
 
-static void htraced_sbuf_free(struct htraced_sbuf *sbuf)
+/**
+ * Ask the transmitter thread to send every span added so far.
+ *
+ * This function must be called with the lock held.
+ *
+ * @return              The sequence number which htraced_xprt_done_seq will
+ *                          reach once those spans are done.
+ */
+static uint64_t htraced_xprt_request_flush(struct htraced_xprt *xprt)
 {
-    free(sbuf);
-}
+    uint64_t target = xprt->next_seq;
 
-static uint64_t htraced_sbuf_remaining(const struct htraced_sbuf *sbuf)
-{
-    return sbuf->len - sbuf->off;
+    if (xprt->flush_seq < target) {
+        xprt->flush_seq = target;
+    }
+    pthread_cond_signal(&xprt->bg_cond);
+    return target;
 }
 
-static uint64_t htraced_get_bounded_u64(struct htrace_log *lg,
-                const struct htrace_conf *cnf, const char *prop,
-                uint64_t min, uint64_t max)
+/**
+ * Complete the asynchronous flush requests whose spans are all done.
+ *
+ * This function must be called with the lock held.  The lock is released while
+ * the callbacks run.
+ */
+static void htraced_xprt_run_waiters(struct htraced_xprt *xprt)
 {
-    uint64_t val = htrace_conf_get_u64(lg, cnf, prop);
-    if (val < min) {
-        htrace_log(lg, "htraced_rcv_create: can't set %s to %"PRId64
-                   ".  Using minimum value of %"PRId64 " instead.\n",
-                   prop, val, min);
-        return min;
-    } else if (val > max) {
-        htrace_log(lg, "htraced_rcv_create: can't set %s to %"PRId64
-                   ".  Using maximum value of %"PRId64 " instead.\n",
-                   prop, val, max);
-        return max;
+    struct htraced_flush_waiter *ready = NULL, *waiter, **prev;
+    uint64_t done, num_abandoned;
+
+    done = htraced_xprt_done_seq(xprt);
+    prev = &xprt->waiters;
+    while ((waiter = *prev)) {
+        if (waiter->target_seq <= done) {
+            // Waiters are added at the head of the list, so pushing the ready
+            // ones onto another list puts them back in the order they were
+            // added.
+            *prev = waiter->next;
+            waiter->next = ready;
+            ready = waiter;
+        } else {
+            prev = &waiter->next;
+        }
     }
-    return val;
+    if (!ready) {
+        return;
+    }
+    num_abandoned = htraced_xprt_num_abandoned(xprt);
+    pthread_mutex_unlock(&xprt->lock);
+    while (ready) {
+        waiter = ready;
+        ready = waiter->next;
+        waiter->cb(waiter->arg,
+                   (waiter->num_abandoned != num_abandoned) ? EIO : 0);
+        free(waiter);
+    }
+    pthread_mutex_lock(&xprt->lock);
 }
 
-static double htraced_get_bounded_double(struct htrace_log *lg,
-                const struct htrace_conf *cnf, const char *prop,
-                double min, double max)
+static void htraced_slabs_free(struct htraced_slab *slab)
 {
-    double val = htrace_conf_get_double(lg, cnf, prop);
-    if (val < min) {
-        htrace_log(lg, "htraced_rcv_create: can't set %s to %g"
-                   ".  Using minimum value of %g instead.\n",
-                   prop, val, min);
-        return min;
-    } else if (val > max) {
-        htrace_log(lg, "htraced_rcv_create: can't set %s to %g"
-                   ".  Using maximum value of %g instead.\n",
-                   prop, val, max);
-        return max;
+    struct htraced_slab *next;
+
+    while (slab) {
+        next = slab->next;
+        bufmem_free(slab->mem, HTRACED_SLAB_SIZE);
+        free(slab);
+        membudget_release(HTRACED_SLAB_SIZE);
+        slab = next;
     }
-    return val;
 }
 
-static struct htrace_rcv *htraced_rcv_create(struct htracer *tracer,
-                                             const struct htrace_conf *conf)
+/**
+ * Allocate a new slab and add its chunks to the pool.
+ *
+ * This function must be called with the lock held.
+ *
+ * @param xprt          The htraced transport.
+ * @param prefault      Nonzero if we are allocating ahead of need.  Such
+ *                          slabs may not put the memory budget under
+ *                          pressure.
+ *
+ * @return              0 on success; ENOMEM if we are out of memory, or the
+ *                          slab would exceed the memory budget.
+ */
+static int htraced_slab_add(struct htraced_xprt *xprt, int prefault)
 {
-    struct htraced_rcv *rcv;
-    const char *endpoint;
-    int i, ret;
-    uint64_t write_timeo_ms, read_timeo_ms, buf_len;
-    double send_fraction;
-
-    endpoint = htrace_conf_get(conf, HTRACED_ADDRESS_KEY);
-    if (!endpoint) {
-        htrace_log(tracer->lg, "htraced_rcv_create: no value found for %s. "
-                   "You must set this configuration key to the "
-                   "hostname:port identifying the htraced server.\n",
-                   HTRACED_ADDRESS_KEY);
-        goto error;
-    }
-    rcv = calloc(1, sizeof(*rcv));
-    if (!rcv) {
-        htrace_log(tracer->lg, "htraced_rcv_create: OOM while "
-                   "allocating htraced_rcv.\n");
-        goto error;
-    }
-    rcv->base.ty = &g_htraced_rcv_ty;
-    rcv->shutdown = 0;
-    rcv->tracer = tracer;
+    struct htraced_slab *slab;
+    struct htraced_chunk *chunk;
+    int i;
 
-    rcv->flush_interval_ms = htraced_get_bounded_u64(tracer->lg, conf,
-                HTRACED_FLUSH_INTERVAL_MS_KEY, HTRACED_FLUSH_INTERVAL_MS_MIN,
-                HTRACED_FLUSH_INTERVAL_MS_MAX);
-    write_timeo_ms = htraced_get_bounded_u64(tracer->lg, conf,
-                HTRACED_WRITE_TIMEO_MS_KEY, HTRACED_WRITE_TIMEO_MS_MIN,
-                0x7fffffffffffffffULL);
-    read_timeo_ms = htraced_get_bounded_u64(tracer->lg, conf,
-                HTRACED_READ_TIMEO_MS_KEY, HTRACED_READ_TIMEO_MS_MIN,
-                0x7fffffffffffffffULL);
-    rcv->hcli = hrpc_client_alloc(tracer->lg, write_timeo_ms,
-                                  read_timeo_ms, endpoint);
-    if (!rcv->hcli) {
-        goto error_free_rcv;
-    }
-    buf_len = htraced_get_bounded_u64(tracer->lg, conf,
-                HTRACED_BUFFER_SIZE_KEY, HTRACED_MIN_BUFFER_SIZE,
-                HTRACED_MAX_BUFFER_SIZE) / 2;
-    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
-        rcv->sbuf[i] = htraced_sbuf_alloc(buf_len);
-        if (!rcv->sbuf[i]) {
-            htrace_log(tracer->lg, "htraced_rcv_create: htraced_sbuf_alloc("
-                       "buf_len=%"PRId64") failed: OOM.\n", buf_len);
-            goto error_free_bufs;
+    if (prefault) {
+        if (!membudget_reserve_below_watermark(HTRACED_SLAB_SIZE)) {
+            return ENOMEM;
         }
+    } else if (!membudget_reserve(HTRACED_SLAB_SIZE)) {
+        return ENOMEM;
     }
-    send_fraction = htraced_get_bounded_double(tracer->lg, conf,
-                HTRACED_BUFFER_SEND_TRIGGER_FRACTION, 0.1, 1.0);
-    rcv->send_threshold = buf_len * send_fraction;
-    if (rcv->send_threshold > buf_len) {
-        rcv->send_threshold = buf_len;
+    slab = malloc(sizeof(*slab));
+    if (!slab) {
+        membudget_release(HTRACED_SLAB_SIZE);
+        return ENOMEM;
     }
-    rcv->last_send_ms = monotonic_now_ms(tracer->lg);
-    ret = pthread_mutex_init(&rcv->lock, NULL);
-    if (ret) {
-        htrace_log(tracer->lg, "htraced_rcv_create: pthread_mutex_init "
-                   "error %d: %s\n", ret, terror(ret));
-        goto error_free_bufs;
+    slab->mem = bufmem_alloc(xprt->lg, &xprt->mem_opts,
+                             HTRACED_SLAB_SIZE);
+    if (!slab->mem) {
+        free(slab);
+        membudget_release(HTRACED_SLAB_SIZE);
+        return ENOMEM;
     }
-    ret = pthread_cond_init(&rcv->bg_cond, NULL);
-    if (ret) {
-        htrace_log(tracer->lg, "htraced_rcv_create: pthread_cond_init("
-                   "bg_cond) error %d: %s\n", ret, terror(ret));
-        goto error_free_lock;
+    slab->next = xprt->slabs;
+    xprt->slabs = slab;
+    for (i = 0; i < HTRACED_CHUNKS_PER_SLAB; i++) {
+        chunk = (struct htraced_chunk *)
+            (((char*)slab->mem) + (i * HTRACED_CHUNK_SIZE));
+        chunk->off = 0;
+        chunk->len = HTRACED_CHUNK_DATA_LEN;
+        chunk->next = xprt->pool;
+        xprt->pool = chunk;
     }
-    ret = pthread_cond_init(&rcv->flush_cond, NULL);
+    xprt->num_slab_chunks += HTRACED_CHUNKS_PER_SLAB;
+    xprt->pool_len += HTRACED_CHUNKS_PER_SLAB;
+    return 0;
+}
+
+/**
+ * Get an empty chunk with room for at least len bytes.
+ *
+ * This function must be called with the lock held.
+ *
+ * @param xprt          The htraced transport.
+ * @param len           The number of bytes needed.
+ *
+ * @return              NULL on OOM or if the memory budget is exhausted; the
+ *                          chunk otherwise.
+ */
+static struct htraced_chunk *htraced_chunk_get(struct htraced_xprt *xprt,
+                                               uint64_t len)
+{
+    struct htraced_chunk *chunk;
+
+    if (len <= HTRACED_CHUNK_DATA_LEN) {
+        xprt->pool_last_used_ms = monotonic_now_ms(xprt->lg);
+        if ((!xprt->pool) && htraced_slab_add(xprt, 0)) {
+            return NULL;
+        }
+        chunk = xprt->pool;
+        xprt->pool = chunk->next;
+        xprt->pool_len--;
+        chunk->next = NULL;
+        return chunk;
+    }
+    // The final field of the htraced_chunk structure is declared as having
+    // size 1, but really it has size 'len'.  This avoids a pointer
+    // dereference when accessing data in the chunk.
+    if (!membudget_reserve(len)) {
+        return NULL;
+    }
+    chunk = malloc(offsetof(struct htraced_chunk, buf) + len);
+    if (!chunk) {
+        membudget_release(len);
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->off = 0;
+    chunk->len = len;
+    return chunk;
+}
+
+/**
+ * Empty a send buffer, returning its chunks to the pool.  Oversized chunks
+ * are freed rather than pooled.
+ *
+ * This function must be called with the lock held.
+ */
+static void htraced_sbuf_clear(struct htraced_xprt *xprt,
+                               struct htraced_sbuf *sbuf)
+{
+    struct htraced_chunk *chunk, *next;
+
+    for (chunk = sbuf->head; chunk; chunk = next) {
+        next = chunk->next;
+        if (chunk->len == HTRACED_CHUNK_DATA_LEN) {
+            chunk->off = 0;
+            chunk->next = xprt->pool;
+            xprt->pool = chunk;
+            xprt->pool_len++;
+        } else {
+            membudget_release(chunk->len);
+            free(chunk);
+        }
+    }
+    sbuf->head = NULL;
+    sbuf->tail = NULL;
+    sbuf->num_chunks = 0;
+    sbuf->off = 0;
+    sbuf->num_spans = 0;
+}
+
+/**
+ * Find the slab which a pooled chunk was carved out of.
+ */
+static struct htraced_slab *htraced_chunk_slab(struct htraced_xprt *xprt,
+                                               struct htraced_chunk *chunk)
+{
+    struct htraced_slab *slab;
+    char *mem;
+
+    for (slab = xprt->slabs; slab; slab = slab->next) {
+        mem = slab->mem;
+        if (((char*)chunk >= mem) && ((char*)chunk < mem + HTRACED_SLAB_SIZE)) {
+            return slab;
+        }
+    }
+    return NULL; // not reached
+}
+
+/**
+ * Free the slabs whose chunks are all in the pool, if the pool hasn't been
+ * used for a while, or right away if the memory budget is under pressure.
+ *
+ * This function must be called with the lock held.
+ */
+static void htraced_pool_trim(struct htraced_xprt *xprt)
+{
+    struct htraced_slab *slab, **prev_slab;
+    struct htraced_chunk *chunk, **prev;
+    uint64_t now;
+
+    if (!xprt->pool) {
+        return;
+    }
+    if (!membudget_under_pressure()) {
+        if (xprt->mem_opts.prefault != BUFMEM_PREFAULT_NONE) {
+            // The buffers were prefaulted so that we would never have to
+            // fault them in again.  Only give them back under pressure.
+            return;
+        }
+        // Read the clock here rather than taking the caller's time.  Callers
+        // may have dropped the lock to send since reading it, and producers
+        // may have used the pool in the meantime.
+        now = monotonic_now_ms(xprt->lg);
+        if ((xprt->pool_last_used_ms >= now) ||
+                (now - xprt->pool_last_used_ms < HTRACED_CHUNK_IDLE_MS)) {
+            return;
+        }
+    }
+    for (slab = xprt->slabs; slab; slab = slab->next) {
+        slab->num_pooled = 0;
+    }
+    for (chunk = xprt->pool; chunk; chunk = chunk->next) {
+        htraced_chunk_slab(xprt, chunk)->num_pooled++;
+    }
+    // Unlink the chunks of the slabs we are about to free from the pool.
+    prev = &xprt->pool;
+    while ((chunk = *prev)) {
+        if (htraced_chunk_slab(xprt, chunk)->num_pooled ==
+                HTRACED_CHUNKS_PER_SLAB) {
+            *prev = chunk->next;
+            xprt->pool_len--;
+        } else {
+            prev = &chunk->next;
+        }
+    }
+    prev_slab = &xprt->slabs;
+    while ((slab = *prev_slab)) {
+        if (slab->num_pooled == HTRACED_CHUNKS_PER_SLAB) {
+            *prev_slab = slab->next;
+            slab->next = NULL;
+            htraced_slabs_free(slab);
+            xprt->num_slab_chunks -= HTRACED_CHUNKS_PER_SLAB;
+        } else {
+            prev_slab = &slab->next;
+        }
+    }
+}
+
+static uint64_t htraced_sbuf_remaining(const struct htraced_sbuf *sbuf)
+{
+    return sbuf->len - sbuf->off;
+}
+
+static uint64_t htraced_get_bounded_u64(struct htrace_log *lg,
+                const struct htrace_conf *cnf, const char *prop,
+                uint64_t min, uint64_t max)
+{
+    uint64_t val = htrace_conf_get_u64(lg, cnf, prop);
+    if (val < min) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "htraced_xprt_create: can't set %s to %"PRId64
+                    ".  Using minimum value of %"PRId64 " instead.\n", prop,
+                    val, min);
+        return min;
+    } else if (val > max) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "htraced_xprt_create: can't set %s to %"PRId64
+                    ".  Using maximum value of %"PRId64 " instead.\n", prop,
+                    val, max);
+        return max;
+    }
+    return val;
+}
+
+static double htraced_get_bounded_double(struct htrace_log *lg,
+                const struct htrace_conf *cnf, const char *prop,
+                double min, double max)
+{
+    double val = htrace_conf_get_double(lg, cnf, prop);
+    if (val < min) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "htraced_xprt_create: can't set %s to %g"
+                    ".  Using minimum value of %g instead.\n", prop, val, min);
+        return min;
+    } else if (val > max) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "htraced_xprt_create: can't set %s to %g"
+                    ".  Using maximum value of %g instead.\n", prop, val, max);
+        return max;
+    }
+    return val;
+}
+
+/**
+ * Parse the buffer allocation options.
+ */
+static void htraced_get_mem_opts(struct htrace_log *lg,
+                const struct htrace_conf *cnf, struct bufmem_opts *opts)
+{
+    const char *str;
+    char *end;
+    long node;
+
+    opts->huge_pages = BUFMEM_HUGE_PAGES_NONE;
+    str = htrace_conf_get(cnf, HTRACED_BUFFER_HUGE_PAGES_KEY);
+    if (str) {
+        opts->huge_pages = bufmem_parse_huge_pages(str);
+        if (opts->huge_pages < 0) {
+            htrace_logl(lg, HTRACE_LOG_WARN,
+                        "htraced_xprt_create: unknown %s '%s'.  Valid "
+                        "values are: none, transparent, explicit.  Using "
+                        "none.\n", HTRACED_BUFFER_HUGE_PAGES_KEY, str);
+            opts->huge_pages = BUFMEM_HUGE_PAGES_NONE;
+        }
+    }
+    opts->prefault = BUFMEM_PREFAULT_NONE;
+    str = htrace_conf_get(cnf, HTRACED_BUFFER_PREFAULT_KEY);
+    if (str) {
+        opts->prefault = bufmem_parse_prefault(str);
+        if (opts->prefault < 0) {
+            htrace_logl(lg, HTRACE_LOG_WARN,
+                        "htraced_xprt_create: unknown %s '%s'.  Valid "
+                        "values are: none, populate, lock.  Using none.\n",
+                        HTRACED_BUFFER_PREFAULT_KEY, str);
+            opts->prefault = BUFMEM_PREFAULT_NONE;
+        }
+    }
+    opts->numa_node = -1;
+    str = htrace_conf_get(cnf, HTRACED_BUFFER_NUMA_NODE_KEY);
+    if (str && str[0]) {
+        errno = 0;
+        node = strtol(str, &end, 10);
+        if (errno || (*end != '\0') || (node < 0) || (node > INT32_MAX)) {
+            htrace_logl(lg, HTRACE_LOG_WARN,
+                        "htraced_xprt_create: invalid %s '%s'.  Using the "
+                        "default memory policy.\n",
+                        HTRACED_BUFFER_NUMA_NODE_KEY, str);
+        } else {
+            opts->numa_node = node;
+        }
+    }
+}
+
+/**
+ * Pin the calling thread to the CPUs in a list like "0-3,8".
+ */
+static void htraced_pin_thread(struct htrace_log *lg, const char *cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    const char *str = cpus;
+    char *end;
+    long lo, hi;
+    int ret;
+
+    CPU_ZERO(&set);
+    while (*str) {
+        lo = strtol(str, &end, 10);
+        if ((end == str) || (lo < 0) || (lo >= CPU_SETSIZE)) {
+            goto invalid;
+        }
+        hi = lo;
+        str = end;
+        if (*str == '-') {
+            str++;
+            hi = strtol(str, &end, 10);
+            if ((end == str) || (hi < lo) || (hi >= CPU_SETSIZE)) {
+                goto invalid;
+            }
+            str = end;
+        }
+        for (; lo <= hi; lo++) {
+            CPU_SET(lo, &set);
+        }
+        if (*str == ',') {
+            str++;
+        } else if (*str) {
+            goto invalid;
+        }
+    }
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "htraced_pin_thread: failed to pin the transmitter "
+                    "thread to CPUs %s: %s\n", cpus, terror(ret));
+    }
+    return;
+
+invalid:
+    htrace_logl(lg, HTRACE_LOG_WARN,
+                "htraced_pin_thread: invalid %s '%s'.  Not pinning the "
+                "transmitter thread.\n", HTRACED_XMIT_CPUS_KEY, cpus);
+#else
+    htrace_logl(lg, HTRACE_LOG_WARN,
+                "htraced_pin_thread: %s is not supported on this "
+                "platform.\n", HTRACED_XMIT_CPUS_KEY);
+#endif
+}
+
+/**
+ * The transport settings a receiver asks for.
+ */
+struct htraced_xprt_conf {
+    uint64_t flush_interval_ms;
+    uint64_t write_timeo_ms;
+    uint64_t read_timeo_ms;
+    uint64_t buf_len;
+    uint64_t send_threshold;
+    struct bufmem_opts mem_opts;
+
+    /**
+     * The CPUs to pin the transmitter thread to, or NULL.  Borrowed from the
+     * configuration.
+     */
+    const char *xmit_cpus;
+
+    /**
+     * The spill directory, or NULL.  Borrowed from the configuration.
+     */
+    const char *spill_dir;
+};
+
+/**
+ * Read the transport settings from a configuration.
+ */
+static void htraced_xprt_conf_read(struct htrace_log *lg,
+                const struct htrace_conf *conf, struct htraced_xprt_conf *xc)
+{
+    double send_fraction;
+
+    xc->flush_interval_ms = htraced_get_bounded_u64(lg, conf,
+                HTRACED_FLUSH_INTERVAL_MS_KEY, HTRACED_FLUSH_INTERVAL_MS_MIN,
+                HTRACED_FLUSH_INTERVAL_MS_MAX);
+    xc->write_timeo_ms = htraced_get_bounded_u64(lg, conf,
+                HTRACED_WRITE_TIMEO_MS_KEY, HTRACED_WRITE_TIMEO_MS_MIN,
+                0x7fffffffffffffffULL);
+    xc->read_timeo_ms = htraced_get_bounded_u64(lg, conf,
+                HTRACED_READ_TIMEO_MS_KEY, HTRACED_READ_TIMEO_MS_MIN,
+                0x7fffffffffffffffULL);
+    xc->buf_len = htraced_get_bounded_u64(lg, conf,
+                HTRACED_BUFFER_SIZE_KEY, HTRACED_MIN_BUFFER_SIZE,
+                HTRACED_MAX_BUFFER_SIZE) / 2;
+    htraced_get_mem_opts(lg, conf, &xc->mem_opts);
+    xc->xmit_cpus = htrace_conf_get(conf, HTRACED_XMIT_CPUS_KEY);
+    if (xc->xmit_cpus && !xc->xmit_cpus[0]) {
+        xc->xmit_cpus = NULL;
+    }
+    xc->spill_dir = htrace_conf_get(conf, HTRACED_SPILL_DIR_KEY);
+    if (xc->spill_dir && !xc->spill_dir[0]) {
+        xc->spill_dir = NULL;
+    }
+    send_fraction = htraced_get_bounded_double(lg, conf,
+                HTRACED_BUFFER_SEND_TRIGGER_FRACTION, 0.1, 1.0);
+    xc->send_threshold = xc->buf_len * send_fraction;
+    if (xc->send_threshold > xc->buf_len) {
+        xc->send_threshold = xc->buf_len;
+    }
+}
+
+static int htraced_str_eq(const char *a, const char *b)
+{
+    if ((!a) || (!b)) {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+/**
+ * Determine whether a transport was created with the given settings.
+ *
+ * These fields are never changed after the transport is created, so no lock
+ * is needed to read them.
+ */
+static int htraced_xprt_conf_matches(const struct htraced_xprt *xprt,
+                                     const struct htraced_xprt_conf *xc)
+{
+    return (xprt->flush_interval_ms == xc->flush_interval_ms) &&
+        (xprt->write_timeo_ms == xc->write_timeo_ms) &&
+        (xprt->read_timeo_ms == xc->read_timeo_ms) &&
+        (xprt->sbuf[0].len == xc->buf_len) &&
+        (xprt->send_threshold == xc->send_threshold) &&
+        (xprt->mem_opts.huge_pages == xc->mem_opts.huge_pages) &&
+        (xprt->mem_opts.prefault == xc->mem_opts.prefault) &&
+        (xprt->mem_opts.numa_node == xc->mem_opts.numa_node) &&
+        htraced_str_eq(xprt->xmit_cpus, xc->xmit_cpus) &&
+        htraced_str_eq(xprt->spill_dir, xc->spill_dir);
+}
+
+/**
+ * Create a new transport.
+ *
+ * @param tracer        The tracer whose receiver is creating the transport.
+ * @param conf          The configuration to use.
+ * @param xc            The transport settings, read from conf.
+ * @param endpoint      The htraced endpoint.
+ *
+ * @return              The new transport, with a reference count of 1, or
+ *                          NULL on error.
+ */
+static struct htraced_xprt *htraced_xprt_create(struct htracer *tracer,
+                const struct htrace_conf *conf,
+                const struct htraced_xprt_conf *xc, const char *endpoint)
+{
+    struct htraced_xprt *xprt;
+    int i, ret;
+    uint64_t buf_len = xc->buf_len;
+
+    xprt = calloc(1, sizeof(*xprt));
+    if (!xprt) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_create: OOM while "
+                    "allocating htraced_xprt.\n");
+        goto error;
+    }
+    xprt->refcnt = 1;
+    xprt->shutdown = 0;
+    xprt->endpoint = strdup(endpoint);
+    xprt->trid = strdup(tracer->trid);
+    if ((!xprt->endpoint) || (!xprt->trid)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_create: OOM while "
+                    "allocating htraced_xprt.\n");
+        goto error_free_strs;
+    }
+    xprt->lg = htrace_log_alloc(conf);
+    if (!xprt->lg) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_create: failed to allocate "
+                    "the log.\n");
+        goto error_free_strs;
+    }
+
+    xprt->flush_interval_ms = xc->flush_interval_ms;
+    xprt->write_timeo_ms = xc->write_timeo_ms;
+    xprt->read_timeo_ms = xc->read_timeo_ms;
+    xprt->hcli = hrpc_client_alloc(xprt->lg, xprt->write_timeo_ms,
+                                   xprt->read_timeo_ms, endpoint);
+    if (!xprt->hcli) {
+        goto error_free_log;
+    }
+    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
+        xprt->sbuf[i].len = buf_len;
+    }
+    xprt->mem_opts = xc->mem_opts;
+    if (xprt->mem_opts.prefault != BUFMEM_PREFAULT_NONE) {
+        // Allocate enough chunks to fill both buffers now, rather than while
+        // spans are being added.  Stop before the memory budget comes under
+        // pressure, since that would throttle new traces.
+        while (xprt->num_slab_chunks * HTRACED_CHUNK_DATA_LEN <
+                    HTRACED_NUM_BUFS * buf_len) {
+            if (htraced_slab_add(xprt, 1)) {
+                htrace_logl(xprt->lg, HTRACE_LOG_WARN,
+                            "htraced_xprt_create: only able to "
+                            "prefault %" PRId64 " of %" PRId64 " bytes of "
+                            "buffers.  The rest will be allocated on "
+                            "demand.\n",
+                            (uint64_t)(xprt->num_slab_chunks *
+                                       HTRACED_CHUNK_DATA_LEN),
+                            HTRACED_NUM_BUFS * buf_len);
+                break;
+            }
+        }
+    }
+    if (xc->xmit_cpus) {
+        xprt->xmit_cpus = strdup(xc->xmit_cpus);
+        if (!xprt->xmit_cpus) {
+            htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                        "htraced_xprt_create: OOM while "
+                        "allocating xmit_cpus.\n");
+            goto error_free_hcli;
+        }
+    }
+    if (xc->spill_dir) {
+        xprt->spill_dir = strdup(xc->spill_dir);
+        if (!xprt->spill_dir) {
+            htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                        "htraced_xprt_create: OOM while "
+                        "allocating spill_dir.\n");
+            goto error_free_hcli;
+        }
+    }
+    xprt->send_threshold = xc->send_threshold;
+    xprt->last_send_ms = monotonic_now_ms(xprt->lg);
+    ret = pthread_mutex_init(&xprt->lock, NULL);
     if (ret) {
-        htrace_log(tracer->lg, "htraced_rcv_create: pthread_cond_init("
-                   "flush_cond) error %d: %s\n", ret, terror(ret));
+        htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_create: pthread_mutex_init "
+                    "error %d: %s\n", ret, terror(ret));
+        goto error_free_hcli;
+    }
+    ret = monotonic_cond_init(&xprt->bg_cond);
+    if (ret) {
+        htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_create: pthread_cond_init("
+                    "bg_cond) error %d: %s\n", ret, terror(ret));
+        goto error_free_lock;
+    }
+    ret = monotonic_cond_init(&xprt->flush_cond);
+    if (ret) {
+        htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_create: pthread_cond_init("
+                    "flush_cond) error %d: %s\n", ret, terror(ret));
         goto error_free_bg_cond;
     }
-    ret = pthread_create(&rcv->xmit_thread, NULL, run_htraced_xmit_manager, rcv);
+    ret = pthread_create(&xprt->xmit_thread, NULL,
+                         run_htraced_xmit_manager, xprt);
     if (ret) {
-        htrace_log(tracer->lg, "htraced_rcv_create: failed to create xmit thread: "
-                   "error %d: %s\n", ret, terror(ret));
+        htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_create: failed to create xmit "
+                    "thread: error %d: %s\n", ret, terror(ret));
         goto error_free_flush_cond;
     }
-    htrace_log(tracer->lg, "Initialized htraced receiver for %s"
+    htrace_log(xprt->lg, "Initialized htraced transport for %s"
                 ", flush_interval_ms=%" PRId64 ", send_threshold=%" PRId64
                 ", write_timeo_ms=%" PRId64 ", read_timeo_ms=%" PRId64
-                ", buf_len=%" PRId64 ".\n", hrpc_client_get_endpoint(rcv->hcli),
-                rcv->flush_interval_ms, rcv->send_threshold,
-                write_timeo_ms, read_timeo_ms, buf_len);
-    return (struct htrace_rcv*)rcv;
+                ", buf_len=%" PRId64 ", huge_pages=%d, prefault=%d"
+                ", numa_node=%d.\n", hrpc_client_get_endpoint(xprt->hcli),
+                xprt->flush_interval_ms, xprt->send_threshold,
+                xprt->write_timeo_ms, xprt->read_timeo_ms, buf_len,
+                xprt->mem_opts.huge_pages, xprt->mem_opts.prefault,
+                xprt->mem_opts.numa_node);
+    return xprt;
 
 error_free_flush_cond:
-    pthread_cond_destroy(&rcv->flush_cond);
+    pthread_cond_destroy(&xprt->flush_cond);
 error_free_bg_cond:
-    pthread_cond_destroy(&rcv->bg_cond);
+    pthread_cond_destroy(&xprt->bg_cond);
 error_free_lock:
-    pthread_mutex_destroy(&rcv->lock);
-error_free_bufs:
-    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
-        htraced_sbuf_free(rcv->sbuf[i]);
-    }
-    hrpc_client_free(rcv->hcli);
-error_free_rcv:
-    free(rcv);
+    pthread_mutex_destroy(&xprt->lock);
+error_free_hcli:
+    htraced_slabs_free(xprt->slabs);
+    free(xprt->xmit_cpus);
+    free(xprt->spill_dir);
+    hrpc_client_free(xprt->hcli);
+error_free_log:
+    htrace_log_free(xprt->lg);
+error_free_strs:
+    free(xprt->endpoint);
+    free(xprt->trid);
+    free(xprt);
 error:
     return NULL;
 }
 
+/**
+ * Get the number of spans which the transport has given up on.
+ */
+static uint64_t htraced_xprt_num_abandoned(struct htraced_xprt *xprt)
+{
+    return __atomic_load_n(&xprt->num_spilled, __ATOMIC_RELAXED) +
+        __atomic_load_n(&xprt->num_dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * Shut down a transport, sending whatever is still buffered, and free it.
+ *
+ * The transport must already have been removed from g_htraced_xprts.
+ *
+ * @param xprt          The transport.
+ * @param deadline_ms   The monotonic-clock time by which we must be done, or
+ *                          0 to keep trying to send for as long as it takes.
+ *
+ * @return              The number of buffered spans which couldn't be sent.
+ */
+static uint64_t htraced_xprt_free(struct htraced_xprt *xprt,
+                                  uint64_t deadline_ms)
+{
+    struct htrace_log *lg = xprt->lg;
+    struct timespec deadline_ts;
+    uint64_t num_abandoned;
+    int i, ret;
+
+    htrace_log(lg, "Shutting down htraced transport for %s\n",
+               hrpc_client_get_endpoint(xprt->hcli));
+    num_abandoned = htraced_xprt_num_abandoned(xprt);
+    pthread_mutex_lock(&xprt->lock);
+    xprt->shutdown = 1;
+    __atomic_store_n(&xprt->deadline_ms, deadline_ms, __ATOMIC_RELAXED);
+    pthread_cond_signal(&xprt->bg_cond);
+    if (deadline_ms) {
+        ms_to_timespec(deadline_ms, &deadline_ts);
+        while (!xprt->exited) {
+            ret = pthread_cond_timedwait(&xprt->flush_cond, &xprt->lock,
+                                         &deadline_ts);
+            if (ret == ETIMEDOUT) {
+                // Unblock the transmitter thread if it is waiting on the
+                // network.  It will see that the deadline has passed and
+                // give up on the rest of the spans.
+                hrpc_client_interrupt(xprt->hcli);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&xprt->lock);
+    ret = pthread_join(xprt->xmit_thread, NULL);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_free: pthread_join "
+                    "error %d: %s\n", ret, terror(ret));
+    }
+    num_abandoned = htraced_xprt_num_abandoned(xprt) - num_abandoned;
+    if (xprt->num_spilled || xprt->num_dropped) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "htraced_xprt_free: over the life of the transport, "
+                    "%" PRId64 " span(s) which couldn't be sent were spilled "
+                    "to disk, and %" PRId64 " were dropped.\n",
+                    xprt->num_spilled, xprt->num_dropped);
+    }
+    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
+        htraced_sbuf_clear(xprt, &xprt->sbuf[i]);
+    }
+    htraced_slabs_free(xprt->slabs);
+    free(xprt->xmit_cpus);
+    free(xprt->spill_dir);
+    hrpc_client_free(xprt->hcli);
+    ret = pthread_mutex_destroy(&xprt->lock);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_free: pthread_mutex_destroy "
+                    "error %d: %s\n", ret, terror(ret));
+    }
+    ret = pthread_cond_destroy(&xprt->bg_cond);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_free: pthread_cond_destroy(bg_cond) "
+                    "error %d: %s\n", ret, terror(ret));
+    }
+    ret = pthread_cond_destroy(&xprt->flush_cond);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "htraced_xprt_free: pthread_cond_destroy(flush_cond) "
+                    "error %d: %s\n", ret, terror(ret));
+    }
+    free(xprt->endpoint);
+    free(xprt->trid);
+    free(xprt);
+    htrace_log_free(lg);
+    return num_abandoned;
+}
+
+static struct htrace_rcv *htraced_rcv_create(struct htracer *tracer,
+                                             const struct htrace_conf *conf)
+{
+    struct htraced_rcv *rcv;
+    struct htraced_xprt *xprt;
+    struct htraced_xprt_conf xc;
+    const char *endpoint;
+    int stale = 0;
+
+    endpoint = htrace_conf_get(conf, HTRACED_ADDRESS_KEY);
+    if (!endpoint) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htraced_rcv_create: no value found for %s. "
+                    "You must set this configuration key to the "
+                    "hostname:port identifying the htraced server.\n",
+                    HTRACED_ADDRESS_KEY);
+        return NULL;
+    }
+    rcv = calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "htraced_rcv_create: OOM while "
+                    "allocating htraced_rcv.\n");
+        return NULL;
+    }
+    rcv->base.ty = &g_htraced_rcv_ty;
+    rcv->tracer = tracer;
+    htraced_xprt_conf_read(tracer->lg, conf, &xc);
+
+    // Share a transport only if it has the settings we want.  Otherwise, for
+    // example when htracer_reconfigure changes them, start a new one.  The
+    // old transport stays around until its last receiver is freed.
+    pthread_mutex_lock(&g_htraced_xprts_lock);
+    for (xprt = g_htraced_xprts; xprt; xprt = xprt->next) {
+        if (strcmp(xprt->endpoint, endpoint) == 0) {
+            if (htraced_xprt_conf_matches(xprt, &xc)) {
+                break;
+            }
+            stale = 1;
+        }
+    }
+    if (xprt) {
+        xprt->refcnt++;
+        htrace_log(tracer->lg, "htraced_rcv_create: sharing the existing "
+                   "transport for %s.\n", endpoint);
+    } else {
+        if (stale) {
+            htrace_log(tracer->lg, "htraced_rcv_create: the existing "
+                       "transport for %s has different settings.  Starting "
+                       "a new one.\n", endpoint);
+        }
+        xprt = htraced_xprt_create(tracer, conf, &xc, endpoint);
+        if (!xprt) {
+            pthread_mutex_unlock(&g_htraced_xprts_lock);
+            free(rcv);
+            return NULL;
+        }
+        xprt->next = g_htraced_xprts;
+        g_htraced_xprts = xprt;
+    }
+    pthread_mutex_unlock(&g_htraced_xprts_lock);
+    rcv->xprt = xprt;
+    rcv->own_trid = (strcmp(xprt->trid, tracer->trid) != 0);
+    return (struct htrace_rcv*)rcv;
+}
+
 void* run_htraced_xmit_manager(void *data)
 {
-    struct htraced_rcv *rcv = data;
-    struct htrace_log *lg = rcv->tracer->lg;
+    struct htraced_xprt *xprt = data;
+    struct htrace_log *lg = xprt->lg;
     uint64_t now, wakeup;
     struct timespec wakeup_ts;
-    int ret;
+    int i, ret;
 
-    pthread_mutex_lock(&rcv->lock);
+    if (xprt->xmit_cpus) {
+        htraced_pin_thread(lg, xprt->xmit_cpus);
+    }
+    pthread_mutex_lock(&xprt->lock);
     while (1) {
         now = monotonic_now_ms(lg);
-        while (should_xmit(rcv, now)) {
-            htraced_xmit(rcv, now);
+        while (should_xmit(xprt, now)) {
+            htraced_xmit(xprt, now);
+            htraced_xprt_run_waiters(xprt);
         }
-        if (rcv->shutdown) {
-            while (!htraced_sbufs_empty(rcv)) {
-                htraced_xmit(rcv, now);
+        htraced_xprt_run_waiters(xprt);
+        htraced_pool_trim(xprt);
+        if (xprt->shutdown) {
+            while (!htraced_sbufs_empty(xprt)) {
+                if (htraced_past_deadline(xprt)) {
+                    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
+                        htraced_sbuf_abandon(xprt, &xprt->sbuf[i]);
+                        htraced_sbuf_clear(xprt, &xprt->sbuf[i]);
+                    }
+                    break;
+                }
+                htraced_xmit(xprt, now);
             }
+            // Every span is done now, so this completes all the waiters.
+            htraced_xprt_run_waiters(xprt);
+            xprt->exited = 1;
+            pthread_cond_broadcast(&xprt->flush_cond);
             break;
         }
         // Wait for one of a few things to happen:
@@ -448,15 +1450,16 @@ void* run_htraced_xmit_manager(void *data)
         //      because of send_timeo_ms.
         // * A writer to signal that we should wake up because enough bytes are
         //      buffered.
-        wakeup = now + (rcv->flush_interval_ms / 2);
+        wakeup = now + (xprt->flush_interval_ms / 2);
         ms_to_timespec(wakeup, &wakeup_ts);
-        ret = pthread_cond_timedwait(&rcv->bg_cond, &rcv->lock, &wakeup_ts);
+        ret = pthread_cond_timedwait(&xprt->bg_cond, &xprt->lock, &wakeup_ts);
         if ((ret != 0) && (ret != ETIMEDOUT)) {
-            htrace_log(lg, "run_htraced_xmit_manager: pthread_cond_timedwait "
-                       "error: %d (%s)\n", ret, terror(ret));
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "run_htraced_xmit_manager: pthread_cond_timedwait "
+                        "error: %d (%s)\n", ret, terror(ret));
         }
     }
-    pthread_mutex_unlock(&rcv->lock);
+    pthread_mutex_unlock(&xprt->lock);
     htrace_log(lg, "run_htraced_xmit_manager: shutting down the transmission "
                "manager thread.\n");
     return NULL;
@@ -466,20 +1469,25 @@ void* run_htraced_xmit_manager(void *data)
  * Determine if the xmit manager should send.
  * This function must be called with the lock held.
  *
- * @param rcv           The htraced receiver.
+ * @param xprt          The htraced transport.
  * @param now           The current time in milliseconds.
  *
  * @return              nonzero if we should send now.
  */
-static int should_xmit(struct htraced_rcv *rcv, uint64_t now)
+static int should_xmit(struct htraced_xprt *xprt, uint64_t now)
 {
-    uint64_t off = rcv->sbuf[rcv->active_buf]->off;
+    const struct htraced_sbuf *sbuf = &xprt->sbuf[xprt->active_buf];
+    uint64_t off = sbuf->off;
 
-    if (off > rcv->send_threshold) {
+    if (off > xprt->send_threshold) {
         // We have buffered a lot of bytes, so let's send.
         return 1;
     }
-    if (now - rcv->last_send_ms > rcv->flush_interval_ms) {
+    if (sbuf->num_spans && (sbuf->first_seq < xprt->flush_seq)) {
+        // Someone is waiting for spans in this buffer to be sent.
+        return 1;
+    }
+    if (now - xprt->last_send_ms > xprt->flush_interval_ms) {
         // It's been too long since the last transmission, so let's send.
         if (off > 0) {
             return 1;
@@ -496,7 +1504,7 @@ static int should_xmit(struct htraced_rcv *rcv, uint64_t now)
 /**
  * Write the prequel to the WriteSpans message.
  */
-static int add_writespans_prequel(struct htraced_rcv *rcv,
+static int add_writespans_prequel(struct htraced_xprt *xprt,
                                   struct htraced_sbuf *sbuf, uint8_t *prequel)
 {
     struct cmp_bcopy_ctx bctx;
@@ -508,7 +1516,7 @@ static int add_writespans_prequel(struct htraced_rcv *rcv,
     if (!cmp_write_fixstr(ctx, DEFAULT_TRID_STR, DEFAULT_TRID_STR_LEN)) {
         return -1;
     }
-    if (!cmp_write_str(ctx, rcv->tracer->trid, strlen(rcv->tracer->trid))) {
+    if (!cmp_write_str(ctx, xprt->trid, strlen(xprt->trid))) {
         return -1;
     }
     if (!cmp_write_fixstr(ctx, NUM_SPANS_STR, NUM_SPANS_STR_LEN)) {
@@ -520,210 +1528,578 @@ static int add_writespans_prequel(struct htraced_rcv *rcv,
     return bctx.off;
 }
 
+/**
+ * Get the buffers which make up the WriteSpans request body for a send
+ * buffer.
+ *
+ * @param xprt          The htraced transport.
+ * @param sbuf          The send buffer.
+ * @param prequel       A buffer of MAX_WRITESPANS_PREQUEL_LEN bytes to write
+ *                          the prequel to.
+ *
+ * @return              A malloced array of sbuf->num_chunks + 1 buffers, or
+ *                          NULL on error.
+ */
+static struct iovec *htraced_sbuf_iov(struct htraced_xprt *xprt,
+                                      struct htraced_sbuf *sbuf,
+                                      uint8_t *prequel)
+{
+    struct htraced_chunk *chunk;
+    struct iovec *iov;
+    int i, prequel_len;
+
+    iov = malloc(sizeof(*iov) * (sbuf->num_chunks + 1));
+    if (!iov) {
+        htrace_logl(xprt->lg, HTRACE_LOG_ERROR, "htraced_sbuf_iov: OOM\n");
+        return NULL;
+    }
+    prequel_len = add_writespans_prequel(xprt, sbuf, prequel);
+    if (prequel_len < 0) {
+        htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                    "htraced_sbuf_iov: add_writespans_prequel "
+                    "failed.\n");
+        free(iov);
+        return NULL;
+    }
+    iov[0].iov_base = prequel;
+    iov[0].iov_len = prequel_len;
+    for (i = 1, chunk = sbuf->head; chunk; i++, chunk = chunk->next) {
+        iov[i].iov_base = chunk->buf;
+        iov[i].iov_len = chunk->off;
+    }
+    return iov;
+}
+
 /**
  * Send all the spans which we have buffered.
  *
- * @param rcv           The htraced receiver.
+ * @param xprt          The htraced transport.
  * @param sbuf          The span buffer to send.
  *
  * @return              1 on success; 0 otherwise.
  */
-static int htraced_xmit_impl(struct htraced_rcv *rcv, struct htraced_sbuf *sbuf)
+static int htraced_xmit_impl(struct htraced_xprt *xprt, struct htraced_sbuf *sbuf)
 {
-    struct htrace_log *lg = rcv->tracer->lg;
+    struct htrace_log *lg = xprt->lg;
     uint8_t prequel[MAX_WRITESPANS_PREQUEL_LEN];
-    int prequel_len, ret;
+    struct iovec *iov;
+    int ret;
     char *err = NULL, *resp = NULL;
     size_t resp_len = 0;
 
-    prequel_len = add_writespans_prequel(rcv, sbuf, prequel);
-    if (prequel_len < 0) {
-        htrace_log(lg, "htrace_xmit_impl: add_writespans_prequel failed.\n");
-        ret = 0;
-        goto done;
+    iov = htraced_sbuf_iov(xprt, sbuf, prequel);
+    if (!iov) {
+        return 0;
     }
-    ret = hrpc_client_call(rcv->hcli, METHOD_ID_WRITE_SPANS,
-                    prequel, prequel_len, sbuf->buf, sbuf->off,
+    ret = hrpc_client_call(xprt->hcli, METHOD_ID_WRITE_SPANS,
+                    iov, sbuf->num_chunks + 1,
                     &err, (void**)&resp, &resp_len);
     if (!ret) {
-        htrace_log(lg, "htrace_xmit_impl: hrpc_client_call failed.\n");
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "htrace_xmit_impl: hrpc_client_call failed.\n");
         goto done;
     } else if (err) {
-        htrace_log(lg, "htrace_xmit_impl: server returned error: %s\n", err);
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "htrace_xmit_impl: server returned error: %s\n", err);
         ret = 0;
         goto done;
     }
     ret = 1;
 done:
+    free(iov);
     free(err);
     free(resp);
     return ret;
 }
 
-static void htraced_xmit(struct htraced_rcv *rcv, uint64_t now)
+/**
+ * Determine if the shutdown deadline has passed.
+ */
+static int htraced_past_deadline(struct htraced_xprt *xprt)
+{
+    uint64_t deadline_ms;
+
+    deadline_ms = __atomic_load_n(&xprt->deadline_ms, __ATOMIC_RELAXED);
+    return deadline_ms && (monotonic_now_ms(xprt->lg) >= deadline_ms);
+}
+
+/**
+ * Write the contents of a send buffer to a new file in the spill directory.
+ *
+ * The file holds the body of the WriteSpans request we would have sent.
+ *
+ * @return              1 on success; 0 otherwise.
+ */
+static int htraced_sbuf_spill(struct htraced_xprt *xprt,
+                              struct htraced_sbuf *sbuf)
+{
+    uint8_t prequel[MAX_WRITESPANS_PREQUEL_LEN];
+    struct iovec *iov;
+    char *path = NULL;
+    const char *buf;
+    size_t rem;
+    ssize_t res;
+    int i, fd = -1, ret = 0, err;
+
+    iov = htraced_sbuf_iov(xprt, sbuf, prequel);
+    if (!iov) {
+        goto done;
+    }
+    if (asprintf(&path, "%s/htraced-%lld-%" PRId64 ".spill", xprt->spill_dir,
+                 (long long)getpid(), __atomic_fetch_add(&xprt->spill_seq, 1,
+                 __ATOMIC_RELAXED)) < 0) {
+        path = NULL;
+        htrace_logl(xprt->lg, HTRACE_LOG_ERROR, "htraced_sbuf_spill: OOM\n");
+        goto done;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        err = errno;
+        htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                    "htraced_sbuf_spill: failed to create %s: "
+                    "error %d (%s)\n", path, err, terror(err));
+        goto done;
+    }
+    for (i = 0; i < sbuf->num_chunks + 1; i++) {
+        buf = iov[i].iov_base;
+        rem = iov[i].iov_len;
+        while (rem > 0) {
+            res = write(fd, buf, rem);
+            if (res < 0) {
+                err = errno;
+                if (err == EINTR) {
+                    continue;
+                }
+                htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                            "htraced_sbuf_spill: error writing "
+                            "%s: error %d (%s)\n", path, err, terror(err));
+                goto done;
+            }
+            buf += res;
+            rem -= res;
+        }
+    }
+    if (close(fd) < 0) {
+        err = errno;
+        fd = -1;
+        htrace_logl(xprt->lg, HTRACE_LOG_ERROR,
+                    "htraced_sbuf_spill: error closing %s: "
+                    "error %d (%s)\n", path, err, terror(err));
+        goto done;
+    }
+    fd = -1;
+    ret = 1;
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if ((!ret) && path) {
+        unlink(path);
+    }
+    free(path);
+    free(iov);
+    return ret;
+}
+
+/**
+ * Give up on sending the spans in a send buffer.  They are written to the
+ * spill directory if there is one, and dropped otherwise.
+ *
+ * This function may be called with or without the lock held.  The caller
+ * is responsible for clearing the buffer afterwards.
+ */
+static void htraced_sbuf_abandon(struct htraced_xprt *xprt,
+                                 struct htraced_sbuf *sbuf)
 {
-    int tries = 0;
+    if (!sbuf->num_spans) {
+        return;
+    }
+    if (xprt->spill_dir && htraced_sbuf_spill(xprt, sbuf)) {
+        __atomic_add_fetch(&xprt->num_spilled, sbuf->num_spans,
+                           __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&xprt->num_dropped, sbuf->num_spans, __ATOMIC_RELAXED);
+    HTRACE_LOG_RATE_LIMITED(xprt->lg, HTRACE_LOG_WARN,
+               HTRACED_LOG_INTERVAL_MS, "htraced_sbuf_abandon(%s): dropped "
+               "%" PRId64 " span(s) which couldn't be sent.\n",
+               hrpc_client_get_endpoint(xprt->hcli), sbuf->num_spans);
+}
+
+static void htraced_xmit(struct htraced_xprt *xprt, uint64_t now)
+{
+    int tries = 0, success;
     struct htraced_sbuf *sbuf;
 
     // Flip to the other buffer.
-    sbuf = rcv->sbuf[rcv->active_buf];
-    rcv->active_buf = !rcv->active_buf;
+    sbuf = &xprt->sbuf[xprt->active_buf];
+    xprt->active_buf = !xprt->active_buf;
 
     // Release the lock while doing network I/O, so that we don't block threads
     // adding spans.
-    pthread_mutex_unlock(&rcv->lock);
+    pthread_mutex_unlock(&xprt->lock);
     while (1) {
-        int retry, success = htraced_xmit_impl(rcv, sbuf);
+        int retry;
+        success = htraced_xmit_impl(xprt, sbuf);
         if (success) {
             break;
         }
         tries++;
-        retry = (tries < HTRACED_MAX_SEND_TRIES);
-        htrace_log(rcv->tracer->lg, "htraced_xmit(%s) failed on try %d.  %s\n",
-                   hrpc_client_get_endpoint(rcv->hcli), tries,
+        retry = (tries < HTRACED_MAX_SEND_TRIES) &&
+            (!htraced_past_deadline(xprt));
+        HTRACE_LOG_RATE_LIMITED(xprt->lg, HTRACE_LOG_WARN,
+                   HTRACED_LOG_INTERVAL_MS, "htraced_xmit(%s) failed on try "
+                   "%d.  %s\n", hrpc_client_get_endpoint(xprt->hcli), tries,
                    (retry ? "Retrying after a delay." : "Giving up."));
         if (!retry) {
+            htraced_sbuf_abandon(xprt, sbuf);
             break;
         }
     }
-    sbuf->off = 0;
-    sbuf->num_spans = 0;
-    pthread_mutex_lock(&rcv->lock);
-    rcv->last_send_ms = now;
-    pthread_cond_broadcast(&rcv->flush_cond);
+    HTRACE_PROBE3(htraced__xmit, sbuf->num_spans, sbuf->off, success);
+    pthread_mutex_lock(&xprt->lock);
+    htraced_sbuf_clear(xprt, sbuf);
+    htraced_pool_trim(xprt);
+    xprt->last_send_ms = now;
+    pthread_cond_broadcast(&xprt->flush_cond);
 }
 
-static void htraced_rcv_add_span(struct htrace_rcv *r,
-                                 struct htrace_span *span)
+/**
+ * Find enough space in the active buffer to hold a serialized span.
+ *
+ * This function must be called with the lock held.  It may release and
+ * re-acquire the lock while waiting for the transmitter thread to free up
+ * some space, but the lock will always be held when it returns.
+ *
+ * @param xprt          The htraced transport.
+ * @param msgpack_len   The number of bytes we need.
+ *
+ * @return              The active buffer, if it has enough space; NULL if we
+ *                          gave up waiting for space or ran out of memory.
+ *                          The last chunk of the buffer will have at least
+ *                          msgpack_len bytes free.
+ */
+static struct htraced_sbuf *htraced_xprt_get_space(struct htraced_xprt *xprt,
+                                                  uint64_t msgpack_len)
 {
-    int tries, retry;
-    uint64_t rem, off;
-    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
+    int tries = 0, retry;
+    uint64_t rem;
     struct htraced_sbuf *sbuf;
-    struct htrace_log *lg = rcv->tracer->lg;
-    struct cmp_counter_ctx cctx;
-    struct cmp_bcopy_ctx bctx;
-    uint64_t msgpack_len;
+    struct htraced_chunk *chunk;
 
-    // Determine the length of the span when serialized to msgpack.
-    cmp_counter_ctx_init(&cctx);
-    if (!span_write_msgpack(span, (cmp_ctx_t*)&cctx)) {
-        htrace_log(lg, "htraced_rcv_add_span: span_write_msgpack failed.\n");
-        return;
-    }
-    msgpack_len = cctx.count;
-
-    // Try to get enough space in the current buffer.
-    tries = 0;
-    do {
-        pthread_mutex_lock(&rcv->lock);
-        sbuf = rcv->sbuf[rcv->active_buf];
+    while (1) {
+        sbuf = &xprt->sbuf[xprt->active_buf];
         rem = htraced_sbuf_remaining(sbuf);
-        if (rem < msgpack_len) {
-            pthread_cond_signal(&rcv->bg_cond);
-            pthread_mutex_unlock(&rcv->lock);
-            tries++;
-            retry = tries < HTRACED_MAX_ADD_TRIES;
-            htrace_log(lg, "htraced_rcv_add_span: not enough space in the "
-                           "current buffer.  Have %" PRId64 ", need %"
-                           PRId64 ".  %s...\n", rem, msgpack_len,
-                           (retry ? "Retrying" : "Giving up"));
-            if (retry) {
-                pthread_yield();
-                continue;
+        if (rem >= msgpack_len) {
+            chunk = sbuf->tail;
+            if (chunk && (chunk->len - chunk->off >= msgpack_len)) {
+                return sbuf;
             }
-            pthread_mutex_unlock(&rcv->lock);
-            return;
+            chunk = htraced_chunk_get(xprt, msgpack_len);
+            if (!chunk) {
+                HTRACE_LOG_RATE_LIMITED(xprt->lg, HTRACE_LOG_WARN,
+                           HTRACED_LOG_INTERVAL_MS, "htraced_rcv_add_span: "
+                           "unable to allocate a chunk of at least %" PRId64
+                           " bytes: out of memory, or over the tracing "
+                           "memory budget.\n", msgpack_len);
+                return NULL;
+            }
+            if (sbuf->tail) {
+                sbuf->tail->next = chunk;
+            } else {
+                sbuf->head = chunk;
+            }
+            sbuf->tail = chunk;
+            sbuf->num_chunks++;
+            return sbuf;
+        }
+        pthread_cond_signal(&xprt->bg_cond);
+        pthread_mutex_unlock(&xprt->lock);
+        tries++;
+        retry = tries < HTRACED_MAX_ADD_TRIES;
+        HTRACE_LOG_RATE_LIMITED(xprt->lg, HTRACE_LOG_WARN,
+                   HTRACED_LOG_INTERVAL_MS, "htraced_rcv_add_span: not "
+                   "enough space in the current buffer.  Have %" PRId64
+                   ", need %" PRId64 ".  %s...\n", rem, msgpack_len,
+                   (retry ? "Retrying" : "Giving up"));
+        if (retry) {
+            pthread_yield();
         }
-    } while (0);
-    // OK, now we have the lock, and we know that there is enough space in the
-    // current buffer.
-    off = sbuf->off;
-    cmp_bcopy_ctx_init(&bctx, sbuf->buf + off, msgpack_len);
+        pthread_mutex_lock(&xprt->lock);
+        if (!retry) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Serialize a span into a send buffer.
+ *
+ * This function must be called with the lock held.
+ *
+ * @param xprt          The htraced transport.
+ * @param sbuf          The send buffer.  Its last chunk must have at least
+ *                          msgpack_len bytes remaining.
+ * @param span          The span to serialize.
+ * @param msgpack_len   The serialized length of the span.
+ */
+static void htraced_sbuf_append(struct htraced_xprt *xprt,
+                                struct htraced_sbuf *sbuf,
+                                struct htrace_span *span,
+                                uint64_t msgpack_len)
+{
+    struct cmp_bcopy_ctx bctx;
+    struct htraced_chunk *chunk = sbuf->tail;
+    uint64_t off;
+
+    cmp_bcopy_ctx_init(&bctx, chunk->buf + chunk->off, msgpack_len);
     bctx.base.write = cmp_bcopy_write_nocheck_fn;
     span_write_msgpack(span, (cmp_ctx_t*)&bctx);
-    off += msgpack_len;
+    chunk->off += msgpack_len;
+    off = sbuf->off + msgpack_len;
     sbuf->off = off;
+    if (!sbuf->num_spans) {
+        sbuf->first_seq = xprt->next_seq;
+    }
     sbuf->num_spans++;
-    if (off > rcv->send_threshold) {
-        pthread_cond_signal(&rcv->bg_cond);
+    xprt->next_seq++;
+    if (off > xprt->send_threshold) {
+        pthread_cond_signal(&xprt->bg_cond);
     }
-    pthread_mutex_unlock(&rcv->lock);
 }
 
-static void htraced_rcv_flush(struct htrace_rcv *r)
+/**
+ * Get the serialized length of a span.
+ *
+ * If the span doesn't come from the tracer whose ID the transport sends as
+ * the DefaultTrid, it has to carry its own tracer ID.  We set it on the span
+ * for as long as we need it, which is until the span has been serialized.
+ *
+ * @param rcv           The htraced receiver.
+ * @param span          The span.
+ *
+ * @return              The serialized length, or 0 if the span couldn't be
+ *                          serialized.
+ */
+static uint64_t htraced_rcv_span_len(struct htraced_rcv *rcv,
+                                     struct htrace_span *span)
+{
+    struct cmp_counter_ctx cctx;
+
+    if (rcv->own_trid && (!span->trid)) {
+        span->trid = rcv->tracer->trid;
+    }
+    cmp_counter_ctx_init(&cctx);
+    if (!span_write_msgpack(span, (cmp_ctx_t*)&cctx)) {
+        return 0;
+    }
+    return cctx.count;
+}
+
+/**
+ * Undo any changes made to a span by htraced_rcv_span_len.
+ */
+static void htraced_rcv_span_done(struct htraced_rcv *rcv,
+                                  struct htrace_span *span)
+{
+    if (span->trid == rcv->tracer->trid) {
+        span->trid = NULL;
+    }
+}
+
+static void htraced_rcv_add_span(struct htrace_rcv *r,
+                                 struct htrace_span *span)
 {
     struct htraced_rcv *rcv = (struct htraced_rcv *)r;
-    uint64_t now;
+    struct htraced_xprt *xprt = rcv->xprt;
+    struct htraced_sbuf *sbuf;
+    uint64_t msgpack_len;
 
-    // Note: This assumes that we only flush one buffer at once, and
-    // that we flush buffers in order.  If we revisit those assumptions we'll
-    // need to change this.
-    // The SpanReceiver flush is only used for testing anyway.
-    pthread_mutex_lock(&rcv->lock);
-    now = monotonic_now_ms(rcv->tracer->lg);
-    while (1) {
-        if (rcv->last_send_ms >= now) {
-            break;
+    // Determine the length of the span when serialized to msgpack.
+    msgpack_len = htraced_rcv_span_len(rcv, span);
+    if (!msgpack_len) {
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "htraced_rcv_add_span: "
+                    "span_write_msgpack failed.\n");
+        HTRACE_PROBE4(htraced__drop, span->span_id.high, span->span_id.low,
+                      span->desc, "serialize");
+        goto done;
+    }
+    pthread_mutex_lock(&xprt->lock);
+    sbuf = htraced_xprt_get_space(xprt, msgpack_len);
+    if (sbuf) {
+        htraced_sbuf_append(xprt, sbuf, span, msgpack_len);
+    }
+    pthread_mutex_unlock(&xprt->lock);
+    if (!sbuf) {
+        HTRACE_PROBE4(htraced__drop, span->span_id.high, span->span_id.low,
+                      span->desc, "no space");
+    }
+done:
+    htraced_rcv_span_done(rcv, span);
+}
+
+static void htraced_rcv_add_spans(struct htrace_rcv *r,
+                                  struct htrace_span *spans, int num_spans)
+{
+    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
+    struct htraced_xprt *xprt = rcv->xprt;
+    struct htraced_sbuf *sbuf;
+    uint64_t msgpack_len;
+    int i, num_dropped = 0;
+
+    // Take the lock once for the whole batch.  Sizing each span is cheap
+    // compared with the lock round trips we save.
+    pthread_mutex_lock(&xprt->lock);
+    for (i = 0; i < num_spans; i++) {
+        msgpack_len = htraced_rcv_span_len(rcv, spans + i);
+        sbuf = NULL;
+        if (msgpack_len) {
+            sbuf = htraced_xprt_get_space(xprt, msgpack_len);
+        }
+        if (sbuf) {
+            htraced_sbuf_append(xprt, sbuf, spans + i, msgpack_len);
+        } else {
+            HTRACE_PROBE4(htraced__drop, spans[i].span_id.high,
+                          spans[i].span_id.low, spans[i].desc,
+                          (msgpack_len ? "no space" : "serialize"));
+            num_dropped++;
         }
-        if (htraced_sbufs_empty(rcv)) {
+        htraced_rcv_span_done(rcv, spans + i);
+    }
+    pthread_mutex_unlock(&xprt->lock);
+    if (num_dropped) {
+        HTRACE_LOG_RATE_LIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                   HTRACED_LOG_INTERVAL_MS, "htraced_rcv_add_spans: dropped "
+                   "%d out of %d span(s).\n", num_dropped, num_spans);
+    }
+}
+
+/**
+ * Wait for everything buffered in a transport to be sent.
+ *
+ * Since the buffers are shared, this also flushes the spans of any other
+ * tracers using the transport.
+ *
+ * @param xprt          The htraced transport.
+ * @param deadline_ms   The monotonic-clock time at which to stop waiting, or 0
+ *                          to wait for as long as it takes.
+ */
+static void htraced_xprt_flush(struct htraced_xprt *xprt, uint64_t deadline_ms)
+{
+    struct timespec deadline_ts;
+    uint64_t target;
+
+    ms_to_timespec(deadline_ms, &deadline_ts);
+    pthread_mutex_lock(&xprt->lock);
+    target = htraced_xprt_request_flush(xprt);
+    while (htraced_xprt_done_seq(xprt) < target) {
+        if (!deadline_ms) {
+            pthread_cond_wait(&xprt->flush_cond, &xprt->lock);
+        } else if (pthread_cond_timedwait(&xprt->flush_cond, &xprt->lock,
+                                          &deadline_ts) == ETIMEDOUT) {
             break;
         }
-        rcv->last_send_ms = 0;
-        pthread_cond_wait(&rcv->flush_cond, &rcv->lock);
     }
-    pthread_mutex_unlock(&rcv->lock);
+    pthread_mutex_unlock(&xprt->lock);
 }
 
-static void htraced_rcv_free(struct htrace_rcv *r)
+static void htraced_rcv_flush(struct htrace_rcv *r)
 {
     struct htraced_rcv *rcv = (struct htraced_rcv *)r;
-    struct htrace_log *lg;
-    int i, ret;
 
-    if (!rcv) {
-        return;
-    }
-    lg = rcv->tracer->lg;
-    htrace_log(lg, "Shutting down htraced receiver for %s\n",
-               hrpc_client_get_endpoint(rcv->hcli));
-    pthread_mutex_lock(&rcv->lock);
-    rcv->shutdown = 1;
-    pthread_cond_signal(&rcv->bg_cond);
-    pthread_mutex_unlock(&rcv->lock);
-    ret = pthread_join(rcv->xmit_thread, NULL);
-    if (ret) {
-        htrace_log(lg, "htraced_rcv_free: pthread_join "
-                   "error %d: %s\n", ret, terror(ret));
-    }
-    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
-        htraced_sbuf_free(rcv->sbuf[i]);
-    }
-    hrpc_client_free(rcv->hcli);
-    ret = pthread_mutex_destroy(&rcv->lock);
-    if (ret) {
-        htrace_log(lg, "htraced_rcv_free: pthread_mutex_destroy "
-                   "error %d: %s\n", ret, terror(ret));
+    htraced_xprt_flush(rcv->xprt, 0);
+}
+
+static int htraced_rcv_flush_async(struct htrace_rcv *r,
+                                   void (*cb)(void *arg, int err), void *arg)
+{
+    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
+    struct htraced_xprt *xprt = rcv->xprt;
+    struct htraced_flush_waiter *waiter;
+
+    waiter = malloc(sizeof(*waiter));
+    if (!waiter) {
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "htraced_rcv_flush_async: OOM\n");
+        return ENOMEM;
     }
-    ret = pthread_cond_destroy(&rcv->bg_cond);
-    if (ret) {
-        htrace_log(lg, "htraced_rcv_free: pthread_cond_destroy(bg_cond) "
-                   "error %d: %s\n", ret, terror(ret));
+    waiter->cb = cb;
+    waiter->arg = arg;
+    pthread_mutex_lock(&xprt->lock);
+    waiter->target_seq = htraced_xprt_request_flush(xprt);
+    waiter->num_abandoned = htraced_xprt_num_abandoned(xprt);
+    waiter->next = xprt->waiters;
+    xprt->waiters = waiter;
+    pthread_mutex_unlock(&xprt->lock);
+    return 0;
+}
+
+/**
+ * Free an htraced receiver.
+ *
+ * @param rcv           The htraced receiver.
+ * @param deadline_ms   The monotonic-clock time by which we must be done, or
+ *                          0 if there is no deadline.
+ *
+ * @return              The number of buffered spans which couldn't be sent.
+ */
+static uint64_t htraced_rcv_free_impl(struct htraced_rcv *rcv,
+                                      uint64_t deadline_ms)
+{
+    struct htraced_xprt *xprt, **prev;
+    uint64_t num_abandoned = 0;
+    int last;
+
+    xprt = rcv->xprt;
+    pthread_mutex_lock(&g_htraced_xprts_lock);
+    last = (--xprt->refcnt == 0);
+    if (last) {
+        for (prev = &g_htraced_xprts; *prev != xprt; prev = &(*prev)->next) {
+            ;
+        }
+        *prev = xprt->next;
     }
-    ret = pthread_cond_destroy(&rcv->flush_cond);
-    if (ret) {
-        htrace_log(lg, "htraced_rcv_free: pthread_cond_destroy(flush_cond) "
-                   "error %d: %s\n", ret, terror(ret));
+    pthread_mutex_unlock(&g_htraced_xprts_lock);
+    if (last) {
+        num_abandoned = htraced_xprt_free(xprt, deadline_ms);
+    } else {
+        // Other tracers are still using the transport, so it will stay up.
+        // Send what we have buffered anyway, so that our spans are on their
+        // way by the time the tracer is gone, like they would be with a
+        // transport of our own.  Spans which aren't sent by the deadline
+        // will still be sent later by the transport.
+        htraced_xprt_flush(xprt, deadline_ms);
     }
     free(rcv);
+    return num_abandoned;
+}
+
+static void htraced_rcv_free(struct htrace_rcv *r)
+{
+    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
+
+    if (!rcv) {
+        return;
+    }
+    htraced_rcv_free_impl(rcv, 0);
+}
+
+static uint64_t htraced_rcv_shutdown(struct htrace_rcv *r,
+                                     uint64_t deadline_ms)
+{
+    return htraced_rcv_free_impl((struct htraced_rcv *)r, deadline_ms);
 }
 
 const struct htrace_rcv_ty g_htraced_rcv_ty = {
     "htraced",
     htraced_rcv_create,
     htraced_rcv_add_span,
+    htraced_rcv_add_spans,
     htraced_rcv_flush,
     htraced_rcv_free,
+    htraced_rcv_shutdown,
+    htraced_rcv_flush_async,
 };
 
 // vim:ts=4:sw=4:et
@@ -0,0 +1,644 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "receiver/http.h"
+#include "util/log.h"
+#include "util/net.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/**
+ * @file http.c
+ *
+ * Implements sending requests via HTTP/1.1.
+ */
+
+/**
+ * The size of the buffer we read responses into.  The status line and
+ * headers of a response must fit in it.
+ */
+#define HTTP_RBUF_LEN 16384
+
+/**
+ * The maximum length of a request line and headers.
+ */
+#define HTTP_MAX_REQ_HEADER_LEN 1024
+
+struct http_client {
+    /**
+     * The HTrace log object.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * The tcp write timeout in milliseconds.
+     */
+    uint64_t write_timeo_ms;
+
+    /**
+     * The tcp read timeout in milliseconds.
+     */
+    uint64_t read_timeo_ms;
+
+    /**
+     * The hostname or IP address.  Malloced.
+     */
+    char *host;
+
+    /**
+     * The port.
+     */
+    int port;
+
+    /**
+     * The host:port string.  Malloced.
+     */
+    char *endpoint;
+
+    /**
+     * Socket of current open connection, or -1 if there is no currently open
+     * connection.  This is also set while the connection is being made, so
+     * that http_client_interrupt can abort the connect.  Changes are made
+     * with the lock held.
+     */
+    int sock;
+
+    /**
+     * Nonzero if http_client_interrupt has been called.  Protected by the
+     * lock.
+     */
+    int interrupted;
+
+    /**
+     * Lock which keeps http_client_interrupt from shutting down a socket
+     * which is being closed.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The remote IP address.
+     */
+    char addr_str[NET_ADDR_STR_MAX];
+
+    /**
+     * Response bytes which have been read from the socket.  The unconsumed
+     * ones are between rstart and rend.
+     */
+    char rbuf[HTTP_RBUF_LEN];
+    size_t rstart;
+    size_t rend;
+};
+
+/**
+ * What we need to know about a response.
+ */
+struct http_resp {
+    int status;
+    int keep_alive;
+};
+
+static int http_client_open_conn(struct http_client *hcli);
+static int try_connect(struct http_client *hcli, struct addrinfo *p);
+static int http_client_send_req(struct http_client *hcli, const char *path,
+                const char *content_type, const struct http_body *body);
+static int http_client_rcv_resp(struct http_client *hcli,
+                                struct http_resp *resp);
+
+struct http_client *http_client_alloc(struct htrace_log *lg,
+                uint64_t write_timeo_ms, uint64_t read_timeo_ms,
+                const char *endpoint, int default_port)
+{
+    struct http_client *hcli;
+
+    hcli = calloc(1, sizeof(*hcli));
+    if (!hcli) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "Failed to allocate memory for the HTTP client.\n");
+        goto error;
+    }
+    hcli->lg = lg;
+    hcli->write_timeo_ms = write_timeo_ms;
+    hcli->read_timeo_ms = read_timeo_ms;
+    hcli->sock = -1;
+    pthread_mutex_init(&hcli->lock, NULL);
+    hcli->endpoint = strdup(endpoint);
+    if (!hcli->endpoint) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "Failed to allocate memory for the endpoint string.\n");
+        goto error;
+    }
+    if (!parse_endpoint(lg, endpoint, default_port,
+                   &hcli->host, &hcli->port)) {
+        goto error;
+    }
+    return hcli;
+
+error:
+    if (hcli) {
+        pthread_mutex_destroy(&hcli->lock);
+        free(hcli->host);
+        free(hcli->endpoint);
+        free(hcli);
+    }
+    return NULL;
+}
+
+/**
+ * Close the current connection, if there is one.
+ */
+static void http_client_close_conn(struct http_client *hcli)
+{
+    pthread_mutex_lock(&hcli->lock);
+    if (hcli->sock >= 0) {
+        close(hcli->sock);
+        hcli->sock = -1;
+    }
+    pthread_mutex_unlock(&hcli->lock);
+    hcli->rstart = hcli->rend = 0;
+}
+
+void http_client_free(struct http_client *hcli)
+{
+    if (!hcli) {
+        return;
+    }
+    http_client_close_conn(hcli);
+    pthread_mutex_destroy(&hcli->lock);
+    free(hcli->host);
+    free(hcli->endpoint);
+    free(hcli);
+}
+
+int http_client_post(struct http_client *hcli, const char *path,
+                     const char *content_type,
+                     const struct http_body *bodies, int num_bodies)
+{
+    struct http_resp resp;
+    int i, num, got, done = 0, fresh, ret, retried = 0, interrupted;
+
+    while (done < num_bodies) {
+        pthread_mutex_lock(&hcli->lock);
+        interrupted = hcli->interrupted;
+        pthread_mutex_unlock(&hcli->lock);
+        if (interrupted) {
+            htrace_logl(hcli->lg, HTRACE_LOG_DEBUG,
+                        "http_client_post: the client has been interrupted.\n");
+            break;
+        }
+        fresh = (hcli->sock < 0);
+        if (fresh) {
+            if (!http_client_open_conn(hcli)) {
+                break;
+            }
+            htrace_log(hcli->lg, "http_client_post(%s): successfully opened "
+                       "connection\n", hcli->addr_str);
+        }
+        num = num_bodies - done;
+        if (num > HTTP_MAX_PIPELINE) {
+            num = HTTP_MAX_PIPELINE;
+        }
+        ret = 1;
+        for (i = 0; i < num; i++) {
+            if (!http_client_send_req(hcli, path, content_type,
+                                      bodies + done + i)) {
+                ret = -1;
+                break;
+            }
+        }
+        for (got = 0; (ret > 0) && (got < num); got++) {
+            ret = http_client_rcv_resp(hcli, &resp);
+            if (ret <= 0) {
+                break;
+            }
+            if ((resp.status < 200) || (resp.status > 299)) {
+                htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                            "http_client_post(%s): server "
+                            "returned HTTP status %d for %s\n",
+                            hcli->addr_str, resp.status, path);
+                ret = 0;
+                break;
+            }
+            done++;
+            if (!resp.keep_alive) {
+                // The server won't answer anything else we sent on this
+                // connection, so the rest go out again on a new one.
+                http_client_close_conn(hcli);
+                got++;
+                break;
+            }
+        }
+        if (ret > 0) {
+            retried = 0;
+            continue;
+        }
+        http_client_close_conn(hcli);
+        if (ret == 0) {
+            break;
+        }
+        // The connection was closed before we got a response.  If we have
+        // made progress, or if the server closed the connection while it
+        // was idle, try again on a new connection.
+        if (got > 0) {
+            retried = 0;
+        } else if (fresh || retried) {
+            break;
+        } else {
+            htrace_logl(hcli->lg, HTRACE_LOG_DEBUG, "http_client_post(%s): "
+                        "the connection was closed.  Reconnecting.\n",
+                        hcli->addr_str);
+            retried = 1;
+        }
+    }
+    return done;
+}
+
+void http_client_interrupt(struct http_client *hcli)
+{
+    pthread_mutex_lock(&hcli->lock);
+    hcli->interrupted = 1;
+    if (hcli->sock >= 0) {
+        // This wakes up any thread blocked sending, receiving, or connecting
+        // on the socket.  The socket is closed by the thread using it.
+        shutdown(hcli->sock, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&hcli->lock);
+}
+
+static int http_client_open_conn(struct http_client *hcli)
+{
+    int res, sock = -1;
+    struct addrinfo hints, *list, *info;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    res = getaddrinfo(hcli->host, NULL, &hints, &list);
+    if (res) {
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "http_client_open_conn: "
+                    "getaddrinfo(%s) error %d: %s\n", hcli->host, res,
+                    gai_strerror(res));
+        return 0;
+    }
+    for (info = list; info; info = info->ai_next) {
+        sock = try_connect(hcli, info);
+        if (sock >= 0) {
+            break;
+        }
+    }
+    freeaddrinfo(list);
+    if (!info) {
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "http_client_open_conn(%s): failed to connect.\n",
+                    hcli->host);
+        return 0;
+    }
+    return 1;
+}
+
+static int try_connect(struct http_client *hcli, struct addrinfo *p)
+{
+    int e, sock;
+
+    sock = net_socket_create(hcli->lg, p, hcli->port, hcli->write_timeo_ms,
+                             hcli->read_timeo_ms, hcli->addr_str,
+                             sizeof(hcli->addr_str));
+    if (sock < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&hcli->lock);
+    if (hcli->interrupted) {
+        pthread_mutex_unlock(&hcli->lock);
+        close(sock);
+        return -1;
+    }
+    hcli->sock = sock;
+    pthread_mutex_unlock(&hcli->lock);
+    if (connect(sock, p->ai_addr, p->ai_addrlen) < 0) {
+        e = errno;
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "try_connect(%s): connect "
+                    "failed: error %d (%s)\n", hcli->addr_str, e, terror(e));
+        http_client_close_conn(hcli);
+        return -1;
+    }
+    hcli->rstart = hcli->rend = 0;
+    return sock;
+}
+
+static int http_client_send_req(struct http_client *hcli, const char *path,
+                const char *content_type, const struct http_body *body)
+{
+    char hdr[HTTP_MAX_REQ_HEADER_LEN];
+    struct iovec *iov;
+    uint64_t length = 0;
+    int i, ret, hdr_len;
+
+    iov = malloc(sizeof(*iov) * (body->iov_cnt + 1));
+    if (!iov) {
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR, "http_client_send_req: OOM\n");
+        return 0;
+    }
+    for (i = 0; i < body->iov_cnt; i++) {
+        iov[i + 1] = body->iov[i];
+        length += body->iov[i].iov_len;
+    }
+    hdr_len = snprintf(hdr, sizeof(hdr), "POST %s HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "User-Agent: htrace-c\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %" PRIu64 "\r\n"
+                       "\r\n", path, hcli->endpoint, content_type, length);
+    if ((hdr_len < 0) || (hdr_len >= (int)sizeof(hdr))) {
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "http_client_send_req: the request headers for "
+                    "%s are too long.\n", path);
+        free(iov);
+        return 0;
+    }
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hdr_len;
+    ret = net_writev_fully(hcli->sock, iov, body->iov_cnt + 1);
+    free(iov);
+    if (ret) {
+        htrace_logl(hcli->lg, HTRACE_LOG_DEBUG, "http_client_send_req"
+                    "(%s): sendmsg error: error %d: %s\n",
+                    hcli->addr_str, ret, terror(ret));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Read more response bytes into the buffer.
+ *
+ * @return              The number of bytes read; 0 at end of file; a
+ *                          negative error code on error, or if the buffer is
+ *                          full.
+ */
+static int http_client_fill(struct http_client *hcli)
+{
+    ssize_t res;
+    int e;
+
+    if (hcli->rstart > 0) {
+        memmove(hcli->rbuf, hcli->rbuf + hcli->rstart,
+                hcli->rend - hcli->rstart);
+        hcli->rend -= hcli->rstart;
+        hcli->rstart = 0;
+    }
+    if (hcli->rend == sizeof(hcli->rbuf)) {
+        htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                    "http_client_rcv_resp(%s): response headers "
+                    "are too long.\n", hcli->addr_str);
+        return -EFBIG;
+    }
+    while (1) {
+        res = read(hcli->sock, hcli->rbuf + hcli->rend,
+                   sizeof(hcli->rbuf) - hcli->rend);
+        if (res >= 0) {
+            hcli->rend += res;
+            return res;
+        }
+        e = errno;
+        if (e != EINTR) {
+            htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                        "http_client_rcv_resp(%s): read error %d: "
+                        "%s\n", hcli->addr_str, e, terror(e));
+            return -e;
+        }
+    }
+}
+
+/**
+ * Find the end of a delimiter in the unconsumed response bytes, reading more
+ * of them as needed.
+ *
+ * @return              The offset just past the delimiter, relative to
+ *                          rstart; 0 if the connection was closed first; -1
+ *                          on error.
+ */
+static ssize_t http_client_find(struct http_client *hcli, const char *delim)
+{
+    size_t dlen = strlen(delim), i;
+    int res;
+
+    while (1) {
+        for (i = hcli->rstart; i + dlen <= hcli->rend; i++) {
+            if (!memcmp(hcli->rbuf + i, delim, dlen)) {
+                return i + dlen - hcli->rstart;
+            }
+        }
+        res = http_client_fill(hcli);
+        if (res <= 0) {
+            return (res == 0) ? 0 : -1;
+        }
+    }
+}
+
+/**
+ * Consume response bytes.
+ *
+ * @param hcli          The HTTP client.
+ * @param amt           The number of bytes to consume, or UINT64_MAX to
+ *                          consume everything until the connection is closed.
+ *
+ * @return              1 on success; 0 on error.
+ */
+static int http_client_skip(struct http_client *hcli, uint64_t amt)
+{
+    int until_close = (amt == UINT64_MAX), res;
+    size_t avail;
+
+    while (1) {
+        avail = hcli->rend - hcli->rstart;
+        if (avail > amt) {
+            avail = amt;
+        }
+        hcli->rstart += avail;
+        amt -= avail;
+        if (amt == 0) {
+            return 1;
+        }
+        res = http_client_fill(hcli);
+        if (res == 0) {
+            return until_close;
+        } else if (res < 0) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Consume a chunked response body.
+ *
+ * @return              1 on success; 0 on error.
+ */
+static int http_client_skip_chunked(struct http_client *hcli)
+{
+    char line[64];
+    ssize_t len;
+    uint64_t chunk_len;
+
+    while (1) {
+        len = http_client_find(hcli, "\r\n");
+        if ((len <= 0) || (len >= (ssize_t)sizeof(line))) {
+            return 0;
+        }
+        memcpy(line, hcli->rbuf + hcli->rstart, len);
+        line[len] = '\0';
+        hcli->rstart += len;
+        chunk_len = strtoull(line, NULL, 16);
+        if (chunk_len == 0) {
+            break;
+        }
+        if (!http_client_skip(hcli, chunk_len + 2)) {
+            return 0;
+        }
+    }
+    // Skip the trailers, up to and including the empty line which ends them.
+    while (1) {
+        len = http_client_find(hcli, "\r\n");
+        if (len <= 0) {
+            return 0;
+        }
+        hcli->rstart += len;
+        if (len == 2) {
+            return 1;
+        }
+    }
+}
+
+/**
+ * Check if a header has a given name, and return its value if so.
+ */
+static const char *http_header_value(const char *line, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (strncasecmp(line, name, len) || (line[len] != ':')) {
+        return NULL;
+    }
+    line += len + 1;
+    while ((*line == ' ') || (*line == '\t')) {
+        line++;
+    }
+    return line;
+}
+
+/**
+ * Read a response.
+ *
+ * @return              1 on success; 0 on error; -1 if the connection was
+ *                          closed before any of the response was read.
+ */
+static int http_client_rcv_resp(struct http_client *hcli,
+                                struct http_resp *resp)
+{
+    char *hdrs, *line, *next;
+    const char *val;
+    ssize_t len;
+    int major, minor, chunked, has_len;
+    uint64_t content_len;
+
+    do {
+        len = http_client_find(hcli, "\r\n\r\n");
+        if (len <= 0) {
+            if ((len == 0) && (hcli->rstart == hcli->rend)) {
+                return -1;
+            }
+            htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                        "http_client_rcv_resp(%s): failed to read "
+                        "the response headers.\n", hcli->addr_str);
+            return 0;
+        }
+        hdrs = malloc(len + 1);
+        if (!hdrs) {
+            htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                        "http_client_rcv_resp: OOM\n");
+            return 0;
+        }
+        memcpy(hdrs, hcli->rbuf + hcli->rstart, len);
+        hdrs[len] = '\0';
+        hcli->rstart += len;
+        if (sscanf(hdrs, "HTTP/%d.%d %d", &major, &minor,
+                   &resp->status) != 3) {
+            htrace_logl(hcli->lg, HTRACE_LOG_ERROR,
+                        "http_client_rcv_resp(%s): invalid status "
+                        "line.\n", hcli->addr_str);
+            free(hdrs);
+            return 0;
+        }
+        resp->keep_alive = (major > 1) || ((major == 1) && (minor >= 1));
+        chunked = 0;
+        has_len = 0;
+        content_len = 0;
+        line = strstr(hdrs, "\r\n") + 2;
+        for (; *line; line = next + 2) {
+            next = strstr(line, "\r\n");
+            *next = '\0';
+            if ((val = http_header_value(line, "Content-Length"))) {
+                content_len = strtoull(val, NULL, 10);
+                has_len = 1;
+            } else if ((val = http_header_value(line, "Transfer-Encoding"))) {
+                chunked = (strcasestr(val, "chunked") != NULL);
+            } else if ((val = http_header_value(line, "Connection"))) {
+                if (strcasestr(val, "close")) {
+                    resp->keep_alive = 0;
+                } else if (strcasestr(val, "keep-alive")) {
+                    resp->keep_alive = 1;
+                }
+            }
+        }
+        free(hdrs);
+        // Informational responses are followed by the real response.
+    } while ((resp->status >= 100) && (resp->status <= 199));
+
+    if ((resp->status == 204) || (resp->status == 304)) {
+        return 1;
+    } else if (chunked) {
+        return http_client_skip_chunked(hcli);
+    } else if (has_len) {
+        return http_client_skip(hcli, content_len);
+    }
+    // The body goes on until the server closes the connection.
+    resp->keep_alive = 0;
+    return http_client_skip(hcli, UINT64_MAX);
+}
+
+const char *http_client_get_endpoint(struct http_client *hcli)
+{
+    return hcli->endpoint;
+}
+
+// vim: ts=4:sw=4:et
@@ -0,0 +1,127 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_RECEIVER_HTTP
+#define APACHE_HTRACE_RECEIVER_HTTP
+
+/**
+ * @file http.h
+ *
+ * A minimal HTTP/1.1 client for sending spans to HTTP collectors.
+ *
+ * The client keeps its connection open between calls, and pipelines the
+ * requests it is given in one call.  It only speaks plain HTTP.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+#include <sys/uio.h> /* for struct iovec */
+
+struct htrace_log;
+
+/**
+ * The maximum number of requests to write before reading their responses.
+ */
+#define HTTP_MAX_PIPELINE 8
+
+/**
+ * The body of one HTTP request.
+ */
+struct http_body {
+    /**
+     * The buffers which make up the body.  They are sent in order with
+     * writev, so the caller does not need to copy them into one buffer.
+     */
+    const struct iovec *iov;
+
+    /**
+     * The number of buffers.
+     */
+    int iov_cnt;
+};
+
+/**
+ * Create an HTTP client.
+ *
+ * @param lg                The log object to use for the HTTP client.
+ * @param write_timeo_ms    The TCP write timeout to use.
+ * @param read_timeo_ms     The TCP read timeout to use.
+ * @param endpoint          The hostname and port, separated by a colon.
+ * @param default_port      The port to use if the endpoint doesn't have one.
+ *
+ * @return                  NULL on error; the http_client otherwise.
+ */
+struct http_client *http_client_alloc(struct htrace_log *lg,
+                uint64_t write_timeo_ms, uint64_t read_timeo_ms,
+                const char *endpoint, int default_port);
+
+/**
+ * Free the HTTP client.
+ *
+ * @param hcli              The HTTP client.
+ */
+void http_client_free(struct http_client *hcli);
+
+/**
+ * Send POST requests using the HTTP client.
+ *
+ * Up to HTTP_MAX_PIPELINE requests are written before any of their responses
+ * are read.  The connection is reused by later calls unless the server closes
+ * it.  If the server closed an idle connection before we wrote to it, the
+ * requests are sent again on a new connection.
+ *
+ * @param hcli              The HTTP client.
+ * @param path              The request path.
+ * @param content_type      The Content-Type of the bodies.
+ * @param bodies            The request bodies.
+ * @param num_bodies        The number of request bodies.
+ *
+ * @return                  The number of requests, counting from the first,
+ *                              which got a 2xx response.  If this is less
+ *                              than num_bodies, the rest should be sent again
+ *                              or given up on.
+ */
+int http_client_post(struct http_client *hcli, const char *path,
+                     const char *content_type,
+                     const struct http_body *bodies, int num_bodies);
+
+/**
+ * Interrupt the HTTP client.
+ *
+ * Any call which is blocked sending, receiving, or connecting fails right
+ * away, and all later calls fail without doing anything.  Name lookups can't
+ * be interrupted.  This may be called from any thread.
+ *
+ * @param hcli              The HTTP client.
+ */
+void http_client_interrupt(struct http_client *hcli);
+
+/**
+ * Get the endpoint for this HTTP client.
+ *
+ * @param hcli              The HTTP client.
+ *
+ * @return                  The endpoint.  This string will be valid for the
+ *                              lifetime of the HTTP client.
+ */
+const char *http_client_get_endpoint(struct http_client *hcli);
+
+#endif
+
+// vim: ts=4: sw=4: et
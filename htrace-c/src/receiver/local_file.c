@@ -68,39 +68,44 @@ static struct htrace_rcv *local_file_rcv_create(struct htracer *tracer,
 
     path = htrace_conf_get(conf, HTRACE_LOCAL_FILE_RCV_PATH_KEY);
     if (!path) {
-        htrace_log(tracer->lg, "local_file_rcv_create: no value found for %s. "
-                   "You must set this configuration key to the path you wish "
-                   "to write spans to.\n", HTRACE_LOCAL_FILE_RCV_PATH_KEY);
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_create: no value found for %s. "
+                    "You must set this configuration key to the path you wish "
+                    "to write spans to.\n", HTRACE_LOCAL_FILE_RCV_PATH_KEY);
         return NULL;
     }
     rcv = calloc(1, sizeof(*rcv));
     if (!rcv) {
-        htrace_log(tracer->lg, "local_file_rcv_create: OOM while "
-                   "allocating local_file_rcv.\n");
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_create: OOM while "
+                    "allocating local_file_rcv.\n");
         return NULL;
     }
     ret = pthread_mutex_init(&rcv->lock, NULL);
     if (ret) {
-        htrace_log(tracer->lg, "local_file_rcv_create: failed to "
-                   "create mutex while setting up local_file_rcv: "
-                   "error %d (%s)\n", ret, terror(ret));
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_create: failed to "
+                    "create mutex while setting up local_file_rcv: "
+                    "error %d (%s)\n", ret, terror(ret));
         free(rcv);
         return NULL;
     }
     rcv->base.ty = &g_local_file_rcv_ty;
+    rcv->tracer = tracer;
     rcv->path = strdup(path);
     if (!rcv->path) {
         local_file_rcv_free((struct htrace_rcv*)rcv);
         return NULL;
     }
-    rcv->tracer = tracer;
     rcv->fp = fopen(path, "a");
     if (!rcv->fp) {
         ret = errno;
-        htrace_log(tracer->lg, "local_file_rcv_create: failed to "
-                   "open '%s' for write: error %d (%s)\n",
-                   path, ret, terror(ret));
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_create: failed to "
+                    "open '%s' for write: error %d (%s)\n", path, ret,
+                    terror(ret));
         local_file_rcv_free((struct htrace_rcv*)rcv);
+        return NULL;
     }
     htrace_log(tracer->lg, "Initialized local_file receiver with path=%s.\n",
                rcv->path);
@@ -119,7 +124,8 @@ static void local_file_rcv_add_span(struct htrace_rcv *r,
     buf = malloc(len + 1);
     if (!buf) {
         span->trid = NULL;
-        htrace_log(rcv->tracer->lg, "local_file_rcv_add_span: OOM\n");
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_add_span: OOM\n");
         return;
     }
     span_json_sprintf(span, len, buf);
@@ -131,8 +137,52 @@ static void local_file_rcv_add_span(struct htrace_rcv *r,
     err = errno;
     pthread_mutex_unlock(&rcv->lock);
     if (res < len) {
-        htrace_log(rcv->tracer->lg, "local_file_rcv_add_span(%s): fwrite error: "
-                   "%d (%s)\n", rcv->path, err, terror(err));
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_add_span(%s): fwrite error: "
+                    "%d (%s)\n", rcv->path, err, terror(err));
+    }
+    free(buf);
+}
+
+static void local_file_rcv_add_spans(struct htrace_rcv *r,
+                                     struct htrace_span *spans, int num_spans)
+{
+    int i, len, total = 0, res, err;
+    char *buf, *cur;
+    struct local_file_rcv *rcv = (struct local_file_rcv *)r;
+
+    for (i = 0; i < num_spans; i++) {
+        spans[i].trid = rcv->tracer->trid;
+        total += span_json_size(spans + i);
+    }
+    buf = malloc(total + 1);
+    if (!buf) {
+        for (i = 0; i < num_spans; i++) {
+            spans[i].trid = NULL;
+        }
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_add_spans: OOM\n");
+        return;
+    }
+    // Serialize all the spans into one buffer, so that we only need to take
+    // the lock and call fwrite once for the whole batch.
+    cur = buf;
+    for (i = 0; i < num_spans; i++) {
+        len = span_json_size(spans + i);
+        span_json_sprintf(spans + i, len, cur);
+        spans[i].trid = NULL;
+        cur[len - 1] = '\n';
+        cur += len;
+    }
+    *cur = '\0';
+    pthread_mutex_lock(&rcv->lock);
+    res = fwrite(buf, 1, total, rcv->fp);
+    err = errno;
+    pthread_mutex_unlock(&rcv->lock);
+    if (res < total) {
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_add_spans(%s): fwrite "
+                    "error: %d (%s)\n", rcv->path, err, terror(err));
     }
     free(buf);
 }
@@ -142,8 +192,9 @@ static void local_file_rcv_flush(struct htrace_rcv *r)
     struct local_file_rcv *rcv = (struct local_file_rcv *)r;
     if (fflush(rcv->fp) < 0) {
         int e = errno;
-        htrace_log(rcv->tracer->lg, "local_file_rcv_flush(path=%s): fflush "
-                   "error: %s\n", rcv->path, terror(e));
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_flush(path=%s): fflush "
+                    "error: %s\n", rcv->path, terror(e));
     }
 }
 
@@ -161,13 +212,17 @@ static void local_file_rcv_free(struct htrace_rcv *r)
                rcv->path);
     ret = pthread_mutex_destroy(&rcv->lock);
     if (ret) {
-        htrace_log(lg, "local_file_rcv_free: pthread_mutex_destroy "
-                   "error %d: %s\n", ret, terror(ret));
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "local_file_rcv_free: pthread_mutex_destroy "
+                    "error %d: %s\n", ret, terror(ret));
     }
-    ret = fclose(rcv->fp);
-    if (ret) {
-        htrace_log(lg, "local_file_rcv_free: fclose error "
-                   "%d: %s\n", ret, terror(ret));
+    if (rcv->fp) {
+        ret = fclose(rcv->fp);
+        if (ret) {
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "local_file_rcv_free: fclose error "
+                        "%d: %s\n", ret, terror(ret));
+        }
     }
     free(rcv->path);
     free(rcv);
@@ -177,8 +232,11 @@ const struct htrace_rcv_ty g_local_file_rcv_ty = {
     "local.file",
     local_file_rcv_create,
     local_file_rcv_add_span,
+    local_file_rcv_add_spans,
     local_file_rcv_flush,
     local_file_rcv_free,
+    NULL,
+    NULL,
 };
 
 // vim:ts=4:sw=4:et
@@ -44,6 +44,12 @@ static void noop_rcv_add_span(struct htrace_rcv *rcv,
     // do nothing
 }
 
+static void noop_rcv_add_spans(struct htrace_rcv *rcv,
+                               struct htrace_span *spans, int num_spans)
+{
+    // do nothing
+}
+
 static void noop_rcv_flush(struct htrace_rcv *rcv)
 {
     // do nothing
@@ -58,8 +64,11 @@ const struct htrace_rcv_ty g_noop_rcv_ty = {
     "noop",
     noop_rcv_create,
     noop_rcv_add_span,
+    noop_rcv_add_spans,
     noop_rcv_flush,
     noop_rcv_free,
+    NULL,
+    NULL,
 };
 
 // vim:ts=4:sw=4:et
@@ -0,0 +1,925 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/receiver.h"
+#include "util/htable.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * @file perfetto.c
+ *
+ * A span receiver that writes spans to a local file which can be opened in
+ * ui.perfetto.dev or chrome://tracing.
+ *
+ * By default, the file is a Perfetto protobuf trace.  A protobuf trace is a
+ * series of length-delimited TracePacket messages, so we can keep appending
+ * packets to it without ever going back to rewrite a header.  Each span
+ * becomes a pair of slice begin and slice end events on the track of the
+ * thread which delivered it.  Spans delivered in a batch were usually closed
+ * on some other thread, so they go on a track for their trace instead.
+ * Descriptions are interned: the first event
+ * which uses a description carries it in the packet's interned data, and
+ * later events only carry the interned ID.
+ *
+ * The Chrome JSON trace event format is available as a fallback for tools
+ * which don't read protobuf traces.  It has no interning, so it is much
+ * larger.
+ */
+
+/**
+ * Protobuf wire types.
+ */
+#define PB_VARINT 0
+#define PB_LEN 2
+
+/**
+ * Field numbers from perfetto/trace/trace.proto and the messages it uses.
+ */
+#define TRACE_PACKET 1
+
+#define PACKET_TIMESTAMP 8
+#define PACKET_SEQUENCE_ID 10
+#define PACKET_TRACK_EVENT 11
+#define PACKET_INTERNED_DATA 12
+#define PACKET_SEQUENCE_FLAGS 13
+#define PACKET_TRACK_DESCRIPTOR 60
+
+#define SEQ_INCREMENTAL_STATE_CLEARED 1
+#define SEQ_NEEDS_INCREMENTAL_STATE 2
+
+#define TRACK_EVENT_DEBUG_ANNOTATION 4
+#define TRACK_EVENT_TYPE 9
+#define TRACK_EVENT_NAME_IID 10
+#define TRACK_EVENT_TRACK_UUID 11
+
+#define TYPE_SLICE_BEGIN 1
+#define TYPE_SLICE_END 2
+
+#define DEBUG_ANNOTATION_NAME_IID 1
+#define DEBUG_ANNOTATION_STRING_VALUE 6
+
+#define INTERNED_EVENT_NAMES 2
+#define INTERNED_DEBUG_ANNOTATION_NAMES 3
+
+#define INTERNED_IID 1
+#define INTERNED_NAME 2
+
+#define TRACK_DESCRIPTOR_UUID 1
+#define TRACK_DESCRIPTOR_NAME 2
+#define TRACK_DESCRIPTOR_PROCESS 3
+#define TRACK_DESCRIPTOR_THREAD 4
+#define TRACK_DESCRIPTOR_PARENT_UUID 5
+
+#define PROCESS_DESCRIPTOR_PID 1
+#define PROCESS_DESCRIPTOR_NAME 6
+
+#define THREAD_DESCRIPTOR_PID 1
+#define THREAD_DESCRIPTOR_TID 2
+
+/**
+ * The trusted packet sequence ID which all of our packets use.  Interned
+ * IDs are scoped to a sequence.
+ */
+#define PERFETTO_SEQUENCE_ID 1
+
+/**
+ * The interned IDs of the debug annotation names.
+ */
+#define PERFETTO_ANNOTATION_SPAN_ID 1
+#define PERFETTO_ANNOTATION_PARENTS 2
+
+/**
+ * Set in the UUIDs of trace tracks.  Thread track UUIDs never have it set,
+ * since process IDs are less than 2^31.
+ */
+#define PERFETTO_TRACE_TRACK_BIT 0x8000000000000000ULL
+
+/**
+ * Passed as the thread ID of a span which should go on its trace's track.
+ * No thread has this ID.
+ */
+#define PERFETTO_NO_TID 0
+
+/**
+ * The maximum number of descriptions, threads or traces to remember.  Once any
+ * of the three tables is full, we clear the incremental state and start again,
+ * so that a process which generates unbounded descriptions, threads or traces
+ * doesn't grow without bound.
+ */
+#define PERFETTO_MAX_INTERNED 4096
+
+enum perfetto_format {
+    PERFETTO_FORMAT_PROTO = 0,
+    PERFETTO_FORMAT_JSON,
+};
+
+/**
+ * A growable buffer.
+ */
+struct pf_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+
+    /**
+     * Nonzero if we failed to grow the buffer.  Further writes are ignored.
+     */
+    int oom;
+};
+
+struct perfetto_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The output format.
+     */
+    enum perfetto_format format;
+
+    /**
+     * The output file.
+     */
+    FILE *fp;
+
+    /**
+     * Path to the output file.  Dynamically allocated.
+     */
+    char *path;
+
+    /**
+     * Our process ID.
+     */
+    uint32_t pid;
+
+    /**
+     * Lock protecting everything below.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Maps descriptions to their interned IDs.  The keys are dynamically
+     * allocated.
+     */
+    struct htable *names;
+
+    /**
+     * The last interned description ID we handed out.
+     */
+    uint64_t last_name_iid;
+
+    /**
+     * The set of thread IDs which we have written track descriptors for.
+     */
+    struct htable *tids;
+
+    /**
+     * The set of trace track names which we have written track descriptors
+     * for.  The keys are dynamically allocated.
+     */
+    struct htable *traces;
+
+    /**
+     * Nonzero if the next packet must tell the reader to clear its
+     * incremental state.
+     */
+    int cleared;
+
+    /**
+     * The serialized packets which haven't been written yet.
+     */
+    struct pf_buf out;
+
+    /**
+     * Scratch buffers for building nested messages.
+     */
+    struct pf_buf pkt;
+    struct pf_buf ev;
+    struct pf_buf interned;
+    struct pf_buf sub;
+};
+
+static void perfetto_rcv_free(struct htrace_rcv *r);
+
+static uint32_t pf_gettid(void)
+{
+#if defined(__linux__) && defined(SYS_gettid)
+    return (uint32_t)syscall(SYS_gettid);
+#else
+    return (uint32_t)(uintptr_t)pthread_self();
+#endif
+}
+
+static uint32_t pf_hash_tid(const void *key)
+{
+    return ((uint32_t)(uintptr_t)key) * 2654435761U;
+}
+
+static int pf_compare_tid(const void *a, const void *b)
+{
+    return a == b;
+}
+
+static void pf_free_key(void *ctx __attribute__((unused)), void *key,
+                        void *val __attribute__((unused)))
+{
+    free(key);
+}
+
+static void pf_buf_reserve(struct pf_buf *buf, size_t amt)
+{
+    size_t ncap;
+    uint8_t *ndata;
+
+    if (buf->oom) {
+        return;
+    }
+    if (buf->len + amt <= buf->cap) {
+        return;
+    }
+    ncap = buf->cap ? buf->cap : 256;
+    while (ncap < buf->len + amt) {
+        ncap *= 2;
+    }
+    ndata = realloc(buf->data, ncap);
+    if (!ndata) {
+        buf->oom = 1;
+        return;
+    }
+    buf->data = ndata;
+    buf->cap = ncap;
+}
+
+static void pf_buf_put_raw(struct pf_buf *buf, const void *data, size_t len)
+{
+    pf_buf_reserve(buf, len);
+    if (buf->oom) {
+        return;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void pf_buf_put_varint(struct pf_buf *buf, uint64_t val)
+{
+    uint8_t tmp[10];
+    size_t i = 0;
+
+    do {
+        tmp[i] = val & 0x7f;
+        val >>= 7;
+        if (val) {
+            tmp[i] |= 0x80;
+        }
+        i++;
+    } while (val);
+    pf_buf_put_raw(buf, tmp, i);
+}
+
+static void pf_buf_put_uint(struct pf_buf *buf, uint32_t field, uint64_t val)
+{
+    pf_buf_put_varint(buf, (field << 3) | PB_VARINT);
+    pf_buf_put_varint(buf, val);
+}
+
+static void pf_buf_put_bytes(struct pf_buf *buf, uint32_t field,
+                             const void *data, size_t len)
+{
+    pf_buf_put_varint(buf, (field << 3) | PB_LEN);
+    pf_buf_put_varint(buf, len);
+    pf_buf_put_raw(buf, data, len);
+}
+
+static void pf_buf_put_str(struct pf_buf *buf, uint32_t field, const char *str)
+{
+    pf_buf_put_bytes(buf, field, str, strlen(str));
+}
+
+/**
+ * Append a nested message, and reset the buffer which held it.
+ */
+static void pf_buf_put_msg(struct pf_buf *buf, uint32_t field,
+                           struct pf_buf *msg)
+{
+    if (msg->oom) {
+        buf->oom = 1;
+    } else {
+        pf_buf_put_bytes(buf, field, msg->data, msg->len);
+    }
+    msg->len = 0;
+    msg->oom = 0;
+}
+
+static void pf_buf_free(struct pf_buf *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+    buf->oom = 0;
+}
+
+static uint64_t pf_thread_uuid(const struct perfetto_rcv *rcv, uint32_t tid)
+{
+    return (((uint64_t)rcv->pid) << 32) | tid;
+}
+
+/**
+ * Write the track descriptor for our process.
+ */
+static void pf_put_process_track(struct perfetto_rcv *rcv)
+{
+    pf_buf_put_uint(&rcv->sub, PROCESS_DESCRIPTOR_PID, rcv->pid);
+    if (rcv->tracer->trid) {
+        pf_buf_put_str(&rcv->sub, PROCESS_DESCRIPTOR_NAME, rcv->tracer->trid);
+    }
+    pf_buf_put_uint(&rcv->ev, TRACK_DESCRIPTOR_UUID, rcv->pid);
+    pf_buf_put_msg(&rcv->ev, TRACK_DESCRIPTOR_PROCESS, &rcv->sub);
+    pf_buf_put_msg(&rcv->pkt, PACKET_TRACK_DESCRIPTOR, &rcv->ev);
+    pf_buf_put_msg(&rcv->out, TRACE_PACKET, &rcv->pkt);
+}
+
+/**
+ * Write the track descriptor for a trace, unless we already have.
+ *
+ * @return              The track UUID, or 0 on OOM.
+ */
+static uint64_t pf_put_trace_track(struct perfetto_rcv *rcv,
+                                   const struct htrace_span *span)
+{
+    char name[32];
+    char *key;
+    uint64_t uuid = span->span_id.high | PERFETTO_TRACE_TRACK_BIT;
+
+    snprintf(name, sizeof(name), "trace %016" PRIx64, span->span_id.high);
+    if (htable_get(rcv->traces, name)) {
+        return uuid;
+    }
+    if (htable_used(rcv->traces) >= PERFETTO_MAX_INTERNED) {
+        // Forgetting a trace just means that we describe its track again.
+        htable_visit(rcv->traces, pf_free_key, NULL);
+        htable_free(rcv->traces);
+        rcv->traces = htable_alloc(64, ht_hash_string, ht_compare_string);
+        if (!rcv->traces) {
+            return 0;
+        }
+    }
+    key = strdup(name);
+    if (!key) {
+        return 0;
+    }
+    if (htable_put(rcv->traces, key, key)) {
+        free(key);
+        return 0;
+    }
+    pf_buf_put_uint(&rcv->ev, TRACK_DESCRIPTOR_UUID, uuid);
+    pf_buf_put_str(&rcv->ev, TRACK_DESCRIPTOR_NAME, name);
+    pf_buf_put_uint(&rcv->ev, TRACK_DESCRIPTOR_PARENT_UUID, rcv->pid);
+    pf_buf_put_msg(&rcv->pkt, PACKET_TRACK_DESCRIPTOR, &rcv->ev);
+    pf_buf_put_msg(&rcv->out, TRACE_PACKET, &rcv->pkt);
+    return uuid;
+}
+
+/**
+ * Write the track descriptor for a thread, unless we already have.
+ */
+static void pf_put_thread_track(struct perfetto_rcv *rcv, uint32_t tid)
+{
+    void *key = (void *)(uintptr_t)(tid + 1);
+
+    if (htable_get(rcv->tids, key)) {
+        return;
+    }
+    if (htable_used(rcv->tids) >= PERFETTO_MAX_INTERNED) {
+        // Forgetting a thread just means that we describe its track again.
+        htable_free(rcv->tids);
+        rcv->tids = htable_alloc(64, pf_hash_tid, pf_compare_tid);
+        if (!rcv->tids) {
+            rcv->out.oom = 1;
+            return;
+        }
+    }
+    if (htable_put(rcv->tids, key, key)) {
+        rcv->out.oom = 1;
+        return;
+    }
+    pf_buf_put_uint(&rcv->sub, THREAD_DESCRIPTOR_PID, rcv->pid);
+    pf_buf_put_uint(&rcv->sub, THREAD_DESCRIPTOR_TID, tid);
+    pf_buf_put_uint(&rcv->ev, TRACK_DESCRIPTOR_UUID,
+                    pf_thread_uuid(rcv, tid));
+    pf_buf_put_msg(&rcv->ev, TRACK_DESCRIPTOR_THREAD, &rcv->sub);
+    pf_buf_put_msg(&rcv->pkt, PACKET_TRACK_DESCRIPTOR, &rcv->ev);
+    pf_buf_put_msg(&rcv->out, TRACE_PACKET, &rcv->pkt);
+}
+
+static void pf_put_interned_name(struct pf_buf *interned, struct pf_buf *sub,
+                                 uint32_t field, uint64_t iid,
+                                 const char *name)
+{
+    pf_buf_put_uint(sub, INTERNED_IID, iid);
+    pf_buf_put_str(sub, INTERNED_NAME, name);
+    pf_buf_put_msg(interned, field, sub);
+}
+
+/**
+ * Look up the interned ID of a description, interning it if needed.  If the
+ * description is new, it is added to rcv->interned.
+ *
+ * @return              The interned ID, or 0 on OOM.
+ */
+static uint64_t pf_intern_desc(struct perfetto_rcv *rcv, const char *desc)
+{
+    char *key;
+    uint64_t iid;
+
+    iid = (uint64_t)(uintptr_t)htable_get(rcv->names, desc);
+    if (iid) {
+        return iid;
+    }
+    if (htable_used(rcv->names) >= PERFETTO_MAX_INTERNED) {
+        htable_visit(rcv->names, pf_free_key, NULL);
+        htable_free(rcv->names);
+        rcv->names = htable_alloc(256, ht_hash_string, ht_compare_string);
+        rcv->last_name_iid = 0;
+        rcv->cleared = 1;
+        if (!rcv->names) {
+            return 0;
+        }
+    }
+    key = strdup(desc);
+    if (!key) {
+        return 0;
+    }
+    iid = rcv->last_name_iid + 1;
+    if (htable_put(rcv->names, key, (void *)(uintptr_t)iid)) {
+        free(key);
+        return 0;
+    }
+    rcv->last_name_iid = iid;
+    pf_put_interned_name(&rcv->interned, &rcv->sub, INTERNED_EVENT_NAMES,
+                         iid, desc);
+    return iid;
+}
+
+static void pf_put_annotation(struct perfetto_rcv *rcv, uint64_t name_iid,
+                              const char *val)
+{
+    pf_buf_put_uint(&rcv->sub, DEBUG_ANNOTATION_NAME_IID, name_iid);
+    pf_buf_put_str(&rcv->sub, DEBUG_ANNOTATION_STRING_VALUE, val);
+    pf_buf_put_msg(&rcv->ev, TRACK_EVENT_DEBUG_ANNOTATION, &rcv->sub);
+}
+
+/**
+ * Format the span's parents as a comma-separated list.
+ */
+static void pf_parents_str(const struct htrace_span *span, char *buf,
+                           size_t len)
+{
+    const struct htrace_span_id *parents;
+    size_t off = 0;
+    int i;
+
+    buf[0] = '\0';
+    parents = (span->num_parents == 1) ? &span->parent.single :
+        span->parent.list;
+    for (i = 0; i < span->num_parents; i++) {
+        if (off + HTRACE_SPAN_ID_STRING_LENGTH + 2 > len) {
+            break;
+        }
+        if (i > 0) {
+            buf[off++] = ',';
+        }
+        htrace_span_id_to_str(parents + i, buf + off, len - off);
+        off += strlen(buf + off);
+    }
+}
+
+static void pf_put_span_proto(struct perfetto_rcv *rcv,
+                              const struct htrace_span *span, uint32_t tid)
+{
+    char sbuf[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char pbuf[(HTRACE_SPAN_ID_STRING_LENGTH + 1) * 8];
+    uint64_t iid, track;
+    uint32_t flags = SEQ_NEEDS_INCREMENTAL_STATE;
+
+    if (tid == PERFETTO_NO_TID) {
+        track = pf_put_trace_track(rcv, span);
+        if (!track) {
+            rcv->out.oom = 1;
+            return;
+        }
+    } else {
+        track = pf_thread_uuid(rcv, tid);
+        pf_put_thread_track(rcv, tid);
+    }
+    iid = pf_intern_desc(rcv, span->desc);
+    if (!iid) {
+        rcv->out.oom = 1;
+        return;
+    }
+    if (rcv->cleared) {
+        // The reader forgets everything we interned before this packet, so
+        // the annotation names have to be sent again.
+        flags |= SEQ_INCREMENTAL_STATE_CLEARED;
+        pf_put_interned_name(&rcv->interned, &rcv->sub,
+                INTERNED_DEBUG_ANNOTATION_NAMES,
+                PERFETTO_ANNOTATION_SPAN_ID, "span_id");
+        pf_put_interned_name(&rcv->interned, &rcv->sub,
+                INTERNED_DEBUG_ANNOTATION_NAMES,
+                PERFETTO_ANNOTATION_PARENTS, "parents");
+        rcv->cleared = 0;
+    }
+
+    // The slice begin event.  Span times are in microseconds, and Perfetto
+    // timestamps are in nanoseconds.
+    pf_buf_put_uint(&rcv->ev, TRACK_EVENT_TYPE, TYPE_SLICE_BEGIN);
+    pf_buf_put_uint(&rcv->ev, TRACK_EVENT_TRACK_UUID, track);
+    pf_buf_put_uint(&rcv->ev, TRACK_EVENT_NAME_IID, iid);
+    htrace_span_id_to_str(&span->span_id, sbuf, sizeof(sbuf));
+    pf_put_annotation(rcv, PERFETTO_ANNOTATION_SPAN_ID, sbuf);
+    if (span->num_parents > 0) {
+        pf_parents_str(span, pbuf, sizeof(pbuf));
+        pf_put_annotation(rcv, PERFETTO_ANNOTATION_PARENTS, pbuf);
+    }
+    pf_buf_put_uint(&rcv->pkt, PACKET_TIMESTAMP, span->begin_ms * 1000);
+    pf_buf_put_uint(&rcv->pkt, PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+    pf_buf_put_uint(&rcv->pkt, PACKET_SEQUENCE_FLAGS, flags);
+    if (rcv->interned.len > 0) {
+        pf_buf_put_msg(&rcv->pkt, PACKET_INTERNED_DATA, &rcv->interned);
+    }
+    pf_buf_put_msg(&rcv->pkt, PACKET_TRACK_EVENT, &rcv->ev);
+    pf_buf_put_msg(&rcv->out, TRACE_PACKET, &rcv->pkt);
+
+    // The slice end event.
+    pf_buf_put_uint(&rcv->ev, TRACK_EVENT_TYPE, TYPE_SLICE_END);
+    pf_buf_put_uint(&rcv->ev, TRACK_EVENT_TRACK_UUID, track);
+    pf_buf_put_uint(&rcv->pkt, PACKET_TIMESTAMP, span->end_ms * 1000);
+    pf_buf_put_uint(&rcv->pkt, PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+    pf_buf_put_uint(&rcv->pkt, PACKET_SEQUENCE_FLAGS,
+                    SEQ_NEEDS_INCREMENTAL_STATE);
+    pf_buf_put_msg(&rcv->pkt, PACKET_TRACK_EVENT, &rcv->ev);
+    pf_buf_put_msg(&rcv->out, TRACE_PACKET, &rcv->pkt);
+}
+
+static void pf_put_span_json(struct perfetto_rcv *rcv,
+                             const struct htrace_span *span, uint32_t tid)
+{
+    char sbuf[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char pbuf[(HTRACE_SPAN_ID_STRING_LENGTH + 1) * 8];
+    char *str;
+    int len;
+
+    // Descriptions have already been validated, so they don't need to be
+    // escaped.  The trailing comma is allowed by the JSON array trace format,
+    // and lets us keep appending events without ever closing the array.
+    htrace_span_id_to_str(&span->span_id, sbuf, sizeof(sbuf));
+    pf_parents_str(span, pbuf, sizeof(pbuf));
+    if (tid == PERFETTO_NO_TID) {
+        // Nestable async events with the trace ID as their ID all go on one
+        // track for the trace.
+        len = asprintf(&str, "{\"name\":\"%s\",\"cat\":\"htrace\","
+                "\"ph\":\"b\",\"id\":\"0x%016" PRIx64 "\",\"ts\":%" PRIu64
+                ",\"pid\":%" PRIu32 ",\"args\":{\"span_id\":\"%s\","
+                "\"parents\":\"%s\"}},\n{\"name\":\"%s\",\"cat\":\"htrace\","
+                "\"ph\":\"e\",\"id\":\"0x%016" PRIx64 "\",\"ts\":%" PRIu64
+                ",\"pid\":%" PRIu32 "},\n", span->desc, span->span_id.high,
+                span->begin_ms, rcv->pid, sbuf, pbuf, span->desc,
+                span->span_id.high, span->end_ms, rcv->pid);
+    } else {
+        len = asprintf(&str, "{\"name\":\"%s\",\"cat\":\"htrace\",\"ph\":\"X\","
+            "\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":%" PRIu32
+            ",\"tid\":%" PRIu32 ",\"args\":{\"span_id\":\"%s\","
+            "\"parents\":\"%s\"}},\n", span->desc, span->begin_ms,
+            (span->end_ms > span->begin_ms) ?
+                (span->end_ms - span->begin_ms) : (uint64_t)0,
+            rcv->pid, tid, sbuf, pbuf);
+    }
+    if (len < 0) {
+        rcv->out.oom = 1;
+        return;
+    }
+    pf_buf_put_raw(&rcv->out, str, len);
+    free(str);
+}
+
+/**
+ * Forget all interned descriptions and threads, and discard the buffered
+ * packets.  Must be called with the lock held.
+ */
+static void pf_reset(struct perfetto_rcv *rcv)
+{
+    if (rcv->names) {
+        htable_visit(rcv->names, pf_free_key, NULL);
+        htable_free(rcv->names);
+    }
+    rcv->names = htable_alloc(256, ht_hash_string, ht_compare_string);
+    rcv->last_name_iid = 0;
+    if (rcv->tids) {
+        htable_free(rcv->tids);
+    }
+    rcv->tids = htable_alloc(64, pf_hash_tid, pf_compare_tid);
+    if (rcv->traces) {
+        htable_visit(rcv->traces, pf_free_key, NULL);
+        htable_free(rcv->traces);
+    }
+    rcv->traces = htable_alloc(64, ht_hash_string, ht_compare_string);
+    rcv->cleared = 1;
+    rcv->out.len = rcv->pkt.len = rcv->ev.len = 0;
+    rcv->interned.len = rcv->sub.len = 0;
+    rcv->out.oom = rcv->pkt.oom = rcv->ev.oom = 0;
+    rcv->interned.oom = rcv->sub.oom = 0;
+}
+
+/**
+ * Write out the buffered packets.  Must be called with the lock held.
+ */
+static void pf_write_out(struct perfetto_rcv *rcv, const char *what)
+{
+    size_t res;
+    int err;
+
+    if (rcv->out.oom) {
+        // Some of the buffered packets may have been lost, including ones
+        // with interned data or track descriptors.  Drop the rest, and start
+        // over with a clean slate.
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "%s(%s): OOM\n", what, rcv->path);
+        pf_reset(rcv);
+        return;
+    }
+    if (rcv->out.len == 0) {
+        return;
+    }
+    res = fwrite(rcv->out.data, 1, rcv->out.len, rcv->fp);
+    err = errno;
+    if (res < rcv->out.len) {
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "%s(%s): fwrite error: %d (%s)\n", what, rcv->path, err,
+                    terror(err));
+    }
+    rcv->out.len = 0;
+}
+
+/**
+ * Add a span to the buffered packets.  Must be called with the lock held.
+ *
+ * @param rcv           The receiver.
+ * @param span          The span.
+ * @param tid           The thread whose track the span goes on, or
+ *                          PERFETTO_NO_TID to put it on its trace's track.
+ */
+static void pf_put_span(struct perfetto_rcv *rcv,
+                        const struct htrace_span *span, uint32_t tid)
+{
+    if ((!rcv->names) || (!rcv->tids) || (!rcv->traces)) {
+        rcv->out.oom = 1;
+    } else if (rcv->format == PERFETTO_FORMAT_JSON) {
+        pf_put_span_json(rcv, span, tid);
+    } else {
+        pf_put_span_proto(rcv, span, tid);
+    }
+}
+
+static int pf_parse_format(struct htracer *tracer, const char *str,
+                           enum perfetto_format *format)
+{
+    if (!str || !strcmp(str, "proto")) {
+        *format = PERFETTO_FORMAT_PROTO;
+    } else if (!strcmp(str, "json")) {
+        *format = PERFETTO_FORMAT_JSON;
+    } else {
+        htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                    "perfetto_rcv_create: invalid value '%s' for "
+                    "%s.  Valid values are proto and json.\n", str,
+                    HTRACE_PERFETTO_FORMAT_KEY);
+        return EINVAL;
+    }
+    return 0;
+}
+
+static struct htrace_rcv *perfetto_rcv_create(struct htracer *tracer,
+                                              const struct htrace_conf *conf)
+{
+    struct perfetto_rcv *rcv;
+    enum perfetto_format format;
+    const char *path;
+    int ret;
+
+    path = htrace_conf_get(conf, HTRACE_PERFETTO_PATH_KEY);
+    if (!path) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "perfetto_rcv_create: no value found for %s. "
+                    "You must set this configuration key to the path you wish "
+                    "to write the trace to.\n", HTRACE_PERFETTO_PATH_KEY);
+        return NULL;
+    }
+    if (pf_parse_format(tracer, htrace_conf_get(conf,
+                HTRACE_PERFETTO_FORMAT_KEY), &format)) {
+        return NULL;
+    }
+    rcv = calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "perfetto_rcv_create: OOM while "
+                    "allocating perfetto_rcv.\n");
+        return NULL;
+    }
+    ret = pthread_mutex_init(&rcv->lock, NULL);
+    if (ret) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "perfetto_rcv_create: failed to "
+                    "create mutex while setting up perfetto_rcv: "
+                    "error %d (%s)\n", ret, terror(ret));
+        free(rcv);
+        return NULL;
+    }
+    rcv->base.ty = &g_perfetto_rcv_ty;
+    rcv->tracer = tracer;
+    rcv->format = format;
+    rcv->pid = (uint32_t)getpid();
+    rcv->cleared = 1;
+    rcv->path = strdup(path);
+    rcv->names = htable_alloc(256, ht_hash_string, ht_compare_string);
+    rcv->tids = htable_alloc(64, pf_hash_tid, pf_compare_tid);
+    rcv->traces = htable_alloc(64, ht_hash_string, ht_compare_string);
+    if ((!rcv->path) || (!rcv->names) || (!rcv->tids) || (!rcv->traces)) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "perfetto_rcv_create: OOM while "
+                    "allocating perfetto_rcv.\n");
+        perfetto_rcv_free((struct htrace_rcv*)rcv);
+        return NULL;
+    }
+    // Both formats can be appended to, so that a reconfiguration which
+    // creates a new receiver for the same path doesn't lose what the old one
+    // wrote.  A protobuf trace is just a series of packets, and this
+    // receiver's first event clears the interned state of whatever was there
+    // before.
+    rcv->fp = fopen(path, "a");
+    if (!rcv->fp) {
+        ret = errno;
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "perfetto_rcv_create: failed to "
+                    "open '%s' for write: error %d (%s)\n", path, ret,
+                    terror(ret));
+        perfetto_rcv_free((struct htrace_rcv*)rcv);
+        return NULL;
+    }
+    if (format == PERFETTO_FORMAT_JSON) {
+        if (ftell(rcv->fp) == 0) {
+            pf_buf_put_raw(&rcv->out, "[\n", 2);
+        }
+        if (tracer->trid) {
+            char *str;
+            int len = asprintf(&str, "{\"name\":\"process_name\",\"ph\":\"M\","
+                    "\"pid\":%" PRIu32 ",\"args\":{\"name\":\"%s\"}},\n",
+                    rcv->pid, tracer->trid);
+            if (len >= 0) {
+                pf_buf_put_raw(&rcv->out, str, len);
+                free(str);
+            }
+        }
+    } else {
+        pf_put_process_track(rcv);
+    }
+    pf_write_out(rcv, "perfetto_rcv_create");
+    htrace_log(tracer->lg, "Initialized perfetto receiver with path=%s, "
+               "format=%s.\n", rcv->path,
+               (format == PERFETTO_FORMAT_JSON) ? "json" : "proto");
+    return (struct htrace_rcv*)rcv;
+}
+
+static void perfetto_rcv_add_span(struct htrace_rcv *r,
+                                  struct htrace_span *span)
+{
+    struct perfetto_rcv *rcv = (struct perfetto_rcv *)r;
+    uint32_t tid = pf_gettid();
+
+    pthread_mutex_lock(&rcv->lock);
+    pf_put_span(rcv, span, tid);
+    pf_write_out(rcv, "perfetto_rcv_add_span");
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+static void perfetto_rcv_add_spans(struct htrace_rcv *r,
+                                   struct htrace_span *spans, int num_spans)
+{
+    struct perfetto_rcv *rcv = (struct perfetto_rcv *)r;
+    int i;
+
+    // Serialize the whole batch before writing, so that we only need to call
+    // fwrite once.  Batches come from the watchdog, signal-safe spans and
+    // the like, which deliver spans closed on other threads, so the calling
+    // thread's track would be the wrong place for them.
+    pthread_mutex_lock(&rcv->lock);
+    for (i = 0; i < num_spans; i++) {
+        pf_put_span(rcv, spans + i, PERFETTO_NO_TID);
+    }
+    pf_write_out(rcv, "perfetto_rcv_add_spans");
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+static void perfetto_rcv_flush(struct htrace_rcv *r)
+{
+    struct perfetto_rcv *rcv = (struct perfetto_rcv *)r;
+    int ret;
+
+    pthread_mutex_lock(&rcv->lock);
+    ret = fflush(rcv->fp);
+    pthread_mutex_unlock(&rcv->lock);
+    if (ret < 0) {
+        int e = errno;
+        htrace_logl(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                    "perfetto_rcv_flush(path=%s): fflush "
+                    "error: %s\n", rcv->path, terror(e));
+    }
+}
+
+static void perfetto_rcv_free(struct htrace_rcv *r)
+{
+    struct perfetto_rcv *rcv = (struct perfetto_rcv *)r;
+    int ret;
+    struct htrace_log *lg;
+
+    if (!rcv) {
+        return;
+    }
+    lg = rcv->tracer->lg;
+    htrace_log(lg, "Shutting down perfetto receiver with path=%s\n",
+               rcv->path);
+    ret = pthread_mutex_destroy(&rcv->lock);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "perfetto_rcv_free: pthread_mutex_destroy "
+                    "error %d: %s\n", ret, terror(ret));
+    }
+    if (rcv->fp) {
+        ret = fclose(rcv->fp);
+        if (ret) {
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "perfetto_rcv_free: fclose error "
+                        "%d: %s\n", ret, terror(ret));
+        }
+    }
+    if (rcv->names) {
+        htable_visit(rcv->names, pf_free_key, NULL);
+        htable_free(rcv->names);
+    }
+    if (rcv->tids) {
+        htable_free(rcv->tids);
+    }
+    if (rcv->traces) {
+        htable_visit(rcv->traces, pf_free_key, NULL);
+        htable_free(rcv->traces);
+    }
+    pf_buf_free(&rcv->out);
+    pf_buf_free(&rcv->pkt);
+    pf_buf_free(&rcv->ev);
+    pf_buf_free(&rcv->interned);
+    pf_buf_free(&rcv->sub);
+    free(rcv->path);
+    free(rcv);
+}
+
+const struct htrace_rcv_ty g_perfetto_rcv_ty = {
+    "perfetto",
+    perfetto_rcv_create,
+    perfetto_rcv_add_span,
+    perfetto_rcv_add_spans,
+    perfetto_rcv_flush,
+    perfetto_rcv_free,
+    NULL,
+    NULL,
+};
+
+// vim:ts=4:sw=4:et
@@ -29,6 +29,9 @@ const struct htrace_rcv_ty * const g_rcv_tys[] = {
     &g_noop_rcv_ty,
     &g_local_file_rcv_ty,
     &g_htraced_rcv_ty,
+    &g_ftrace_rcv_ty,
+    &g_perfetto_rcv_ty,
+    &g_zipkin_rcv_ty,
     NULL,
 };
 
@@ -58,8 +61,9 @@ static const struct htrace_rcv_ty *select_rcv_ty(struct htracer *tracer,
             prefix = ", ";
         }
     }
-    htrace_log(tracer->lg, "Unknown span receiver type as '%s'.  Valid "
-               "span receiver types are: %s\n", tstr, buf);
+    htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                "Unknown span receiver type as '%s'.  Valid "
+                "span receiver types are: %s\n", tstr, buf);
     return &g_noop_rcv_ty;
 }
 
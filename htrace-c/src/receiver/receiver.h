@@ -27,6 +27,8 @@
  * This is an internal header, not intended for external use.
  */
 
+#include <stdint.h>
+
 struct htrace_conf;
 struct htrace_span;
 struct htracer;
@@ -73,6 +75,19 @@ struct htrace_rcv_ty {
      */
     void (*add_span)(struct htrace_rcv *rcv, struct htrace_span *span);
 
+    /**
+     * Callback to add several spans at once.
+     *
+     * Receivers should take whatever locks they need once for the whole
+     * batch, rather than once per span.
+     *
+     * @param rcv           The HTrace span receiver.
+     * @param spans         An array of trace spans to add.
+     * @param num_spans     The number of spans in the array.
+     */
+    void (*add_spans)(struct htrace_rcv *rcv, struct htrace_span *spans,
+                      int num_spans);
+
     /**
      * Flush all buffered spans to the backing store used by this receiver.
      *
@@ -86,6 +101,38 @@ struct htrace_rcv_ty {
      * @param rcv           The HTrace span receiver.
      */
     void (*free)(struct htrace_rcv *rcv);
+
+    /**
+     * Frees this HTrace span receiver, giving up on any buffered spans which
+     * can't be delivered by a deadline.
+     *
+     * This is NULL for receivers whose free callback can't block for long.
+     *
+     * @param rcv           The HTrace span receiver.
+     * @param deadline_ms   The monotonic-clock time by which we must be done.
+     *
+     * @return              The number of buffered spans which couldn't be
+     *                          delivered.
+     */
+    uint64_t (*shutdown)(struct htrace_rcv *rcv, uint64_t deadline_ms);
+
+    /**
+     * Start flushing the spans added so far, without waiting for it to finish.
+     *
+     * This is NULL for receivers whose flush callback can't block for long.
+     *
+     * @param rcv           The HTrace span receiver.
+     * @param cb            The callback to invoke once every span added
+     *                          before this call has been delivered or given
+     *                          up on.  err is 0 if they were all delivered.
+     *                          The callback is invoked from a receiver thread.
+     * @param arg           The argument to pass to the callback.
+     *
+     * @return              0 on success; an error code if the callback won't
+     *                          be invoked.
+     */
+    int (*flush_async)(struct htrace_rcv *rcv,
+                       void (*cb)(void *arg, int err), void *arg);
 };
 
 /**
@@ -105,9 +152,12 @@ struct htrace_rcv *htrace_rcv_create(struct htracer *tracer,
 /*
  * HTrace span receiver types.
  */
-const struct htrace_rcv_ty g_noop_rcv_ty;
-const struct htrace_rcv_ty g_local_file_rcv_ty;
-const struct htrace_rcv_ty g_htraced_rcv_ty;
+extern const struct htrace_rcv_ty g_noop_rcv_ty;
+extern const struct htrace_rcv_ty g_local_file_rcv_ty;
+extern const struct htrace_rcv_ty g_htraced_rcv_ty;
+extern const struct htrace_rcv_ty g_ftrace_rcv_ty;
+extern const struct htrace_rcv_ty g_perfetto_rcv_ty;
+extern const struct htrace_rcv_ty g_zipkin_rcv_ty;
 
 #endif
 
@@ -0,0 +1,1089 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/http.h"
+#include "receiver/receiver.h"
+#include "util/log.h"
+#include "util/membudget.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file zipkin.c
+ *
+ * A span receiver which sends spans to a Zipkin collector, using the Zipkin
+ * v2 JSON format.
+ *
+ * Like the htraced receiver, this receiver has two send buffers.  Spans are
+ * serialized into the active buffer as they are added, and a transmitter
+ * thread flips the buffers and sends the inactive one, so that adding spans
+ * never waits on the network.  A buffer which holds more than
+ * zipkin.request.size bytes of spans is sent as several requests, which are
+ * pipelined over one keep-alive connection.
+ *
+ * HTrace span IDs are 128 bits.  The upper 64 bits are shared by every span
+ * in a trace, so they become the Zipkin trace ID, and the lower 64 bits
+ * become the Zipkin span ID.
+ */
+
+#define ZIPKIN_DEFAULT_PORT 9411
+
+#define ZIPKIN_CONTENT_TYPE "application/json"
+
+/**
+ * The minimum and maximum total sizes of the send buffers.
+ */
+#define ZIPKIN_MIN_BUFFER_SIZE (64ULL * 1024ULL)
+#define ZIPKIN_MAX_BUFFER_SIZE (1024ULL * 1024ULL * 1024ULL)
+
+/**
+ * The minimum and maximum sizes of a request body.
+ */
+#define ZIPKIN_MIN_REQUEST_SIZE 1024ULL
+#define ZIPKIN_MAX_REQUEST_SIZE (64ULL * 1024ULL * 1024ULL)
+
+/**
+ * How much memory a send buffer starts out with.  It grows as needed, up to
+ * half of zipkin.buffer.size.
+ */
+#define ZIPKIN_INITIAL_BUF_LEN (16ULL * 1024ULL)
+
+#define ZIPKIN_FLUSH_INTERVAL_MS_MIN 10ULL
+#define ZIPKIN_FLUSH_INTERVAL_MS_MAX 86400000ULL
+
+#define ZIPKIN_TIMEO_MS_MIN 50ULL
+
+/**
+ * The maximum number of times to try to find space for a span.
+ */
+#define ZIPKIN_MAX_ADD_TRIES 3
+
+/**
+ * The maximum number of times to try to send a buffer.
+ */
+#define ZIPKIN_MAX_SEND_TRIES 3
+
+/**
+ * The minimum number of milliseconds between rate-limited warnings.
+ */
+#define ZIPKIN_LOG_INTERVAL_MS 10000
+
+#define ZIPKIN_NUM_BUFS 2
+
+/**
+ * One request's worth of spans in a send buffer.
+ */
+struct zipkin_req {
+    /**
+     * The offset in the buffer just past the request's last span.
+     */
+    uint64_t end;
+
+    /**
+     * The number of spans in the request.
+     */
+    uint64_t num_spans;
+};
+
+/**
+ * A send buffer.
+ *
+ * Each span is serialized as a JSON object followed by a comma.  When a
+ * request is sent, the spans are wrapped in brackets and the last comma is
+ * left out.
+ */
+struct zipkin_sbuf {
+    /**
+     * The buffer.  Malloced.
+     */
+    char *buf;
+
+    /**
+     * The number of bytes allocated for the buffer.
+     */
+    uint64_t cap;
+
+    /**
+     * The number of bytes used.
+     */
+    uint64_t off;
+
+    /**
+     * The number of spans in the buffer.
+     */
+    uint64_t num_spans;
+
+    /**
+     * The sequence number of the first span in the buffer.
+     */
+    uint64_t first_seq;
+
+    /**
+     * The requests which the buffer will be sent as.  Malloced.
+     */
+    struct zipkin_req *reqs;
+    int num_reqs;
+    int max_reqs;
+};
+
+/**
+ * A request to be called back once the spans added up to a certain point have
+ * been sent.
+ */
+struct zipkin_flush_waiter {
+    /**
+     * The next waiter in the list.
+     */
+    struct zipkin_flush_waiter *next;
+
+    /**
+     * We are done once every span with a sequence number below this one has
+     * been sent or dropped.
+     */
+    uint64_t target_seq;
+
+    /**
+     * The value of num_dropped when the waiter was added.
+     */
+    uint64_t num_dropped;
+
+    /**
+     * The callback and its argument.
+     */
+    void (*cb)(void *arg, int err);
+    void *arg;
+};
+
+struct zipkin_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The HTrace log object.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * The HTTP client.
+     */
+    struct http_client *hcli;
+
+    /**
+     * The path to post spans to.  Malloced.
+     */
+    char *path;
+
+    /**
+     * The maximum length of time to go before sending spans.
+     */
+    uint64_t flush_interval_ms;
+
+    /**
+     * The maximum size of each send buffer.
+     */
+    uint64_t buf_len;
+
+    /**
+     * The number of buffered bytes which triggers a send.
+     */
+    uint64_t send_threshold;
+
+    /**
+     * The maximum size of a request body.
+     */
+    uint64_t req_len;
+
+    /**
+     * The send buffers.
+     */
+    struct zipkin_sbuf sbuf[ZIPKIN_NUM_BUFS];
+
+    /**
+     * The index of the buffer which spans are being added to.
+     */
+    int active_buf;
+
+    /**
+     * The sequence number to give the next span added.
+     */
+    uint64_t next_seq;
+
+    /**
+     * The transmitter thread sends any buffer with spans below this sequence
+     * number right away.
+     */
+    uint64_t flush_seq;
+
+    /**
+     * The monotonic time in ms of the last send.
+     */
+    uint64_t last_send_ms;
+
+    /**
+     * The monotonic-clock time by which we must shut down, or 0 if there is
+     * no deadline.  Accessed atomically.
+     */
+    uint64_t deadline_ms;
+
+    /**
+     * The number of spans which we gave up on.  Accessed atomically.
+     */
+    uint64_t num_dropped;
+
+    /**
+     * The flush_async requests which haven't completed yet.
+     */
+    struct zipkin_flush_waiter *waiters;
+
+    /**
+     * Nonzero if the transmitter thread should exit.
+     */
+    int shutdown;
+
+    /**
+     * Nonzero once the transmitter thread has sent its last spans.
+     */
+    int exited;
+
+    /**
+     * Lock protecting the fields above.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Condition variable which wakes up the transmitter thread.
+     */
+    pthread_cond_t bg_cond;
+
+    /**
+     * Condition variable which is signalled after each send.
+     */
+    pthread_cond_t flush_cond;
+
+    /**
+     * The transmitter thread.
+     */
+    pthread_t xmit_thread;
+};
+
+static void *run_zipkin_xmit_manager(void *data);
+static void zipkin_xmit(struct zipkin_rcv *rcv, uint64_t now);
+
+static uint64_t zipkin_get_bounded_u64(struct htrace_log *lg,
+                const struct htrace_conf *cnf, const char *prop,
+                uint64_t min, uint64_t max)
+{
+    uint64_t val = htrace_conf_get_u64(lg, cnf, prop);
+    if (val < min) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "zipkin_rcv_create: can't set %s to %"PRId64
+                    ".  Using minimum value of %"PRId64 " instead.\n", prop,
+                    val, min);
+        return min;
+    } else if (val > max) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "zipkin_rcv_create: can't set %s to %"PRId64
+                    ".  Using maximum value of %"PRId64 " instead.\n", prop,
+                    val, max);
+        return max;
+    }
+    return val;
+}
+
+/**
+ * Serialize a span as a Zipkin v2 JSON object, followed by a comma.
+ *
+ * @param rcv           The zipkin receiver.
+ * @param span          The span.
+ * @param max           The size of the buffer.
+ * @param buf           The buffer, or NULL to just get the length.
+ *
+ * @return              The serialized length, not including the terminating
+ *                          null which is written after it.
+ */
+static int zipkin_span_json(const struct zipkin_rcv *rcv,
+                            const struct htrace_span *span, int max, char *buf)
+{
+    char **bufp = buf ? &buf : NULL;
+    char sbuf[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    const char *prefix = "";
+    int i, ret = 0;
+
+    // The description and tracer ID have already been validated, so they
+    // don't need to be escaped.
+    ret += fwdprintf(bufp, &max, "{\"traceId\":\"%016" PRIx64 "\","
+                     "\"id\":\"%016" PRIx64 "\",", span->span_id.high,
+                     span->span_id.low);
+    if (span->num_parents == 1) {
+        ret += fwdprintf(bufp, &max, "\"parentId\":\"%016" PRIx64 "\",",
+                         span->parent.single.low);
+    } else if (span->num_parents > 1) {
+        ret += fwdprintf(bufp, &max, "\"parentId\":\"%016" PRIx64 "\",",
+                         span->parent.list[0].low);
+    }
+    if (span->desc[0]) {
+        ret += fwdprintf(bufp, &max, "\"name\":\"%s\",", span->desc);
+    }
+    // Zipkin durations are at least one microsecond.
+    ret += fwdprintf(bufp, &max, "\"timestamp\":%" PRIu64 ",\"duration\":%"
+                     PRIu64 ",\"localEndpoint\":{\"serviceName\":\"%s\"}",
+                     span->begin_ms, (span->end_ms > span->begin_ms) ?
+                        (span->end_ms - span->begin_ms) : (uint64_t)1,
+                     rcv->tracer->trid);
+    if ((span->num_parents > 1) || (span->flags & HTRACE_SPAN_FLAG_INFLIGHT)) {
+        ret += fwdprintf(bufp, &max, ",\"tags\":{");
+        if (span->num_parents > 1) {
+            // Zipkin spans only have one parent, so list all of them here.
+            ret += fwdprintf(bufp, &max, "\"htrace.parents\":\"");
+            for (i = 0; i < span->num_parents; i++) {
+                htrace_span_id_to_str(span->parent.list + i, sbuf,
+                                      sizeof(sbuf));
+                ret += fwdprintf(bufp, &max, "%s%s", prefix, sbuf);
+                prefix = ",";
+            }
+            ret += fwdprintf(bufp, &max, "\"");
+            prefix = ",";
+        }
+        if (span->flags & HTRACE_SPAN_FLAG_INFLIGHT) {
+            ret += fwdprintf(bufp, &max, "%s\"htrace.inflight\":\"true\"",
+                             prefix);
+        }
+        ret += fwdprintf(bufp, &max, "}");
+    }
+    ret += fwdprintf(bufp, &max, "},");
+    return ret;
+}
+
+/**
+ * The sequence number below which every span is done.
+ *
+ * This function must be called with the lock held.
+ */
+static uint64_t zipkin_done_seq(struct zipkin_rcv *rcv)
+{
+    uint64_t done = rcv->next_seq;
+    int i;
+
+    for (i = 0; i < ZIPKIN_NUM_BUFS; i++) {
+        if (rcv->sbuf[i].num_spans && (rcv->sbuf[i].first_seq < done)) {
+            done = rcv->sbuf[i].first_seq;
+        }
+    }
+    return done;
+}
+
+/**
+ * Ask the transmitter thread to send every span added so far.
+ *
+ * This function must be called with the lock held.
+ *
+ * @return              The sequence number which zipkin_done_seq will reach
+ *                          once those spans are done.
+ */
+static uint64_t zipkin_request_flush(struct zipkin_rcv *rcv)
+{
+    uint64_t target = rcv->next_seq;
+
+    if (rcv->flush_seq < target) {
+        rcv->flush_seq = target;
+    }
+    pthread_cond_signal(&rcv->bg_cond);
+    return target;
+}
+
+/**
+ * Complete the asynchronous flush requests whose spans are all done.
+ *
+ * This function must be called with the lock held.  The lock is released while
+ * the callbacks run.
+ */
+static void zipkin_run_waiters(struct zipkin_rcv *rcv)
+{
+    struct zipkin_flush_waiter *ready = NULL, *waiter, **prev;
+    uint64_t done, num_dropped;
+
+    done = zipkin_done_seq(rcv);
+    prev = &rcv->waiters;
+    while ((waiter = *prev)) {
+        if (waiter->target_seq <= done) {
+            *prev = waiter->next;
+            waiter->next = ready;
+            ready = waiter;
+        } else {
+            prev = &waiter->next;
+        }
+    }
+    if (!ready) {
+        return;
+    }
+    num_dropped = __atomic_load_n(&rcv->num_dropped, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rcv->lock);
+    while (ready) {
+        waiter = ready;
+        ready = waiter->next;
+        waiter->cb(waiter->arg,
+                   (waiter->num_dropped != num_dropped) ? EIO : 0);
+        free(waiter);
+    }
+    pthread_mutex_lock(&rcv->lock);
+}
+
+/**
+ * Determine if the shutdown deadline has passed.
+ */
+static int zipkin_past_deadline(struct zipkin_rcv *rcv)
+{
+    uint64_t deadline_ms;
+
+    deadline_ms = __atomic_load_n(&rcv->deadline_ms, __ATOMIC_RELAXED);
+    return deadline_ms && (monotonic_now_ms(rcv->lg) >= deadline_ms);
+}
+
+static void zipkin_sbuf_clear(struct zipkin_sbuf *sbuf)
+{
+    sbuf->off = 0;
+    sbuf->num_spans = 0;
+    sbuf->num_reqs = 0;
+}
+
+static void zipkin_sbuf_free(struct zipkin_sbuf *sbuf)
+{
+    if (sbuf->cap) {
+        membudget_release(sbuf->cap);
+    }
+    free(sbuf->buf);
+    free(sbuf->reqs);
+    memset(sbuf, 0, sizeof(*sbuf));
+}
+
+static struct htrace_rcv *zipkin_rcv_create(struct htracer *tracer,
+                                            const struct htrace_conf *conf)
+{
+    struct zipkin_rcv *rcv;
+    const char *endpoint, *path;
+    uint64_t timeo_ms;
+    int ret;
+
+    endpoint = htrace_conf_get(conf, HTRACE_ZIPKIN_ADDRESS_KEY);
+    if (!endpoint) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_create: no value found for %s. "
+                    "You must set this configuration key to the hostname "
+                    "and port of the Zipkin collector.\n",
+                    HTRACE_ZIPKIN_ADDRESS_KEY);
+        return NULL;
+    }
+    path = htrace_conf_get(conf, HTRACE_ZIPKIN_PATH_KEY);
+    rcv = calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_create: OOM while "
+                    "allocating zipkin_rcv.\n");
+        return NULL;
+    }
+    rcv->base.ty = &g_zipkin_rcv_ty;
+    rcv->tracer = tracer;
+    rcv->lg = tracer->lg;
+    rcv->path = strdup(path ? path : "/api/v2/spans");
+    if (!rcv->path) {
+        htrace_logl(rcv->lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_create: OOM while "
+                    "allocating the path.\n");
+        goto error;
+    }
+    rcv->flush_interval_ms = zipkin_get_bounded_u64(rcv->lg, conf,
+                HTRACE_ZIPKIN_FLUSH_INTERVAL_MS_KEY,
+                ZIPKIN_FLUSH_INTERVAL_MS_MIN, ZIPKIN_FLUSH_INTERVAL_MS_MAX);
+    timeo_ms = zipkin_get_bounded_u64(rcv->lg, conf,
+                HTRACE_ZIPKIN_TIMEO_MS_KEY, ZIPKIN_TIMEO_MS_MIN,
+                0x7fffffffffffffffULL);
+    rcv->buf_len = zipkin_get_bounded_u64(rcv->lg, conf,
+                HTRACE_ZIPKIN_BUFFER_SIZE_KEY, ZIPKIN_MIN_BUFFER_SIZE,
+                ZIPKIN_MAX_BUFFER_SIZE) / ZIPKIN_NUM_BUFS;
+    rcv->req_len = zipkin_get_bounded_u64(rcv->lg, conf,
+                HTRACE_ZIPKIN_REQUEST_SIZE_KEY, ZIPKIN_MIN_REQUEST_SIZE,
+                ZIPKIN_MAX_REQUEST_SIZE);
+    rcv->send_threshold = rcv->buf_len / 2;
+    rcv->hcli = http_client_alloc(rcv->lg, timeo_ms, timeo_ms, endpoint,
+                                  ZIPKIN_DEFAULT_PORT);
+    if (!rcv->hcli) {
+        goto error;
+    }
+    rcv->last_send_ms = monotonic_now_ms(rcv->lg);
+    ret = pthread_mutex_init(&rcv->lock, NULL);
+    if (ret) {
+        htrace_logl(rcv->lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_create: pthread_mutex_init "
+                    "error %d: %s\n", ret, terror(ret));
+        goto error_free_hcli;
+    }
+    ret = monotonic_cond_init(&rcv->bg_cond);
+    if (ret) {
+        htrace_logl(rcv->lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_create: pthread_cond_init("
+                    "bg_cond) error %d: %s\n", ret, terror(ret));
+        goto error_free_lock;
+    }
+    ret = monotonic_cond_init(&rcv->flush_cond);
+    if (ret) {
+        htrace_logl(rcv->lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_create: pthread_cond_init("
+                    "flush_cond) error %d: %s\n", ret, terror(ret));
+        goto error_free_bg_cond;
+    }
+    ret = pthread_create(&rcv->xmit_thread, NULL,
+                         run_zipkin_xmit_manager, rcv);
+    if (ret) {
+        htrace_logl(rcv->lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_create: failed to create xmit "
+                    "thread: error %d: %s\n", ret, terror(ret));
+        goto error_free_flush_cond;
+    }
+    htrace_log(rcv->lg, "Initialized zipkin receiver for http://%s%s"
+                ", flush_interval_ms=%" PRId64 ", timeo_ms=%" PRId64
+                ", buf_len=%" PRId64 ", req_len=%" PRId64 ".\n",
+                http_client_get_endpoint(rcv->hcli), rcv->path,
+                rcv->flush_interval_ms, timeo_ms, rcv->buf_len, rcv->req_len);
+    return (struct htrace_rcv*)rcv;
+
+error_free_flush_cond:
+    pthread_cond_destroy(&rcv->flush_cond);
+error_free_bg_cond:
+    pthread_cond_destroy(&rcv->bg_cond);
+error_free_lock:
+    pthread_mutex_destroy(&rcv->lock);
+error_free_hcli:
+    http_client_free(rcv->hcli);
+error:
+    free(rcv->path);
+    free(rcv);
+    return NULL;
+}
+
+/**
+ * Determine if the transmitter thread should send.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The zipkin receiver.
+ * @param now           The current monotonic time in milliseconds.
+ *
+ * @return              nonzero if we should send now.
+ */
+static int should_xmit(struct zipkin_rcv *rcv, uint64_t now)
+{
+    const struct zipkin_sbuf *sbuf = &rcv->sbuf[rcv->active_buf];
+
+    if (!sbuf->num_spans) {
+        return 0;
+    }
+    if (sbuf->off > rcv->send_threshold) {
+        // We have buffered a lot of bytes, so let's send.
+        return 1;
+    }
+    if (sbuf->first_seq < rcv->flush_seq) {
+        // Someone is waiting for spans in this buffer to be sent.
+        return 1;
+    }
+    // Send if it's been too long since the last transmission.
+    return (now - rcv->last_send_ms > rcv->flush_interval_ms);
+}
+
+static void *run_zipkin_xmit_manager(void *data)
+{
+    struct zipkin_rcv *rcv = data;
+    struct htrace_log *lg = rcv->lg;
+    uint64_t now, wakeup;
+    struct timespec wakeup_ts;
+    int ret;
+
+    pthread_mutex_lock(&rcv->lock);
+    while (1) {
+        now = monotonic_now_ms(lg);
+        while (should_xmit(rcv, now)) {
+            zipkin_xmit(rcv, now);
+            zipkin_run_waiters(rcv);
+        }
+        zipkin_run_waiters(rcv);
+        if (rcv->shutdown) {
+            // Send what's left.  zipkin_xmit gives up right away once the
+            // deadline has passed.
+            while (rcv->sbuf[rcv->active_buf].num_spans) {
+                zipkin_xmit(rcv, now);
+            }
+            zipkin_run_waiters(rcv);
+            rcv->exited = 1;
+            pthread_cond_broadcast(&rcv->flush_cond);
+            break;
+        }
+        wakeup = now + (rcv->flush_interval_ms / 2) + 1;
+        ms_to_timespec(wakeup, &wakeup_ts);
+        ret = pthread_cond_timedwait(&rcv->bg_cond, &rcv->lock, &wakeup_ts);
+        if ((ret != 0) && (ret != ETIMEDOUT)) {
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "run_zipkin_xmit_manager: pthread_cond_timedwait "
+                        "error: %d (%s)\n", ret, terror(ret));
+        }
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    htrace_log(lg, "run_zipkin_xmit_manager: shutting down the transmission "
+               "manager thread.\n");
+    return NULL;
+}
+
+/**
+ * Send the requests in a send buffer.
+ *
+ * @param rcv           The zipkin receiver.
+ * @param sbuf          The send buffer.
+ *
+ * @return              The number of requests, counting from the first, which
+ *                          were sent.
+ */
+static int zipkin_sbuf_send(struct zipkin_rcv *rcv, struct zipkin_sbuf *sbuf)
+{
+    struct iovec *iov;
+    struct http_body *bodies;
+    uint64_t start = 0;
+    int i, sent = 0, tries = 0, retry;
+
+    iov = malloc(sizeof(*iov) * 3 * sbuf->num_reqs);
+    bodies = malloc(sizeof(*bodies) * sbuf->num_reqs);
+    if ((!iov) || (!bodies)) {
+        htrace_logl(rcv->lg, HTRACE_LOG_ERROR, "zipkin_sbuf_send: OOM\n");
+        goto done;
+    }
+    for (i = 0; i < sbuf->num_reqs; i++) {
+        iov[3 * i].iov_base = "[";
+        iov[3 * i].iov_len = 1;
+        iov[(3 * i) + 1].iov_base = sbuf->buf + start;
+        // Leave out the comma after the last span.
+        iov[(3 * i) + 1].iov_len = sbuf->reqs[i].end - start - 1;
+        iov[(3 * i) + 2].iov_base = "]";
+        iov[(3 * i) + 2].iov_len = 1;
+        bodies[i].iov = iov + (3 * i);
+        bodies[i].iov_cnt = 3;
+        start = sbuf->reqs[i].end;
+    }
+    while (1) {
+        sent += http_client_post(rcv->hcli, rcv->path, ZIPKIN_CONTENT_TYPE,
+                                 bodies + sent, sbuf->num_reqs - sent);
+        if (sent == sbuf->num_reqs) {
+            break;
+        }
+        tries++;
+        retry = (tries < ZIPKIN_MAX_SEND_TRIES) &&
+            (!zipkin_past_deadline(rcv));
+        HTRACE_LOG_RATE_LIMITED(rcv->lg, HTRACE_LOG_WARN,
+                   ZIPKIN_LOG_INTERVAL_MS, "zipkin_xmit(%s) failed on try "
+                   "%d with %d of %d request(s) sent.  %s\n",
+                   http_client_get_endpoint(rcv->hcli), tries, sent,
+                   sbuf->num_reqs, (retry ? "Retrying." : "Giving up."));
+        if (!retry) {
+            break;
+        }
+    }
+done:
+    free(iov);
+    free(bodies);
+    return sent;
+}
+
+static void zipkin_xmit(struct zipkin_rcv *rcv, uint64_t now)
+{
+    struct zipkin_sbuf *sbuf;
+    uint64_t num_dropped = 0;
+    int i, sent = 0;
+
+    // Flip to the other buffer.
+    sbuf = &rcv->sbuf[rcv->active_buf];
+    rcv->active_buf = !rcv->active_buf;
+
+    // Release the lock while doing network I/O, so that we don't block threads
+    // adding spans.
+    pthread_mutex_unlock(&rcv->lock);
+    if (!zipkin_past_deadline(rcv)) {
+        sent = zipkin_sbuf_send(rcv, sbuf);
+    }
+    for (i = sent; i < sbuf->num_reqs; i++) {
+        num_dropped += sbuf->reqs[i].num_spans;
+    }
+    if (num_dropped) {
+        __atomic_add_fetch(&rcv->num_dropped, num_dropped, __ATOMIC_RELAXED);
+        HTRACE_LOG_RATE_LIMITED(rcv->lg, HTRACE_LOG_WARN,
+                   ZIPKIN_LOG_INTERVAL_MS, "zipkin_xmit(%s): dropped %"
+                   PRId64 " span(s) which couldn't be sent.\n",
+                   http_client_get_endpoint(rcv->hcli), num_dropped);
+    }
+    pthread_mutex_lock(&rcv->lock);
+    zipkin_sbuf_clear(sbuf);
+    rcv->last_send_ms = now;
+    pthread_cond_broadcast(&rcv->flush_cond);
+}
+
+/**
+ * Make sure that a send buffer has room for another span.
+ *
+ * This function must be called with the lock held.
+ *
+ * @return              1 on success; 0 if the buffer is full or we are out
+ *                          of memory.
+ */
+static int zipkin_sbuf_reserve(struct zipkin_sbuf *sbuf, uint64_t need,
+                               uint64_t buf_len)
+{
+    uint64_t ncap;
+    char *nbuf;
+
+    if (sbuf->off + need <= sbuf->cap) {
+        return 1;
+    }
+    if (sbuf->off + need > buf_len) {
+        return 0;
+    }
+    ncap = sbuf->cap ? sbuf->cap : ZIPKIN_INITIAL_BUF_LEN;
+    while (ncap < sbuf->off + need) {
+        ncap *= 2;
+    }
+    if (ncap > buf_len) {
+        ncap = buf_len;
+    }
+    if (!membudget_reserve(ncap - sbuf->cap)) {
+        return 0;
+    }
+    nbuf = realloc(sbuf->buf, ncap);
+    if (!nbuf) {
+        membudget_release(ncap - sbuf->cap);
+        return 0;
+    }
+    sbuf->buf = nbuf;
+    sbuf->cap = ncap;
+    return 1;
+}
+
+/**
+ * Find room in the active buffer for a serialized span.
+ *
+ * This function must be called with the lock held.  It may release and
+ * re-acquire the lock while waiting for the transmitter thread to free up
+ * some space, but the lock will always be held when it returns.
+ *
+ * @param rcv           The zipkin receiver.
+ * @param len           The serialized length of the span, plus room for a
+ *                          terminating null.
+ *
+ * @return              The active buffer, if it has enough space; NULL if we
+ *                          gave up waiting for space or ran out of memory.
+ */
+static struct zipkin_sbuf *zipkin_get_space(struct zipkin_rcv *rcv,
+                                            uint64_t len)
+{
+    struct zipkin_sbuf *sbuf;
+    struct zipkin_req *nreqs;
+    int tries = 0, retry, nmax;
+
+    while (1) {
+        sbuf = &rcv->sbuf[rcv->active_buf];
+        if (sbuf->num_reqs == sbuf->max_reqs) {
+            nmax = sbuf->max_reqs ? (sbuf->max_reqs * 2) : 4;
+            nreqs = realloc(sbuf->reqs, sizeof(*nreqs) * nmax);
+            if (!nreqs) {
+                return NULL;
+            }
+            sbuf->reqs = nreqs;
+            sbuf->max_reqs = nmax;
+        }
+        if (zipkin_sbuf_reserve(sbuf, len, rcv->buf_len)) {
+            return sbuf;
+        }
+        if (sbuf->off + len <= rcv->buf_len) {
+            // We're out of memory or over the tracing memory budget.
+            return NULL;
+        }
+        pthread_cond_signal(&rcv->bg_cond);
+        pthread_mutex_unlock(&rcv->lock);
+        tries++;
+        retry = tries < ZIPKIN_MAX_ADD_TRIES;
+        if (retry) {
+            sched_yield();
+        }
+        pthread_mutex_lock(&rcv->lock);
+        if (!retry) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Serialize a span into a send buffer.
+ *
+ * This function must be called with the lock held.
+ */
+static void zipkin_sbuf_append(struct zipkin_rcv *rcv,
+                               struct zipkin_sbuf *sbuf,
+                               const struct htrace_span *span, int len)
+{
+    struct zipkin_req *req = NULL;
+    uint64_t req_start = 0;
+
+    if (sbuf->num_reqs > 0) {
+        req = &sbuf->reqs[sbuf->num_reqs - 1];
+        if (sbuf->num_reqs > 1) {
+            req_start = sbuf->reqs[sbuf->num_reqs - 2].end;
+        }
+        if (req->end - req_start + len > rcv->req_len) {
+            // Start a new request.  zipkin_get_space made sure that there is
+            // room for it.
+            req = NULL;
+        }
+    }
+    if (!req) {
+        req = &sbuf->reqs[sbuf->num_reqs++];
+        req->num_spans = 0;
+    }
+    zipkin_span_json(rcv, span, len + 1, sbuf->buf + sbuf->off);
+    sbuf->off += len;
+    req->end = sbuf->off;
+    req->num_spans++;
+    if (!sbuf->num_spans) {
+        sbuf->first_seq = rcv->next_seq;
+    }
+    sbuf->num_spans++;
+    rcv->next_seq++;
+    if (sbuf->off > rcv->send_threshold) {
+        pthread_cond_signal(&rcv->bg_cond);
+    }
+}
+
+/**
+ * Add a span.  This function must be called with the lock held.
+ *
+ * @return              1 if the span was added; 0 if it was dropped.
+ */
+static int zipkin_add_span(struct zipkin_rcv *rcv,
+                           const struct htrace_span *span)
+{
+    struct zipkin_sbuf *sbuf;
+    int len;
+
+    len = zipkin_span_json(rcv, span, 0, NULL);
+    sbuf = zipkin_get_space(rcv, len + 1);
+    if (!sbuf) {
+        __atomic_add_fetch(&rcv->num_dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    zipkin_sbuf_append(rcv, sbuf, span, len);
+    return 1;
+}
+
+static void zipkin_rcv_add_span(struct htrace_rcv *r,
+                                struct htrace_span *span)
+{
+    struct zipkin_rcv *rcv = (struct zipkin_rcv *)r;
+    int added;
+
+    pthread_mutex_lock(&rcv->lock);
+    added = zipkin_add_span(rcv, span);
+    pthread_mutex_unlock(&rcv->lock);
+    if (!added) {
+        HTRACE_LOG_RATE_LIMITED(rcv->lg, HTRACE_LOG_WARN,
+                   ZIPKIN_LOG_INTERVAL_MS, "zipkin_rcv_add_span: no space "
+                   "for the span.  Dropping it.\n");
+    }
+}
+
+static void zipkin_rcv_add_spans(struct htrace_rcv *r,
+                                 struct htrace_span *spans, int num_spans)
+{
+    struct zipkin_rcv *rcv = (struct zipkin_rcv *)r;
+    int i, num_dropped = 0;
+
+    // Take the lock once for the whole batch.
+    pthread_mutex_lock(&rcv->lock);
+    for (i = 0; i < num_spans; i++) {
+        if (!zipkin_add_span(rcv, spans + i)) {
+            num_dropped++;
+        }
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    if (num_dropped) {
+        HTRACE_LOG_RATE_LIMITED(rcv->lg, HTRACE_LOG_WARN,
+                   ZIPKIN_LOG_INTERVAL_MS, "zipkin_rcv_add_spans: dropped "
+                   "%d out of %d span(s).\n", num_dropped, num_spans);
+    }
+}
+
+static void zipkin_rcv_flush(struct htrace_rcv *r)
+{
+    struct zipkin_rcv *rcv = (struct zipkin_rcv *)r;
+    uint64_t target;
+
+    pthread_mutex_lock(&rcv->lock);
+    target = zipkin_request_flush(rcv);
+    while ((zipkin_done_seq(rcv) < target) && (!rcv->exited)) {
+        pthread_cond_wait(&rcv->flush_cond, &rcv->lock);
+    }
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+static int zipkin_rcv_flush_async(struct htrace_rcv *r,
+                                  void (*cb)(void *arg, int err), void *arg)
+{
+    struct zipkin_rcv *rcv = (struct zipkin_rcv *)r;
+    struct zipkin_flush_waiter *waiter;
+
+    waiter = malloc(sizeof(*waiter));
+    if (!waiter) {
+        htrace_logl(rcv->lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_flush_async: OOM\n");
+        return ENOMEM;
+    }
+    waiter->cb = cb;
+    waiter->arg = arg;
+    pthread_mutex_lock(&rcv->lock);
+    waiter->target_seq = zipkin_request_flush(rcv);
+    waiter->num_dropped = __atomic_load_n(&rcv->num_dropped,
+                                          __ATOMIC_RELAXED);
+    waiter->next = rcv->waiters;
+    rcv->waiters = waiter;
+    pthread_mutex_unlock(&rcv->lock);
+    return 0;
+}
+
+/**
+ * Free a zipkin receiver.
+ *
+ * @param rcv           The zipkin receiver.
+ * @param deadline_ms   The monotonic-clock time by which we must be done, or
+ *                          0 if there is no deadline.
+ *
+ * @return              The number of buffered spans which couldn't be sent.
+ */
+static uint64_t zipkin_rcv_free_impl(struct zipkin_rcv *rcv,
+                                     uint64_t deadline_ms)
+{
+    struct htrace_log *lg = rcv->lg;
+    struct timespec deadline_ts;
+    uint64_t num_dropped;
+    int i, ret;
+
+    htrace_log(lg, "Shutting down zipkin receiver for %s\n",
+               http_client_get_endpoint(rcv->hcli));
+    num_dropped = __atomic_load_n(&rcv->num_dropped, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&rcv->lock);
+    rcv->shutdown = 1;
+    __atomic_store_n(&rcv->deadline_ms, deadline_ms, __ATOMIC_RELAXED);
+    pthread_cond_signal(&rcv->bg_cond);
+    if (deadline_ms) {
+        ms_to_timespec(deadline_ms, &deadline_ts);
+        while (!rcv->exited) {
+            ret = pthread_cond_timedwait(&rcv->flush_cond, &rcv->lock,
+                                         &deadline_ts);
+            if (ret == ETIMEDOUT) {
+                // Unblock the transmitter thread if it is waiting on the
+                // network.
+                http_client_interrupt(rcv->hcli);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    ret = pthread_join(rcv->xmit_thread, NULL);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_free: pthread_join "
+                    "error %d: %s\n", ret, terror(ret));
+    }
+    num_dropped = __atomic_load_n(&rcv->num_dropped, __ATOMIC_RELAXED) -
+        num_dropped;
+    if (rcv->num_dropped) {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "zipkin_rcv_free: over the life of the receiver, %"
+                    PRId64 " span(s) were dropped.\n", rcv->num_dropped);
+    }
+    for (i = 0; i < ZIPKIN_NUM_BUFS; i++) {
+        zipkin_sbuf_free(&rcv->sbuf[i]);
+    }
+    http_client_free(rcv->hcli);
+    ret = pthread_mutex_destroy(&rcv->lock);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_free: pthread_mutex_destroy "
+                    "error %d: %s\n", ret, terror(ret));
+    }
+    ret = pthread_cond_destroy(&rcv->bg_cond);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_free: pthread_cond_destroy(bg_cond) "
+                    "error %d: %s\n", ret, terror(ret));
+    }
+    ret = pthread_cond_destroy(&rcv->flush_cond);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "zipkin_rcv_free: pthread_cond_destroy(flush_cond) "
+                    "error %d: %s\n", ret, terror(ret));
+    }
+    free(rcv->path);
+    free(rcv);
+    return num_dropped;
+}
+
+static void zipkin_rcv_free(struct htrace_rcv *r)
+{
+    struct zipkin_rcv *rcv = (struct zipkin_rcv *)r;
+
+    if (!rcv) {
+        return;
+    }
+    zipkin_rcv_free_impl(rcv, 0);
+}
+
+static uint64_t zipkin_rcv_shutdown(struct htrace_rcv *r,
+                                    uint64_t deadline_ms)
+{
+    return zipkin_rcv_free_impl((struct zipkin_rcv *)r, deadline_ms);
+}
+
+const struct htrace_rcv_ty g_zipkin_rcv_ty = {
+    "zipkin",
+    zipkin_rcv_create,
+    zipkin_rcv_add_span,
+    zipkin_rcv_add_spans,
+    zipkin_rcv_flush,
+    zipkin_rcv_free,
+    zipkin_rcv_shutdown,
+    zipkin_rcv_flush_async,
+};
+
+// vim:ts=4:sw=4:et
@@ -47,11 +47,23 @@ struct prob_sampler {
     char *name;
 
     /**
-     * The threshold at which we should sample.
+     * Names from before the sampler was reconfigured.  We can't free these
+     * until the sampler is freed, since to_str callers may still hold them.
+     */
+    struct prob_sampler_name *old_names;
+
+    /**
+     * The threshold at which we should sample.  Accessed atomically, since
+     * it may be changed by reconfiguration.
      */
     uint32_t threshold;
 };
 
+struct prob_sampler_name {
+    struct prob_sampler_name *next;
+    char *name;
+};
+
 static double get_prob_sampler_threshold(struct htrace_log *lg,
                                          const struct htrace_conf *conf);
 static struct htrace_sampler *prob_sampler_create(struct htracer *tracer,
@@ -59,6 +71,8 @@ static struct htrace_sampler *prob_sampler_create(struct htracer *tracer,
 static const char *prob_sampler_to_str(struct htrace_sampler *s);
 static int prob_sampler_next(struct htrace_sampler *s);
 static void prob_sampler_free(struct htrace_sampler *s);
+static void prob_sampler_reconfigure(struct htrace_sampler *s,
+                                     const struct htrace_conf *conf);
 
 const struct htrace_sampler_ty g_prob_sampler_ty = {
     "prob",
@@ -66,6 +80,7 @@ const struct htrace_sampler_ty g_prob_sampler_ty = {
     prob_sampler_to_str,
     prob_sampler_next,
     prob_sampler_free,
+    prob_sampler_reconfigure,
 };
 
 static double get_prob_sampler_threshold(struct htrace_log *lg,
@@ -74,12 +89,14 @@ static double get_prob_sampler_threshold(struct htrace_log *lg,
     double fraction =
         htrace_conf_get_double(lg, conf, HTRACE_PROB_SAMPLER_FRACTION_KEY);
     if (fraction < 0) {
-        htrace_log(lg, "sampler_create: can't have a sampling fraction "
-                   "less than 0.  Setting fraction to 0.\n");
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "sampler_create: can't have a sampling fraction "
+                    "less than 0.  Setting fraction to 0.\n");
         fraction = 0.0;
     } else if (fraction > 1.0) {
-        htrace_log(lg, "sampler_create: can't have a sampling fraction "
-                   "greater than 1.  Setting fraction to 1.\n");
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "sampler_create: can't have a sampling fraction "
+                    "greater than 1.  Setting fraction to 1.\n");
         fraction = 1.0;
     }
     return fraction;
@@ -93,13 +110,15 @@ static struct htrace_sampler *prob_sampler_create(struct htracer *tracer,
 
     smp = calloc(1, sizeof(*smp));
     if (!smp) {
-        htrace_log(tracer->lg, "prob_sampler_create: OOM\n");
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "prob_sampler_create: OOM\n");
         return NULL;
     }
     smp->base.ty = &g_prob_sampler_ty;
     smp->rnd = random_src_alloc(tracer->lg);
     if (!smp->rnd) {
-        htrace_log(tracer->lg, "random_src_alloc failed.\n");
+        htrace_logl(tracer->lg, HTRACE_LOG_ERROR,
+                    "random_src_alloc failed.\n");
         free(smp);
         return NULL;
     }
@@ -110,6 +129,7 @@ static struct htrace_sampler *prob_sampler_create(struct htracer *tracer,
         smp->name = NULL;
         random_src_free(smp->rnd);
         free(smp);
+        return NULL;
     }
     return (struct htrace_sampler *)smp;
 }
@@ -117,21 +137,56 @@ static struct htrace_sampler *prob_sampler_create(struct htracer *tracer,
 static const char *prob_sampler_to_str(struct htrace_sampler *s)
 {
     struct prob_sampler *smp = (struct prob_sampler *)s;
-    return smp->name;
+    return __atomic_load_n(&smp->name, __ATOMIC_ACQUIRE);
 }
 
 static int prob_sampler_next(struct htrace_sampler *s)
 {
     struct prob_sampler *smp = (struct prob_sampler *)s;
-    return random_u32(smp->rnd) < smp->threshold;
+    return random_u32(smp->rnd) <
+        __atomic_load_n(&smp->threshold, __ATOMIC_RELAXED);
 }
 
 static void prob_sampler_free(struct htrace_sampler *s)
 {
     struct prob_sampler *smp = (struct prob_sampler *)s;
+    struct prob_sampler_name *old;
+
     random_src_free(smp->rnd);
     free(smp->name);
+    while ((old = smp->old_names)) {
+        smp->old_names = old->next;
+        free(old->name);
+        free(old);
+    }
     free(smp);
 }
 
+static void prob_sampler_reconfigure(struct htrace_sampler *s,
+                                     const struct htrace_conf *conf)
+{
+    struct prob_sampler *smp = (struct prob_sampler *)s;
+    struct htrace_log *lg = s->tracer->lg;
+    struct prob_sampler_name *old;
+    double fraction;
+    char *name;
+
+    fraction = get_prob_sampler_threshold(lg, conf);
+    __atomic_store_n(&smp->threshold, (uint32_t)(0xffffffffLU * fraction),
+                     __ATOMIC_RELAXED);
+    old = calloc(1, sizeof(*old));
+    if (!old) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "prob_sampler_reconfigure: OOM\n");
+        return;
+    }
+    if (asprintf(&name, "ProbabilitySampler(fraction=%.03g)", fraction) < 0) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "prob_sampler_reconfigure: OOM\n");
+        free(old);
+        return;
+    }
+    old->name = __atomic_exchange_n(&smp->name, name, __ATOMIC_ACQ_REL);
+    old->next = smp->old_names;
+    smp->old_names = old;
+}
+
 // vim: ts=4:sw=4:tw=79:et
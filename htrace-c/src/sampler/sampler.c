@@ -61,8 +61,9 @@ static const struct htrace_sampler_ty *select_sampler_ty(
             prefix = ", ";
         }
     }
-    htrace_log(tracer->lg, "Unknown sampler type '%s'.  Valid "
-               "sampler types are: %s\n", tstr, buf);
+    htrace_logl(tracer->lg, HTRACE_LOG_WARN,
+                "Unknown sampler type '%s'.  Valid "
+                "sampler types are: %s\n", tstr, buf);
     return &g_never_sampler_ty;
 }
 
@@ -70,9 +71,14 @@ struct htrace_sampler *htrace_sampler_create(struct htracer *tracer,
                                              struct htrace_conf *cnf)
 {
     const struct htrace_sampler_ty *ty;
+    struct htrace_sampler *smp;
 
     ty = select_sampler_ty(tracer, cnf);
-    return ty->create(tracer, cnf);
+    smp = ty->create(tracer, cnf);
+    if (smp && ty->reconfigure) {
+        htracer_register_sampler(tracer, smp);
+    }
+    return smp;
 }
 
 const char *htrace_sampler_to_str(struct htrace_sampler *smp)
@@ -82,6 +88,9 @@ const char *htrace_sampler_to_str(struct htrace_sampler *smp)
 
 void htrace_sampler_free(struct htrace_sampler *smp)
 {
+    if (smp->ty->reconfigure) {
+        htracer_unregister_sampler(smp);
+    }
     return smp->ty->free(smp);
 }
 
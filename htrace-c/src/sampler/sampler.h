@@ -43,6 +43,17 @@ struct htrace_sampler {
      * The type of the sampler.
      */
     const struct htrace_sampler_ty *ty;
+
+    /**
+     * The tracer this sampler is registered with for reconfiguration, or NULL
+     * if it is not registered.  Managed by the tracer.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The next sampler registered with the tracer.  Managed by the tracer.
+     */
+    struct htrace_sampler *reconf_next;
 };
 
 /**
@@ -98,6 +109,20 @@ struct htrace_sampler_ty {
      * @param rcv           The HTrace sampler.
      */
     void (*free)(struct htrace_sampler *smp);
+
+    /**
+     * Apply a new configuration to this HTrace sampler, or NULL if samplers
+     * of this type have nothing to reconfigure.
+     *
+     * This callback may be called while other threads are calling next.  It
+     * will not be called concurrently with itself.
+     *
+     * @param smp           The HTrace sampler.
+     * @param conf          The new configuration.  The sampler must not hold
+     *                          on to this pointer.
+     */
+    void (*reconfigure)(struct htrace_sampler *smp,
+                        const struct htrace_conf *conf);
 };
 
 /**
@@ -0,0 +1,106 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "test/test.h"
+#include "util/bufmem.h"
+#include "util/log.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_BUF_LEN (2 * 1024 * 1024)
+
+static struct htrace_conf *g_test_conf;
+
+static struct htrace_log *g_test_lg;
+
+static int test_parse(void)
+{
+    EXPECT_INT_EQ(BUFMEM_HUGE_PAGES_NONE, bufmem_parse_huge_pages("none"));
+    EXPECT_INT_EQ(BUFMEM_HUGE_PAGES_TRANSPARENT,
+                  bufmem_parse_huge_pages("transparent"));
+    EXPECT_INT_EQ(BUFMEM_HUGE_PAGES_EXPLICIT,
+                  bufmem_parse_huge_pages("explicit"));
+    EXPECT_INT_EQ(-1, bufmem_parse_huge_pages("always"));
+    EXPECT_INT_EQ(BUFMEM_PREFAULT_NONE, bufmem_parse_prefault("none"));
+    EXPECT_INT_EQ(BUFMEM_PREFAULT_POPULATE,
+                  bufmem_parse_prefault("populate"));
+    EXPECT_INT_EQ(BUFMEM_PREFAULT_LOCK, bufmem_parse_prefault("lock"));
+    EXPECT_INT_EQ(-1, bufmem_parse_prefault(""));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Allocate a buffer with the given options, and check that we can use all of
+ * it.  Options which the host can't honor should degrade gracefully rather
+ * than failing the allocation.
+ */
+static int test_alloc(int huge_pages, int prefault, int numa_node)
+{
+    struct bufmem_opts opts;
+    uint8_t *buf;
+    size_t i;
+
+    opts.huge_pages = huge_pages;
+    opts.prefault = prefault;
+    opts.numa_node = numa_node;
+    buf = bufmem_alloc(g_test_lg, &opts, TEST_BUF_LEN);
+    EXPECT_NONNULL(buf);
+    EXPECT_UINTPTR_EQ((uintptr_t)0, ((uintptr_t)buf) % 4096);
+    if (huge_pages != BUFMEM_HUGE_PAGES_NONE) {
+        // The buffer should be aligned so that a huge page can back it.
+        EXPECT_UINTPTR_EQ((uintptr_t)0, ((uintptr_t)buf) % TEST_BUF_LEN);
+    }
+    for (i = 0; i < TEST_BUF_LEN; i++) {
+        if (buf[i] != 0) {
+            fail("buf[%zu] was 0x%02x, not zero.\n", i, buf[i]);
+        }
+    }
+    memset(buf, 0xa5, TEST_BUF_LEN);
+    EXPECT_INT_EQ(0xa5, buf[TEST_BUF_LEN - 1]);
+    bufmem_free(buf, TEST_BUF_LEN);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    g_test_conf = htrace_conf_from_strs("", "");
+    g_test_lg = htrace_log_alloc(g_test_conf);
+
+    EXPECT_INT_ZERO(test_parse());
+    EXPECT_INT_ZERO(test_alloc(BUFMEM_HUGE_PAGES_NONE,
+                               BUFMEM_PREFAULT_NONE, -1));
+    EXPECT_INT_ZERO(test_alloc(BUFMEM_HUGE_PAGES_TRANSPARENT,
+                               BUFMEM_PREFAULT_NONE, -1));
+    EXPECT_INT_ZERO(test_alloc(BUFMEM_HUGE_PAGES_EXPLICIT,
+                               BUFMEM_PREFAULT_POPULATE, -1));
+    EXPECT_INT_ZERO(test_alloc(BUFMEM_HUGE_PAGES_NONE,
+                               BUFMEM_PREFAULT_LOCK, -1));
+    EXPECT_INT_ZERO(test_alloc(BUFMEM_HUGE_PAGES_TRANSPARENT,
+                               BUFMEM_PREFAULT_POPULATE, 0));
+    bufmem_free(NULL, TEST_BUF_LEN);
+
+    htrace_log_free(g_test_lg);
+    htrace_conf_free(g_test_conf);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,266 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test/test.h"
+#include "util/cmap.h"
+#include "util/epoch.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint32_t ptr_hash(const void *key)
+{
+    uint64_t k = (uintptr_t)key;
+
+    // The 64-bit MurmurHash3 finalizer.
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (uint32_t)k;
+}
+
+static int ptr_compare(const void *a, const void *b)
+{
+    return a == b;
+}
+
+/**
+ * A value in the stress test.  Values are freed through the epoch domain, so
+ * readers can safely check their contents.
+ */
+struct cmap_test_val {
+    struct epoch_entry entry;
+    uintptr_t key;
+};
+
+static void cmap_test_val_free(struct epoch_entry *entry)
+{
+    free(entry);
+}
+
+static void count_entries(void *ctx, void *key, void *val)
+{
+    uint32_t *count = ctx;
+    struct cmap_test_val *tval = val;
+
+    if (tval->key != (uintptr_t)key) {
+        abort();
+    }
+    (*count)++;
+}
+
+static int test_cmap_basic(void)
+{
+    struct epoch_domain *ed;
+    struct cmap *map;
+    struct cmap_test_val vals[1000];
+    void *k, *v;
+    uintptr_t i;
+    uint32_t count = 0;
+
+    ed = epoch_domain_alloc();
+    EXPECT_NONNULL(ed);
+    map = cmap_alloc(4, ptr_hash, ptr_compare, ed);
+    EXPECT_NONNULL(map);
+    EXPECT_INT_ZERO(cmap_size(map));
+    EXPECT_NULL(cmap_get(map, (void*)1));
+    EXPECT_INT_EQ(EINVAL, cmap_put(map, NULL, vals));
+    EXPECT_INT_EQ(EINVAL, cmap_put(map, (void*)1, NULL));
+    for (i = 0; i < 1000; i++) {
+        vals[i].key = i + 1;
+        EXPECT_INT_ZERO(cmap_put(map, (void*)(i + 1), vals + i));
+    }
+    EXPECT_INT_EQ(1000, cmap_size(map));
+    EXPECT_TRUE((cmap_capacity(map) >= 1000));
+    EXPECT_INT_EQ(EEXIST, cmap_put(map, (void*)1, vals + 1));
+    EXPECT_TRUE((vals == cmap_get(map, (void*)1)));
+    for (i = 0; i < 1000; i++) {
+        EXPECT_TRUE((vals + i == cmap_get(map, (void*)(i + 1))));
+    }
+    cmap_visit(map, count_entries, &count);
+    EXPECT_INT_EQ(1000, count);
+    for (i = 0; i < 1000; i += 2) {
+        cmap_remove(map, (void*)(i + 1), &k, &v);
+        EXPECT_TRUE((k == (void*)(i + 1)));
+        EXPECT_TRUE((v == vals + i));
+    }
+    cmap_remove(map, (void*)1, &k, &v);
+    EXPECT_NULL(k);
+    EXPECT_NULL(v);
+    EXPECT_INT_EQ(500, cmap_size(map));
+    for (i = 0; i < 1000; i++) {
+        if (i & 1) {
+            EXPECT_TRUE((vals + i == cmap_get(map, (void*)(i + 1))));
+        } else {
+            EXPECT_NULL(cmap_get(map, (void*)(i + 1)));
+        }
+    }
+    cmap_free(map);
+    epoch_domain_free(ed);
+    return EXIT_SUCCESS;
+}
+
+#define CMAP_STRESS_NUM_THREADS 4
+#define CMAP_STRESS_NUM_KEYS 2048
+#define CMAP_STRESS_NUM_OPS 200000
+
+struct cmap_stress_ctx {
+    struct cmap *map;
+    struct epoch_domain *ed;
+    unsigned int seed;
+    int write_pct;
+    int num_ops;
+    int errors;
+};
+
+static void *cmap_stress_thread(void *arg)
+{
+    struct cmap_stress_ctx *ctx = arg;
+    struct cmap_test_val *tval;
+    uintptr_t key;
+    void *k, *v;
+    int i, op, token;
+
+    for (i = 0; i < ctx->num_ops; i++) {
+        key = 1 + (rand_r(&ctx->seed) % CMAP_STRESS_NUM_KEYS);
+        op = rand_r(&ctx->seed) % 100;
+        if (op >= ctx->write_pct) {
+            token = epoch_enter(ctx->ed);
+            tval = cmap_get(ctx->map, (void*)key);
+            if (tval && (tval->key != key)) {
+                ctx->errors++;
+            }
+            epoch_exit(ctx->ed, token);
+        } else if (op & 1) {
+            tval = malloc(sizeof(*tval));
+            if (!tval) {
+                ctx->errors++;
+                continue;
+            }
+            tval->key = key;
+            if (cmap_put(ctx->map, (void*)key, tval)) {
+                free(tval);
+            }
+        } else {
+            cmap_remove(ctx->map, (void*)key, &k, &v);
+            if (v) {
+                tval = v;
+                if ((tval->key != key) || (k != (void*)key)) {
+                    ctx->errors++;
+                }
+                epoch_retire(ctx->ed, &tval->entry, cmap_test_val_free);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void free_val(void *ctx, void *key, void *val)
+{
+    free(val);
+}
+
+static double timespec_diff_s(const struct timespec *a,
+                              const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + ((b->tv_nsec - a->tv_nsec) / 1e9);
+}
+
+/**
+ * Run a mix of gets, puts, and removes on many threads at once.
+ *
+ * @param write_pct     The percentage of operations which are writes.
+ * @param prefill       Nonzero if every key should be present at the start.
+ * @param print         Nonzero to print the throughput.
+ */
+static int cmap_stress(int write_pct, int prefill, int print)
+{
+    struct cmap_stress_ctx ctx[CMAP_STRESS_NUM_THREADS];
+    pthread_t threads[CMAP_STRESS_NUM_THREADS];
+    struct epoch_domain *ed;
+    struct cmap *map;
+    struct cmap_test_val *tval;
+    struct timespec t0, t1;
+    uint32_t count = 0;
+    uintptr_t key;
+    int i;
+
+    ed = epoch_domain_alloc();
+    EXPECT_NONNULL(ed);
+    map = cmap_alloc(16, ptr_hash, ptr_compare, ed);
+    EXPECT_NONNULL(map);
+    for (key = 1; prefill && (key <= CMAP_STRESS_NUM_KEYS); key++) {
+        tval = malloc(sizeof(*tval));
+        EXPECT_NONNULL(tval);
+        tval->key = key;
+        EXPECT_INT_ZERO(cmap_put(map, (void*)key, tval));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < CMAP_STRESS_NUM_THREADS; i++) {
+        ctx[i].map = map;
+        ctx[i].ed = ed;
+        ctx[i].seed = i + 1;
+        ctx[i].write_pct = write_pct;
+        ctx[i].num_ops = CMAP_STRESS_NUM_OPS;
+        ctx[i].errors = 0;
+        EXPECT_INT_ZERO(pthread_create(&threads[i], NULL,
+                                       cmap_stress_thread, &ctx[i]));
+    }
+    for (i = 0; i < CMAP_STRESS_NUM_THREADS; i++) {
+        EXPECT_INT_ZERO(pthread_join(threads[i], NULL));
+        EXPECT_INT_ZERO(ctx[i].errors);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (print) {
+        fprintf(stderr, "cmap_stress: %d threads, %d%% writes: "
+                "%.2f Mops/s\n", CMAP_STRESS_NUM_THREADS, write_pct,
+                (CMAP_STRESS_NUM_THREADS * (double)CMAP_STRESS_NUM_OPS) /
+                    timespec_diff_s(&t0, &t1) / 1e6);
+    }
+    cmap_visit(map, count_entries, &count);
+    EXPECT_INT_EQ(count, cmap_size(map));
+    cmap_visit(map, free_val, NULL);
+    cmap_free(map);
+    epoch_domain_free(ed);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_cmap_basic());
+    // Write-heavy, starting from an empty map, to exercise growth and
+    // reclamation under contention.
+    EXPECT_INT_ZERO(cmap_stress(50, 0, 0));
+    // Benchmarks.  These only run when HTRACE_CMAP_BENCH is set in the
+    // environment, so that normal test runs stay quiet.
+    if (getenv("HTRACE_CMAP_BENCH")) {
+        EXPECT_INT_ZERO(cmap_stress(0, 1, 1));
+        EXPECT_INT_ZERO(cmap_stress(10, 1, 1));
+    }
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
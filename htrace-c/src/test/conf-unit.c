@@ -102,10 +102,28 @@ static int test_double_conf(void)
     return EXIT_SUCCESS;
 }
 
+static int test_copy_conf(void)
+{
+    struct htrace_conf *conf, *copy;
+
+    conf = htrace_conf_from_strs("foo=bar;foo2=baz", "foo2=default2;foo3=x");
+    EXPECT_NONNULL(conf);
+    copy = htrace_conf_copy(conf);
+    EXPECT_NONNULL(copy);
+    htrace_conf_free(conf);
+    EXPECT_STR_EQ("bar", htrace_conf_get(copy, "foo"));
+    EXPECT_STR_EQ("baz", htrace_conf_get(copy, "foo2"));
+    EXPECT_STR_EQ("x", htrace_conf_get(copy, "foo3"));
+    EXPECT_NULL(htrace_conf_get(copy, "unknown"));
+    htrace_conf_free(copy);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     test_simple_conf();
     test_double_conf();
+    test_copy_conf();
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,165 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test/test.h"
+#include "util/epoch.h"
+#include "util/time.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct epoch_test_obj {
+    struct epoch_entry entry;
+    int *num_freed;
+};
+
+static void epoch_test_obj_free(struct epoch_entry *entry)
+{
+    struct epoch_test_obj *obj = (struct epoch_test_obj *)entry;
+    __atomic_add_fetch(obj->num_freed, 1, __ATOMIC_SEQ_CST);
+    free(obj);
+}
+
+static struct epoch_test_obj *epoch_test_obj_alloc(int *num_freed)
+{
+    struct epoch_test_obj *obj = calloc(1, sizeof(*obj));
+    if (obj) {
+        obj->num_freed = num_freed;
+    }
+    return obj;
+}
+
+struct epoch_test_ctx {
+    struct epoch_domain *ed;
+    struct epoch_test_obj *obj;
+};
+
+static void *epoch_test_retire_thread(void *arg)
+{
+    struct epoch_test_ctx *ctx = arg;
+
+    epoch_retire(ctx->ed, &ctx->obj->entry, epoch_test_obj_free);
+    epoch_synchronize(ctx->ed);
+    return NULL;
+}
+
+/**
+ * Test that an object is not freed while a reader which might see it is still
+ * in its read section.
+ */
+static int test_epoch_waits_for_readers(void)
+{
+    struct epoch_test_ctx ctx;
+    pthread_t thread;
+    int token, inner, num_freed = 0;
+
+    ctx.ed = epoch_domain_alloc();
+    EXPECT_NONNULL(ctx.ed);
+    ctx.obj = epoch_test_obj_alloc(&num_freed);
+    EXPECT_NONNULL(ctx.obj);
+    token = epoch_enter(ctx.ed);
+    // Read sections may nest.
+    inner = epoch_enter(ctx.ed);
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, epoch_test_retire_thread,
+                                   &ctx));
+    sleep_ms(50);
+    EXPECT_INT_ZERO(__atomic_load_n(&num_freed, __ATOMIC_SEQ_CST));
+    epoch_exit(ctx.ed, inner);
+    sleep_ms(10);
+    EXPECT_INT_ZERO(__atomic_load_n(&num_freed, __ATOMIC_SEQ_CST));
+    epoch_exit(ctx.ed, token);
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    EXPECT_INT_EQ(1, num_freed);
+    epoch_domain_free(ctx.ed);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that retired objects are freed by reclamation or when the domain is
+ * freed.
+ */
+static int test_epoch_retire_many(void)
+{
+    struct epoch_domain *ed;
+    struct epoch_test_obj *obj;
+    int i, num_freed = 0;
+
+    ed = epoch_domain_alloc();
+    EXPECT_NONNULL(ed);
+    for (i = 0; i < 10000; i++) {
+        obj = epoch_test_obj_alloc(&num_freed);
+        EXPECT_NONNULL(obj);
+        epoch_retire(ed, &obj->entry, epoch_test_obj_free);
+    }
+    // Most of the objects should have been reclaimed along the way.
+    EXPECT_TRUE((num_freed > 5000));
+    epoch_synchronize(ed);
+    EXPECT_INT_EQ(10000, num_freed);
+    obj = epoch_test_obj_alloc(&num_freed);
+    EXPECT_NONNULL(obj);
+    epoch_retire(ed, &obj->entry, epoch_test_obj_free);
+    epoch_domain_free(ed);
+    EXPECT_INT_EQ(10001, num_freed);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that retiring many objects from inside a read section does not wait
+ * for that read section, and that none of them are freed until it exits.
+ */
+static int test_epoch_retire_in_read_section(void)
+{
+    struct epoch_domain *ed;
+    struct epoch_test_obj *obj;
+    int i, token, num_freed = 0;
+
+    ed = epoch_domain_alloc();
+    EXPECT_NONNULL(ed);
+    token = epoch_enter(ed);
+    for (i = 0; i < 10000; i++) {
+        obj = epoch_test_obj_alloc(&num_freed);
+        EXPECT_NONNULL(obj);
+        epoch_retire(ed, &obj->entry, epoch_test_obj_free);
+    }
+    EXPECT_INT_ZERO(__atomic_load_n(&num_freed, __ATOMIC_SEQ_CST));
+    epoch_exit(ed, token);
+    for (i = 0; i < 10000; i++) {
+        obj = epoch_test_obj_alloc(&num_freed);
+        EXPECT_NONNULL(obj);
+        epoch_retire(ed, &obj->entry, epoch_test_obj_free);
+    }
+    // Once the reader is gone, later retires can reclaim the backlog.
+    EXPECT_INT_GT(10000, num_freed);
+    epoch_synchronize(ed);
+    EXPECT_INT_EQ(20000, num_freed);
+    epoch_domain_free(ed);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_epoch_waits_for_readers());
+    EXPECT_INT_ZERO(test_epoch_retire_many());
+    EXPECT_INT_ZERO(test_epoch_retire_in_read_section());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,386 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/flight_reader.h"
+#include "core/htrace.h"
+#include "core/span_id.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file flight_recorder-unit.c
+ *
+ * Tests the flight recorder.
+ */
+
+#define TEST_TRID "flight_recorder-unit"
+
+/**
+ * The configuration for these tests.  The arguments are the flight recorder
+ * path, the sampler, and any extra settings, each preceded by a semicolon.
+ */
+#define FR_CONF_FMT \
+    HTRACE_FLIGHT_RECORDER_PATH_KEY "=%s;" \
+    HTRACE_SAMPLER_KEY "=%s;" \
+    HTRACE_SPAN_RECEIVER_KEY "=noop;" \
+    HTRACE_TRACER_ID "=" TEST_TRID "%s"
+
+struct thread_ctx {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    int num_spans;
+};
+
+static void *close_spans(void *data)
+{
+    struct thread_ctx *ctx = data;
+    struct htrace_scope *scope;
+    int i;
+
+    for (i = 0; i < ctx->num_spans; i++) {
+        scope = htrace_start_spanf(ctx->tracer, ctx->smp, "thread %d", i);
+        htrace_scope_close(scope);
+    }
+    return NULL;
+}
+
+static int run_thread(struct htracer *tracer, struct htrace_sampler *smp,
+                      int num_spans)
+{
+    struct thread_ctx ctx;
+    pthread_t thread;
+
+    ctx.tracer = tracer;
+    ctx.smp = smp;
+    ctx.num_spans = num_spans;
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, close_spans, &ctx));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    return EXIT_SUCCESS;
+}
+
+static const struct fr_span *find_span(const struct fr_file *file,
+                                       const char *desc)
+{
+    uint64_t i;
+
+    for (i = 0; i < file->num_spans; i++) {
+        if (!strcmp(file->spans[i].desc, desc)) {
+            return file->spans + i;
+        }
+    }
+    return NULL;
+}
+
+static int test_record(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *outer, *inner;
+    const struct fr_span *fouter, *finner;
+    struct fr_file file;
+    char *path, err[512];
+
+    EXPECT_TRUE((asprintf(&path, "%s/record.fr", tdir) > 0));
+    cnf = test_conf(FR_CONF_FMT, path, "always",
+                    ";" HTRACE_FLIGHT_RECORDER_SLOTS_KEY "=4;"
+                    HTRACE_FLIGHT_RECORDER_THREADS_KEY "=2");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_recorder-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+
+    outer = htrace_start_span(tracer, smp, "outer");
+    EXPECT_NONNULL(outer);
+    inner = htrace_start_span(tracer, smp, "inner");
+    EXPECT_NONNULL(inner);
+    htrace_scope_close(inner);
+    htrace_scope_close(outer);
+    // Only the last 4 spans closed by the thread are kept.
+    EXPECT_INT_ZERO(run_thread(tracer, smp, 6));
+
+    // The file can be read while the tracer is still running.
+    err[0] = '\0';
+    EXPECT_INT_ZERO(fr_file_read(path, &file, err, sizeof(err)));
+    EXPECT_STR_EQ("", err);
+    EXPECT_STR_EQ(TEST_TRID, file.trid);
+    EXPECT_UINT64_EQ((uint64_t)getpid(), file.pid);
+    EXPECT_UINT64_EQ((uint64_t)0, file.num_lost);
+    EXPECT_UINT64_EQ((uint64_t)6, file.num_spans);
+    fouter = find_span(&file, "outer");
+    EXPECT_NONNULL(fouter);
+    finner = find_span(&file, "inner");
+    EXPECT_NONNULL(finner);
+    EXPECT_INT_EQ(0, fouter->num_parents);
+    EXPECT_INT_EQ(1, finner->num_parents);
+    EXPECT_UINT64_EQ(fouter->span_id_high, finner->parent_high);
+    EXPECT_UINT64_EQ(fouter->span_id_low, finner->parent_low);
+    EXPECT_TRUE((fouter->tid == finner->tid));
+    EXPECT_NULL(find_span(&file, "thread 1"));
+    EXPECT_NONNULL(find_span(&file, "thread 2"));
+    EXPECT_NONNULL(find_span(&file, "thread 5"));
+    EXPECT_TRUE((find_span(&file, "thread 5")->tid != fouter->tid));
+    fr_file_free(&file);
+
+    // The thread which exited gave up its ring, so another thread can
+    // take it over.
+    EXPECT_INT_ZERO(run_thread(tracer, smp, 1));
+    EXPECT_INT_ZERO(fr_file_read(path, &file, err, sizeof(err)));
+    EXPECT_UINT64_EQ((uint64_t)0, file.num_lost);
+    EXPECT_NONNULL(find_span(&file, "thread 0"));
+    fr_file_free(&file);
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    // The file outlives the tracer.
+    EXPECT_INT_ZERO(fr_file_read(path, &file, err, sizeof(err)));
+    EXPECT_NONNULL(find_span(&file, "outer"));
+    fr_file_free(&file);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that spans which the sampler drops reach the flight recorder, if it
+ * asks for them.
+ */
+static int test_unsampled(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *outer, *inner;
+    struct htrace_span_id id;
+    const struct fr_span *fouter, *finner;
+    struct fr_file file;
+    char *path, err[512];
+
+    // By default, a span which isn't traced doesn't get a scope.
+    EXPECT_TRUE((asprintf(&path, "%s/dropped.fr", tdir) > 0));
+    cnf = test_conf(FR_CONF_FMT, path, "never", "");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_recorder-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    EXPECT_NULL(htrace_start_span(tracer, smp, "dropped"));
+    EXPECT_NULL(htrace_start_spanf(tracer, smp, "dropped %d", 1));
+    err[0] = '\0';
+    EXPECT_INT_ZERO(fr_file_read(path, &file, err, sizeof(err)));
+    EXPECT_STR_EQ("", err);
+    EXPECT_UINT64_EQ((uint64_t)0, file.num_spans);
+    fr_file_free(&file);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(path);
+
+    EXPECT_TRUE((asprintf(&path, "%s/unsampled.fr", tdir) > 0));
+    cnf = test_conf(FR_CONF_FMT, path, "never",
+                    ";" HTRACE_FLIGHT_RECORDER_UNSAMPLED_KEY "=true");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_recorder-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+
+    outer = htrace_start_span(tracer, smp, "outer");
+    EXPECT_NONNULL(outer);
+    // The span isn't traced, so it has no ID to propagate, and can't be
+    // detached.
+    htrace_scope_get_span_id(outer, &id);
+    EXPECT_INT_ZERO(htrace_span_id_compare(&id, &INVALID_SPAN_ID));
+    EXPECT_NULL(htrace_scope_detach(outer));
+    inner = htrace_start_spanf(tracer, smp, "inner %d", 1);
+    EXPECT_NONNULL(inner);
+    htrace_scope_close(inner);
+    // A formatted description is cut to the length the recorder keeps.
+    inner = htrace_start_spanf(tracer, smp, "%s", "0123456789012345678901234"
+                               "567890123456789012345678901234567890");
+    EXPECT_NONNULL(inner);
+    htrace_scope_close(inner);
+    htrace_scope_close(outer);
+
+    err[0] = '\0';
+    EXPECT_INT_ZERO(fr_file_read(path, &file, err, sizeof(err)));
+    EXPECT_STR_EQ("", err);
+    EXPECT_UINT64_EQ((uint64_t)3, file.num_spans);
+    fouter = find_span(&file, "outer");
+    EXPECT_NONNULL(fouter);
+    finner = find_span(&file, "inner 1");
+    EXPECT_NONNULL(finner);
+    EXPECT_INT_EQ(0, fouter->num_parents);
+    EXPECT_INT_EQ(1, finner->num_parents);
+    EXPECT_UINT64_EQ(fouter->span_id_high, finner->parent_high);
+    EXPECT_UINT64_EQ(fouter->span_id_low, finner->parent_low);
+    finner = find_span(&file, "0123456789012345678901234567890123456789"
+                       "012345678901234");
+    EXPECT_NONNULL(finner);
+    EXPECT_UINT64_EQ(fouter->span_id_low, finner->parent_low);
+    fr_file_free(&file);
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_lost(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    struct fr_file file;
+    char *path, err[512];
+
+    EXPECT_TRUE((asprintf(&path, "%s/lost.fr", tdir) > 0));
+    cnf = test_conf(FR_CONF_FMT, path, "always",
+                    ";" HTRACE_FLIGHT_RECORDER_THREADS_KEY "=1");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_recorder-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    scope = htrace_start_span(tracer, smp, "main");
+    htrace_scope_close(scope);
+    EXPECT_INT_ZERO(run_thread(tracer, smp, 3));
+    err[0] = '\0';
+    EXPECT_INT_ZERO(fr_file_read(path, &file, err, sizeof(err)));
+    EXPECT_STR_EQ("", err);
+    EXPECT_UINT64_EQ((uint64_t)1, file.num_spans);
+    EXPECT_UINT64_EQ((uint64_t)3, file.num_lost);
+    fr_file_free(&file);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int g_old_sigusr2_calls;
+
+static void old_sigusr2_handler(int sig)
+{
+    (void)sig;
+    g_old_sigusr2_calls++;
+}
+
+static int test_dump(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    struct fr_file file;
+    struct sigaction act;
+    char *path, *copy_path, *sig_path, err[512];
+
+    EXPECT_TRUE((asprintf(&path, "%s/dump.fr", tdir) > 0));
+    EXPECT_TRUE((asprintf(&copy_path, "%s/copy.fr", tdir) > 0));
+    EXPECT_TRUE((asprintf(&sig_path, "%s.dump", path) > 0));
+    // A SIGUSR2 handler which was there first should still be called.
+    EXPECT_TRUE((signal(SIGUSR2, old_sigusr2_handler) != SIG_ERR));
+    cnf = test_conf(FR_CONF_FMT, path, "always",
+                    ";" HTRACE_FLIGHT_RECORDER_SIGNAL_KEY "=true");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_recorder-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    scope = htrace_start_span(tracer, smp, "before dump");
+    htrace_scope_close(scope);
+
+    EXPECT_INT_ZERO(htracer_flight_recorder_dump(tracer, copy_path));
+    err[0] = '\0';
+    EXPECT_INT_ZERO(fr_file_read(copy_path, &file, err, sizeof(err)));
+    EXPECT_STR_EQ("", err);
+    EXPECT_NONNULL(find_span(&file, "before dump"));
+    fr_file_free(&file);
+
+    EXPECT_INT_ZERO(raise(SIGUSR2));
+    EXPECT_INT_EQ(1, g_old_sigusr2_calls);
+    EXPECT_INT_ZERO(fr_file_read(sig_path, &file, err, sizeof(err)));
+    EXPECT_STR_EQ("", err);
+    EXPECT_NONNULL(find_span(&file, "before dump"));
+    fr_file_free(&file);
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    // Our handler stays installed once the tracer is gone, so that a late
+    // SIGUSR2 can't kill the process, and it still passes the signal on.
+    memset(&act, 0, sizeof(act));
+    EXPECT_INT_ZERO(sigaction(SIGUSR2, NULL, &act));
+    EXPECT_TRUE(((act.sa_flags & SA_SIGINFO) != 0));
+    EXPECT_INT_ZERO(raise(SIGUSR2));
+    EXPECT_INT_EQ(2, g_old_sigusr2_calls);
+    free(path);
+    free(copy_path);
+    free(sig_path);
+    return EXIT_SUCCESS;
+}
+
+static int test_disabled(void)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+
+    cnf = htrace_conf_from_str(HTRACE_SPAN_RECEIVER_KEY "=noop;"
+                               HTRACE_TRACER_ID "=" TEST_TRID);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_recorder-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_EQ(EINVAL, htracer_flight_recorder_dump(tracer, "/dev/null"));
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    char err[512];
+    char *tdir;
+
+    err[0] = '\0';
+    tdir = create_tempdir("flight_recorder-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_ZERO(test_record(tdir));
+    EXPECT_INT_ZERO(test_unsampled(tdir));
+    EXPECT_INT_ZERO(test_lost(tdir));
+    EXPECT_INT_ZERO(test_dump(tdir));
+    EXPECT_INT_ZERO(test_disabled());
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
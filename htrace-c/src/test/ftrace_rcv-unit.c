@@ -0,0 +1,310 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "receiver/ftrace.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file ftrace_rcv-unit.c
+ *
+ * Tests the ftrace span receiver and the marker converter.  A temporary
+ * directory stands in for tracefs.
+ */
+
+#define TEST_TRID "ftrace_rcv-unit"
+
+/**
+ * A kernel trace line prefix, up to the timestamp.
+ */
+#define LINE_PREFIX "          test-100     [001] ..... "
+
+/**
+ * The configuration for these tests.  The arguments are the fake tracefs
+ * directory, the directory again for the metadata file, and any extra
+ * settings, each preceded by a semicolon.
+ */
+#define FTRACE_CONF_FMT \
+    HTRACE_SPAN_RECEIVER_KEY "=ftrace;" \
+    HTRACE_TRACER_ID "=" TEST_TRID ";" \
+    HTRACE_FTRACE_DIR_KEY "=%s;" \
+    HTRACE_FTRACE_METADATA_PATH_KEY "=%s/meta.json%s"
+
+static int create_empty(const char *tdir, const char *name)
+{
+    char *path;
+    int fd;
+
+    EXPECT_TRUE((asprintf(&path, "%s/%s", tdir, name) > 0));
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    EXPECT_TRUE((fd >= 0));
+    close(fd);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static char *read_file(const char *tdir, const char *name, size_t *len)
+{
+    char *path, *buf = NULL;
+    FILE *fp;
+    long flen;
+
+    if (asprintf(&path, "%s/%s", tdir, name) < 0) {
+        return NULL;
+    }
+    fp = fopen(path, "r");
+    free(path);
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    flen = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = calloc(1, flen + 1);
+    if (buf && (fread(buf, 1, flen, fp) != (size_t)flen)) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    if (len) {
+        *len = flen;
+    }
+    return buf;
+}
+
+/**
+ * Run the converter on a trace held in a string.
+ */
+static char *merge_str(const char *trace_str, const char *tdir)
+{
+    FILE *trace, *meta, *out;
+    char *meta_path, *buf = NULL, err[512];
+    size_t buf_len = 0;
+    int ret;
+
+    if (asprintf(&meta_path, "%s/meta.json", tdir) < 0) {
+        return NULL;
+    }
+    meta = fopen(meta_path, "r");
+    free(meta_path);
+    trace = fmemopen((void *)trace_str, strlen(trace_str), "r");
+    out = open_memstream(&buf, &buf_len);
+    if ((!meta) || (!trace) || (!out)) {
+        return NULL;
+    }
+    err[0] = '\0';
+    ret = ftrace_merge(trace, meta, out, err, sizeof(err));
+    fclose(meta);
+    fclose(trace);
+    fclose(out);
+    if (ret) {
+        fprintf(stderr, "ftrace_merge failed: %s\n", err);
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static int test_text(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    char *markers, *line, *trace, *merged, expected[256];
+    char outer_str[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char inner_str[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    const char *begin_outer, *begin_inner, *kernel, *end_inner, *end_outer;
+
+    EXPECT_INT_ZERO(create_empty(tdir, "trace_marker"));
+    // There is no trace_marker_raw, so we fall back to text markers.
+    cnf = test_conf(FTRACE_CONF_FMT, tdir, tdir,
+                    ";" HTRACE_FTRACE_RAW_KEY "=true");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("ftrace_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "outer", 1000, 1800));
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "inner", 1300, 1500));
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    markers = read_file(tdir, "trace_marker", NULL);
+    EXPECT_NONNULL(markers);
+    EXPECT_NONNULL(strstr(markers, " - 1000 1800 outer\n"));
+    EXPECT_NONNULL(strstr(markers, " - 1300 1500 inner\n"));
+    EXPECT_INT_EQ(0, strncmp(markers, FTRACE_TEXT_PREFIX,
+                             strlen(FTRACE_TEXT_PREFIX)));
+    memcpy(outer_str, markers + strlen(FTRACE_TEXT_PREFIX),
+           HTRACE_SPAN_ID_STRING_LENGTH);
+    outer_str[HTRACE_SPAN_ID_STRING_LENGTH] = '\0';
+    line = strchr(markers, '\n') + 1;
+    memcpy(inner_str, line + strlen(FTRACE_TEXT_PREFIX),
+           HTRACE_SPAN_ID_STRING_LENGTH);
+    inner_str[HTRACE_SPAN_ID_STRING_LENGTH] = '\0';
+
+    // The inner marker was written first in the kernel trace, since that
+    // span ended first.
+    line[-1] = '\0';
+    EXPECT_TRUE((asprintf(&trace,
+        "# tracer: nop\n"
+        LINE_PREFIX "10.000500: tracing_mark_write: %s"
+        LINE_PREFIX "10.000600: sched_switch: kernel event\n"
+        LINE_PREFIX "10.001000: tracing_mark_write: %s\n",
+        line, markers) > 0));
+    merged = merge_str(trace, tdir);
+    EXPECT_NONNULL(merged);
+    EXPECT_INT_EQ(0, strncmp(merged, "# tracer: nop\n", 14));
+    snprintf(expected, sizeof(expected), LINE_PREFIX "10.000200: "
+             "htrace_begin: span=%s parent=- desc=outer trid=" TEST_TRID,
+             outer_str);
+    begin_outer = strstr(merged, expected);
+    EXPECT_NONNULL(begin_outer);
+    snprintf(expected, sizeof(expected), LINE_PREFIX "10.000300: "
+             "htrace_begin: span=%s parent=- desc=inner trid=" TEST_TRID,
+             inner_str);
+    begin_inner = strstr(merged, expected);
+    EXPECT_NONNULL(begin_inner);
+    snprintf(expected, sizeof(expected), LINE_PREFIX "10.000500: "
+             "htrace_end: span=%s duration_us=200", inner_str);
+    end_inner = strstr(merged, expected);
+    EXPECT_NONNULL(end_inner);
+    kernel = strstr(merged, "sched_switch: kernel event");
+    EXPECT_NONNULL(kernel);
+    snprintf(expected, sizeof(expected), LINE_PREFIX "10.001000: "
+             "htrace_end: span=%s duration_us=800", outer_str);
+    end_outer = strstr(merged, expected);
+    EXPECT_NONNULL(end_outer);
+    EXPECT_TRUE((begin_outer < begin_inner));
+    EXPECT_TRUE((begin_inner < end_inner));
+    EXPECT_TRUE((end_inner < kernel));
+    EXPECT_TRUE((kernel < end_outer));
+    EXPECT_NULL(strstr(merged, "tracing_mark_write"));
+    free(merged);
+    free(trace);
+    free(markers);
+    return EXIT_SUCCESS;
+}
+
+static int test_raw(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_span_id parent;
+    struct ftrace_raw_marker marker;
+    char *buf, *trace, *merged, hex[256], expected[512];
+    const uint8_t *bytes;
+    size_t len, i;
+
+    EXPECT_INT_ZERO(create_empty(tdir, "trace_marker"));
+    EXPECT_INT_ZERO(create_empty(tdir, "trace_marker_raw"));
+    EXPECT_INT_ZERO(create_empty(tdir, "meta.json"));
+    cnf = test_conf(FTRACE_CONF_FMT, tdir, tdir,
+                    ";" HTRACE_FTRACE_RAW_KEY "=true");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("ftrace_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    parent.high = 0x1234;
+    parent.low = 0x5678;
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, &parent, "raw span",
+                                        5000, 5250));
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    buf = read_file(tdir, "trace_marker_raw", &len);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_EQ((int)sizeof(marker), (int)len);
+    memcpy(&marker, buf, sizeof(marker));
+    free(buf);
+    EXPECT_INT_EQ((int)FTRACE_RAW_ID, (int)marker.id);
+    EXPECT_INT_EQ(FTRACE_RAW_VERSION, (int)marker.version);
+    EXPECT_UINT64_EQ((uint64_t)0x1234, marker.span_id_high);
+    EXPECT_UINT64_EQ((uint64_t)0x1234, marker.parent_high);
+    EXPECT_UINT64_EQ((uint64_t)0x5678, marker.parent_low);
+    EXPECT_UINT64_EQ((uint64_t)5000, marker.begin_us);
+    EXPECT_UINT64_EQ((uint64_t)5250, marker.end_us);
+    buf = read_file(tdir, "trace_marker", &len);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_ZERO((int)len);
+    free(buf);
+
+    // This is how the kernel prints a raw marker.
+    bytes = (const uint8_t *)&marker;
+    hex[0] = '\0';
+    for (i = sizeof(marker.id); i < sizeof(marker); i++) {
+        snprintf(hex + strlen(hex), sizeof(hex) - strlen(hex), " %02x",
+                 bytes[i]);
+    }
+    EXPECT_TRUE((asprintf(&trace, LINE_PREFIX "20.000250: "
+                          "tracing_mark_raw_write: # %x buf:%s\n",
+                          FTRACE_RAW_ID, hex) > 0));
+    merged = merge_str(trace, tdir);
+    EXPECT_NONNULL(merged);
+    snprintf(expected, sizeof(expected), LINE_PREFIX "20.000000: "
+             "htrace_begin: span=%016" PRIx64 "%016" PRIx64 " parent="
+             "00000000000012340000000000005678 desc=raw span trid="
+             TEST_TRID "\n" LINE_PREFIX "20.000250: htrace_end: span=%016"
+             PRIx64 "%016" PRIx64 " duration_us=250\n",
+             marker.span_id_high, marker.span_id_low,
+             marker.span_id_high, marker.span_id_low);
+    EXPECT_STR_EQ(expected, merged);
+    free(merged);
+    free(trace);
+    return EXIT_SUCCESS;
+}
+
+static int test_no_tracefs(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    char *dir;
+
+    EXPECT_TRUE((asprintf(&dir, "%s/nonexistent", tdir) > 0));
+    cnf = test_conf(FTRACE_CONF_FMT, dir, dir, "");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("ftrace_rcv-unit", cnf);
+    EXPECT_NULL(tracer);
+    htrace_conf_free(cnf);
+    free(dir);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    char err[512];
+    char *tdir;
+
+    err[0] = '\0';
+    tdir = create_tempdir("ftrace_rcv-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_ZERO(test_text(tdir));
+    EXPECT_INT_ZERO(test_raw(tdir));
+    EXPECT_INT_ZERO(test_no_tracefs(tdir));
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
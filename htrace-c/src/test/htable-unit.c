@@ -24,11 +24,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-static uint32_t simple_hash(const void *key, uint32_t size)
+static uint32_t simple_hash(const void *key)
 {
     uintptr_t k = (uintptr_t)key;
-    return ((13 + k) * 6367) % size;
+    return (uint32_t)((13 + k) * 6367);
 }
 
 static int simple_compare(const void *a, const void *b)
@@ -57,6 +58,117 @@ static void *htable_pop_val(struct htable *ht, void *key)
     return old_val;
 }
 
+/**
+ * A hash function which puts every key in the same home slot, to exercise
+ * long Robin Hood probe sequences and backward-shift deletion.
+ */
+static uint32_t collide_hash(const void *key)
+{
+    return 0x1000;
+}
+
+/**
+ * Insert and remove many keys, checking the whole table after every step.
+ */
+static int test_put_pop(htable_hash_fn_t hash_fun, uint32_t num)
+{
+    struct htable *ht;
+    uintptr_t i, j;
+
+    ht = htable_alloc(4, hash_fun, simple_compare);
+    EXPECT_NONNULL(ht);
+    for (i = 1; i <= num; i++) {
+        EXPECT_INT_ZERO(htable_put(ht, (void*)i, (void*)(i + 1000)));
+        EXPECT_UINTPTR_EQ(i, (uintptr_t)htable_used(ht));
+        // We should never go over the 85% load factor.
+        EXPECT_TRUE((i * 20 <= htable_capacity(ht) * 17));
+    }
+    for (i = 1; i <= num; i += 2) {
+        EXPECT_UINTPTR_EQ(i + 1000, (uintptr_t)htable_pop_val(ht, (void*)i));
+        for (j = 1; j <= num; j++) {
+            if ((j & 1) && (j <= i)) {
+                EXPECT_NULL(htable_get(ht, (void*)j));
+            } else {
+                EXPECT_UINTPTR_EQ(j + 1000,
+                                  (uintptr_t)htable_get(ht, (void*)j));
+            }
+        }
+    }
+    EXPECT_INT_EQ(num / 2, htable_used(ht));
+    htable_free(ht);
+    return EXIT_SUCCESS;
+}
+
+#define HTABLE_BENCH_NUM_KEYS 200000
+
+static double timespec_diff_s(const struct timespec *a,
+                              const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + ((b->tv_nsec - a->tv_nsec) / 1e9);
+}
+
+/**
+ * Time puts, hits, misses, and pops with string keys.  This only runs when
+ * HTRACE_HTABLE_BENCH is set in the environment, so that normal test runs
+ * stay quiet.
+ */
+static int htable_bench(void)
+{
+    struct htable *ht;
+    struct timespec t0, t1, t2, t3, t4;
+    char **keys;
+    char miss[32];
+    void *k, *v;
+    int i;
+
+    if (!getenv("HTRACE_HTABLE_BENCH")) {
+        return EXIT_SUCCESS;
+    }
+    keys = calloc(HTABLE_BENCH_NUM_KEYS, sizeof(keys[0]));
+    EXPECT_NONNULL(keys);
+    for (i = 0; i < HTABLE_BENCH_NUM_KEYS; i++) {
+        EXPECT_INT_GE(0, asprintf(&keys[i], "span.%d.desc", i));
+    }
+    ht = htable_alloc(16, ht_hash_string, ht_compare_string);
+    EXPECT_NONNULL(ht);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < HTABLE_BENCH_NUM_KEYS; i++) {
+        EXPECT_INT_ZERO(htable_put(ht, keys[i], keys[i]));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (i = 0; i < HTABLE_BENCH_NUM_KEYS; i++) {
+        if (htable_get(ht, keys[i]) != keys[i]) {
+            fprintf(stderr, "htable_bench: failed to find %s\n", keys[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    for (i = 0; i < HTABLE_BENCH_NUM_KEYS; i++) {
+        snprintf(miss, sizeof(miss), "span.%d.miss", i);
+        EXPECT_NULL(htable_get(ht, miss));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t3);
+    for (i = 0; i < HTABLE_BENCH_NUM_KEYS; i++) {
+        htable_pop(ht, keys[i], &k, &v);
+        EXPECT_NONNULL(v);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t4);
+    EXPECT_INT_EQ(0, htable_used(ht));
+    fprintf(stderr, "htable_bench: %d string keys: put %.1f ns/op, "
+            "get %.1f ns/op, miss %.1f ns/op, pop %.1f ns/op\n",
+            HTABLE_BENCH_NUM_KEYS,
+            timespec_diff_s(&t0, &t1) * 1e9 / HTABLE_BENCH_NUM_KEYS,
+            timespec_diff_s(&t1, &t2) * 1e9 / HTABLE_BENCH_NUM_KEYS,
+            timespec_diff_s(&t2, &t3) * 1e9 / HTABLE_BENCH_NUM_KEYS,
+            timespec_diff_s(&t3, &t4) * 1e9 / HTABLE_BENCH_NUM_KEYS);
+    htable_free(ht);
+    for (i = 0; i < HTABLE_BENCH_NUM_KEYS; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     struct htable *ht;
@@ -77,15 +189,23 @@ int main(void)
     EXPECT_INT_ZERO(htable_put(ht, (void*)2, (void*)102));
     EXPECT_INT_ZERO(htable_put(ht, (void*)3, (void*)103));
     EXPECT_INT_EQ(3, htable_used(ht));
+    EXPECT_INT_EQ(4, htable_capacity(ht));
+    EXPECT_INT_ZERO(htable_put(ht, (void*)4, (void*)104));
+    EXPECT_INT_EQ(4, htable_used(ht));
     EXPECT_INT_EQ(8, htable_capacity(ht));
     EXPECT_UINTPTR_EQ(102L, (uintptr_t)htable_get(ht, (void*)2));
     EXPECT_UINTPTR_EQ(101L, (uintptr_t)htable_pop_val(ht, (void*)1));
     EXPECT_UINTPTR_EQ(103L, (uintptr_t)htable_pop_val(ht, (void*)3));
+    EXPECT_UINTPTR_EQ(104L, (uintptr_t)htable_pop_val(ht, (void*)4));
     EXPECT_INT_EQ(1, htable_used(ht));
     htable_visit(ht, expect_102, &found_102);
     EXPECT_INT_EQ(1, found_102);
     htable_free(ht);
 
+    EXPECT_INT_ZERO(test_put_pop(simple_hash, 200));
+    EXPECT_INT_ZERO(test_put_pop(collide_hash, 50));
+    EXPECT_INT_ZERO(htable_bench());
+
     return EXIT_SUCCESS;
 }
 
@@ -28,9 +28,11 @@
 #include "util/time.h"
 
 #include <inttypes.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 static int htraced_rcv_test(struct rtest *rt)
@@ -92,6 +94,168 @@ static int htraced_rcv_test(struct rtest *rt)
     return EXIT_SUCCESS;
 }
 
+/**
+ * Test that tracers sending to the same htraced share a transport, and that
+ * each tracer's spans still arrive with that tracer's ID.
+ */
+static int htraced_shared_xprt_test(void)
+{
+    char err[512], *conf_str[2], *json_path, trid[32];
+    size_t err_len = sizeof(err);
+    struct mini_htraced_params params;
+    struct mini_htraced *ht = NULL;
+    struct span_table *st;
+    struct htrace_conf *cnf[2];
+    struct htracer *tracer[2];
+    struct htrace_span *span;
+    uint64_t start_ms;
+    int i;
+
+    params.name = "shared_xprt";
+    params.confstr = "";
+    mini_htraced_build(&params, &ht, err, err_len);
+    EXPECT_STR_EQ("", err);
+    EXPECT_INT_GE(0, asprintf(&json_path, "%s/%s",
+                ht->root_dir, "spans.json"));
+    for (i = 0; i < 2; i++) {
+        EXPECT_INT_GE(0, asprintf(&conf_str[i], "%s=%s;%s=%s;%s=lib%d",
+                    HTRACE_SPAN_RECEIVER_KEY, "htraced",
+                    HTRACED_ADDRESS_KEY, ht->htraced_hrpc_addr,
+                    HTRACE_TRACER_ID, i));
+        cnf[i] = htrace_conf_from_str(conf_str[i]);
+        EXPECT_NONNULL(cnf[i]);
+        tracer[i] = htracer_create("shared_xprt", cnf[i]);
+        EXPECT_NONNULL(tracer[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        htrace_record_span(tracer[i], NULL, "shared", 100, 200);
+    }
+    for (i = 0; i < 2; i++) {
+        htracer_free(tracer[i]);
+        htrace_conf_free(cnf[i]);
+        free(conf_str[i]);
+    }
+    start_ms = monotonic_now_ms(NULL);
+    while (1) {
+        int nspans;
+
+        mini_htraced_dump_spans(ht, err, err_len, json_path);
+        EXPECT_STR_EQ("", err);
+        st = span_table_alloc();
+        EXPECT_NONNULL(st);
+        nspans = load_trace_span_file(json_path, st);
+        EXPECT_INT_GE(0, nspans);
+        if (nspans >= 2) {
+            break;
+        }
+        span_table_free(st);
+        st = NULL;
+        EXPECT_UINT64_GE(start_ms, monotonic_now_ms(NULL) + 30000);
+        sleep_ms(100);
+    }
+    for (i = 0; i < 2; i++) {
+        snprintf(trid, sizeof(trid), "lib%d", i);
+        EXPECT_INT_ZERO(span_table_get(st, &span, "shared", trid));
+    }
+    free(json_path);
+    span_table_free(st);
+    mini_htraced_stop(ht);
+    mini_htraced_free(ht);
+    return EXIT_SUCCESS;
+}
+
+static void flush_async_test_cb(void *arg, int err)
+{
+    int *done = arg;
+
+    __atomic_store_n(done, err ? -1 : 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Test that htracer_flush_async sends the spans closed before it was called
+ * without waiting for the flush interval, and then signals completion.
+ */
+static int htraced_flush_async_test(void)
+{
+    char err[512], *conf_str, *json_path;
+    size_t err_len = sizeof(err);
+    struct mini_htraced_params params;
+    struct mini_htraced *ht = NULL;
+    struct span_table *st;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_span *span;
+    struct pollfd pfd;
+    uint64_t start_ms, val;
+    int efd, done = 0;
+
+    params.name = "flush_async";
+    params.confstr = "";
+    mini_htraced_build(&params, &ht, err, err_len);
+    EXPECT_STR_EQ("", err);
+    EXPECT_INT_GE(0, asprintf(&json_path, "%s/%s",
+                ht->root_dir, "spans.json"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%d;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "htraced",
+                HTRACED_ADDRESS_KEY, ht->htraced_hrpc_addr,
+                HTRACED_FLUSH_INTERVAL_MS_KEY, 3600000,
+                HTRACE_TRACER_ID, "flush_async"));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flush_async", cnf);
+    EXPECT_NONNULL(tracer);
+
+    // Wait for the first span on an eventfd.
+    htrace_record_span(tracer, NULL, "first", 100, 200);
+    efd = eventfd(0, EFD_CLOEXEC);
+    EXPECT_TRUE((efd >= 0));
+    EXPECT_INT_ZERO(htracer_flush_async_fd(tracer, efd));
+    pfd.fd = efd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    EXPECT_INT_EQ(1, poll(&pfd, 1, 30000));
+    EXPECT_INT_EQ((int)sizeof(val), (int)read(efd, &val, sizeof(val)));
+    EXPECT_UINT64_EQ((uint64_t)1, val);
+    close(efd);
+
+    // Wait for the second span with a callback.
+    htrace_record_span(tracer, NULL, "second", 300, 400);
+    EXPECT_INT_ZERO(htracer_flush_async(tracer, flush_async_test_cb, &done));
+    start_ms = monotonic_now_ms(NULL);
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        EXPECT_TRUE((monotonic_now_ms(NULL) < start_ms + 30000));
+        sleep_ms(10);
+    }
+    EXPECT_INT_EQ(1, done);
+
+    // Both spans should have been sent, even though the tracer is still up
+    // and the flush interval hasn't elapsed.
+    start_ms = monotonic_now_ms(NULL);
+    while (1) {
+        mini_htraced_dump_spans(ht, err, err_len, json_path);
+        EXPECT_STR_EQ("", err);
+        st = span_table_alloc();
+        EXPECT_NONNULL(st);
+        if (load_trace_span_file(json_path, st) >= 2) {
+            break;
+        }
+        span_table_free(st);
+        st = NULL;
+        EXPECT_UINT64_GE(start_ms, monotonic_now_ms(NULL) + 30000);
+        sleep_ms(100);
+    }
+    EXPECT_INT_ZERO(span_table_get(st, &span, "first", "flush_async"));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "second", "flush_async"));
+    span_table_free(st);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    free(json_path);
+    mini_htraced_stop(ht);
+    mini_htraced_free(ht);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     int i;
@@ -103,6 +267,14 @@ int main(void)
             return EXIT_FAILURE;
         }
     }
+    if (htraced_shared_xprt_test() != EXIT_SUCCESS) {
+        fprintf(stderr, "htraced_shared_xprt_test failed\n");
+        return EXIT_FAILURE;
+    }
+    if (htraced_flush_async_test() != EXIT_SUCCESS) {
+        fprintf(stderr, "htraced_flush_async_test failed\n");
+        return EXIT_FAILURE;
+    }
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,264 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "util/membudget.h"
+#include "util/time.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @file htraced_shutdown-unit.c
+ *
+ * Tests the htraced receiver when htraced isn't answering.
+ */
+
+#define NUM_TEST_SPANS 100
+
+#define SHUTDOWN_TIMEOUT_MS 500
+
+/**
+ * How long htracer_shutdown may take, allowing for a slow test machine.
+ * This is much shorter than the read timeout.
+ */
+#define MAX_SHUTDOWN_MS 10000
+
+/**
+ * Open a socket which accepts connections, but never reads or answers
+ * anything.
+ *
+ * @param port          (out param) The port the socket is listening on.
+ *
+ * @return              The socket.
+ */
+static int open_unresponsive_listener(int *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if ((bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) ||
+            (listen(sock, 8) < 0) ||
+            (getsockname(sock, (struct sockaddr*)&addr, &addr_len) < 0)) {
+        close(sock);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return sock;
+}
+
+static int count_spill_files(const char *dir)
+{
+    DIR *dp;
+    struct dirent *de;
+    int count = 0;
+
+    dp = opendir(dir);
+    if (!dp) {
+        return -1;
+    }
+    while ((de = readdir(dp))) {
+        if (strncmp(de->d_name, "htraced-", 8) == 0) {
+            count++;
+        }
+    }
+    closedir(dp);
+    return count;
+}
+
+static int test_shutdown_deadline(const char *tdir, int spill)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    char *conf_str;
+    uint64_t start_ms, elapsed_ms, num_abandoned;
+    int i, sock, port = 0;
+
+    sock = open_unresponsive_listener(&port);
+    EXPECT_TRUE((sock >= 0));
+    EXPECT_TRUE((asprintf(&conf_str, "%s=htraced;%s=127.0.0.1:%d;%s=%s;"
+                "%s=htraced_shutdown-unit",
+                HTRACE_SPAN_RECEIVER_KEY, HTRACED_ADDRESS_KEY, port,
+                HTRACED_SPILL_DIR_KEY, spill ? tdir : "",
+                HTRACE_TRACER_ID) > 0));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("htraced_shutdown-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    for (i = 0; i < NUM_TEST_SPANS; i++) {
+        EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "span", i, i + 1));
+    }
+    start_ms = monotonic_now_ms(NULL);
+    num_abandoned = htracer_shutdown(tracer, SHUTDOWN_TIMEOUT_MS);
+    elapsed_ms = monotonic_now_ms(NULL) - start_ms;
+    EXPECT_UINT64_EQ((uint64_t)NUM_TEST_SPANS, num_abandoned);
+    EXPECT_TRUE((elapsed_ms < MAX_SHUTDOWN_MS));
+    EXPECT_INT_EQ(spill ? 1 : 0, count_spill_files(tdir));
+    htrace_conf_free(cnf);
+    free(conf_str);
+    close(sock);
+    return EXIT_SUCCESS;
+}
+
+static void pool_test_flush_cb(void *arg, int err)
+{
+    (void)err;
+    __atomic_add_fetch((int*)arg, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Test that adding spans while a send is in flight doesn't make the
+ * transport think its chunk pool is idle and free it.
+ */
+static int test_pool_kept_during_send(void)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct membudget_stats before, after;
+    char *conf_str;
+    uint64_t start_ms;
+    int sock, port = 0, done = 0;
+
+    sock = open_unresponsive_listener(&port);
+    EXPECT_TRUE((sock >= 0));
+    EXPECT_TRUE((asprintf(&conf_str, "%s=htraced;%s=127.0.0.1:%d;%s=%s;"
+                "%s=%d;%s=%d;%s=htraced_pool-unit",
+                HTRACE_SPAN_RECEIVER_KEY, HTRACED_ADDRESS_KEY, port,
+                HTRACED_SPILL_DIR_KEY, "",
+                HTRACED_READ_TIMEO_MS_KEY, 100,
+                HTRACED_WRITE_TIMEO_MS_KEY, 100,
+                HTRACE_TRACER_ID) > 0));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("htraced_pool-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "first", 1, 2));
+    membudget_get_stats(&before);
+    EXPECT_INT_ZERO(htracer_flush_async(tracer, pool_test_flush_cb, &done));
+    // The first send waits for a response which never comes.  Add a span to
+    // the other buffer while it does, and ask for that buffer to be sent
+    // right after.
+    sleep_ms(50);
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "second", 3, 4));
+    EXPECT_INT_ZERO(htracer_flush_async(tracer, pool_test_flush_cb, &done));
+    start_ms = monotonic_now_ms(NULL);
+    while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < 2) {
+        EXPECT_TRUE((monotonic_now_ms(NULL) < start_ms + MAX_SHUTDOWN_MS));
+        sleep_ms(10);
+    }
+    // Both buffers are empty now, but the pool was used moments ago, so its
+    // memory should still be there.
+    membudget_get_stats(&after);
+    EXPECT_UINT64_GE(before.used, after.used);
+    htracer_shutdown(tracer, SHUTDOWN_TIMEOUT_MS);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    close(sock);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that htracer_reconfigure puts new htraced settings into effect, even
+ * though the new receiver is created while the old one still holds the
+ * transport for the same endpoint.
+ */
+static int test_reconfigure_flush_interval(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    char *conf_str, *log_path, *contents;
+    int sock, port = 0;
+
+    sock = open_unresponsive_listener(&port);
+    EXPECT_TRUE((sock >= 0));
+    EXPECT_TRUE((asprintf(&log_path, "%s/reconfigure.log", tdir) > 0));
+    EXPECT_TRUE((asprintf(&conf_str, "%s=htraced;%s=127.0.0.1:%d;%s=%s;"
+                "%s=%s;%s=%d;%s=htraced_reconfigure-unit",
+                HTRACE_SPAN_RECEIVER_KEY, HTRACED_ADDRESS_KEY, port,
+                HTRACED_SPILL_DIR_KEY, "", HTRACE_LOG_PATH_KEY, log_path,
+                HTRACED_FLUSH_INTERVAL_MS_KEY, 3600000,
+                HTRACE_TRACER_ID) > 0));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("htraced_reconfigure-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+
+    EXPECT_TRUE((asprintf(&conf_str, "%s=htraced;%s=127.0.0.1:%d;%s=%s;"
+                "%s=%s;%s=%d;%s=htraced_reconfigure-unit",
+                HTRACE_SPAN_RECEIVER_KEY, HTRACED_ADDRESS_KEY, port,
+                HTRACED_SPILL_DIR_KEY, "", HTRACE_LOG_PATH_KEY, log_path,
+                HTRACED_FLUSH_INTERVAL_MS_KEY, 30000,
+                HTRACE_TRACER_ID) > 0));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    EXPECT_INT_EQ(1, htracer_reconfigure(tracer, cnf));
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "span", 1, 2));
+    htracer_shutdown(tracer, SHUTDOWN_TIMEOUT_MS);
+
+    // The receiver created by htracer_reconfigure must have a transport
+    // running with the new flush interval, rather than sharing the old one.
+    contents = read_path(log_path);
+    EXPECT_NONNULL(contents);
+    EXPECT_NONNULL(strstr(contents, "flush_interval_ms=3600000,"));
+    EXPECT_NONNULL(strstr(contents, "flush_interval_ms=30000,"));
+    free(contents);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    free(log_path);
+    close(sock);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    char err[512];
+    char *tdir;
+
+    err[0] = '\0';
+    tdir = create_tempdir("htraced_shutdown-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_ZERO(test_shutdown_deadline(tdir, 0));
+    EXPECT_INT_ZERO(test_shutdown_deadline(tdir, 1));
+    EXPECT_INT_ZERO(test_pool_kept_during_send());
+    EXPECT_INT_ZERO(test_reconfigure_flush_interval(tdir));
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
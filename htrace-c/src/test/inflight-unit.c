@@ -0,0 +1,315 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "util/time.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file inflight-unit.c
+ *
+ * Tests tracking open spans.
+ */
+
+#define TEST_TRID "inflight-unit"
+
+#define INFLIGHT_ANNOTATION "\"n\":{\"inflight\":\"true\"}"
+
+/**
+ * How long to wait for the watchdog.
+ */
+#define WATCHDOG_TIMEOUT_MS 30000
+
+/**
+ * The configuration for these tests.  The arguments are the local file path,
+ * and any extra settings, each preceded by a semicolon.
+ */
+#define INFLIGHT_CONF_FMT \
+    HTRACE_SPAN_RECEIVER_KEY "=local.file;" \
+    HTRACE_LOCAL_FILE_RCV_PATH_KEY "=%s;" \
+    HTRACE_TRACER_ID "=" TEST_TRID ";" \
+    HTRACE_SAMPLER_KEY "=always%s"
+
+/**
+ * Read everything from a file descriptor into a malloced string.
+ */
+static char *read_all(int fd)
+{
+    char *buf = NULL, *nbuf;
+    size_t len = 0;
+    ssize_t res;
+
+    while (1) {
+        nbuf = realloc(buf, len + 4096 + 1);
+        if (!nbuf) {
+            free(buf);
+            return NULL;
+        }
+        buf = nbuf;
+        res = read(fd, buf + len, 4096);
+        if (res <= 0) {
+            break;
+        }
+        len += res;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+/**
+ * Dump the open spans of a tracer into a string.
+ */
+static char *dump_to_str(struct htracer *tracer, int *num_spans)
+{
+    int fds[2];
+    char *buf;
+
+    if (pipe(fds)) {
+        return NULL;
+    }
+    *num_spans = htracer_dump_inflight(tracer, fds[1]);
+    close(fds[1]);
+    buf = read_all(fds[0]);
+    close(fds[0]);
+    return buf;
+}
+
+static int test_dump(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *outer, *inner;
+    struct htrace_span *span;
+    char *path, *buf;
+    int num_spans;
+
+    EXPECT_TRUE((asprintf(&path, "%s/dump.json", tdir) > 0));
+    cnf = test_conf(INFLIGHT_CONF_FMT, path, ";" HTRACE_INFLIGHT_KEY "=true;"
+                    HTRACE_INFLIGHT_THRESHOLD_MS_KEY "=0");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("inflight-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+
+    buf = dump_to_str(tracer, &num_spans);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_ZERO(num_spans);
+    EXPECT_STR_EQ("", buf);
+    free(buf);
+
+    outer = htrace_start_span(tracer, smp, "outer");
+    EXPECT_NONNULL(outer);
+    inner = htrace_start_span(tracer, smp, "inner");
+    EXPECT_NONNULL(inner);
+    buf = dump_to_str(tracer, &num_spans);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_EQ(2, num_spans);
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"outer\""));
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"inner\""));
+    EXPECT_NONNULL(strstr(buf, INFLIGHT_ANNOTATION));
+    free(buf);
+
+    // A detached span isn't open on any thread.
+    span = htrace_scope_detach(inner);
+    EXPECT_NONNULL(span);
+    buf = dump_to_str(tracer, &num_spans);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_EQ(1, num_spans);
+    EXPECT_NULL(strstr(buf, "\"d\":\"inner\""));
+    free(buf);
+    htrace_scope_close(inner);
+    inner = htrace_restart_span(tracer, span);
+    EXPECT_NONNULL(inner);
+    buf = dump_to_str(tracer, &num_spans);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_EQ(2, num_spans);
+    free(buf);
+
+    htrace_scope_close(inner);
+    htrace_scope_close(outer);
+    buf = dump_to_str(tracer, &num_spans);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_ZERO(num_spans);
+    free(buf);
+
+    // With the watchdog off, only closed spans reach the receiver.
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"outer\""));
+    EXPECT_NULL(strstr(buf, INFLIGHT_ANNOTATION));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static void ignore_flush_cb(void *arg, int err)
+{
+    (void)arg;
+    (void)err;
+}
+
+static int count_substrs(const char *str, const char *substr)
+{
+    int count = 0;
+
+    while ((str = strstr(str, substr))) {
+        count++;
+        str += strlen(substr);
+    }
+    return count;
+}
+
+struct thread_ctx {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+};
+
+static void *open_and_close_span(void *data)
+{
+    struct thread_ctx *ctx = data;
+    struct htrace_scope *scope;
+
+    scope = htrace_start_span(ctx->tracer, ctx->smp, "thread");
+    htrace_scope_close(scope);
+    return NULL;
+}
+
+static int test_watchdog(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    struct thread_ctx ctx;
+    pthread_t thread;
+    uint64_t start_ms;
+    char *path, *buf;
+    int num_spans;
+
+    EXPECT_TRUE((asprintf(&path, "%s/watchdog.json", tdir) > 0));
+    cnf = test_conf(INFLIGHT_CONF_FMT, path, ";" HTRACE_INFLIGHT_KEY "=true;"
+                    HTRACE_INFLIGHT_THRESHOLD_MS_KEY "=50;"
+                    HTRACE_INFLIGHT_INTERVAL_MS_KEY "=10");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("inflight-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+
+    // Spans opened by threads which have exited are gone from the registry.
+    ctx.tracer = tracer;
+    ctx.smp = smp;
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, open_and_close_span, &ctx));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    buf = dump_to_str(tracer, &num_spans);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_ZERO(num_spans);
+    free(buf);
+
+    scope = htrace_start_span(tracer, smp, "stuck");
+    EXPECT_NONNULL(scope);
+    start_ms = monotonic_now_ms(NULL);
+    while (1) {
+        EXPECT_INT_ZERO(htracer_flush_async(tracer, ignore_flush_cb, NULL));
+        buf = read_path(path);
+        EXPECT_NONNULL(buf);
+        if (strstr(buf, INFLIGHT_ANNOTATION)) {
+            break;
+        }
+        free(buf);
+        EXPECT_TRUE((monotonic_now_ms(NULL) < start_ms + WATCHDOG_TIMEOUT_MS));
+        sleep_ms(10);
+    }
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"stuck\""));
+    free(buf);
+
+    // Give the watchdog many more scans.  It shouldn't send the stuck span
+    // again.
+    sleep_ms(200);
+    htrace_scope_close(scope);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_EQ(1, count_substrs(buf, INFLIGHT_ANNOTATION));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_disabled(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    char *path, *buf;
+    int num_spans;
+
+    EXPECT_TRUE((asprintf(&path, "%s/disabled.json", tdir) > 0));
+    cnf = test_conf(INFLIGHT_CONF_FMT, path, "");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("inflight-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    scope = htrace_start_span(tracer, smp, "untracked");
+    EXPECT_NONNULL(scope);
+    buf = dump_to_str(tracer, &num_spans);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_ZERO(num_spans);
+    free(buf);
+    htrace_scope_close(scope);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    char err[512];
+    char *tdir;
+
+    err[0] = '\0';
+    tdir = create_tempdir("inflight-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_ZERO(test_dump(tdir));
+    EXPECT_INT_ZERO(test_watchdog(tdir));
+    EXPECT_INT_ZERO(test_disabled(tdir));
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
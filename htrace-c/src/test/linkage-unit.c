@@ -37,17 +37,46 @@
  */
 
 static const char * const PUBLIC_SYMS[] = {
+    "htrace_child_close",
+    "htrace_child_get_span_id",
     "htrace_conf_free",
+    "htrace_context_decode",
+    "htrace_context_decode_text",
+    "htrace_context_encode",
+    "htrace_context_encode_text",
     "htrace_conf_from_str",
+    "htrace_interposed_lock_wait",
+    "htrace_mutex_destroy",
+    "htrace_mutex_init",
+    "htrace_mutex_lock",
+    "htrace_mutex_unlock",
+    "htrace_record_span",
+    "htrace_record_spans",
     "htrace_restart_span",
+    "htrace_rwlock_destroy",
+    "htrace_rwlock_init",
+    "htrace_rwlock_rdlock",
+    "htrace_rwlock_unlock",
+    "htrace_rwlock_wrlock",
     "htrace_sampler_create",
     "htrace_sampler_free",
     "htrace_sampler_to_str",
     "htrace_scope_close",
     "htrace_scope_detach",
+    "htrace_sigsafe_end",
+    "htrace_sigsafe_start",
+    "htrace_start_children",
     "htrace_start_span",
+    "htrace_start_spanf",
     "htracer_create",
     "htracer_free",
+    "htracer_reconfigure",
+    "htracer_flush_async",
+    "htracer_flush_async_fd",
+    "htracer_dump_inflight",
+    "htracer_flight_recorder_dump",
+    "htracer_sigsafe_drain",
+    "htracer_shutdown",
     "htracer_tname",
     "htrace_span_id_clear",
     "htrace_span_id_compare",
@@ -0,0 +1,355 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "test/test_config.h"
+#include "util/time.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * @file lock-unit.c
+ *
+ * Tests tracing lock waits.
+ */
+
+#define TEST_TRID "lock-unit"
+
+/**
+ * How long the lock is held while another thread waits for it.
+ */
+#define HOLD_MS 50
+
+/**
+ * The configuration for these tests.  The arguments are the local file path,
+ * and any extra settings, each preceded by a semicolon.
+ */
+#define LOCK_CONF_FMT \
+    HTRACE_SPAN_RECEIVER_KEY "=local.file;" \
+    HTRACE_LOCAL_FILE_RCV_PATH_KEY "=%s;" \
+    HTRACE_TRACER_ID "=" TEST_TRID ";" \
+    HTRACE_SAMPLER_KEY "=always%s"
+
+/**
+ * Find the line of a span with the given description, and check that it is
+ * a child of the given span.
+ *
+ * @return              1 if there is such a span; 0 otherwise.
+ */
+static int has_child_span(const char *buf, const char *desc,
+                          const struct htrace_span_id *parent)
+{
+    char id_str[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char d[256], p[128];
+    const char *line, *end;
+
+    if (!htrace_span_id_to_str(parent, id_str, sizeof(id_str))) {
+        return 0;
+    }
+    snprintf(d, sizeof(d), "\"d\":\"%s\"", desc);
+    snprintf(p, sizeof(p), "\"p\":[\"%s\"]", id_str);
+    for (line = buf; (line = strstr(line, d)); line = end) {
+        end = strchr(line, '\n');
+        if (!end) {
+            end = line + strlen(line);
+        }
+        if (memmem(line, end - line, p, strlen(p))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct waiter_ctx {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_mutex *mutex;
+    struct htrace_rwlock *rwlock;
+    struct htrace_span_id span_id;
+    int ret;
+};
+
+static void *mutex_waiter(void *data)
+{
+    struct waiter_ctx *ctx = data;
+    struct htrace_scope *scope;
+
+    scope = htrace_start_span(ctx->tracer, ctx->smp, "waiter");
+    htrace_scope_get_span_id(scope, &ctx->span_id);
+    ctx->ret = htrace_mutex_lock(ctx->mutex);
+    if (!ctx->ret) {
+        ctx->ret = htrace_mutex_unlock(ctx->mutex);
+    }
+    htrace_scope_close(scope);
+    return NULL;
+}
+
+static void *rwlock_waiter(void *data)
+{
+    struct waiter_ctx *ctx = data;
+    struct htrace_scope *scope;
+
+    scope = htrace_start_span(ctx->tracer, ctx->smp, "reader");
+    htrace_scope_get_span_id(scope, &ctx->span_id);
+    ctx->ret = htrace_rwlock_rdlock(ctx->rwlock);
+    if (!ctx->ret) {
+        ctx->ret = htrace_rwlock_unlock(ctx->rwlock);
+    }
+    htrace_scope_close(scope);
+    return NULL;
+}
+
+static int test_waits(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    struct htrace_mutex mutex;
+    struct htrace_rwlock rwlock;
+    struct htrace_span_id span_id, waiter_id;
+    struct waiter_ctx ctx;
+    pthread_t thread;
+    char *path, *buf, id_str[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char expected[128];
+
+    EXPECT_TRUE((asprintf(&path, "%s/waits.json", tdir) > 0));
+    cnf = test_conf(LOCK_CONF_FMT, path,
+                    ";" HTRACE_LOCK_THRESHOLD_US_KEY "=1000");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("lock-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    EXPECT_INT_ZERO(htrace_mutex_init(&mutex, tracer, "test mutex", NULL));
+    EXPECT_INT_ZERO(htrace_rwlock_init(&rwlock, tracer, "test rwlock",
+                                       NULL));
+
+    // An acquisition which doesn't wait isn't recorded.
+    scope = htrace_start_span(tracer, smp, "uncontended");
+    EXPECT_NONNULL(scope);
+    htrace_scope_get_span_id(scope, &span_id);
+    EXPECT_INT_ZERO(htrace_mutex_lock(&mutex));
+    EXPECT_INT_ZERO(htrace_mutex_unlock(&mutex));
+    EXPECT_INT_ZERO(htrace_rwlock_wrlock(&rwlock));
+    EXPECT_INT_ZERO(htrace_rwlock_unlock(&rwlock));
+    htrace_scope_close(scope);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.tracer = tracer;
+    ctx.smp = smp;
+    ctx.mutex = &mutex;
+    ctx.rwlock = &rwlock;
+    EXPECT_INT_ZERO(htrace_mutex_lock(&mutex));
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, mutex_waiter, &ctx));
+    sleep_ms(HOLD_MS);
+    EXPECT_INT_ZERO(htrace_mutex_unlock(&mutex));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    EXPECT_INT_ZERO(ctx.ret);
+    EXPECT_INT_ZERO(htrace_mutex_destroy(&mutex));
+    waiter_id = ctx.span_id;
+
+    EXPECT_INT_ZERO(htrace_rwlock_wrlock(&rwlock));
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, rwlock_waiter, &ctx));
+    sleep_ms(HOLD_MS);
+    EXPECT_INT_ZERO(htrace_rwlock_unlock(&rwlock));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    EXPECT_INT_ZERO(ctx.ret);
+    EXPECT_INT_ZERO(htrace_rwlock_destroy(&rwlock));
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_EQ(1, has_child_span(buf, "mutex wait: test mutex",
+                                    &waiter_id));
+    EXPECT_INT_EQ(1, has_child_span(buf, "rwlock wait: test rwlock",
+                                    &ctx.span_id));
+    // Nothing waited inside the uncontended span.
+    EXPECT_INT_EQ(1, htrace_span_id_to_str(&span_id, id_str,
+                                           sizeof(id_str)));
+    snprintf(expected, sizeof(expected), "\"p\":[\"%s\"]", id_str);
+    EXPECT_NULL(strstr(buf, expected));
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"uncontended\""));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_threshold(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_mutex mutex;
+    struct waiter_ctx ctx;
+    pthread_t thread;
+    char *path, *buf;
+
+    EXPECT_TRUE((asprintf(&path, "%s/threshold.json", tdir) > 0));
+    cnf = test_conf(LOCK_CONF_FMT, path,
+                    ";" HTRACE_LOCK_THRESHOLD_US_KEY "=60000000");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("lock-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    EXPECT_INT_ZERO(htrace_mutex_init(&mutex, tracer, "short wait", NULL));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.tracer = tracer;
+    ctx.smp = smp;
+    ctx.mutex = &mutex;
+    EXPECT_INT_ZERO(htrace_mutex_lock(&mutex));
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, mutex_waiter, &ctx));
+    sleep_ms(HOLD_MS);
+    EXPECT_INT_ZERO(htrace_mutex_unlock(&mutex));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    EXPECT_INT_ZERO(ctx.ret);
+    EXPECT_INT_ZERO(htrace_mutex_destroy(&mutex));
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"waiter\""));
+    EXPECT_NULL(strstr(buf, "short wait"));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_interposed(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    struct htrace_span_id span_id;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    char *path, *buf;
+
+    EXPECT_TRUE((asprintf(&path, "%s/interposed.json", tdir) > 0));
+    cnf = test_conf(LOCK_CONF_FMT, path,
+                    ";" HTRACE_LOCK_INTERPOSE_KEY "=true");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("lock-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    scope = htrace_start_span(tracer, smp, "interposed");
+    EXPECT_NONNULL(scope);
+    htrace_scope_get_span_id(scope, &span_id);
+    // Waits which are too short, or which HTrace's own code had, are not
+    // recorded.
+    htrace_interposed_lock_wait(&lock, NULL, 999000);
+    htrace_interposed_lock_wait(&lock, (const void *)htrace_mutex_lock,
+                                5000000);
+    htrace_interposed_lock_wait(&lock, NULL, 5000000);
+    htrace_scope_close(scope);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    // Once the tracer is gone, reports are ignored.
+    htrace_interposed_lock_wait(&lock, NULL, 5000000);
+    htrace_conf_free(cnf);
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"interposed\""));
+    EXPECT_NONNULL(strstr(buf, " at 0x0\""));
+    EXPECT_NULL(strstr(buf, " at htrace_mutex_lock"));
+    EXPECT_NULL(strstr(strstr(buf, "\"d\":\"mutex wait: ") + 1,
+                       "\"d\":\"mutex wait: "));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Count the non-overlapping copies of a string in a buffer.
+ */
+static int count_substrs(const char *buf, const char *str)
+{
+    int count = 0;
+
+    while ((buf = strstr(buf, str))) {
+        count++;
+        buf += strlen(str);
+    }
+    return count;
+}
+
+static int test_preload(const char *tdir)
+{
+    char *path, *buf;
+    pid_t pid;
+    int status;
+
+    EXPECT_TRUE((asprintf(&path, "%s/preload.json", tdir) > 0));
+    pid = fork();
+    EXPECT_TRUE((pid >= 0));
+    if (pid == 0) {
+        if (setenv("LD_PRELOAD", HTRACE_LOCKWAIT_ABSPATH, 1) == 0) {
+            execl(LOCKWAIT_HELPER_ABSPATH, LOCKWAIT_HELPER_ABSPATH, path,
+                  (char *)NULL);
+        }
+        _exit(127);
+    }
+    EXPECT_INT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE((WIFEXITED(status)));
+    EXPECT_INT_ZERO(WEXITSTATUS(status));
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"waiter\""));
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"worker\""));
+    // The helper's own wait is reported, naming the function which waited.
+    // Its workers contend for libhtrace's locks while they create spans, but
+    // those waits are not reported.
+    EXPECT_NONNULL(strstr(buf, " at lockwait_helper_waiter\""));
+    EXPECT_INT_EQ(1, count_substrs(buf, "\"d\":\"mutex wait: "));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    char err[512];
+    char *tdir;
+
+    err[0] = '\0';
+    tdir = create_tempdir("lock-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_ZERO(test_waits(tdir));
+    EXPECT_INT_ZERO(test_threshold(tdir));
+    EXPECT_INT_ZERO(test_interposed(tdir));
+    EXPECT_INT_ZERO(test_preload(tdir));
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,157 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/htrace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @file lockwait_helper.c
+ *
+ * A program with contended pthread mutexes, which lock-unit runs under
+ * LD_PRELOAD=libhtrace_lockwait.so.
+ *
+ * One thread waits for a mutex which the main thread holds.  Several more
+ * threads create spans as fast as they can, so that they contend for
+ * libhtrace's own locks.  The spans are written to the file given as the
+ * first argument.
+ */
+
+/**
+ * The number of threads which create spans.
+ */
+#define NUM_WORKERS 8
+
+/**
+ * The number of child spans each of those threads creates.
+ */
+#define NUM_CHILDREN 2000
+
+/**
+ * How long the main thread holds the mutex which the waiter waits for.
+ */
+#define HOLD_MS 50
+
+/**
+ * How long the helper may run, in seconds.  Reporting a wait for one of
+ * libhtrace's own locks can deadlock, and the test should fail rather than
+ * hang if that happens.
+ */
+#define TIMEOUT_S 60
+
+struct helper_ctx {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    pthread_mutex_t mutex;
+};
+
+/**
+ * Wait for the mutex which the main thread holds.  This is exported, so that
+ * the interposer can find its name.
+ */
+__attribute__((visibility("default")))
+void *lockwait_helper_waiter(void *data)
+{
+    struct helper_ctx *ctx = data;
+    struct htrace_scope *scope;
+
+    scope = htrace_start_span(ctx->tracer, ctx->smp, "waiter");
+    pthread_mutex_lock(&ctx->mutex);
+    pthread_mutex_unlock(&ctx->mutex);
+    htrace_scope_close(scope);
+    return NULL;
+}
+
+static void *lockwait_helper_worker(void *data)
+{
+    struct helper_ctx *ctx = data;
+    struct htrace_scope *scope, *child;
+    int i;
+
+    scope = htrace_start_span(ctx->tracer, ctx->smp, "worker");
+    for (i = 0; i < NUM_CHILDREN; i++) {
+        child = htrace_start_span(ctx->tracer, ctx->smp, "child");
+        htrace_scope_close(child);
+    }
+    htrace_scope_close(scope);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct helper_ctx ctx;
+    struct htrace_conf *cnf;
+    pthread_t waiter, workers[NUM_WORKERS];
+    struct timespec ts;
+    char *str;
+    int i;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <span file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    alarm(TIMEOUT_S);
+    // Every wait is recorded, however short, so that contention on
+    // libhtrace's own locks would show up if it were reported.
+    if (asprintf(&str, "%s=local.file;%s=%s;%s=lockwait-helper;%s=always;"
+                 "%s=true;%s=0", HTRACE_SPAN_RECEIVER_KEY,
+                 HTRACE_LOCAL_FILE_RCV_PATH_KEY, argv[1], HTRACE_TRACER_ID,
+                 HTRACE_SAMPLER_KEY, HTRACE_LOCK_INTERPOSE_KEY,
+                 HTRACE_LOCK_THRESHOLD_US_KEY) < 0) {
+        return EXIT_FAILURE;
+    }
+    cnf = htrace_conf_from_str(str);
+    free(str);
+    if (!cnf) {
+        return EXIT_FAILURE;
+    }
+    ctx.tracer = htracer_create("lockwait-helper", cnf);
+    ctx.smp = htrace_sampler_create(ctx.tracer, cnf);
+    if ((!ctx.tracer) || (!ctx.smp)) {
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&ctx.mutex, NULL);
+    pthread_mutex_lock(&ctx.mutex);
+    if (pthread_create(&waiter, NULL, lockwait_helper_waiter, &ctx)) {
+        return EXIT_FAILURE;
+    }
+    ts.tv_sec = 0;
+    ts.tv_nsec = HOLD_MS * 1000000LL;
+    nanosleep(&ts, NULL);
+    pthread_mutex_unlock(&ctx.mutex);
+    for (i = 0; i < NUM_WORKERS; i++) {
+        if (pthread_create(&workers[i], NULL, lockwait_helper_worker, &ctx)) {
+            return EXIT_FAILURE;
+        }
+    }
+    pthread_join(waiter, NULL);
+    for (i = 0; i < NUM_WORKERS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&ctx.mutex);
+    htrace_sampler_free(ctx.smp);
+    htracer_free(ctx.tracer);
+    htrace_conf_free(cnf);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
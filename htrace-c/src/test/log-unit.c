@@ -20,20 +20,25 @@
 #include "test/temp_dir.h"
 #include "test/test.h"
 #include "util/log.h"
+#include "util/time.h"
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static int verify_log_file(const char *path)
+/**
+ * How long to wait for the background thread to write a message.
+ */
+#define ASYNC_TIMEOUT_MS 30000
+
+static int verify_log_file(const char *path, const char *expected_contents)
 {
     FILE *fp;
     char contents[4096];
     size_t res;
-    const char * const expected_contents =
-        "foo 2, bar, and baz.\nquux as well.\n";
 
     fp = fopen(path, "r");
     if (!fp) {
@@ -64,7 +69,7 @@ static int verify_log_to_file(void)
 {
     struct htrace_conf *conf;
     struct htrace_log *lg;
-    char *tdir, log_path[PATH_MAX], conf_str[PATH_MAX];
+    char *tdir, *conf_str, log_path[PATH_MAX];
     char err[128];
     size_t err_len = sizeof(err);
 
@@ -72,24 +77,150 @@ static int verify_log_to_file(void)
     EXPECT_NONNULL(tdir);
     EXPECT_INT_ZERO(register_tempdir_for_cleanup(tdir));
     snprintf(log_path, sizeof(log_path), "%s/log.txt", tdir);
-    snprintf(conf_str, sizeof(conf_str), "log.path=%s", log_path);
+    EXPECT_TRUE((asprintf(&conf_str, "log.path=%s", log_path) > 0));
     conf = htrace_conf_from_strs(conf_str, "");
+    free(conf_str);
     EXPECT_NONNULL(conf);
     lg = htrace_log_alloc(conf);
     EXPECT_NONNULL(lg);
     htrace_log(lg, "foo %d, bar, and baz.\n", 2);
     htrace_log(lg, "quux as well.\n");
     htrace_log_free(lg);
-    EXPECT_INT_ZERO(verify_log_file(log_path));
+    EXPECT_INT_ZERO(verify_log_file(log_path,
+                "foo 2, bar, and baz.\nquux as well.\n"));
     htrace_conf_free(conf);
     free(tdir);
 
     return EXIT_SUCCESS;
 }
 
+/**
+ * Log some messages with the given extra configuration, and check what ends
+ * up in the log file.
+ */
+static int verify_log_messages(const char *extra_conf,
+                               void (*log_fn)(struct htrace_log *lg,
+                                              const char *log_path),
+                               const char *expected_contents)
+{
+    struct htrace_conf *conf;
+    struct htrace_log *lg;
+    char *tdir, *conf_str, log_path[PATH_MAX];
+    char err[128];
+    size_t err_len = sizeof(err);
+
+    tdir = create_tempdir("verify_log_messages", 0775, err, err_len);
+    EXPECT_NONNULL(tdir);
+    EXPECT_INT_ZERO(register_tempdir_for_cleanup(tdir));
+    snprintf(log_path, sizeof(log_path), "%s/log.txt", tdir);
+    EXPECT_TRUE((asprintf(&conf_str, "log.path=%s;%s",
+                          log_path, extra_conf) > 0));
+    conf = htrace_conf_from_strs(conf_str, "");
+    free(conf_str);
+    EXPECT_NONNULL(conf);
+    lg = htrace_log_alloc(conf);
+    EXPECT_NONNULL(lg);
+    log_fn(lg, log_path);
+    htrace_log_free(lg);
+    EXPECT_INT_ZERO(verify_log_file(log_path, expected_contents));
+    htrace_conf_free(conf);
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+static void log_levels(struct htrace_log *lg, const char *log_path)
+{
+    htrace_logl(lg, HTRACE_LOG_ERROR, "error\n");
+    htrace_logl(lg, HTRACE_LOG_WARN, "warn\n");
+    htrace_log(lg, "info\n");
+    htrace_logl(lg, HTRACE_LOG_DEBUG, "debug\n");
+}
+
+static void log_rate_limited(struct htrace_log *lg, const char *log_path)
+{
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, 1000000,
+                                "limited %d\n", i);
+    }
+    HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, 0, "unlimited\n");
+    HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, 0, "unlimited\n");
+}
+
+static void log_rate_limited_zero_interval(struct htrace_log *lg,
+                                           const char *log_path)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, 0, "again %d\n", i);
+    }
+}
+
+static void log_rate_limited_async(struct htrace_log *lg,
+                                   const char *log_path)
+{
+    uint64_t deadline;
+    char *contents;
+    int i, found = 0;
+
+    for (i = 0; i < 3; i++) {
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, 50, "timed %d\n", i);
+    }
+    // The background thread should report the suppressed messages once the
+    // interval has passed, without waiting for another message.  If it never
+    // does, the log file won't match what the caller expects.
+    deadline = monotonic_now_ms(NULL) + ASYNC_TIMEOUT_MS;
+    while ((!found) && (monotonic_now_ms(NULL) < deadline)) {
+        contents = read_path(log_path);
+        found = contents && strstr(contents, "(suppressed ");
+        free(contents);
+        if (!found) {
+            sleep_ms(10);
+        }
+    }
+    htrace_log(lg, "after\n");
+}
+
+static void *log_async_thread(void *arg)
+{
+    htrace_log((struct htrace_log *)arg, "from a thread\n");
+    return NULL;
+}
+
+static void log_async(struct htrace_log *lg, const char *log_path)
+{
+    pthread_t thread;
+
+    // The thread exits before the log is drained.  Its messages should
+    // still make it out.
+    if (pthread_create(&thread, NULL, log_async_thread, lg)) {
+        abort();
+    }
+    pthread_join(thread, NULL);
+    htrace_log(lg, "from main\n");
+}
+
 int main(void)
 {
     EXPECT_INT_ZERO(verify_log_to_file());
+    EXPECT_INT_ZERO(verify_log_messages("", log_levels,
+                "error\nwarn\ninfo\n"));
+    EXPECT_INT_ZERO(verify_log_messages("log.level=debug", log_levels,
+                "error\nwarn\ninfo\ndebug\n"));
+    EXPECT_INT_ZERO(verify_log_messages("log.level=warn", log_levels,
+                "error\nwarn\n"));
+    EXPECT_INT_ZERO(verify_log_messages("", log_rate_limited,
+                "limited 0\nunlimited\nunlimited\n"
+                "(suppressed 4 message(s) like \"limited %d\")\n"));
+    EXPECT_INT_ZERO(verify_log_messages("", log_rate_limited_zero_interval,
+                "again 0\nagain 1\n"));
+    EXPECT_INT_ZERO(verify_log_messages("log.async", log_rate_limited_async,
+                "timed 0\n(suppressed 2 message(s) like \"timed %d\")\n"
+                "after\n"));
+    EXPECT_INT_ZERO(verify_log_messages("log.async", log_async,
+                "from a thread\nfrom main\n"));
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,237 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "test/test.h"
+#include "util/log.h"
+#include "util/membudget.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct htrace_conf *g_test_conf;
+
+static struct htrace_log *g_test_lg;
+
+static int test_parse_cgroup_limit(void)
+{
+    EXPECT_UINT64_EQ((uint64_t)0, membudget_parse_cgroup_limit("max\n"));
+    EXPECT_UINT64_EQ((uint64_t)1073741824ULL,
+                     membudget_parse_cgroup_limit("1073741824\n"));
+    EXPECT_UINT64_EQ((uint64_t)4096, membudget_parse_cgroup_limit("4096"));
+    // cgroup v1 reports "no limit" as a huge number.
+    EXPECT_UINT64_EQ((uint64_t)0,
+            membudget_parse_cgroup_limit("9223372036854771712\n"));
+    EXPECT_UINT64_EQ((uint64_t)0, membudget_parse_cgroup_limit("abc"));
+    EXPECT_UINT64_EQ((uint64_t)0, membudget_parse_cgroup_limit("12k"));
+    return EXIT_SUCCESS;
+}
+
+static int test_unlimited(void)
+{
+    struct membudget_stats stats;
+
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)UINT64_MAX, stats.limit);
+    EXPECT_INT_EQ(1, membudget_reserve(1ULL << 40));
+    EXPECT_INT_ZERO(membudget_under_pressure());
+    membudget_release(1ULL << 40);
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.used);
+    return EXIT_SUCCESS;
+}
+
+static int configure_budget(const char *budget, uint64_t *limit)
+{
+    struct htrace_conf *cnf;
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "%s=%s", HTRACE_MEMORY_BUDGET_KEY, budget);
+    cnf = htrace_conf_from_strs(buf, "");
+    EXPECT_NONNULL(cnf);
+    *limit = membudget_configure(g_test_lg, cnf);
+    htrace_conf_free(cnf);
+    return EXIT_SUCCESS;
+}
+
+static int test_limited(void)
+{
+    struct membudget_stats stats;
+    uint64_t limit1, limit2;
+
+    EXPECT_INT_ZERO(configure_budget("1000", &limit1));
+    EXPECT_UINT64_EQ((uint64_t)1000, limit1);
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)1000, stats.limit);
+
+    EXPECT_INT_EQ(1, membudget_reserve(500));
+    EXPECT_INT_ZERO(membudget_under_pressure());
+    EXPECT_INT_ZERO(membudget_throttle());
+    EXPECT_INT_ZERO(membudget_reserve(600));
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)500, stats.used);
+    EXPECT_UINT64_EQ((uint64_t)1, stats.denied);
+
+    // 850 bytes is past the 80% watermark.
+    EXPECT_INT_EQ(1, membudget_reserve(350));
+    EXPECT_INT_EQ(1, membudget_under_pressure());
+    EXPECT_INT_EQ(1, membudget_throttle());
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)850, stats.used);
+    EXPECT_TRUE((stats.peak >= 850));
+    EXPECT_UINT64_EQ((uint64_t)1, stats.pressure_events);
+    EXPECT_UINT64_EQ((uint64_t)1, stats.throttled);
+
+    membudget_release(850);
+    EXPECT_INT_ZERO(membudget_under_pressure());
+
+    // The smallest configured budget wins.
+    EXPECT_INT_ZERO(configure_budget("2000", &limit2));
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)1000, stats.limit);
+
+    // Removing the smallest budget lets the budget rise again.
+    membudget_unconfigure(g_test_lg, limit1);
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)2000, stats.limit);
+    membudget_unconfigure(g_test_lg, limit2);
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)UINT64_MAX, stats.limit);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that new traces are not started while the budget is under pressure,
+ * but that existing traces can still create child spans.
+ */
+static int test_sampler_throttle(void)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope1, *scope2, *scope3;
+    struct htrace_span_id id;
+
+    cnf = htrace_conf_from_str(HTRACE_SPAN_RECEIVER_KEY "=noop;"
+                               HTRACE_SAMPLER_KEY "=always;"
+                               HTRACE_MEMORY_BUDGET_KEY "=1000");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("membudget-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    htrace_conf_free(cnf);
+
+    scope1 = htrace_start_span(tracer, smp, "root");
+    EXPECT_NONNULL(scope1);
+    htrace_scope_get_span_id(scope1, &id);
+    EXPECT_TRUE((id.high || id.low));
+
+    EXPECT_INT_EQ(1, membudget_reserve(900));
+    scope2 = htrace_start_span(tracer, smp, "child");
+    htrace_scope_get_span_id(scope2, &id);
+    EXPECT_TRUE((id.high || id.low));
+    htrace_scope_close(scope2);
+    htrace_scope_close(scope1);
+
+    scope3 = htrace_start_span(tracer, smp, "throttled");
+    htrace_scope_get_span_id(scope3, &id);
+    EXPECT_FALSE((id.high || id.low));
+    htrace_scope_close(scope3);
+    membudget_release(900);
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that prefaulted buffers don't put a small budget under pressure, and
+ * that the budget goes away with the tracer which configured it.
+ */
+static int test_prefault_small_budget(void)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    struct htrace_span_id id;
+    struct membudget_stats stats;
+
+    // The htraced buffers need 6 MiB of slabs when prefaulted, which is more
+    // than the 4 MiB watermark of a 5 MiB budget.
+    cnf = htrace_conf_from_str(HTRACE_SPAN_RECEIVER_KEY "=htraced;"
+                               HTRACED_ADDRESS_KEY "=127.0.0.1:1;"
+                               HTRACED_BUFFER_SIZE_KEY "=4194304;"
+                               HTRACED_BUFFER_PREFAULT_KEY "=populate;"
+                               HTRACE_SAMPLER_KEY "=always;"
+                               HTRACE_MEMORY_BUDGET_KEY "=5242880");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("membudget-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    htrace_conf_free(cnf);
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)5242880, stats.limit);
+    EXPECT_TRUE((stats.used > 0));
+    EXPECT_INT_ZERO(membudget_under_pressure());
+
+    scope = htrace_start_span(tracer, smp, "root");
+    htrace_scope_get_span_id(scope, &id);
+    EXPECT_TRUE((id.high || id.low));
+    htrace_scope_close(scope);
+
+    // A larger budget takes effect when the tracer is reconfigured.
+    cnf = htrace_conf_from_str(HTRACE_SPAN_RECEIVER_KEY "=noop;"
+                               HTRACE_MEMORY_BUDGET_KEY "=10485760");
+    EXPECT_NONNULL(cnf);
+    EXPECT_INT_EQ(1, htracer_reconfigure(tracer, cnf));
+    htrace_conf_free(cnf);
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)10485760, stats.limit);
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    membudget_get_stats(&stats);
+    EXPECT_UINT64_EQ((uint64_t)UINT64_MAX, stats.limit);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.used);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    g_test_conf = htrace_conf_from_strs("", "");
+    g_test_lg = htrace_log_alloc(g_test_conf);
+
+    EXPECT_INT_ZERO(test_parse_cgroup_limit());
+    // The budget is process-wide, so the order of these tests matters.
+    EXPECT_INT_ZERO(test_unlimited());
+    EXPECT_INT_ZERO(test_limited());
+    EXPECT_INT_ZERO(test_sampler_throttle());
+    EXPECT_INT_ZERO(test_prefault_small_budget());
+
+    htrace_log_free(g_test_lg);
+    htrace_conf_free(g_test_conf);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
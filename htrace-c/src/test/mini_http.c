@@ -0,0 +1,325 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test/mini_http.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MINI_HTTP_RBUF_LEN 65536
+
+/**
+ * The state of one connection.
+ */
+struct mini_http_conn {
+    int sock;
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * Read more bytes from the connection.
+ *
+ * @return          1 on success; 0 on EOF or error.
+ */
+static int mini_http_fill(struct mini_http_conn *conn)
+{
+    ssize_t res;
+    char *nbuf;
+
+    // Leave room for a terminating null.
+    if (conn->len + 1 >= conn->cap) {
+        nbuf = realloc(conn->buf, conn->cap * 2);
+        if (!nbuf) {
+            return 0;
+        }
+        conn->buf = nbuf;
+        conn->cap *= 2;
+    }
+    do {
+        res = read(conn->sock, conn->buf + conn->len,
+                   conn->cap - conn->len - 1);
+    } while ((res < 0) && (errno == EINTR));
+    if (res <= 0) {
+        return 0;
+    }
+    conn->len += res;
+    return 1;
+}
+
+static char *mini_http_header(const char *hdrs, const char *name)
+{
+    const char *line, *end;
+    size_t nlen = strlen(name);
+
+    for (line = strstr(hdrs, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if ((!strncasecmp(line, name, nlen)) && (line[nlen] == ':')) {
+            line += nlen + 1;
+            while (*line == ' ') {
+                line++;
+            }
+            end = strstr(line, "\r\n");
+            return strndup(line, end - line);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Read a request and record it.
+ *
+ * @return          1 if a request was read; 0 if the connection is done.
+ */
+static int mini_http_read_req(struct mini_http *mh,
+                              struct mini_http_conn *conn)
+{
+    char *end, *hdrs, *clen, *path, *ctype, *nbodies;
+    size_t hdr_len, body_len;
+
+    while (1) {
+        if (conn->len > 0) {
+            conn->buf[conn->len] = '\0';
+            end = strstr(conn->buf, "\r\n\r\n");
+            if (end) {
+                break;
+            }
+        }
+        if (!mini_http_fill(conn)) {
+            return 0;
+        }
+    }
+    hdr_len = end + 4 - conn->buf;
+    hdrs = strndup(conn->buf, hdr_len);
+    if (!hdrs) {
+        return 0;
+    }
+    clen = mini_http_header(hdrs, "Content-Length");
+    body_len = clen ? strtoul(clen, NULL, 10) : 0;
+    free(clen);
+    while (conn->len < hdr_len + body_len) {
+        if (!mini_http_fill(conn)) {
+            free(hdrs);
+            return 0;
+        }
+    }
+    path = strndup(hdrs + 5, strcspn(hdrs + 5, " "));
+    ctype = mini_http_header(hdrs, "Content-Type");
+    free(hdrs);
+    pthread_mutex_lock(&mh->lock);
+    free(mh->last_path);
+    mh->last_path = path;
+    free(mh->last_content_type);
+    mh->last_content_type = ctype;
+    nbodies = realloc(mh->bodies, mh->bodies_len + body_len + 2);
+    if (nbodies) {
+        mh->bodies = nbodies;
+        memcpy(mh->bodies + mh->bodies_len, conn->buf + hdr_len, body_len);
+        mh->bodies_len += body_len;
+        mh->bodies[mh->bodies_len++] = '\n';
+        mh->bodies[mh->bodies_len] = '\0';
+    }
+    pthread_mutex_unlock(&mh->lock);
+    memmove(conn->buf, conn->buf + hdr_len + body_len,
+            conn->len - hdr_len - body_len);
+    conn->len -= hdr_len + body_len;
+    return 1;
+}
+
+static int mini_http_write(int sock, const char *str)
+{
+    size_t off = 0, len = strlen(str);
+    ssize_t res;
+
+    while (off < len) {
+        res = send(sock, str + off, len - off, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        off += res;
+    }
+    return 1;
+}
+
+static void mini_http_serve(struct mini_http *mh, int sock)
+{
+    struct mini_http_conn conn;
+    int served = 0, last;
+
+    memset(&conn, 0, sizeof(conn));
+    conn.sock = sock;
+    conn.cap = MINI_HTTP_RBUF_LEN;
+    conn.buf = malloc(conn.cap);
+    if (!conn.buf) {
+        return;
+    }
+    while (mini_http_read_req(mh, &conn)) {
+        served++;
+        last = (mh->close_after && (served >= mh->close_after));
+        pthread_mutex_lock(&mh->lock);
+        mh->num_reqs++;
+        pthread_mutex_unlock(&mh->lock);
+        if (!mini_http_write(sock, last ?
+                "HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\n"
+                "Connection: close\r\n\r\n" :
+                "HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\n\r\n")) {
+            break;
+        }
+        if (last) {
+            // Like a real server, don't close the connection while the client
+            // may still be sending, or the reset would discard responses it
+            // hasn't read yet.  Ignore everything until it closes its end.
+            shutdown(sock, SHUT_WR);
+            conn.len = 0;
+            while (mini_http_fill(&conn)) {
+                conn.len = 0;
+            }
+            break;
+        }
+    }
+    free(conn.buf);
+}
+
+static void *mini_http_run(void *arg)
+{
+    struct mini_http *mh = arg;
+    int sock, stopping;
+
+    while (1) {
+        sock = accept(mh->listen_sock, NULL, NULL);
+        pthread_mutex_lock(&mh->lock);
+        stopping = mh->stopping;
+        if ((sock >= 0) && (!stopping)) {
+            mh->conn_sock = sock;
+            mh->num_conns++;
+        }
+        pthread_mutex_unlock(&mh->lock);
+        if (stopping) {
+            if (sock >= 0) {
+                close(sock);
+            }
+            break;
+        }
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        mini_http_serve(mh, sock);
+        pthread_mutex_lock(&mh->lock);
+        mh->conn_sock = -1;
+        pthread_mutex_unlock(&mh->lock);
+        close(sock);
+    }
+    return NULL;
+}
+
+struct mini_http *mini_http_start(int close_after, char *err, size_t err_len)
+{
+    struct mini_http *mh;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int ret;
+
+    mh = calloc(1, sizeof(*mh));
+    if (!mh) {
+        snprintf(err, err_len, "OOM");
+        return NULL;
+    }
+    mh->conn_sock = -1;
+    mh->close_after = close_after;
+    pthread_mutex_init(&mh->lock, NULL);
+    mh->listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (mh->listen_sock < 0) {
+        ret = errno;
+        snprintf(err, err_len, "socket error %d: %s", ret, strerror(ret));
+        goto error;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if ((bind(mh->listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(mh->listen_sock, 8) < 0) ||
+        (getsockname(mh->listen_sock, (struct sockaddr *)&addr,
+                     &addr_len) < 0)) {
+        ret = errno;
+        snprintf(err, err_len, "failed to listen: error %d: %s",
+                 ret, strerror(ret));
+        goto error;
+    }
+    snprintf(mh->addr, sizeof(mh->addr), "127.0.0.1:%d",
+             ntohs(addr.sin_port));
+    ret = pthread_create(&mh->thread, NULL, mini_http_run, mh);
+    if (ret) {
+        snprintf(err, err_len, "pthread_create error %d: %s",
+                 ret, strerror(ret));
+        goto error;
+    }
+    return mh;
+
+error:
+    if (mh->listen_sock >= 0) {
+        close(mh->listen_sock);
+    }
+    pthread_mutex_destroy(&mh->lock);
+    free(mh);
+    return NULL;
+}
+
+void mini_http_stop(struct mini_http *mh)
+{
+    pthread_mutex_lock(&mh->lock);
+    mh->stopping = 1;
+    if (mh->conn_sock >= 0) {
+        shutdown(mh->conn_sock, SHUT_RDWR);
+    }
+    // This wakes up the server thread if it is blocked in accept.
+    shutdown(mh->listen_sock, SHUT_RDWR);
+    pthread_mutex_unlock(&mh->lock);
+    pthread_join(mh->thread, NULL);
+    close(mh->listen_sock);
+    mh->listen_sock = -1;
+}
+
+void mini_http_free(struct mini_http *mh)
+{
+    if (!mh) {
+        return;
+    }
+    pthread_mutex_destroy(&mh->lock);
+    free(mh->last_path);
+    free(mh->last_content_type);
+    free(mh->bodies);
+    free(mh);
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,132 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_TEST_MINI_HTTP_H
+#define APACHE_HTRACE_TEST_MINI_HTTP_H
+
+/**
+ * @file mini_http.h
+ *
+ * Implements a stand-in HTTP collector which can be used in unit tests.
+ *
+ * The server accepts one connection at a time, and answers every request with
+ * 202 Accepted as soon as it has read it, so pipelined requests work.  It
+ * remembers the request bodies.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <pthread.h>
+#include <unistd.h> /* for size_t */
+
+struct mini_http {
+    /**
+     * The listening socket.
+     */
+    int listen_sock;
+
+    /**
+     * The socket of the connection being served, or -1.  Protected by the
+     * lock.
+     */
+    int conn_sock;
+
+    /**
+     * The address the server is listening on, in 127.0.0.1:port format.
+     */
+    char addr[32];
+
+    /**
+     * If nonzero, the server closes each connection after answering this many
+     * requests on it, with Connection: close on the last response.
+     */
+    int close_after;
+
+    /**
+     * The server thread.
+     */
+    pthread_t thread;
+
+    /**
+     * Lock protecting the fields below.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Nonzero once mini_http_stop has been called.
+     */
+    int stopping;
+
+    /**
+     * The number of connections accepted.
+     */
+    int num_conns;
+
+    /**
+     * The number of requests answered.
+     */
+    int num_reqs;
+
+    /**
+     * The path of the last request.  Malloced.
+     */
+    char *last_path;
+
+    /**
+     * The Content-Type of the last request.  Malloced.
+     */
+    char *last_content_type;
+
+    /**
+     * The request bodies, each followed by a newline.  Malloced.
+     */
+    char *bodies;
+    size_t bodies_len;
+};
+
+/**
+ * Start the stand-in HTTP server on an ephemeral port on 127.0.0.1.
+ *
+ * @param close_after       If nonzero, the number of requests to answer on
+ *                              each connection before closing it.
+ * @param err               (out param) The error message if there was an
+ *                              error.
+ * @param err_len           The length of the error buffer provided by the
+ *                              caller.
+ *
+ * @return                  The server, or NULL on error.
+ */
+struct mini_http *mini_http_start(int close_after, char *err, size_t err_len);
+
+/**
+ * Stop the stand-in HTTP server.  Its fields can still be read afterwards.
+ *
+ * @param mh                The server.
+ */
+void mini_http_stop(struct mini_http *mh);
+
+/**
+ * Free the stand-in HTTP server.  It must have been stopped.
+ *
+ * @param mh                The server.
+ */
+void mini_http_free(struct mini_http *mh);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,472 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file perfetto_rcv-unit.c
+ *
+ * Tests the perfetto span receiver.  The protobuf trace is checked with a
+ * minimal decoder which only understands the fields the receiver writes.
+ */
+
+#define TEST_TRID "perfetto_rcv-unit"
+
+#define MAX_NAMES 8
+
+/**
+ * What we found in a protobuf trace.
+ */
+struct trace_summary {
+    int process_tracks;
+    int thread_tracks;
+    int trace_tracks;
+    uint64_t trace_track_uuid;
+    uint64_t last_event_track;
+    int begins;
+    int ends;
+    int cleared;
+    int num_names;
+    uint64_t name_iids[MAX_NAMES];
+    char names[MAX_NAMES][32];
+    uint64_t first_ts;
+    uint64_t begin_iids[MAX_NAMES];
+    int annotations;
+};
+
+/**
+ * A length-delimited protobuf field or a varint.
+ */
+struct pb_field {
+    uint32_t num;
+    uint64_t val;
+    const uint8_t *data;
+    size_t len;
+};
+
+static int pb_varint(const uint8_t **cur, const uint8_t *end, uint64_t *val)
+{
+    int shift = 0;
+
+    *val = 0;
+    while (*cur < end) {
+        uint8_t b = **cur;
+        (*cur)++;
+        *val |= ((uint64_t)(b & 0x7f)) << shift;
+        if (!(b & 0x80)) {
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+/**
+ * Read the next field of a message.
+ *
+ * @return      1 if a field was read; 0 at the end; -1 on a decoding error.
+ */
+static int pb_next(const uint8_t **cur, const uint8_t *end,
+                   struct pb_field *field)
+{
+    uint64_t tag;
+
+    if (*cur >= end) {
+        return 0;
+    }
+    if (!pb_varint(cur, end, &tag)) {
+        return -1;
+    }
+    field->num = tag >> 3;
+    field->data = NULL;
+    field->len = 0;
+    switch (tag & 7) {
+    case 0:
+        return pb_varint(cur, end, &field->val) ? 1 : -1;
+    case 2:
+        if (!pb_varint(cur, end, &field->val)) {
+            return -1;
+        }
+        if (field->val > (uint64_t)(end - *cur)) {
+            return -1;
+        }
+        field->data = *cur;
+        field->len = field->val;
+        *cur += field->len;
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+static int summarize_interned(struct trace_summary *sum,
+                              const uint8_t *cur, const uint8_t *end)
+{
+    struct pb_field f, g;
+    const uint8_t *ncur;
+    int res;
+
+    while ((res = pb_next(&cur, end, &f)) > 0) {
+        if (f.num != 2) {
+            continue;
+        }
+        // An EventName.
+        EXPECT_TRUE((sum->num_names < MAX_NAMES));
+        ncur = f.data;
+        while (pb_next(&ncur, f.data + f.len, &g) > 0) {
+            if (g.num == 1) {
+                sum->name_iids[sum->num_names] = g.val;
+            } else if (g.num == 2) {
+                EXPECT_TRUE((g.len < sizeof(sum->names[0])));
+                memcpy(sum->names[sum->num_names], g.data, g.len);
+                sum->names[sum->num_names][g.len] = '\0';
+            }
+        }
+        sum->num_names++;
+    }
+    EXPECT_INT_ZERO(res);
+    return EXIT_SUCCESS;
+}
+
+static int summarize_packet(struct trace_summary *sum,
+                            const uint8_t *cur, const uint8_t *end)
+{
+    struct pb_field f, g;
+    const uint8_t *ecur;
+    uint64_t ts = 0, type = 0, iid = 0, uuid = 0;
+    int res, named = 0;
+
+    while ((res = pb_next(&cur, end, &f)) > 0) {
+        switch (f.num) {
+        case 8:
+            ts = f.val;
+            break;
+        case 10:
+            EXPECT_UINT64_EQ((uint64_t)1, f.val);
+            break;
+        case 13:
+            if (f.val & 1) {
+                sum->cleared++;
+            }
+            break;
+        case 12:
+            EXPECT_INT_ZERO(summarize_interned(sum, f.data,
+                                               f.data + f.len));
+            break;
+        case 60:
+            ecur = f.data;
+            while (pb_next(&ecur, f.data + f.len, &g) > 0) {
+                if (g.num == 1) {
+                    uuid = g.val;
+                } else if (g.num == 2) {
+                    named = 1;
+                } else if (g.num == 3) {
+                    sum->process_tracks++;
+                } else if (g.num == 4) {
+                    sum->thread_tracks++;
+                }
+            }
+            if (named) {
+                sum->trace_tracks++;
+                sum->trace_track_uuid = uuid;
+            }
+            break;
+        case 11:
+            ecur = f.data;
+            while (pb_next(&ecur, f.data + f.len, &g) > 0) {
+                if (g.num == 9) {
+                    type = g.val;
+                } else if (g.num == 10) {
+                    iid = g.val;
+                } else if (g.num == 11) {
+                    sum->last_event_track = g.val;
+                } else if (g.num == 4) {
+                    sum->annotations++;
+                }
+            }
+            if (type == 1) {
+                if (sum->begins == 0) {
+                    sum->first_ts = ts;
+                }
+                EXPECT_TRUE((sum->begins < MAX_NAMES));
+                sum->begin_iids[sum->begins++] = iid;
+            } else if (type == 2) {
+                sum->ends++;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    EXPECT_INT_ZERO(res);
+    return EXIT_SUCCESS;
+}
+
+static int summarize_trace(const char *path, struct trace_summary *sum)
+{
+    FILE *fp;
+    uint8_t *buf;
+    const uint8_t *cur;
+    long len;
+    struct pb_field f;
+    int res;
+
+    memset(sum, 0, sizeof(*sum));
+    fp = fopen(path, "r");
+    EXPECT_NONNULL(fp);
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = malloc(len);
+    EXPECT_NONNULL(buf);
+    EXPECT_INT_EQ((int)len, (int)fread(buf, 1, len, fp));
+    fclose(fp);
+    cur = buf;
+    while ((res = pb_next(&cur, buf + len, &f)) > 0) {
+        // Every top-level field is a TracePacket.
+        EXPECT_INT_EQ(1, (int)f.num);
+        EXPECT_NONNULL(f.data);
+        EXPECT_INT_ZERO(summarize_packet(sum, f.data, f.data + f.len));
+    }
+    EXPECT_INT_ZERO(res);
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+static struct htracer *perfetto_tracer(const char *path, const char *format)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    char *str;
+
+    if (asprintf(&str, "%s=perfetto;%s=%s;%s=%s;%s=%s",
+                 HTRACE_SPAN_RECEIVER_KEY, HTRACE_TRACER_ID, TEST_TRID,
+                 HTRACE_PERFETTO_PATH_KEY, path,
+                 HTRACE_PERFETTO_FORMAT_KEY, format) < 0) {
+        return NULL;
+    }
+    cnf = htrace_conf_from_str(str);
+    free(str);
+    if (!cnf) {
+        return NULL;
+    }
+    tracer = htracer_create("perfetto_rcv-unit", cnf);
+    htrace_conf_free(cnf);
+    return tracer;
+}
+
+static int test_proto(const char *tdir)
+{
+    struct htracer *tracer;
+    struct htrace_span_id parent;
+    struct trace_summary sum;
+    char *path;
+
+    EXPECT_TRUE((asprintf(&path, "%s/trace.pftrace", tdir) > 0));
+    tracer = perfetto_tracer(path, "proto");
+    EXPECT_NONNULL(tracer);
+    parent.high = 0x1234;
+    parent.low = 0x5678;
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "alpha", 1000, 1800));
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, &parent, "beta", 1100, 1200));
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "alpha", 1300, 1400));
+    htracer_free(tracer);
+
+    EXPECT_INT_ZERO(summarize_trace(path, &sum));
+    EXPECT_INT_EQ(1, sum.process_tracks);
+    EXPECT_INT_EQ(1, sum.thread_tracks);
+    EXPECT_INT_EQ(3, sum.begins);
+    EXPECT_INT_EQ(3, sum.ends);
+    EXPECT_INT_EQ(1, sum.cleared);
+    // Span times are in microseconds, and trace timestamps in nanoseconds.
+    EXPECT_UINT64_EQ((uint64_t)1000000, sum.first_ts);
+    // Every span has its ID, and beta also has its parent.
+    EXPECT_INT_EQ(4, sum.annotations);
+    // The repeated description was only written once.
+    EXPECT_INT_EQ(2, sum.num_names);
+    EXPECT_STR_EQ("alpha", sum.names[0]);
+    EXPECT_STR_EQ("beta", sum.names[1]);
+    EXPECT_UINT64_EQ(sum.name_iids[0], sum.begin_iids[0]);
+    EXPECT_UINT64_EQ(sum.name_iids[1], sum.begin_iids[1]);
+    EXPECT_UINT64_EQ(sum.name_iids[0], sum.begin_iids[2]);
+    EXPECT_TRUE((sum.name_iids[0] != sum.name_iids[1]));
+
+    // A new receiver appends to the trace, and starts its interned
+    // descriptions over.
+    tracer = perfetto_tracer(path, "proto");
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "alpha", 2000, 2100));
+    htracer_free(tracer);
+    EXPECT_INT_ZERO(summarize_trace(path, &sum));
+    EXPECT_INT_EQ(2, sum.process_tracks);
+    EXPECT_INT_EQ(4, sum.begins);
+    EXPECT_INT_EQ(2, sum.cleared);
+    EXPECT_INT_EQ(3, sum.num_names);
+    EXPECT_STR_EQ("alpha", sum.names[2]);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Fill in a span for a batch.
+ */
+static struct htrace_span *batch_span(const char *desc, uint64_t trace_id,
+                                      uint64_t begin, uint64_t end)
+{
+    struct htrace_span_id id;
+    struct htrace_span *span;
+
+    id.high = trace_id;
+    id.low = begin;
+    span = htrace_span_alloc(desc, begin, &id);
+    if (span) {
+        span->end_ms = end;
+    }
+    return span;
+}
+
+static int test_batch(const char *tdir)
+{
+    struct htracer *tracer;
+    struct htrace_span *span, spans[3];
+    struct trace_summary sum;
+    char *path, buf[4096];
+    FILE *fp;
+    size_t len;
+    int i;
+
+    EXPECT_TRUE((asprintf(&path, "%s/batch.pftrace", tdir) > 0));
+    tracer = perfetto_tracer(path, "proto");
+    EXPECT_NONNULL(tracer);
+    for (i = 0; i < 3; i++) {
+        span = batch_span("batched", (i == 2) ? 0x2222 : 0x1111,
+                          1000 + i, 2000 + i);
+        EXPECT_NONNULL(span);
+        spans[i] = *span;
+        free(span);
+    }
+    htracer_add_spans(tracer, spans, 3);
+    htracer_free(tracer);
+    EXPECT_INT_ZERO(summarize_trace(path, &sum));
+    // The spans weren't closed on this thread, so they go on one track per
+    // trace, rather than on this thread's track.
+    EXPECT_INT_ZERO(sum.thread_tracks);
+    EXPECT_INT_EQ(2, sum.trace_tracks);
+    EXPECT_INT_EQ(3, sum.begins);
+    EXPECT_INT_EQ(3, sum.ends);
+    EXPECT_UINT64_EQ(sum.trace_track_uuid, sum.last_event_track);
+    free(path);
+
+    EXPECT_TRUE((asprintf(&path, "%s/batch.json", tdir) > 0));
+    tracer = perfetto_tracer(path, "json");
+    EXPECT_NONNULL(tracer);
+    htracer_add_spans(tracer, spans, 1);
+    htracer_free(tracer);
+    fp = fopen(path, "r");
+    EXPECT_NONNULL(fp);
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[len] = '\0';
+    fclose(fp);
+    EXPECT_NONNULL(strstr(buf, "{\"name\":\"batched\",\"cat\":\"htrace\","
+                "\"ph\":\"b\",\"id\":\"0x0000000000001111\",\"ts\":1000,"));
+    EXPECT_NONNULL(strstr(buf, "{\"name\":\"batched\",\"cat\":\"htrace\","
+                "\"ph\":\"e\",\"id\":\"0x0000000000001111\",\"ts\":2000,"));
+    EXPECT_NULL(strstr(buf, "\"ph\":\"X\""));
+    for (i = 0; i < 3; i++) {
+        free(spans[i].desc);
+    }
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_json(const char *tdir)
+{
+    struct htracer *tracer;
+    char *path, buf[4096];
+    FILE *fp;
+    size_t len;
+
+    EXPECT_TRUE((asprintf(&path, "%s/trace.json", tdir) > 0));
+    tracer = perfetto_tracer(path, "json");
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "alpha", 1000, 1800));
+    htracer_free(tracer);
+    tracer = perfetto_tracer(path, "json");
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "beta", 1100, 1200));
+    htracer_free(tracer);
+
+    fp = fopen(path, "r");
+    EXPECT_NONNULL(fp);
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[len] = '\0';
+    fclose(fp);
+    // The array is only opened once, even though the file was appended to.
+    EXPECT_INT_EQ(0, strncmp(buf, "[\n{", 3));
+    EXPECT_NULL(strstr(buf + 1, "["));
+    EXPECT_NONNULL(strstr(buf, "\"name\":\"process_name\",\"ph\":\"M\""));
+    EXPECT_NONNULL(strstr(buf, "\"args\":{\"name\":\"" TEST_TRID "\"}"));
+    EXPECT_NONNULL(strstr(buf, "{\"name\":\"alpha\",\"cat\":\"htrace\","
+                          "\"ph\":\"X\",\"ts\":1000,\"dur\":800,"));
+    EXPECT_NONNULL(strstr(buf, "{\"name\":\"beta\",\"cat\":\"htrace\","
+                          "\"ph\":\"X\",\"ts\":1100,\"dur\":100,"));
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_bad_format(const char *tdir)
+{
+    struct htracer *tracer;
+    char *path;
+
+    EXPECT_TRUE((asprintf(&path, "%s/trace.bad", tdir) > 0));
+    tracer = perfetto_tracer(path, "xml");
+    EXPECT_NULL(tracer);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    char err[512];
+    char *tdir;
+
+    err[0] = '\0';
+    tdir = create_tempdir("perfetto_rcv-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_ZERO(test_proto(tdir));
+    EXPECT_INT_ZERO(test_json(tdir));
+    EXPECT_INT_ZERO(test_batch(tdir));
+    EXPECT_INT_ZERO(test_bad_format(tdir));
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
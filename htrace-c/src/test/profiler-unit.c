@@ -0,0 +1,310 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/profiler.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @file profiler-unit.c
+ *
+ * Tests the span-attributed CPU profiler.
+ */
+
+#define TEST_TRID "profiler-unit"
+
+/**
+ * A flush interval long enough that the aggregation thread never gets in
+ * the way.
+ */
+#define NO_FLUSH ";" HTRACE_PROFILER_FLUSH_INTERVAL_MS_KEY "=3600000"
+
+/**
+ * How much CPU time to spend in each span, in milliseconds.
+ */
+#define BURN_MS 200
+
+/**
+ * The configuration for these tests.  The arguments are the profile path,
+ * and any extra settings, each preceded by a semicolon.
+ */
+#define PROFILER_CONF_FMT \
+    HTRACE_SPAN_RECEIVER_KEY "=noop;" \
+    HTRACE_TRACER_ID "=" TEST_TRID ";" \
+    HTRACE_SAMPLER_KEY "=always;" \
+    HTRACE_PROFILER_HZ_KEY "=1000;" \
+    HTRACE_PROFILER_PATH_KEY "=%s%s"
+
+static uint64_t thread_cpu_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000ULL);
+}
+
+/**
+ * Use up some CPU time on the calling thread.
+ */
+static void burn_cpu(uint64_t ms)
+{
+    volatile uint64_t x = 0;
+    uint64_t start = thread_cpu_ms();
+
+    while (thread_cpu_ms() - start < ms) {
+        x++;
+    }
+}
+
+/**
+ * Count the samples in a folded stack file whose first frame is the given
+ * span.
+ *
+ * @return              The number of samples, or -1 if some line doesn't
+ *                          start with any of the given spans.
+ */
+static int64_t count_samples(const char *buf, const char *span,
+                             const char * const *all_spans)
+{
+    const char *line, *end, *sp;
+    const char * const *s;
+    int64_t total = 0;
+    int known;
+
+    for (line = buf; *line; line = end + 1) {
+        end = strchr(line, '\n');
+        if (!end) {
+            return -1;
+        }
+        known = 0;
+        for (s = all_spans; *s; s++) {
+            if ((!strncmp(line, *s, strlen(*s))) &&
+                    (line[strlen(*s)] == ';')) {
+                known = 1;
+            }
+        }
+        if (!known) {
+            return -1;
+        }
+        if ((!strncmp(line, span, strlen(span))) &&
+                (line[strlen(span)] == ';')) {
+            for (sp = end; *sp != ' '; sp--) {
+                ;
+            }
+            total += strtoll(sp + 1, NULL, 10);
+        }
+    }
+    return total;
+}
+
+struct worker_ctx {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+};
+
+static void *worker(void *data)
+{
+    struct worker_ctx *ctx = data;
+    struct htrace_scope *scope;
+
+    scope = htrace_start_span(ctx->tracer, ctx->smp, "worker span");
+    burn_cpu(BURN_MS);
+    htrace_scope_close(scope);
+    return NULL;
+}
+
+static int test_by_desc(const char *tdir)
+{
+    static const char * const all_spans[] = {
+        "profiled span", "worker span", NULL };
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    struct worker_ctx ctx;
+    pthread_t thread;
+    char *path, *buf;
+
+    EXPECT_TRUE((asprintf(&path, "%s/desc.folded", tdir) > 0));
+    cnf = test_conf(PROFILER_CONF_FMT, path, NO_FLUSH);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("profiler-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_NONNULL(tracer->prof);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+
+    scope = htrace_start_span(tracer, smp, "profiled span");
+    EXPECT_NONNULL(scope);
+    burn_cpu(BURN_MS);
+    htrace_scope_close(scope);
+    // Samples taken outside of any span aren't kept.
+    burn_cpu(BURN_MS);
+
+    // The worker's samples are written even though it has exited.
+    ctx.tracer = tracer;
+    ctx.smp = smp;
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, worker, &ctx));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    EXPECT_TRUE((profiler_flush(tracer->prof) > 0));
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    EXPECT_TRUE((count_samples(buf, "profiled span", all_spans) > 0));
+    EXPECT_TRUE((count_samples(buf, "worker span", all_spans) > 0));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_by_span(const char *tdir)
+{
+    const char *all_spans[2];
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    struct htrace_span_id span_id;
+    char *path, *buf, id_str[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char expected[128];
+
+    EXPECT_TRUE((asprintf(&path, "%s/span.folded", tdir) > 0));
+    cnf = test_conf(PROFILER_CONF_FMT, path,
+                    ";" HTRACE_PROFILER_AGGREGATE_KEY "=span" NO_FLUSH);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("profiler-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    scope = htrace_start_span(tracer, smp, "by;span");
+    EXPECT_NONNULL(scope);
+    htrace_scope_get_span_id(scope, &span_id);
+    burn_cpu(BURN_MS);
+    htrace_scope_close(scope);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    // Semicolons in descriptions would look like frame separators.
+    EXPECT_INT_EQ(1, htrace_span_id_to_str(&span_id, id_str,
+                                           sizeof(id_str)));
+    snprintf(expected, sizeof(expected), "by_span [%s]", id_str);
+    all_spans[0] = expected;
+    all_spans[1] = NULL;
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    EXPECT_TRUE((count_samples(buf, expected, all_spans) > 0));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_one_at_a_time(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer, *tracer2;
+    struct sigaction act;
+    char *path;
+
+    EXPECT_TRUE((asprintf(&path, "%s/first.folded", tdir) > 0));
+    cnf = test_conf(PROFILER_CONF_FMT, path, NO_FLUSH);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("profiler-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_NONNULL(tracer->prof);
+    // The second tracer still works, but isn't profiled.
+    tracer2 = htracer_create("profiler-unit", cnf);
+    EXPECT_NONNULL(tracer2);
+    EXPECT_NULL(tracer2->prof);
+    htracer_free(tracer2);
+    htracer_free(tracer);
+    // Once the first tracer is gone, another one can be profiled.
+    tracer = htracer_create("profiler-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_NONNULL(tracer->prof);
+    htracer_free(tracer);
+    // The SIGPROF handler is left in place, so that a timer signal which was
+    // still queued doesn't kill the process.
+    memset(&act, 0, sizeof(act));
+    EXPECT_INT_ZERO(sigaction(SIGPROF, NULL, &act));
+    EXPECT_TRUE(((act.sa_flags & SA_SIGINFO) != 0));
+    EXPECT_INT_ZERO(raise(SIGPROF));
+    htrace_conf_free(cnf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_bad_conf(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    char *path;
+
+    EXPECT_TRUE((asprintf(&path, "%s/bad.folded", tdir) > 0));
+    cnf = test_conf(PROFILER_CONF_FMT, path,
+                    ";" HTRACE_PROFILER_AGGREGATE_KEY "=bogus");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("profiler-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_NULL(tracer->prof);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    cnf = test_conf(PROFILER_CONF_FMT, "", "");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("profiler-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_NULL(tracer->prof);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    char err[512];
+    char *tdir;
+
+    err[0] = '\0';
+    tdir = create_tempdir("profiler-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_ZERO(test_by_desc(tdir));
+    EXPECT_INT_ZERO(test_by_span(tdir));
+    EXPECT_INT_ZERO(test_one_at_a_time(tdir));
+    EXPECT_INT_ZERO(test_bad_conf(tdir));
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -75,6 +75,34 @@ static int test_u32_uniqueness(void)
     return EXIT_SUCCESS;
 }
 
+/**
+ * Test that we can fill large and small arrays of uint64_t objects.
+ */
+static int test_u64_fill(void)
+{
+    struct random_src *rnd = random_src_alloc(g_rand_unit_lg);
+    uint64_t *arr;
+    int i, j, num_zero;
+
+    EXPECT_NONNULL(rnd);
+    arr = calloc(ARRAY_SIZE * 2, sizeof(uint64_t));
+    EXPECT_NONNULL(arr);
+    for (i = 1; i <= ARRAY_SIZE * 2; i *= 4) {
+        memset(arr, 0, ARRAY_SIZE * 2 * sizeof(uint64_t));
+        random_u64_fill(rnd, arr, i);
+        num_zero = 0;
+        for (j = 0; j < i; j++) {
+            if (arr[j] == 0) {
+                num_zero++;
+            }
+        }
+        EXPECT_INT_GE(0, 1 - num_zero);
+    }
+    random_src_free(rnd);
+    free(arr);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     struct htrace_conf *conf;
@@ -84,6 +112,7 @@ int main(void)
     g_rand_unit_lg = htrace_log_alloc(conf);
     EXPECT_NONNULL(g_rand_unit_lg);
     EXPECT_INT_ZERO(test_u32_uniqueness());
+    EXPECT_INT_ZERO(test_u64_fill());
     htrace_log_free(g_rand_unit_lg);
     htrace_conf_free(conf);
 
@@ -0,0 +1,325 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "sampler/sampler.h"
+#include "test/span_table.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @file reconfigure-unit.c
+ *
+ * Tests reconfiguring an htracer at runtime.
+ */
+
+#define TEST_TRID "reconfigure-unit"
+
+#define NUM_TEST_SAMPLES 1000
+
+#define NUM_SWAP_THREADS 4
+
+#define NUM_SWAP_SPANS_PER_THREAD 2000
+
+#define NUM_SWAP_FILES 3
+
+#define NUM_SWAPS 20
+
+/**
+ * How long to wait for the configuration file watcher.
+ */
+#define WATCH_TIMEOUT_MS 30000
+
+/**
+ * The configuration for these tests.  The arguments are the local file path,
+ * the probability sampler's fraction, and any extra settings, each preceded
+ * by a semicolon.
+ */
+#define LOCAL_FILE_CONF_FMT \
+    HTRACE_SPAN_RECEIVER_KEY "=local.file;" \
+    HTRACE_LOCAL_FILE_RCV_PATH_KEY "=%s;" \
+    HTRACE_TRACER_ID "=" TEST_TRID ";" \
+    HTRACE_SAMPLER_KEY "=prob;" \
+    HTRACE_PROB_SAMPLER_FRACTION_KEY "=%g%s"
+
+static int count_samples(struct htrace_sampler *smp)
+{
+    int i, count = 0;
+
+    for (i = 0; i < NUM_TEST_SAMPLES; i++) {
+        count += smp->ty->next(smp);
+    }
+    return count;
+}
+
+static int expect_only_span(const char *path, const char *desc)
+{
+    struct span_table *st;
+    struct htrace_span *span;
+
+    st = span_table_alloc();
+    EXPECT_NONNULL(st);
+    EXPECT_INT_EQ(1, load_trace_span_file(path, st));
+    EXPECT_INT_ZERO(span_table_get(st, &span, desc, TEST_TRID));
+    span_table_free(st);
+    return EXIT_SUCCESS;
+}
+
+static int test_reconfigure(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    char *path_a, *path_b;
+
+    EXPECT_TRUE((asprintf(&path_a, "%s/a.json", tdir) > 0));
+    EXPECT_TRUE((asprintf(&path_b, "%s/b.json", tdir) > 0));
+    cnf = test_conf(LOCAL_FILE_CONF_FMT, path_a, 0.0, "");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("reconfigure-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    htrace_conf_free(cnf);
+    EXPECT_INT_ZERO(count_samples(smp));
+    EXPECT_STR_EQ("ProbabilitySampler(fraction=0)",
+                  htrace_sampler_to_str(smp));
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "before", 1, 2));
+
+    cnf = test_conf(LOCAL_FILE_CONF_FMT, path_b, 1.0, "");
+    EXPECT_NONNULL(cnf);
+    EXPECT_INT_EQ(1, htracer_reconfigure(tracer, cnf));
+    htrace_conf_free(cnf);
+    EXPECT_INT_EQ(NUM_TEST_SAMPLES, count_samples(smp));
+    EXPECT_STR_EQ("ProbabilitySampler(fraction=1)",
+                  htrace_sampler_to_str(smp));
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "after", 3, 4));
+
+    // The old receiver has been shut down, so its spans are on disk already.
+    EXPECT_INT_ZERO(expect_only_span(path_a, "before"));
+
+    // A receiver which can't be created leaves the old configuration alone.
+    cnf = test_conf(LOCAL_FILE_CONF_FMT, "/nonexistent/dir/c.json", 0.0, "");
+    EXPECT_NONNULL(cnf);
+    EXPECT_INT_ZERO(htracer_reconfigure(tracer, cnf));
+    htrace_conf_free(cnf);
+    EXPECT_INT_EQ(NUM_TEST_SAMPLES, count_samples(smp));
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    EXPECT_INT_ZERO(expect_only_span(path_b, "after"));
+    free(path_a);
+    free(path_b);
+    return EXIT_SUCCESS;
+}
+
+struct swap_thread {
+    struct htracer *tracer;
+    pthread_t thread;
+};
+
+static void *swap_thread_run(void *data)
+{
+    struct swap_thread *st = data;
+    int i;
+
+    for (i = 0; i < NUM_SWAP_SPANS_PER_THREAD; i++) {
+        htrace_record_span(st->tracer, NULL, "swap", i, i + 1);
+    }
+    return NULL;
+}
+
+/**
+ * Test that no spans are lost when the receiver is swapped out from under
+ * threads which are recording spans.
+ */
+static int test_reconfigure_while_recording(const char *tdir)
+{
+    struct swap_thread threads[NUM_SWAP_THREADS];
+    char *paths[NUM_SWAP_FILES];
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct span_table *st;
+    int i, total = 0;
+
+    for (i = 0; i < NUM_SWAP_FILES; i++) {
+        EXPECT_TRUE((asprintf(&paths[i], "%s/swap%d.json", tdir, i) > 0));
+    }
+    cnf = test_conf(LOCAL_FILE_CONF_FMT, paths[0], 0.0, "");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("reconfigure-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    htrace_conf_free(cnf);
+    for (i = 0; i < NUM_SWAP_THREADS; i++) {
+        threads[i].tracer = tracer;
+        EXPECT_INT_ZERO(pthread_create(&threads[i].thread, NULL,
+                                       swap_thread_run, &threads[i]));
+    }
+    for (i = 1; i <= NUM_SWAPS; i++) {
+        // The local file receiver appends, so rotating through the same
+        // files keeps every span.
+        cnf = test_conf(LOCAL_FILE_CONF_FMT, paths[i % NUM_SWAP_FILES],
+                        0.0, "");
+        EXPECT_NONNULL(cnf);
+        EXPECT_INT_EQ(1, htracer_reconfigure(tracer, cnf));
+        htrace_conf_free(cnf);
+    }
+    for (i = 0; i < NUM_SWAP_THREADS; i++) {
+        EXPECT_INT_ZERO(pthread_join(threads[i].thread, NULL));
+    }
+    htracer_free(tracer);
+    for (i = 0; i < NUM_SWAP_FILES; i++) {
+        st = span_table_alloc();
+        EXPECT_NONNULL(st);
+        total += load_trace_span_file(paths[i], st);
+        span_table_free(st);
+        free(paths[i]);
+    }
+    EXPECT_INT_EQ(NUM_SWAP_THREADS * NUM_SWAP_SPANS_PER_THREAD, total);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that rewriting the watched configuration file reconfigures the tracer.
+ */
+static int test_conf_watch(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    char *path_a, *path_b, *conf_path, *tmp_path, *extra;
+    FILE *fp;
+    int i;
+
+    EXPECT_TRUE((asprintf(&path_a, "%s/watch_a.json", tdir) > 0));
+    EXPECT_TRUE((asprintf(&path_b, "%s/watch_b.json", tdir) > 0));
+    EXPECT_TRUE((asprintf(&conf_path, "%s/htrace.conf", tdir) > 0));
+    EXPECT_TRUE((asprintf(&tmp_path, "%s/htrace.conf.tmp", tdir) > 0));
+    EXPECT_TRUE((asprintf(&extra, ";%s=%s", HTRACE_CONF_WATCH_PATH_KEY,
+                          conf_path) > 0));
+    cnf = test_conf(LOCAL_FILE_CONF_FMT, path_a, 0.0, extra);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("reconfigure-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    htrace_conf_free(cnf);
+    EXPECT_INT_ZERO(count_samples(smp));
+
+    // Write the new configuration elsewhere and rename it into place, the way
+    // configuration management tools usually do.
+    fp = fopen(tmp_path, "w");
+    EXPECT_NONNULL(fp);
+    fprintf(fp, "%s=local.file\n%s=%s\n%s=%s\n%s=prob\n%s=1.0\n",
+            HTRACE_SPAN_RECEIVER_KEY,
+            HTRACE_LOCAL_FILE_RCV_PATH_KEY, path_b,
+            HTRACE_TRACER_ID, TEST_TRID,
+            HTRACE_SAMPLER_KEY,
+            HTRACE_PROB_SAMPLER_FRACTION_KEY);
+    EXPECT_INT_ZERO(fclose(fp));
+    EXPECT_INT_ZERO(rename(tmp_path, conf_path));
+
+    // Samplers are reconfigured after the receiver is swapped.
+    for (i = 0; i < WATCH_TIMEOUT_MS / 10; i++) {
+        if (smp->ty->next(smp)) {
+            break;
+        }
+        usleep(10000);
+    }
+    EXPECT_TRUE((i < WATCH_TIMEOUT_MS / 10));
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "watched", 1, 2));
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    EXPECT_INT_ZERO(expect_only_span(path_b, "watched"));
+    free(path_a);
+    free(path_b);
+    free(conf_path);
+    free(tmp_path);
+    free(extra);
+    return EXIT_SUCCESS;
+}
+
+static int test_lazy_start(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    char *path_a, *path_b, *extra;
+    struct stat st;
+
+    EXPECT_TRUE((asprintf(&path_a, "%s/lazy_a.json", tdir) > 0));
+    EXPECT_TRUE((asprintf(&path_b, "%s/lazy_b.json", tdir) > 0));
+    EXPECT_TRUE((asprintf(&extra, ";%s=true", HTRACE_TRACER_LAZY_KEY) > 0));
+    cnf = test_conf(LOCAL_FILE_CONF_FMT, path_a, 1.0, extra);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("reconfigure-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    htrace_conf_free(cnf);
+
+    // Nothing has been started yet.
+    EXPECT_NULL(tracer->trid);
+    EXPECT_NULL(tracer->rcv);
+    EXPECT_TRUE((stat(path_a, &st) < 0));
+
+    // Reconfiguring a tracer which hasn't started just changes what it will
+    // start with.
+    cnf = test_conf(LOCAL_FILE_CONF_FMT, path_b, 1.0, extra);
+    EXPECT_NONNULL(cnf);
+    EXPECT_INT_EQ(1, htracer_reconfigure(tracer, cnf));
+    htrace_conf_free(cnf);
+    EXPECT_NULL(tracer->rcv);
+
+    // The first span starts the tracer.
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, "lazy", 1, 2));
+    EXPECT_STR_EQ(TEST_TRID, tracer->trid);
+    EXPECT_NONNULL(tracer->rcv);
+    htracer_free(tracer);
+    EXPECT_TRUE((stat(path_a, &st) < 0));
+    EXPECT_INT_ZERO(expect_only_span(path_b, "lazy"));
+    free(path_a);
+    free(path_b);
+    free(extra);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    char err[512];
+    char *tdir;
+
+    err[0] = '\0';
+    tdir = create_tempdir("reconfigure-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_ZERO(test_reconfigure(tdir));
+    EXPECT_INT_ZERO(test_reconfigure_while_recording(tdir));
+    EXPECT_INT_ZERO(test_conf_watch(tdir));
+    EXPECT_INT_ZERO(test_lazy_start(tdir));
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
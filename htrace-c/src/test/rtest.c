@@ -18,6 +18,7 @@
 
 #include "core/conf.h"
 #include "core/htrace.h"
+#include "core/htracer.h"
 #include "core/scope.h"
 #include "core/span.h"
 #include "test/rtest.h"
@@ -28,6 +29,7 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -159,8 +161,203 @@ static struct rtest g_rtest_simple = {
     rtest_simple_verify,
 };
 
+int rtest_record_run(struct rtest *rt, const char *conf_str)
+{
+    struct htrace_scope *scope0;
+    struct htrace_span_id parent_id;
+    struct htrace_span_record recs[2];
+    struct rtest_data *rdata = NULL;
+
+    EXPECT_INT_ZERO(rtest_data_init(conf_str, &rdata));
+    EXPECT_NONNULL(rdata);
+    scope0 = htrace_start_span(rdata->tracer, rdata->always, "recordParent");
+    htrace_scope_get_span_id(scope0, &parent_id);
+    EXPECT_INT_EQ(1, htrace_record_span(rdata->tracer, &parent_id,
+                                        "recorded1", 1000, 2000));
+    EXPECT_INT_ZERO(htrace_record_span(rdata->tracer, &parent_id,
+                                       "bad\"desc", 1000, 2000));
+    memset(recs, 0, sizeof(recs));
+    recs[0].parent = parent_id;
+    recs[0].desc = "batch1";
+    recs[0].begin = 3000;
+    recs[0].end = 4000;
+    recs[1].desc = "batch2";
+    recs[1].begin = 5000;
+    recs[1].end = 6000;
+    EXPECT_INT_EQ(2, htrace_record_spans(rdata->tracer, recs, 2));
+    EXPECT_TRUE(0 != htrace_span_id_compare(&INVALID_SPAN_ID,
+                                            &recs[0].span_id));
+    EXPECT_TRUE((parent_id.high == recs[0].span_id.high));
+    EXPECT_TRUE(0 != htrace_span_id_compare(&INVALID_SPAN_ID,
+                                            &recs[1].span_id));
+    // Recording spans must not disturb the current trace scope.
+    EXPECT_TRUE((scope0 == htracer_cur_scope(rdata->tracer)));
+    htrace_scope_close(scope0);
+    rt->spans_created = 4;
+    rtest_data_free(rdata);
+    return EXIT_SUCCESS;
+}
+
+int rtest_record_verify(struct rtest *rt, struct span_table *st)
+{
+    struct htrace_span *span;
+    struct htrace_span_id parent_id;
+    char trid[128];
+
+    EXPECT_INT_ZERO(rtest_verify_table_size(rt, st));
+    get_receiver_test_trid(trid, sizeof(trid));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "recordParent", trid));
+    htrace_span_id_copy(&parent_id, &span->span_id);
+
+    EXPECT_INT_ZERO(span_table_get(st, &span, "recorded1", trid));
+    EXPECT_UINT64_EQ((uint64_t)1000, span->begin_ms);
+    EXPECT_UINT64_EQ((uint64_t)2000, span->end_ms);
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_TRUE(0 == htrace_span_id_compare(&parent_id, &span->parent.single));
+
+    EXPECT_INT_ZERO(span_table_get(st, &span, "batch1", trid));
+    EXPECT_UINT64_EQ((uint64_t)3000, span->begin_ms);
+    EXPECT_UINT64_EQ((uint64_t)4000, span->end_ms);
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_TRUE(0 == htrace_span_id_compare(&parent_id, &span->parent.single));
+
+    EXPECT_INT_ZERO(span_table_get(st, &span, "batch2", trid));
+    EXPECT_INT_ZERO(span->num_parents);
+    return EXIT_SUCCESS;
+}
+
+static struct rtest g_rtest_record = {
+    "rtest_record",
+    rtest_record_run,
+    rtest_record_verify,
+};
+
+int rtest_spanf_run(struct rtest *rt, const char *conf_str)
+{
+    struct htrace_scope *scope0, *scope1;
+    struct rtest_data *rdata = NULL;
+
+    EXPECT_INT_ZERO(rtest_data_init(conf_str, &rdata));
+    EXPECT_NONNULL(rdata);
+    // With no sampler and no current span, we should not trace.
+    EXPECT_NULL(htrace_start_spanf(rdata->tracer, NULL, "unsampled %d", 1));
+    scope0 = htrace_start_spanf(rdata->tracer, rdata->always,
+                                "get region=%s key=%llu", "r1", 123ULL);
+    EXPECT_NONNULL(scope0);
+    scope1 = htrace_start_spanf(rdata->tracer, NULL, "child %d", 2);
+    EXPECT_NONNULL(scope1);
+    EXPECT_NULL(htrace_start_spanf(rdata->tracer, NULL, "bad%c", '"'));
+    htrace_scope_close(scope1);
+    htrace_scope_close(scope0);
+    rt->spans_created = 2;
+    rtest_data_free(rdata);
+    return EXIT_SUCCESS;
+}
+
+int rtest_spanf_verify(struct rtest *rt, struct span_table *st)
+{
+    struct htrace_span *span;
+    struct htrace_span_id parent_id;
+    char trid[128];
+
+    EXPECT_INT_ZERO(rtest_verify_table_size(rt, st));
+    get_receiver_test_trid(trid, sizeof(trid));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "get region=r1 key=123", trid));
+    EXPECT_INT_ZERO(span->num_parents);
+    htrace_span_id_copy(&parent_id, &span->span_id);
+
+    EXPECT_INT_ZERO(span_table_get(st, &span, "child 2", trid));
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_TRUE(0 == htrace_span_id_compare(&parent_id, &span->parent.single));
+    return EXIT_SUCCESS;
+}
+
+static struct rtest g_rtest_spanf = {
+    "rtest_spanf",
+    rtest_spanf_run,
+    rtest_spanf_verify,
+};
+
+#define RTEST_NUM_CHILDREN 3
+
+static void *rtest_children_close_thread(void *arg)
+{
+    htrace_child_close((struct htrace_child *)arg, 0);
+    return NULL;
+}
+
+int rtest_children_run(struct rtest *rt, const char *conf_str)
+{
+    struct htrace_scope *scope0;
+    struct htrace_span_id parent_id, ids[RTEST_NUM_CHILDREN];
+    struct htrace_child *children[RTEST_NUM_CHILDREN];
+    struct rtest_data *rdata = NULL;
+    pthread_t thread;
+    int i;
+
+    EXPECT_INT_ZERO(rtest_data_init(conf_str, &rdata));
+    EXPECT_NONNULL(rdata);
+    scope0 = htrace_start_span(rdata->tracer, rdata->always, "fanOut");
+    htrace_scope_get_span_id(scope0, &parent_id);
+    EXPECT_INT_ZERO(htrace_start_children(rdata->tracer, &INVALID_SPAN_ID,
+                                          "shard", RTEST_NUM_CHILDREN,
+                                          children));
+    EXPECT_INT_ZERO(htrace_start_children(rdata->tracer, &parent_id,
+                                          "bad\"desc", RTEST_NUM_CHILDREN,
+                                          children));
+    EXPECT_INT_EQ(RTEST_NUM_CHILDREN,
+                  htrace_start_children(rdata->tracer, &parent_id, "shard",
+                                        RTEST_NUM_CHILDREN, children));
+    // Starting children must not disturb the current trace scope.
+    EXPECT_TRUE((scope0 == htracer_cur_scope(rdata->tracer)));
+    for (i = 0; i < RTEST_NUM_CHILDREN; i++) {
+        htrace_child_get_span_id(children[i], &ids[i]);
+        EXPECT_TRUE((parent_id.high == ids[i].high));
+        EXPECT_TRUE(0 != htrace_span_id_compare(&parent_id, &ids[i]));
+    }
+    EXPECT_TRUE(0 != htrace_span_id_compare(&ids[0], &ids[1]));
+    EXPECT_TRUE(0 != htrace_span_id_compare(&ids[1], &ids[2]));
+    // Children may be closed on any thread.
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL,
+                                   rtest_children_close_thread, children[0]));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    for (i = 1; i < RTEST_NUM_CHILDREN; i++) {
+        htrace_child_close(children[i], 0);
+    }
+    htrace_scope_close(scope0);
+    rt->spans_created = RTEST_NUM_CHILDREN + 1;
+    rtest_data_free(rdata);
+    return EXIT_SUCCESS;
+}
+
+int rtest_children_verify(struct rtest *rt, struct span_table *st)
+{
+    struct htrace_span *span;
+    struct htrace_span_id parent_id;
+    char trid[128];
+
+    EXPECT_INT_ZERO(rtest_verify_table_size(rt, st));
+    get_receiver_test_trid(trid, sizeof(trid));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "fanOut", trid));
+    htrace_span_id_copy(&parent_id, &span->span_id);
+
+    EXPECT_INT_ZERO(span_table_get(st, &span, "shard", trid));
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_TRUE(0 == htrace_span_id_compare(&parent_id, &span->parent.single));
+    return EXIT_SUCCESS;
+}
+
+static struct rtest g_rtest_children = {
+    "rtest_children",
+    rtest_children_run,
+    rtest_children_verify,
+};
+
 struct rtest * const g_rtests[] = {
     &g_rtest_simple,
+    &g_rtest_record,
+    &g_rtest_spanf,
+    &g_rtest_children,
     NULL
 };
 
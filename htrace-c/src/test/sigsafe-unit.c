@@ -0,0 +1,197 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file sigsafe-unit.c
+ *
+ * Tests the async-signal-safe span API.
+ */
+
+#define TEST_TRID "sigsafe-unit"
+
+/**
+ * A drain interval long enough that the drain thread never gets in the way.
+ */
+#define NO_DRAIN ";" HTRACE_SIGSAFE_DRAIN_INTERVAL_MS_KEY "=3600000"
+
+/**
+ * The configuration for these tests.  The arguments are the local file path,
+ * and any extra settings, each preceded by a semicolon.
+ */
+#define SIGSAFE_CONF_FMT \
+    HTRACE_SPAN_RECEIVER_KEY "=local.file;" \
+    HTRACE_LOCAL_FILE_RCV_PATH_KEY "=%s;" \
+    HTRACE_TRACER_ID "=" TEST_TRID "%s"
+
+static struct htracer *g_handler_tracer;
+
+static int g_handler_ret;
+
+static void record_in_handler(int sig)
+{
+    struct htrace_sigsafe_span span;
+
+    htrace_sigsafe_start(g_handler_tracer, NULL, "in handler", &span);
+    g_handler_ret = htrace_sigsafe_end(g_handler_tracer, &span);
+}
+
+static int test_spans(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sigsafe_span outer, inner;
+    struct sigaction act, old_act;
+    char *path, *buf, id_str[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char expected[128];
+
+    EXPECT_TRUE((asprintf(&path, "%s/spans.json", tdir) > 0));
+    cnf = test_conf(SIGSAFE_CONF_FMT, path,
+                    ";" HTRACE_SIGSAFE_SLOTS_KEY "=64" NO_DRAIN);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("sigsafe-unit", cnf);
+    EXPECT_NONNULL(tracer);
+
+    htrace_sigsafe_start(tracer, NULL, "outer", &outer);
+    EXPECT_TRUE((outer.span_id.high || outer.span_id.low));
+    htrace_sigsafe_start(tracer, &outer.span_id, "inner", &inner);
+    EXPECT_UINT64_EQ(outer.span_id.high, inner.span_id.high);
+    EXPECT_TRUE((outer.span_id.low != inner.span_id.low));
+    EXPECT_INT_EQ(1, htrace_sigsafe_end(tracer, &inner));
+    EXPECT_INT_EQ(1, htrace_sigsafe_end(tracer, &outer));
+    EXPECT_INT_EQ(2, htracer_sigsafe_drain(tracer));
+    EXPECT_INT_ZERO(htracer_sigsafe_drain(tracer));
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = record_in_handler;
+    sigemptyset(&act.sa_mask);
+    EXPECT_INT_ZERO(sigaction(SIGUSR1, &act, &old_act));
+    g_handler_tracer = tracer;
+    EXPECT_INT_ZERO(raise(SIGUSR1));
+    EXPECT_INT_ZERO(sigaction(SIGUSR1, &old_act, NULL));
+    EXPECT_INT_EQ(1, g_handler_ret);
+
+    // Spans which haven't been drained yet are sent when the tracer is
+    // freed.
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"outer\""));
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"inner\""));
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"in handler\""));
+    EXPECT_INT_EQ(1, htrace_span_id_to_str(&outer.span_id, id_str,
+                                           sizeof(id_str)));
+    snprintf(expected, sizeof(expected), "\"p\":[\"%s\"]", id_str);
+    EXPECT_NONNULL(strstr(buf, expected));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_full(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sigsafe_span span;
+    char *path, *buf, desc[128];
+
+    EXPECT_TRUE((asprintf(&path, "%s/full.json", tdir) > 0));
+    cnf = test_conf(SIGSAFE_CONF_FMT, path,
+                    ";" HTRACE_SIGSAFE_SLOTS_KEY "=1" NO_DRAIN);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("sigsafe-unit", cnf);
+    EXPECT_NONNULL(tracer);
+
+    // Long descriptions are truncated.
+    memset(desc, 'x', sizeof(desc) - 1);
+    desc[sizeof(desc) - 1] = '\0';
+    htrace_sigsafe_start(tracer, NULL, desc, &span);
+    EXPECT_INT_EQ(1, htrace_sigsafe_end(tracer, &span));
+    htrace_sigsafe_start(tracer, NULL, "dropped", &span);
+    EXPECT_INT_ZERO(htrace_sigsafe_end(tracer, &span));
+    EXPECT_INT_EQ(1, htracer_sigsafe_drain(tracer));
+    htrace_sigsafe_start(tracer, NULL, "after drain", &span);
+    EXPECT_INT_EQ(1, htrace_sigsafe_end(tracer, &span));
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    buf = read_path(path);
+    EXPECT_NONNULL(buf);
+    desc[63] = '\0';
+    EXPECT_NONNULL(strstr(buf, desc));
+    desc[64] = '\0';
+    desc[63] = 'x';
+    EXPECT_NULL(strstr(buf, desc));
+    EXPECT_NULL(strstr(buf, "\"d\":\"dropped\""));
+    EXPECT_NONNULL(strstr(buf, "\"d\":\"after drain\""));
+    free(buf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+static int test_disabled(const char *tdir)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sigsafe_span span;
+    char *path;
+
+    EXPECT_TRUE((asprintf(&path, "%s/disabled.json", tdir) > 0));
+    cnf = test_conf(SIGSAFE_CONF_FMT, path, "");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("sigsafe-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    htrace_sigsafe_start(tracer, NULL, "disabled", &span);
+    EXPECT_UINT64_EQ((uint64_t)0, span.span_id.high);
+    EXPECT_UINT64_EQ((uint64_t)0, span.span_id.low);
+    EXPECT_INT_ZERO(htrace_sigsafe_end(tracer, &span));
+    EXPECT_INT_ZERO(htracer_sigsafe_drain(tracer));
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(path);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    char err[512];
+    char *tdir;
+
+    err[0] = '\0';
+    tdir = create_tempdir("sigsafe-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_ZERO(test_spans(tdir));
+    EXPECT_INT_ZERO(test_full(tdir));
+    EXPECT_INT_ZERO(test_disabled(tdir));
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
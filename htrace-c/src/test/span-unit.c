@@ -65,6 +65,10 @@ int main(void)
         "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
         "\"e\":1000,\"d\":\"thirdSpan\",\"r\":\"other-tracerid\","
         "\"p\":[\"000000002ce111e5b345feff819cdc9f\"]}"));
+    EXPECT_INT_ZERO(test_span_round_trip(
+        "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
+        "\"e\":1000,\"d\":\"openSpan\",\"r\":\"other-tracerid\","
+        "\"p\":[],\"n\":{\"inflight\":\"true\"}}"));
     return EXIT_SUCCESS;
 }
 
@@ -16,16 +16,20 @@
  * limitations under the License.
  */
 
+#include "core/conf.h"
 #include "core/htrace.h"
 #include "core/span_id.h"
 #include "test/span_util.h"
 #include "test/test.h"
+#include "util/log.h"
+#include "util/rand.h"
 
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static int test_span_id_round_trip(const char *str)
 {
@@ -82,6 +86,106 @@ static int test_span_id_eq(const char *sa, const char *sb)
     return test_span_id_compare(0, sa, sb);
 }
 
+static int test_span_id_generate_time_ordered(void)
+{
+    struct htrace_conf *conf;
+    struct htrace_log *lg;
+    struct random_src *rnd;
+    struct htrace_span_id root, child;
+    enum htrace_span_id_scheme scheme;
+    uint64_t before, after;
+
+    EXPECT_INT_EQ(1, htrace_span_id_scheme_parse("time-ordered", &scheme));
+    EXPECT_INT_EQ(HTRACE_SPAN_ID_SCHEME_TIME_ORDERED, scheme);
+    EXPECT_INT_EQ(1, htrace_span_id_scheme_parse("random", &scheme));
+    EXPECT_INT_EQ(HTRACE_SPAN_ID_SCHEME_RANDOM, scheme);
+    EXPECT_INT_ZERO(htrace_span_id_scheme_parse("sequential", &scheme));
+
+    conf = htrace_conf_from_strs("", "");
+    EXPECT_NONNULL(conf);
+    lg = htrace_log_alloc(conf);
+    EXPECT_NONNULL(lg);
+    rnd = random_src_alloc(lg);
+    EXPECT_NONNULL(rnd);
+    before = htrace_span_id_time_prefix();
+    htrace_span_id_generate(&root, rnd, NULL,
+                            HTRACE_SPAN_ID_SCHEME_TIME_ORDERED);
+    after = htrace_span_id_time_prefix();
+    // The minute may change between the two readings.
+    EXPECT_TRUE((((root.high >> 48) << 48) == before) ||
+                (((root.high >> 48) << 48) == after));
+    EXPECT_TRUE((root.low != 0));
+    // Children still inherit the trace ID of their parent.
+    htrace_span_id_generate(&child, rnd, &root,
+                            HTRACE_SPAN_ID_SCHEME_TIME_ORDERED);
+    EXPECT_UINT64_EQ(root.high, child.high);
+    random_src_free(rnd);
+    htrace_log_free(lg);
+    htrace_conf_free(conf);
+    return 0;
+}
+
+static int test_context_round_trip(const char *sid, uint8_t flags,
+                                   const char *expected_text)
+{
+    struct htrace_span_id id, id2;
+    uint8_t buf[HTRACE_CONTEXT_BINARY_LENGTH], flags2;
+    char err[512], text[HTRACE_CONTEXT_TEXT_LENGTH + 1];
+
+    err[0] = '\0';
+    htrace_span_id_parse(&id, sid, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+
+    EXPECT_INT_EQ(HTRACE_CONTEXT_BINARY_LENGTH,
+                  htrace_context_encode(&id, flags, buf, sizeof(buf)));
+    EXPECT_INT_EQ(HTRACE_CONTEXT_VERSION, buf[0]);
+    EXPECT_INT_EQ(flags, buf[HTRACE_CONTEXT_BINARY_LENGTH - 1]);
+    EXPECT_INT_EQ(1, htrace_context_decode(&id2, &flags2, buf, sizeof(buf)));
+    EXPECT_INT_ZERO(htrace_span_id_compare(&id, &id2));
+    EXPECT_INT_EQ(flags, flags2);
+    EXPECT_INT_ZERO(htrace_context_decode(&id2, &flags2, buf,
+                                          sizeof(buf) - 1));
+    EXPECT_INT_ZERO(htrace_context_encode(&id, flags, buf, sizeof(buf) - 1));
+
+    EXPECT_INT_EQ(1, htrace_context_encode_text(&id, flags,
+                                                text, sizeof(text)));
+    EXPECT_STR_EQ(expected_text, text);
+    htrace_span_id_clear(&id2);
+    EXPECT_INT_EQ(1, htrace_context_decode_text(&id2, &flags2,
+                                                text, strlen(text)));
+    EXPECT_INT_ZERO(htrace_span_id_compare(&id, &id2));
+    EXPECT_INT_EQ(flags, flags2);
+    EXPECT_INT_ZERO(htrace_context_encode_text(&id, flags,
+                                               text, sizeof(text) - 1));
+    return 0;
+}
+
+static int test_context_decode_text_fails(const char *text)
+{
+    struct htrace_span_id id;
+    uint8_t flags = 0;
+
+    htrace_span_id_clear(&id);
+    EXPECT_INT_ZERO(htrace_context_decode_text(&id, &flags,
+                                               text, strlen(text)));
+    EXPECT_INT_ZERO(htrace_span_id_compare(&INVALID_SPAN_ID, &id));
+    return 0;
+}
+
+static int test_context_decode_text_upper_case(void)
+{
+    struct htrace_span_id id;
+    uint8_t flags = 0;
+    char str[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+
+    EXPECT_INT_EQ(1, htrace_context_decode_text(&id, &flags,
+        "00-0000000000000000A919F3D62CE111E5-B345FEFF819CDC9F-01", 55));
+    EXPECT_INT_EQ(HTRACE_CONTEXT_FLAG_SAMPLED, flags);
+    EXPECT_INT_EQ(1, htrace_span_id_to_str(&id, str, sizeof(str)));
+    EXPECT_STR_EQ("a919f3d62ce111e5b345feff819cdc9f", str);
+    return 0;
+}
+
 int main(void)
 {
     EXPECT_INT_ZERO(test_span_id_round_trip("0123456789abcdef0011223344556677"));
@@ -99,6 +203,30 @@ int main(void)
                                     "ffffffff2ce111e5b345feff819cdc9f"));
     EXPECT_INT_ZERO(test_span_id_less("1919f3d62ce111e5b345feff819cdc9f",
                                       "f919f3d62ce111e5b345feff81900000"));
+
+    EXPECT_INT_ZERO(test_span_id_generate_time_ordered());
+
+    EXPECT_INT_ZERO(test_context_round_trip("a919f3d62ce111e5b345feff819cdc9f",
+        HTRACE_CONTEXT_FLAG_SAMPLED,
+        "00-0000000000000000a919f3d62ce111e5-b345feff819cdc9f-01"));
+    EXPECT_INT_ZERO(test_context_round_trip("0000000000000001ffffffffffffffff",
+        0xa0, "00-00000000000000000000000000000001-ffffffffffffffff-a0"));
+    EXPECT_INT_ZERO(test_context_decode_text_upper_case());
+    EXPECT_INT_ZERO(test_context_decode_text_fails(""));
+    EXPECT_INT_ZERO(test_context_decode_text_fails(
+        "00-0000000000000000a919f3d62ce111e5-b345feff819cdc9f-0"));
+    EXPECT_INT_ZERO(test_context_decode_text_fails(
+        "01-0000000000000000a919f3d62ce111e5-b345feff819cdc9f-01"));
+    EXPECT_INT_ZERO(test_context_decode_text_fails(
+        "00-1000000000000000a919f3d62ce111e5-b345feff819cdc9f-01"));
+    EXPECT_INT_ZERO(test_context_decode_text_fails(
+        "00-0000000000000000a919f3d62ce111e5-0000000000000000-01"));
+    EXPECT_INT_ZERO(test_context_decode_text_fails(
+        "00-0000000000000000a919f3d62ce111e5_b345feff819cdc9f-01"));
+    EXPECT_INT_ZERO(test_context_decode_text_fails(
+        "00-0000000000000000a919f3d62ce111e5-b345feff819cdc9g-01"));
+    EXPECT_INT_ZERO(test_context_decode_text_fails(
+        "00-0000000000000000a919f3d62ce111e5-b345feff819cdc9f-0x"));
     return EXIT_SUCCESS;
 }
 
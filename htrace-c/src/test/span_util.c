@@ -81,6 +81,7 @@ static void span_json_parse_impl(struct json_object *root,
 {
     char err2[128];
     struct json_object *d = NULL, *b = NULL, *e = NULL, *s = NULL, *r = NULL;
+    struct json_object *n = NULL, *inflight = NULL;
     int res;
 
     err[0] = '\0';
@@ -128,6 +129,11 @@ static void span_json_parse_impl(struct json_object *root,
         snprintf(err, err_len, "out of memory allocating process id");
         return;
     }
+    if (json_object_object_get_ex(root, "n", &n) &&
+            json_object_object_get_ex(n, "inflight", &inflight) &&
+            (!strcmp(json_object_get_string(inflight), "true"))) {
+        span->flags |= HTRACE_SPAN_FLAG_INFLIGHT;
+    }
     span_json_parse_parents(root, span, err, err_len);
     if (err[0]) {
         return;
@@ -312,6 +318,37 @@ static char *cmp_read_malloced_string(struct cmp_ctx_s *ctx, const char *what,
     return str;
 }
 
+static void span_parse_msgpack_info(struct cmp_ctx_s *ctx,
+                struct htrace_span *span, char *err, size_t err_len)
+{
+    uint32_t size;
+    char *key, *val;
+
+    err[0] = '\0';
+    if (!cmp_read_map(ctx, &size)) {
+        snprintf(err, err_len, "span_parse_msgpack_info: cmp_read_map "
+                 "failed.");
+        return;
+    }
+    while (size > 0) {
+        key = cmp_read_malloced_string(ctx, "info key", err, err_len);
+        if (err[0]) {
+            return;
+        }
+        val = cmp_read_malloced_string(ctx, "info value", err, err_len);
+        if (err[0]) {
+            free(key);
+            return;
+        }
+        if ((!strcmp(key, "inflight")) && (!strcmp(val, "true"))) {
+            span->flags |= HTRACE_SPAN_FLAG_INFLIGHT;
+        }
+        free(key);
+        free(val);
+        size--;
+    }
+}
+
 static void span_parse_msgpack_parents(struct cmp_ctx_s *ctx,
                 struct htrace_span *span, char *err, size_t err_len)
 {
@@ -426,6 +463,12 @@ struct htrace_span *span_read_msgpack(struct cmp_ctx_s *ctx,
                 goto error;
             }
             break;
+        case 'n':
+            span_parse_msgpack_info(ctx, span, err, err_len);
+            if (err[0]) {
+                goto error;
+            }
+            break;
         default:
             snprintf(err, err_len, "span_read_msgpack: can't understand key "
                      "'%s'.\n", key);
@@ -16,6 +16,7 @@
  * limitations under the License.
  */
 
+#include "core/htrace.h"
 #include "test/test.h"
 #include "util/string.h"
 
@@ -155,4 +156,59 @@ void hexdump(void *in, int in_len, char *out, int out_len)
     }
 }
 
+struct htrace_conf *test_conf(const char *fmt, ...)
+{
+    struct htrace_conf *cnf;
+    va_list ap;
+    char *str;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = vasprintf(&str, fmt, ap);
+    va_end(ap);
+    if (ret < 0) {
+        return NULL;
+    }
+    cnf = htrace_conf_from_str(str);
+    free(str);
+    return cnf;
+}
+
+char *read_path(const char *path)
+{
+    FILE *fp;
+    char *buf = NULL, *nbuf;
+    size_t len = 0, cap = 0, res;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        return strdup("");
+    }
+    while (1) {
+        if (len + 1 >= cap) {
+            cap = cap ? cap * 2 : 4096;
+            nbuf = realloc(buf, cap);
+            if (!nbuf) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = nbuf;
+        }
+        res = fread(buf + len, 1, cap - len - 1, fp);
+        if (res == 0) {
+            if (ferror(fp)) {
+                free(buf);
+                buf = NULL;
+            } else {
+                buf[len] = '\0';
+            }
+            break;
+        }
+        len += res;
+    }
+    fclose(fp);
+    return buf;
+}
+
 // vim: ts=4:sw=4:tw=79:et
@@ -21,8 +21,11 @@
 
 #include <inttypes.h> /* for PRIdPTR */
 #include <stdarg.h> /* for va_list */
+#include <stdio.h> /* for fprintf */
 #include <unistd.h> /* for size_t */
 
+struct htrace_conf;
+
 #define TEST_ERROR_EQ 0
 #define TEST_ERROR_GE 1
 #define TEST_ERROR_GT 2
@@ -97,6 +100,29 @@ char *xstrdup(const char *in);
  */
 void hexdump(void *in, int in_len, char *buf, int buf_len);
 
+/**
+ * Create a configuration from a printf-style format string.
+ *
+ * @param fmt       The format string.
+ * @param ...       Arguments for the format string.
+ *
+ * @return          The configuration, or NULL if we ran out of memory.
+ */
+struct htrace_conf *test_conf(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+/**
+ * Read the whole of a file.
+ *
+ * @param path      The path of the file.
+ *
+ * @return          A dynamically allocated, null-terminated copy of the
+ *                      file's contents.  An empty string if the file doesn't
+ *                      exist.  NULL if we ran out of memory or couldn't read
+ *                      the file.
+ */
+char *read_path(const char *path);
+
 #define TEST_ERROR_GET_LINE_HELPER2(x) #x
 #define TEST_ERROR_GET_LINE_HELPER(x) TEST_ERROR_GET_LINE_HELPER2(x)
 #define TEST_ERROR_LOCATION_TEXT __FILE__ " at line " \
@@ -134,23 +160,34 @@ void hexdump(void *in, int in_len, char *buf, int buf_len);
 #define COMMON_TEST__TO_STR(x) #x
 #define COMMON_TEST__TO_STR2(x) COMMON_TEST__TO_STR(x)
 
+/**
+ * Compare two numbers by value.  EXPECT_GE and friends compare the printed
+ * forms as strings, which gives the wrong answer for numbers of different
+ * lengths or signs.  Passes if (x op expected).
+ */
+#define EXPECT_NUM_CMP(type, fmt, op, what, expected, x) do { \
+  type expect_num_expected__ = (expected); \
+  type expect_num_x__ = (x); \
+  if (!(expect_num_x__ op expect_num_expected__)) { \
+    fprintf(stderr, "error: expected '%" fmt "', but got '%" fmt "'. " \
+            "Expected something " what ".  %s\n", \
+            expect_num_expected__, expect_num_x__, \
+            TEST_ERROR_LOCATION_TEXT); \
+    return 1; \
+  } \
+} while (0);
+
 #define EXPECT_INT_EQ(expected, x) do { \
   char expected_buf[16] = { 0 }; \
   snprintf(expected_buf, sizeof(expected_buf), "%d", expected); \
   EXPECT(expected_buf, TEST_ERROR_LOCATION_TEXT, TEST_ERROR_EQ, "%d", x); \
 } while(0);
 
-#define EXPECT_INT_GE(expected, x) do { \
-  char expected_buf[16] = { 0 }; \
-  snprintf(expected_buf, sizeof(expected_buf), "%d", expected); \
-  EXPECT(expected_buf, TEST_ERROR_LOCATION_TEXT, TEST_ERROR_GE, "%d", x); \
-} while(0);
+#define EXPECT_INT_GE(expected, x) \
+    EXPECT_NUM_CMP(int, "d", >=, "greater or equal", expected, x)
 
-#define EXPECT_INT_GT(expected, x) do { \
-  char expected_buf[16] = { 0 }; \
-  snprintf(expected_buf, sizeof(expected_buf), "%d", expected); \
-  EXPECT(expected_buf, TEST_ERROR_LOCATION_TEXT, TEST_ERROR_GT, "%d", x); \
-} while(0);
+#define EXPECT_INT_GT(expected, x) \
+    EXPECT_NUM_CMP(int, "d", >, "greater", expected, x)
 
 #define EXPECT_UINT64_EQ(expected, x) do { \
   char expected_buf[32] = { 0 }; \
@@ -159,19 +196,11 @@ void hexdump(void *in, int in_len, char *buf, int buf_len);
          "%" PRIu64, x); \
 } while(0);
 
-#define EXPECT_UINT64_GE(expected, x) do { \
-  char expected_buf[32] = { 0 }; \
-  snprintf(expected_buf, sizeof(expected_buf), "%" PRIu64, expected); \
-  EXPECT(expected_buf, TEST_ERROR_LOCATION_TEXT, TEST_ERROR_GE, \
-         "%" PRIu64, x); \
-} while(0);
+#define EXPECT_UINT64_GE(expected, x) \
+    EXPECT_NUM_CMP(uint64_t, PRIu64, >=, "greater or equal", expected, x)
 
-#define EXPECT_UINT64_GT(expected, x) do { \
-  char expected_buf[32] = { 0 }; \
-  snprintf(expected_buf, sizeof(expected_buf), "%" PRIu64, expected); \
-  EXPECT(expected_buf, TEST_ERROR_LOCATION_TEXT, TEST_ERROR_GT, \
-         "%" PRIu64, x); \
-} while(0);
+#define EXPECT_UINT64_GT(expected, x) \
+    EXPECT_NUM_CMP(uint64_t, PRIu64, >, "greater", expected, x)
 
 #define EXPECT_INT64_EQ(expected, x) do { \
   char expected_buf[32] = { 0 }; \
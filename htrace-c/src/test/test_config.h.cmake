@@ -25,4 +25,10 @@
 // The absolute path to the htraced binary, for use in unit tests.
 #cmakedefine HTRACED_ABSPATH "@HTRACED_ABSPATH@"
 
+// The absolute path to libhtrace_lockwait.so, for use in unit tests.
+#cmakedefine HTRACE_LOCKWAIT_ABSPATH "@HTRACE_LOCKWAIT_ABSPATH@"
+
+// The absolute path to the lockwait_helper binary, for use in unit tests.
+#cmakedefine LOCKWAIT_HELPER_ABSPATH "@LOCKWAIT_HELPER_ABSPATH@"
+
 #endif
@@ -0,0 +1,178 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "test/mini_http.h"
+#include "test/test.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file zipkin_rcv-unit.c
+ *
+ * Tests the zipkin span receiver against a stand-in HTTP collector.
+ */
+
+#define TEST_TRID "zipkin_rcv-unit"
+
+#define NUM_TEST_SPANS 40
+
+static struct htracer *zipkin_tracer(const struct mini_http *mh)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    char *str;
+
+    // Use the smallest request size, so that the spans are sent as several
+    // pipelined requests.
+    if (asprintf(&str, "%s=zipkin;%s=%s;%s=%s;%s=1024;%s=600000",
+                 HTRACE_SPAN_RECEIVER_KEY, HTRACE_TRACER_ID, TEST_TRID,
+                 HTRACE_ZIPKIN_ADDRESS_KEY, mh->addr,
+                 HTRACE_ZIPKIN_REQUEST_SIZE_KEY,
+                 HTRACE_ZIPKIN_FLUSH_INTERVAL_MS_KEY) < 0) {
+        return NULL;
+    }
+    cnf = htrace_conf_from_str(str);
+    free(str);
+    if (!cnf) {
+        return NULL;
+    }
+    tracer = htracer_create("zipkin_rcv-unit", cnf);
+    htrace_conf_free(cnf);
+    return tracer;
+}
+
+static int record_test_spans(struct htracer *tracer)
+{
+    struct htrace_span_id parent;
+    char desc[32];
+    int i;
+
+    parent.high = 0x1234;
+    parent.low = 0x5678;
+    EXPECT_INT_EQ(1, htrace_record_span(tracer, &parent, "child",
+                                        5000, 5250));
+    for (i = 1; i < NUM_TEST_SPANS; i++) {
+        snprintf(desc, sizeof(desc), "span-%02d", i);
+        EXPECT_INT_EQ(1, htrace_record_span(tracer, NULL, desc,
+                                            10000 + i, 10100 + i));
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Check that each request body is an array of spans, and count them.
+ */
+static int count_spans(const struct mini_http *mh, int *num_spans)
+{
+    char *bodies, *body, *cur, *saveptr = NULL;
+    size_t len;
+    int num_bodies = 0;
+
+    *num_spans = 0;
+    EXPECT_NONNULL(mh->bodies);
+    bodies = strdup(mh->bodies);
+    EXPECT_NONNULL(bodies);
+    for (body = strtok_r(bodies, "\n", &saveptr); body;
+            body = strtok_r(NULL, "\n", &saveptr)) {
+        len = strlen(body);
+        EXPECT_TRUE((len > 4));
+        EXPECT_INT_EQ(0, strncmp(body, "[{", 2));
+        EXPECT_STR_EQ("}]", body + len - 2);
+        for (cur = body; (cur = strstr(cur, "{\"traceId\":")); cur++) {
+            (*num_spans)++;
+        }
+        num_bodies++;
+    }
+    free(bodies);
+    EXPECT_INT_EQ(mh->num_reqs, num_bodies);
+    return EXIT_SUCCESS;
+}
+
+static int test_send(void)
+{
+    struct mini_http *mh;
+    struct htracer *tracer;
+    char err[512];
+    int num_spans;
+
+    err[0] = '\0';
+    mh = mini_http_start(0, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    EXPECT_NONNULL(mh);
+    tracer = zipkin_tracer(mh);
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_ZERO(record_test_spans(tracer));
+    // Freeing the tracer sends the buffered spans.
+    htracer_free(tracer);
+    mini_http_stop(mh);
+
+    EXPECT_INT_EQ(1, mh->num_conns);
+    EXPECT_TRUE((mh->num_reqs > 1));
+    EXPECT_STR_EQ("/api/v2/spans", mh->last_path);
+    EXPECT_STR_EQ("application/json", mh->last_content_type);
+    EXPECT_INT_ZERO(count_spans(mh, &num_spans));
+    EXPECT_INT_EQ(NUM_TEST_SPANS, num_spans);
+    EXPECT_NONNULL(strstr(mh->bodies, "[{\"traceId\":\"0000000000001234\","));
+    EXPECT_NONNULL(strstr(mh->bodies, "\"parentId\":\"0000000000005678\","
+            "\"name\":\"child\",\"timestamp\":5000,\"duration\":250,"
+            "\"localEndpoint\":{\"serviceName\":\"" TEST_TRID "\"}}"));
+    EXPECT_NONNULL(strstr(mh->bodies, "\"name\":\"span-39\",\"timestamp\":"
+                          "10039,\"duration\":100,"));
+    mini_http_free(mh);
+    return EXIT_SUCCESS;
+}
+
+static int test_reconnect(void)
+{
+    struct mini_http *mh;
+    struct htracer *tracer;
+    char err[512];
+    int num_spans;
+
+    // The server closes the connection after every two requests, so the
+    // rest of each pipelined batch has to be sent again.
+    err[0] = '\0';
+    mh = mini_http_start(2, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    EXPECT_NONNULL(mh);
+    tracer = zipkin_tracer(mh);
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_ZERO(record_test_spans(tracer));
+    htracer_free(tracer);
+    mini_http_stop(mh);
+
+    EXPECT_TRUE((mh->num_conns > 1));
+    EXPECT_INT_ZERO(count_spans(mh, &num_spans));
+    EXPECT_INT_EQ(NUM_TEST_SPANS, num_spans);
+    mini_http_free(mh);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_send());
+    EXPECT_INT_ZERO(test_reconnect());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,105 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/flight_reader.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * @file htrace_frdump.c
+ *
+ * Prints the spans in a flight recorder file as lines of JSON, in the same
+ * format that the local file span receiver uses.  Each span carries the
+ * annotation thread=<tid>.
+ */
+
+static void print_json_string(FILE *fp, const char *str)
+{
+    const unsigned char *c;
+
+    fputc('"', fp);
+    for (c = (const unsigned char *)str; *c; c++) {
+        if ((*c == '"') || (*c == '\\')) {
+            fprintf(fp, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(fp, "\\u%04x", *c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void print_span(FILE *fp, const struct fr_file *file,
+                       const struct fr_span *span)
+{
+    fprintf(fp, "{\"a\":\"%016" PRIx64 "%016" PRIx64 "\",\"b\":%" PRId64
+            ",\"e\":%" PRId64 ",\"d\":", span->span_id_high,
+            span->span_id_low, span->begin_us, span->end_us);
+    print_json_string(fp, span->desc);
+    fprintf(fp, ",\"r\":");
+    print_json_string(fp, file->trid);
+    if (span->num_parents > 0) {
+        fprintf(fp, ",\"p\":[\"%016" PRIx64 "%016" PRIx64 "\"]",
+                span->parent_high, span->parent_low);
+    }
+    fprintf(fp, ",\"n\":{\"thread\":\"%" PRId32 "\"}}\n", span->tid);
+}
+
+static void usage(FILE *fp)
+{
+    fprintf(fp, "htrace_frdump: print the spans in an HTrace flight recorder "
+            "file.\n\n"
+            "usage: htrace_frdump [-h] <path>\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct fr_file file;
+    char err[512];
+    uint64_t i;
+
+    if ((argc == 2) && ((!strcmp(argv[1], "-h")) ||
+                        (!strcmp(argv[1], "--help")))) {
+        usage(stdout);
+        return 0;
+    }
+    if (argc != 2) {
+        usage(stderr);
+        return 1;
+    }
+    if (fr_file_read(argv[1], &file, err, sizeof(err))) {
+        fprintf(stderr, "htrace_frdump: %s\n", err);
+        return 1;
+    }
+    for (i = 0; i < file.num_spans; i++) {
+        print_span(stdout, &file, file.spans + i);
+    }
+    if (file.num_lost) {
+        fprintf(stderr, "htrace_frdump: %" PRId64 " span(s) from process %"
+                PRId64 " were not recorded because every ring was taken.\n",
+                file.num_lost, file.pid);
+    }
+    fr_file_free(&file);
+    return 0;
+}
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,96 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "receiver/ftrace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file htrace_ftrace_merge.c
+ *
+ * Merges the markers written by the ftrace span receiver into a kernel trace,
+ * so that each span shows up as a pair of htrace_begin and htrace_end lines
+ * among the kernel's own events.
+ */
+
+static void usage(FILE *fp)
+{
+    fprintf(fp, "htrace_ftrace_merge: merge HTrace spans into a kernel "
+            "trace.\n\n"
+            "usage: htrace_ftrace_merge [-h] [-m <metadata path>] "
+            "[<trace path>]\n\n"
+            "The trace is read in the format of the kernel's trace file, "
+            "from standard input\n"
+            "if no path is given.  The metadata file is the one written by "
+            "the receiver when\n"
+            "ftrace.metadata.path is set.\n");
+}
+
+int main(int argc, char **argv)
+{
+    FILE *trace = stdin, *meta = NULL;
+    char err[512];
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "hm:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage(stdout);
+            return 0;
+        case 'm':
+            meta = fopen(optarg, "r");
+            if (!meta) {
+                fprintf(stderr, "htrace_ftrace_merge: failed to open %s: "
+                        "%s\n", optarg, strerror(errno));
+                return 1;
+            }
+            break;
+        default:
+            usage(stderr);
+            return 1;
+        }
+    }
+    if (optind < argc - 1) {
+        usage(stderr);
+        return 1;
+    } else if (optind == argc - 1) {
+        trace = fopen(argv[optind], "r");
+        if (!trace) {
+            fprintf(stderr, "htrace_ftrace_merge: failed to open %s: %s\n",
+                    argv[optind], strerror(errno));
+            return 1;
+        }
+    }
+    err[0] = '\0';
+    ret = ftrace_merge(trace, meta, stdout, err, sizeof(err));
+    if (ret) {
+        fprintf(stderr, "htrace_ftrace_merge: %s\n", err);
+    }
+    if (meta) {
+        fclose(meta);
+    }
+    if (trace != stdin) {
+        fclose(trace);
+    }
+    return ret ? 1 : 0;
+}
+
+// vim:ts=4:sw=4:et
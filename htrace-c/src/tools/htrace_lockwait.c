@@ -0,0 +1,135 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/htrace.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @file htrace_lockwait.c
+ *
+ * An LD_PRELOAD interposer which times pthread_mutex_lock calls that have to
+ * wait, and reports them to HTrace.
+ *
+ *      LD_PRELOAD=libhtrace_lockwait.so ./program
+ *
+ * An acquisition which doesn't have to wait only costs a
+ * pthread_mutex_trylock.  The waits are recorded by the tracer which has
+ * lock.interpose set.  This library doesn't link against libhtrace, so it is
+ * harmless in a program which doesn't use HTrace: it looks up
+ * htrace_interposed_lock_wait when a lock is contended, and does nothing if
+ * it isn't there.
+ */
+
+typedef int (*mutex_lock_fn_t)(pthread_mutex_t *mutex);
+
+typedef void (*lock_wait_fn_t)(const void *lock, const void *call_site,
+                               uint64_t wait_ns);
+
+/**
+ * The next pthread_mutex_lock, normally the one in libc.  Updated
+ * atomically.
+ */
+static mutex_lock_fn_t g_real_lock;
+
+/**
+ * htrace_interposed_lock_wait, once it has been found.  Updated atomically.
+ */
+static lock_wait_fn_t g_report;
+
+/**
+ * Nonzero while this thread is reporting a wait.  Locks taken by the report
+ * itself are not timed.
+ */
+static __thread int g_in_report __attribute__((tls_model("initial-exec")));
+
+static mutex_lock_fn_t lockwait_real_lock(void)
+{
+    mutex_lock_fn_t fn;
+
+    fn = __atomic_load_n(&g_real_lock, __ATOMIC_ACQUIRE);
+    if (!fn) {
+        fn = (mutex_lock_fn_t)dlsym(RTLD_NEXT, "pthread_mutex_lock");
+        __atomic_store_n(&g_real_lock, fn, __ATOMIC_RELEASE);
+    }
+    return fn;
+}
+
+static lock_wait_fn_t lockwait_report_fn(void)
+{
+    lock_wait_fn_t fn;
+
+    fn = __atomic_load_n(&g_report, __ATOMIC_ACQUIRE);
+    if (!fn) {
+        // libhtrace may be loaded later with dlopen, so keep looking.
+        fn = (lock_wait_fn_t)dlsym(RTLD_DEFAULT,
+                                   "htrace_interposed_lock_wait");
+        if (fn) {
+            __atomic_store_n(&g_report, fn, __ATOMIC_RELEASE);
+        }
+    }
+    return fn;
+}
+
+static uint64_t lockwait_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+__attribute__((visibility("default")))
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    mutex_lock_fn_t real_lock;
+    lock_wait_fn_t report;
+    uint64_t begin;
+    int ret;
+
+    ret = pthread_mutex_trylock(mutex);
+    if (ret != EBUSY) {
+        return ret;
+    }
+    real_lock = lockwait_real_lock();
+    if (!real_lock) {
+        return EINVAL;
+    }
+    if (g_in_report) {
+        return real_lock(mutex);
+    }
+    begin = lockwait_now_ns();
+    ret = real_lock(mutex);
+    if (ret) {
+        return ret;
+    }
+    g_in_report = 1;
+    report = lockwait_report_fn();
+    if (report) {
+        report(mutex, __builtin_return_address(0),
+               lockwait_now_ns() - begin);
+    }
+    g_in_report = 0;
+    return 0;
+}
+
+// vim: ts=4:sw=4:tw=79:et
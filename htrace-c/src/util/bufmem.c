@@ -0,0 +1,244 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/bufmem.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/**
+ * @file bufmem.c
+ *
+ * Implementation of large buffer allocation.
+ */
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+/**
+ * The MPOL_PREFERRED memory policy from linux/mempolicy.h.  We use the raw
+ * system call so that we don't need libnuma.
+ */
+#define BUFMEM_MPOL_PREFERRED 1
+
+/**
+ * The usual huge page size.  Buffers at least this big are aligned to it when
+ * we ask for transparent huge pages, since the kernel can only back an
+ * aligned range with a huge page.
+ */
+#define BUFMEM_HUGE_PAGE_SIZE (2UL * 1024UL * 1024UL)
+
+/**
+ * The minimum number of milliseconds between warnings about options we
+ * couldn't honor.  Buffers may be allocated often.
+ */
+#define BUFMEM_LOG_INTERVAL_MS 60000
+
+int bufmem_parse_huge_pages(const char *str)
+{
+    if (strcmp(str, "none") == 0) {
+        return BUFMEM_HUGE_PAGES_NONE;
+    } else if (strcmp(str, "transparent") == 0) {
+        return BUFMEM_HUGE_PAGES_TRANSPARENT;
+    } else if (strcmp(str, "explicit") == 0) {
+        return BUFMEM_HUGE_PAGES_EXPLICIT;
+    }
+    return -1;
+}
+
+int bufmem_parse_prefault(const char *str)
+{
+    if (strcmp(str, "none") == 0) {
+        return BUFMEM_PREFAULT_NONE;
+    } else if (strcmp(str, "populate") == 0) {
+        return BUFMEM_PREFAULT_POPULATE;
+    } else if (strcmp(str, "lock") == 0) {
+        return BUFMEM_PREFAULT_LOCK;
+    }
+    return -1;
+}
+
+/**
+ * Map a buffer whose start is aligned to BUFMEM_HUGE_PAGE_SIZE.
+ *
+ * We map an extra huge page, then unmap the unaligned head and tail.
+ *
+ * @return              The buffer, or MAP_FAILED with errno set.
+ */
+static void *bufmem_map_aligned(size_t len, int flags)
+{
+    char *buf, *aligned;
+    size_t head;
+
+    buf = mmap(NULL, len + BUFMEM_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               flags, -1, 0);
+    if (buf == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    aligned = (char *)((((uintptr_t)buf) + BUFMEM_HUGE_PAGE_SIZE - 1) &
+                       ~((uintptr_t)BUFMEM_HUGE_PAGE_SIZE - 1));
+    head = aligned - buf;
+    if (head) {
+        munmap(buf, head);
+    }
+    if (head != BUFMEM_HUGE_PAGE_SIZE) {
+        munmap(aligned + len, BUFMEM_HUGE_PAGE_SIZE - head);
+    }
+    return aligned;
+}
+
+static void *bufmem_map(struct htrace_log *lg, const struct bufmem_opts *opts,
+                        size_t len, int flags)
+{
+    void *buf;
+    int ret;
+
+#ifdef MAP_HUGETLB
+    if (opts->huge_pages == BUFMEM_HUGE_PAGES_EXPLICIT) {
+        buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   flags | MAP_HUGETLB, -1, 0);
+        if (buf != MAP_FAILED) {
+            return buf;
+        }
+        ret = errno;
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, BUFMEM_LOG_INTERVAL_MS,
+                   "bufmem_alloc: failed to map %zu bytes of explicit huge "
+                   "pages: %s.  Falling back to transparent huge pages.\n",
+                   len, terror(ret));
+    }
+#endif
+    if ((opts->huge_pages != BUFMEM_HUGE_PAGES_NONE) &&
+            (len >= BUFMEM_HUGE_PAGE_SIZE)) {
+        buf = bufmem_map_aligned(len, flags);
+    } else {
+        buf = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    }
+    if (buf == MAP_FAILED) {
+        ret = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "bufmem_alloc: failed to map %zu bytes: %s\n", len,
+                    terror(ret));
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (opts->huge_pages != BUFMEM_HUGE_PAGES_NONE) {
+        if (madvise(buf, len, MADV_HUGEPAGE) < 0) {
+            ret = errno;
+            HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN,
+                       BUFMEM_LOG_INTERVAL_MS, "bufmem_alloc: "
+                       "madvise(MADV_HUGEPAGE) failed: %s\n", terror(ret));
+        }
+    }
+#endif
+    return buf;
+}
+
+static void bufmem_bind(struct htrace_log *lg, const struct bufmem_opts *opts,
+                        void *buf, size_t len)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[4] = { 0 };
+    const int bits = sizeof(unsigned long) * 8;
+    int ret;
+
+    if (opts->numa_node >= (int)(sizeof(mask) * 8)) {
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, BUFMEM_LOG_INTERVAL_MS,
+                   "bufmem_alloc: NUMA node %d is out of range.\n",
+                   opts->numa_node);
+        return;
+    }
+    mask[opts->numa_node / bits] = 1UL << (opts->numa_node % bits);
+    if (syscall(SYS_mbind, buf, len, BUFMEM_MPOL_PREFERRED, mask,
+                sizeof(mask) * 8, 0) < 0) {
+        ret = errno;
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, BUFMEM_LOG_INTERVAL_MS,
+                   "bufmem_alloc: failed to bind buffer to NUMA node %d: "
+                   "%s\n", opts->numa_node, terror(ret));
+    }
+#else
+    HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, BUFMEM_LOG_INTERVAL_MS,
+               "bufmem_alloc: NUMA binding is not supported on this "
+               "platform.\n");
+#endif
+}
+
+void *bufmem_alloc(struct htrace_log *lg, const struct bufmem_opts *opts,
+                   size_t len)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    long page_size;
+    size_t off;
+    char *buf;
+    int ret;
+
+    // The memory policy must be set before the pages are faulted in, so we
+    // can only let mmap populate the buffer if we aren't binding it.  Huge
+    // page buffers are faulted in after madvise, and aligned buffers are
+    // over-mapped, so we don't let mmap populate those either.
+    if ((opts->prefault != BUFMEM_PREFAULT_NONE) && (opts->numa_node < 0) &&
+            (opts->huge_pages == BUFMEM_HUGE_PAGES_NONE)) {
+        flags |= MAP_POPULATE;
+    }
+    buf = bufmem_map(lg, opts, len, flags);
+    if (!buf) {
+        return NULL;
+    }
+    if (opts->numa_node >= 0) {
+        bufmem_bind(lg, opts, buf, len);
+    }
+    if (opts->prefault == BUFMEM_PREFAULT_LOCK) {
+        if (mlock(buf, len) == 0) {
+            return buf;
+        }
+        ret = errno;
+        HTRACE_LOG_RATE_LIMITED(lg, HTRACE_LOG_WARN, BUFMEM_LOG_INTERVAL_MS,
+                   "bufmem_alloc: failed to lock %zu bytes in memory: %s.  "
+                   "Check RLIMIT_MEMLOCK.\n", len, terror(ret));
+    }
+    if ((opts->prefault != BUFMEM_PREFAULT_NONE) && !(flags & MAP_POPULATE)) {
+        page_size = sysconf(_SC_PAGESIZE);
+        if (page_size <= 0) {
+            page_size = 4096;
+        }
+        for (off = 0; off < len; off += page_size) {
+            ((volatile char *)buf)[off] = 0;
+        }
+    }
+    return buf;
+}
+
+void bufmem_free(void *buf, size_t len)
+{
+    if (buf) {
+        munmap(buf, len);
+    }
+}
+
+// vim: ts=4:sw=4:tw=79:et
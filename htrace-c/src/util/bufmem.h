@@ -0,0 +1,132 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_BUFMEM_H
+#define APACHE_HTRACE_UTIL_BUFMEM_H
+
+/**
+ * @file bufmem.h
+ *
+ * Allocation of large, long-lived buffers.
+ *
+ * Buffers are mapped with mmap rather than malloc, so that we can ask for huge
+ * pages, fault the pages in up front, lock them in memory, or bind them to a
+ * NUMA node.  Options which the platform doesn't support are ignored.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stddef.h> /* for size_t */
+
+struct htrace_log;
+
+/**
+ * Use normal pages.
+ */
+#define BUFMEM_HUGE_PAGES_NONE 0
+
+/**
+ * Ask for transparent huge pages with madvise(MADV_HUGEPAGE).  Buffers of at
+ * least 2 MiB are aligned to 2 MiB, so that huge pages can back them.
+ */
+#define BUFMEM_HUGE_PAGES_TRANSPARENT 1
+
+/**
+ * Map huge pages from the hugetlbfs pool with MAP_HUGETLB.  If the pool is
+ * empty, fall back to transparent huge pages.  The buffer length must be a
+ * multiple of the huge page size.
+ */
+#define BUFMEM_HUGE_PAGES_EXPLICIT 2
+
+/**
+ * Fault pages in the first time they are touched.
+ */
+#define BUFMEM_PREFAULT_NONE 0
+
+/**
+ * Fault every page in when the buffer is allocated.
+ */
+#define BUFMEM_PREFAULT_POPULATE 1
+
+/**
+ * Fault every page in when the buffer is allocated, and lock the buffer in
+ * memory with mlock.  If the buffer can't be locked, we still fault it in.
+ */
+#define BUFMEM_PREFAULT_LOCK 2
+
+struct bufmem_opts {
+    /**
+     * One of the BUFMEM_HUGE_PAGES constants.
+     */
+    int huge_pages;
+
+    /**
+     * One of the BUFMEM_PREFAULT constants.
+     */
+    int prefault;
+
+    /**
+     * The NUMA node to bind buffers to, or -1 to use the default policy.
+     */
+    int numa_node;
+};
+
+/**
+ * Parse a huge pages option.
+ *
+ * @param str           The string to parse: none, transparent, or explicit.
+ *
+ * @return              The BUFMEM_HUGE_PAGES constant, or -1 if the string
+ *                          was not recognized.
+ */
+int bufmem_parse_huge_pages(const char *str);
+
+/**
+ * Parse a prefault option.
+ *
+ * @param str           The string to parse: none, populate, or lock.
+ *
+ * @return              The BUFMEM_PREFAULT constant, or -1 if the string
+ *                          was not recognized.
+ */
+int bufmem_parse_prefault(const char *str);
+
+/**
+ * Allocate a buffer.
+ *
+ * @param lg            The log to use for error messages.
+ * @param opts          The allocation options.
+ * @param len           The length of the buffer.
+ *
+ * @return              NULL on failure; the buffer otherwise.  The buffer is
+ *                          page-aligned and zeroed.
+ */
+void *bufmem_alloc(struct htrace_log *lg, const struct bufmem_opts *opts,
+                   size_t len);
+
+/**
+ * Free a buffer allocated with bufmem_alloc.
+ *
+ * @param buf           The buffer, or NULL.
+ * @param len           The length which was passed to bufmem_alloc.
+ */
+void bufmem_free(void *buf, size_t len);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
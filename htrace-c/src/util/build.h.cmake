@@ -19,5 +19,6 @@
 #define APACHE_HTRACE_UTIL_BUILD_H
 
 #cmakedefine HAVE_IMPROVED_TLS
+#cmakedefine HAVE_SYS_SDT_H
 
 #endif
@@ -0,0 +1,419 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/cmap.h"
+#include "util/epoch.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file cmap.c
+ *
+ * Implements a concurrent hash map.
+ *
+ * The map is an array of buckets, each of which is a singly linked list of
+ * nodes.  Writers publish changes to a list with release stores, and readers
+ * traverse it with acquire loads, so readers never need a lock.  Removed
+ * nodes are retired through the epoch domain, since a reader may still be
+ * traversing them.
+ *
+ * Writers lock one of CMAP_NUM_STRIPES stripes, chosen by the low bits of the
+ * key's hash.  The bucket array always has at least as many buckets as there
+ * are stripes, so a key's stripe does not change when the map grows.
+ *
+ * To grow, we take every stripe lock, build a new bucket array with copies
+ * of all the nodes, and publish it.  The old nodes and the old array are
+ * retired.  Copying, rather than relinking, keeps the old lists intact for
+ * readers which are still traversing them.
+ */
+
+/**
+ * The number of lock stripes.  Must be a power of 2.
+ */
+#define CMAP_NUM_STRIPES 64
+
+struct cmap_node {
+    /**
+     * Used to retire this node.  Must be first.
+     */
+    struct epoch_entry entry;
+
+    /**
+     * The next node in this bucket.
+     */
+    struct cmap_node *next;
+
+    /**
+     * The full hash code of the key.
+     */
+    uint32_t hash;
+
+    void *key;
+
+    void *val;
+};
+
+struct cmap_table {
+    /**
+     * Used to retire this table.  Must be first.
+     */
+    struct epoch_entry entry;
+
+    /**
+     * The number of buckets minus one.  The number of buckets is a power of 2.
+     */
+    uint32_t mask;
+
+    /**
+     * The buckets.
+     */
+    struct cmap_node *buckets[];
+};
+
+struct cmap_stripe {
+    pthread_mutex_t lock;
+} __attribute__((aligned(64)));
+
+struct cmap {
+    struct cmap_stripe stripes[CMAP_NUM_STRIPES];
+
+    /**
+     * The current bucket array.
+     */
+    struct cmap_table *tbl;
+
+    /**
+     * The number of entries.
+     */
+    uint32_t size;
+
+    /**
+     * Serializes attempts to grow the map.
+     */
+    pthread_mutex_t grow_lock;
+
+    htable_hash_fn_t hash_fun;
+
+    htable_eq_fn_t eq_fun;
+
+    struct epoch_domain *ed;
+};
+
+static void cmap_free_entry(struct epoch_entry *entry)
+{
+    free(entry);
+}
+
+static struct cmap_table *cmap_table_alloc(uint32_t num_buckets)
+{
+    struct cmap_table *tbl;
+
+    tbl = calloc(1, sizeof(*tbl) + (sizeof(tbl->buckets[0]) * num_buckets));
+    if (!tbl) {
+        return NULL;
+    }
+    tbl->mask = num_buckets - 1;
+    return tbl;
+}
+
+static uint32_t cmap_hash(const struct cmap *map, const void *key)
+{
+    return map->hash_fun(key);
+}
+
+static pthread_mutex_t *cmap_stripe_lock(struct cmap *map, uint32_t hash)
+{
+    return &map->stripes[hash & (CMAP_NUM_STRIPES - 1)].lock;
+}
+
+struct cmap *cmap_alloc(uint32_t capacity, htable_hash_fn_t hash_fun,
+                        htable_eq_fn_t eq_fun, struct epoch_domain *ed)
+{
+    struct cmap *map;
+    uint32_t num_buckets = CMAP_NUM_STRIPES;
+    int i;
+
+    while ((num_buckets < capacity) && (num_buckets < 0x80000000U)) {
+        num_buckets *= 2;
+    }
+    if (posix_memalign((void**)&map, 64, sizeof(*map))) {
+        return NULL;
+    }
+    memset(map, 0, sizeof(*map));
+    map->tbl = cmap_table_alloc(num_buckets);
+    if (!map->tbl) {
+        free(map);
+        return NULL;
+    }
+    for (i = 0; i < CMAP_NUM_STRIPES; i++) {
+        if (pthread_mutex_init(&map->stripes[i].lock, NULL)) {
+            goto error;
+        }
+    }
+    if (pthread_mutex_init(&map->grow_lock, NULL)) {
+        goto error;
+    }
+    map->hash_fun = hash_fun;
+    map->eq_fun = eq_fun;
+    map->ed = ed;
+    return map;
+
+error:
+    while (--i >= 0) {
+        pthread_mutex_destroy(&map->stripes[i].lock);
+    }
+    free(map->tbl);
+    free(map);
+    return NULL;
+}
+
+void cmap_free(struct cmap *map)
+{
+    struct cmap_table *tbl;
+    struct cmap_node *node, *next;
+    uint32_t i;
+
+    if (!map) {
+        return;
+    }
+    tbl = map->tbl;
+    for (i = 0; i <= tbl->mask; i++) {
+        for (node = tbl->buckets[i]; node; node = next) {
+            next = node->next;
+            free(node);
+        }
+    }
+    free(tbl);
+    for (i = 0; i < CMAP_NUM_STRIPES; i++) {
+        pthread_mutex_destroy(&map->stripes[i].lock);
+    }
+    pthread_mutex_destroy(&map->grow_lock);
+    free(map);
+}
+
+/**
+ * Double the number of buckets in the map.
+ *
+ * @param map       The map.
+ * @param old_mask  The mask of the table the caller thought was too small.
+ *                      If the map has already grown, we do nothing.
+ */
+static void cmap_grow(struct cmap *map, uint32_t old_mask)
+{
+    struct cmap_table *tbl, *ntbl;
+    struct cmap_node *node, *nnode, *retired = NULL;
+    uint32_t i, idx;
+    int s;
+
+    pthread_mutex_lock(&map->grow_lock);
+    tbl = map->tbl;
+    if ((tbl->mask != old_mask) || (tbl->mask >= 0x7fffffffU)) {
+        pthread_mutex_unlock(&map->grow_lock);
+        return;
+    }
+    ntbl = cmap_table_alloc((tbl->mask + 1) * 2);
+    if (!ntbl) {
+        // We can keep going with longer chains.
+        pthread_mutex_unlock(&map->grow_lock);
+        return;
+    }
+    for (s = 0; s < CMAP_NUM_STRIPES; s++) {
+        pthread_mutex_lock(&map->stripes[s].lock);
+    }
+    for (i = 0; i <= tbl->mask; i++) {
+        for (node = tbl->buckets[i]; node; node = node->next) {
+            nnode = malloc(sizeof(*nnode));
+            if (!nnode) {
+                goto oom;
+            }
+            idx = node->hash & ntbl->mask;
+            nnode->hash = node->hash;
+            nnode->key = node->key;
+            nnode->val = node->val;
+            nnode->next = ntbl->buckets[idx];
+            ntbl->buckets[idx] = nnode;
+        }
+    }
+    __atomic_store_n(&map->tbl, ntbl, __ATOMIC_RELEASE);
+    for (s = CMAP_NUM_STRIPES - 1; s >= 0; s--) {
+        pthread_mutex_unlock(&map->stripes[s].lock);
+    }
+    pthread_mutex_unlock(&map->grow_lock);
+    // Readers may still be traversing the old table.
+    for (i = 0; i <= tbl->mask; i++) {
+        for (node = tbl->buckets[i]; node; node = node->next) {
+            node->entry.next = (struct epoch_entry *)retired;
+            retired = node;
+        }
+    }
+    while (retired) {
+        node = retired;
+        retired = (struct cmap_node *)node->entry.next;
+        epoch_retire(map->ed, &node->entry, cmap_free_entry);
+    }
+    epoch_retire(map->ed, &tbl->entry, cmap_free_entry);
+    return;
+
+oom:
+    for (s = CMAP_NUM_STRIPES - 1; s >= 0; s--) {
+        pthread_mutex_unlock(&map->stripes[s].lock);
+    }
+    pthread_mutex_unlock(&map->grow_lock);
+    for (i = 0; i <= ntbl->mask; i++) {
+        for (node = ntbl->buckets[i]; node; node = nnode) {
+            nnode = node->next;
+            free(node);
+        }
+    }
+    free(ntbl);
+}
+
+int cmap_put(struct cmap *map, void *key, void *val)
+{
+    struct cmap_table *tbl;
+    struct cmap_node *node, *cur;
+    pthread_mutex_t *lock;
+    uint32_t hash, idx, size, mask;
+
+    if ((!key) || (!val)) {
+        return EINVAL;
+    }
+    node = malloc(sizeof(*node));
+    if (!node) {
+        return ENOMEM;
+    }
+    hash = cmap_hash(map, key);
+    node->hash = hash;
+    node->key = key;
+    node->val = val;
+    lock = cmap_stripe_lock(map, hash);
+    pthread_mutex_lock(lock);
+    // The table can't be replaced while we hold a stripe lock.
+    tbl = map->tbl;
+    mask = tbl->mask;
+    idx = hash & mask;
+    for (cur = tbl->buckets[idx]; cur; cur = cur->next) {
+        if ((cur->hash == hash) && map->eq_fun(cur->key, key)) {
+            pthread_mutex_unlock(lock);
+            free(node);
+            return EEXIST;
+        }
+    }
+    node->next = tbl->buckets[idx];
+    __atomic_store_n(&tbl->buckets[idx], node, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(lock);
+    size = __atomic_add_fetch(&map->size, 1, __ATOMIC_RELAXED);
+    if (size > mask + 1) {
+        cmap_grow(map, mask);
+    }
+    return 0;
+}
+
+void *cmap_get(struct cmap *map, const void *key)
+{
+    struct cmap_table *tbl;
+    struct cmap_node *node;
+    uint32_t hash;
+    void *val = NULL;
+    int token;
+
+    hash = cmap_hash(map, key);
+    token = epoch_enter(map->ed);
+    tbl = __atomic_load_n(&map->tbl, __ATOMIC_ACQUIRE);
+    node = __atomic_load_n(&tbl->buckets[hash & tbl->mask], __ATOMIC_ACQUIRE);
+    while (node) {
+        if ((node->hash == hash) && map->eq_fun(node->key, key)) {
+            val = node->val;
+            break;
+        }
+        node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    }
+    epoch_exit(map->ed, token);
+    return val;
+}
+
+void cmap_remove(struct cmap *map, const void *key,
+                 void **found_key, void **found_val)
+{
+    struct cmap_table *tbl;
+    struct cmap_node *node, **prev;
+    pthread_mutex_t *lock;
+    uint32_t hash;
+
+    hash = cmap_hash(map, key);
+    lock = cmap_stripe_lock(map, hash);
+    pthread_mutex_lock(lock);
+    tbl = map->tbl;
+    prev = &tbl->buckets[hash & tbl->mask];
+    for (node = *prev; node; node = node->next) {
+        if ((node->hash == hash) && map->eq_fun(node->key, key)) {
+            break;
+        }
+        prev = &node->next;
+    }
+    if (!node) {
+        pthread_mutex_unlock(lock);
+        *found_key = NULL;
+        *found_val = NULL;
+        return;
+    }
+    // Readers which are already on this node can still follow its next
+    // pointer, which we leave intact.
+    __atomic_store_n(prev, node->next, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(lock);
+    __atomic_sub_fetch(&map->size, 1, __ATOMIC_RELAXED);
+    *found_key = node->key;
+    *found_val = node->val;
+    epoch_retire(map->ed, &node->entry, cmap_free_entry);
+}
+
+void cmap_visit(struct cmap *map, cmap_visitor_fn_t fun, void *ctx)
+{
+    struct cmap_table *tbl;
+    struct cmap_node *node;
+    uint32_t i;
+    int token;
+
+    token = epoch_enter(map->ed);
+    tbl = __atomic_load_n(&map->tbl, __ATOMIC_ACQUIRE);
+    for (i = 0; i <= tbl->mask; i++) {
+        node = __atomic_load_n(&tbl->buckets[i], __ATOMIC_ACQUIRE);
+        while (node) {
+            fun(ctx, node->key, node->val);
+            node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+        }
+    }
+    epoch_exit(map->ed, token);
+}
+
+uint32_t cmap_size(const struct cmap *map)
+{
+    return __atomic_load_n(&map->size, __ATOMIC_RELAXED);
+}
+
+uint32_t cmap_capacity(const struct cmap *map)
+{
+    struct cmap_table *tbl = __atomic_load_n(&map->tbl, __ATOMIC_ACQUIRE);
+    return tbl->mask + 1;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,156 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_CMAP_H
+#define APACHE_HTRACE_UTIL_CMAP_H
+
+/**
+ * @file cmap.h
+ *
+ * Interfaces for a concurrent hash map.
+ *
+ * Lookups are lock-free.  Inserts and removals lock one of a fixed set of
+ * lock stripes, so writers only contend when their keys hash to the same
+ * stripe.  Memory which readers might still be looking at is freed through an
+ * epoch domain.
+ *
+ * Keys are unique: unlike htable, putting a key which is already present
+ * fails.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include "util/htable.h" // for htable_hash_fn_t, htable_eq_fn_t
+
+#include <stdint.h>
+
+struct cmap;
+struct epoch_domain;
+
+/**
+ * Allocate a new concurrent map.
+ *
+ * @param capacity  The minimum suggested starting capacity.
+ * @param hash_fun  The hash function to use.
+ * @param eq_fun    The equality function to use.
+ * @param ed        The epoch domain to use for reclaiming memory.  The caller
+ *                      may use the same domain to protect values returned by
+ *                      cmap_get.  It must outlive the map.
+ *
+ * @return          The new map on success; NULL on OOM.
+ */
+struct cmap *cmap_alloc(uint32_t capacity, htable_hash_fn_t hash_fun,
+                        htable_eq_fn_t eq_fun, struct epoch_domain *ed);
+
+/**
+ * Free a concurrent map.
+ *
+ * No other thread may be using the map.  It is up the calling code to ensure
+ * that the keys and values inside the map are de-allocated, if that is
+ * necessary.
+ *
+ * @param map       The map.
+ */
+void cmap_free(struct cmap *map);
+
+/**
+ * Add an entry to the map.
+ *
+ * Growing the map retires the old bucket array through the epoch domain.
+ * epoch_retire never waits for readers, so this may be called from inside an
+ * epoch read section.
+ *
+ * @param map       The map.
+ * @param key       The key to add.  This cannot be NULL.
+ * @param val       The value to add.  This cannot be NULL.
+ *
+ * @return          0 on success;
+ *                  EINVAL if we're trying to insert a NULL key or value.
+ *                  EEXIST if the key is already present.
+ *                  ENOMEM if there is not enough memory to add the element.
+ */
+int cmap_put(struct cmap *map, void *key, void *val);
+
+/**
+ * Get an entry from the map.
+ *
+ * This function does not take any locks.  The value is not protected once
+ * this function returns.  If another thread may remove and free the value,
+ * call this from inside an epoch read section, and have the other thread
+ * free the value with epoch_retire.
+ *
+ * @param map       The map.
+ * @param key       The key to find.
+ *
+ * @return          NULL if there is no such entry; the value otherwise.
+ */
+void *cmap_get(struct cmap *map, const void *key);
+
+/**
+ * Remove an entry from the map.
+ *
+ * Like cmap_put, this never waits for readers, so it may be called from
+ * inside an epoch read section.
+ *
+ * @param map       The map.
+ * @param key       The key for the entry to find and remove.
+ * @param found_key (out param) NULL if the entry was not found; the found key
+ *                      otherwise.
+ * @param found_val (out param) NULL if the entry was not found; the found
+ *                      value otherwise.
+ */
+void cmap_remove(struct cmap *map, const void *key,
+                 void **found_key, void **found_val);
+
+typedef void (*cmap_visitor_fn_t)(void *ctx, void *key, void *val);
+
+/**
+ * Visit all of the entries in the map.
+ *
+ * This does not block writers.  Entries which are added or removed during
+ * the visit may or may not be visited.  Since the visit happens inside an
+ * epoch read section, the callback must not call epoch_synchronize, or
+ * remove entries from the map.
+ *
+ * @param map       The map.
+ * @param fun       The callback function to invoke on each key and value.
+ * @param ctx       Context pointer to pass to the callback.
+ */
+void cmap_visit(struct cmap *map, cmap_visitor_fn_t fun, void *ctx);
+
+/**
+ * Get the number of entries in the map.
+ *
+ * @param map       The map.
+ *
+ * @return          The number of entries.
+ */
+uint32_t cmap_size(const struct cmap *map);
+
+/**
+ * Get the number of buckets in the map.
+ *
+ * @param map       The map.
+ *
+ * @return          The number of buckets.
+ */
+uint32_t cmap_capacity(const struct cmap *map);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,318 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/epoch.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file epoch.c
+ *
+ * Implementation of epoch-based memory reclamation.
+ *
+ * Each domain has a global epoch number and a set of reader counters.  Every
+ * counter slot has one counter for readers which entered during an even
+ * epoch and one for readers which entered during an odd epoch.  To reclaim
+ * memory, we take the list of retired objects, advance the epoch, and wait
+ * for the counters of the previous epoch's parity to drain.  Readers which
+ * enter after the epoch advances cannot reach anything on the list, since
+ * everything on it was unlinked before it was retired.
+ *
+ * Reclamation is serialized by a mutex, so at most two parities are ever
+ * live at once.  Threads are assigned counter slots round-robin; threads
+ * which share a slot are still correct, just slower.
+ *
+ * epoch_retire never waits.  Once enough objects have piled up, it checks
+ * whether the readers of the previous epoch are gone, without blocking.  If
+ * so, it frees the objects which were retired before the last advance, and
+ * advances the epoch again.  If not, the objects stay on their lists until a
+ * later call finds the readers gone.  Since a reader only holds up the
+ * parity it entered with, a writer inside a read section can still retire
+ * objects; they are just not freed until it exits.
+ */
+
+/**
+ * The number of reader counter slots.  Must be a power of 2.
+ */
+#define EPOCH_NUM_SLOTS 32
+
+/**
+ * The number of retired entries which triggers reclamation.
+ */
+#define EPOCH_RECLAIM_THRESHOLD 512
+
+struct epoch_slot {
+    /**
+     * Reader counts, indexed by epoch parity.
+     */
+    uint64_t count[2];
+} __attribute__((aligned(64)));
+
+struct epoch_domain {
+    /**
+     * Reader counter slots.
+     */
+    struct epoch_slot slots[EPOCH_NUM_SLOTS];
+
+    /**
+     * The current epoch.
+     */
+    uint64_t epoch;
+
+    /**
+     * Protects the retired list.
+     */
+    pthread_mutex_t retire_lock;
+
+    /**
+     * Serializes reclamation.
+     */
+    pthread_mutex_t reclaim_lock;
+
+    /**
+     * Objects which have been retired since the epoch last advanced.
+     */
+    struct epoch_entry *retired;
+
+    /**
+     * The length of the retired list.
+     */
+    int num_retired;
+
+    /**
+     * Objects which were retired before the epoch last advanced.  They can be
+     * freed once the readers of the previous epoch have exited.  Protected by
+     * reclaim_lock.
+     */
+    struct epoch_entry *waiting;
+};
+
+/**
+ * The counter slot assigned to this thread, or -1 if there is none yet.
+ */
+static __thread int g_epoch_slot = -1;
+
+/**
+ * The next counter slot to assign.
+ */
+static uint32_t g_epoch_next_slot;
+
+static int epoch_get_slot(void)
+{
+    if (g_epoch_slot < 0) {
+        g_epoch_slot = __atomic_fetch_add(&g_epoch_next_slot, 1,
+                            __ATOMIC_RELAXED) & (EPOCH_NUM_SLOTS - 1);
+    }
+    return g_epoch_slot;
+}
+
+struct epoch_domain *epoch_domain_alloc(void)
+{
+    struct epoch_domain *ed;
+
+    if (posix_memalign((void**)&ed, 64, sizeof(*ed))) {
+        return NULL;
+    }
+    memset(ed, 0, sizeof(*ed));
+    if (pthread_mutex_init(&ed->retire_lock, NULL)) {
+        free(ed);
+        return NULL;
+    }
+    if (pthread_mutex_init(&ed->reclaim_lock, NULL)) {
+        pthread_mutex_destroy(&ed->retire_lock);
+        free(ed);
+        return NULL;
+    }
+    return ed;
+}
+
+static void epoch_free_list(struct epoch_entry *entry)
+{
+    struct epoch_entry *next;
+
+    while (entry) {
+        next = entry->next;
+        entry->free_fn(entry);
+        entry = next;
+    }
+}
+
+void epoch_domain_free(struct epoch_domain *ed)
+{
+    if (!ed) {
+        return;
+    }
+    epoch_free_list(ed->waiting);
+    epoch_free_list(ed->retired);
+    pthread_mutex_destroy(&ed->reclaim_lock);
+    pthread_mutex_destroy(&ed->retire_lock);
+    free(ed);
+}
+
+int epoch_enter(struct epoch_domain *ed)
+{
+    struct epoch_slot *slot = &ed->slots[epoch_get_slot()];
+    uint64_t epoch;
+    int parity;
+
+    while (1) {
+        epoch = __atomic_load_n(&ed->epoch, __ATOMIC_SEQ_CST);
+        parity = epoch & 1;
+        __atomic_fetch_add(&slot->count[parity], 1, __ATOMIC_SEQ_CST);
+        // If the epoch advanced while we were incrementing the counter, the
+        // reclaimer may already have checked our counter and found it empty.
+        // Back out and try again with the new epoch.
+        if (__atomic_load_n(&ed->epoch, __ATOMIC_SEQ_CST) == epoch) {
+            return parity;
+        }
+        __atomic_fetch_sub(&slot->count[parity], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void epoch_exit(struct epoch_domain *ed, int token)
+{
+    struct epoch_slot *slot = &ed->slots[epoch_get_slot()];
+
+    __atomic_fetch_sub(&slot->count[token], 1, __ATOMIC_RELEASE);
+}
+
+static void epoch_wait_for_readers(struct epoch_domain *ed, int parity)
+{
+    int i;
+
+    for (i = 0; i < EPOCH_NUM_SLOTS; i++) {
+        while (__atomic_load_n(&ed->slots[i].count[parity],
+                               __ATOMIC_ACQUIRE) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+static int epoch_readers_gone(struct epoch_domain *ed, int parity)
+{
+    int i;
+
+    for (i = 0; i < EPOCH_NUM_SLOTS; i++) {
+        if (__atomic_load_n(&ed->slots[i].count[parity],
+                            __ATOMIC_ACQUIRE) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Take the retired list and advance the epoch.
+ *
+ * Must be called with reclaim_lock held.
+ *
+ * @return              The objects which were retired before the advance.
+ */
+static struct epoch_entry *epoch_advance(struct epoch_domain *ed)
+{
+    struct epoch_entry *list;
+
+    pthread_mutex_lock(&ed->retire_lock);
+    list = ed->retired;
+    ed->retired = NULL;
+    ed->num_retired = 0;
+    pthread_mutex_unlock(&ed->retire_lock);
+    __atomic_add_fetch(&ed->epoch, 1, __ATOMIC_SEQ_CST);
+    return list;
+}
+
+static struct epoch_entry *epoch_concat(struct epoch_entry *a,
+                                        struct epoch_entry *b)
+{
+    struct epoch_entry *tail;
+
+    if (!a) {
+        return b;
+    }
+    for (tail = a; tail->next; tail = tail->next) {
+        ;
+    }
+    tail->next = b;
+    return a;
+}
+
+void epoch_synchronize(struct epoch_domain *ed)
+{
+    struct epoch_entry *list;
+    uint64_t epoch;
+
+    pthread_mutex_lock(&ed->reclaim_lock);
+    // Readers of the previous epoch may still be around if the last advance
+    // came from epoch_retire.  They must be gone before the parity is reused.
+    epoch = __atomic_load_n(&ed->epoch, __ATOMIC_SEQ_CST);
+    epoch_wait_for_readers(ed, (epoch - 1) & 1);
+    list = epoch_concat(epoch_advance(ed), ed->waiting);
+    ed->waiting = NULL;
+    epoch_wait_for_readers(ed, epoch & 1);
+    pthread_mutex_unlock(&ed->reclaim_lock);
+    epoch_free_list(list);
+}
+
+/**
+ * Reclaim memory if it can be done without waiting for any readers.
+ *
+ * @param ed            The epoch domain.
+ */
+static void epoch_try_reclaim(struct epoch_domain *ed)
+{
+    struct epoch_entry *list;
+    uint64_t epoch;
+
+    if (pthread_mutex_trylock(&ed->reclaim_lock)) {
+        // Someone else is already reclaiming.
+        return;
+    }
+    epoch = __atomic_load_n(&ed->epoch, __ATOMIC_SEQ_CST);
+    if (!epoch_readers_gone(ed, (epoch - 1) & 1)) {
+        pthread_mutex_unlock(&ed->reclaim_lock);
+        return;
+    }
+    // Nobody who entered before the last advance can still be reading, so
+    // the objects retired before it can go.
+    list = ed->waiting;
+    ed->waiting = epoch_advance(ed);
+    pthread_mutex_unlock(&ed->reclaim_lock);
+    epoch_free_list(list);
+}
+
+void epoch_retire(struct epoch_domain *ed, struct epoch_entry *entry,
+                  void (*free_fn)(struct epoch_entry *entry))
+{
+    int reclaim;
+
+    entry->free_fn = free_fn;
+    pthread_mutex_lock(&ed->retire_lock);
+    entry->next = ed->retired;
+    ed->retired = entry;
+    reclaim = (++ed->num_retired >= EPOCH_RECLAIM_THRESHOLD);
+    pthread_mutex_unlock(&ed->retire_lock);
+    if (reclaim) {
+        epoch_try_reclaim(ed);
+    }
+}
+
+// vim: ts=4:sw=4:tw=79:et
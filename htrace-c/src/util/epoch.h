@@ -0,0 +1,124 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_EPOCH_H
+#define APACHE_HTRACE_UTIL_EPOCH_H
+
+/**
+ * @file epoch.h
+ *
+ * Epoch-based memory reclamation.
+ *
+ * Lock-free readers cannot tell a writer when they are done with a piece of
+ * memory.  Instead, readers bracket their accesses with epoch_enter and
+ * epoch_exit.  A writer which unlinks an object hands it to epoch_retire
+ * rather than freeing it.  The object is freed once every reader which might
+ * have seen it has exited.
+ *
+ * Read sections are cheap: one atomic increment and one atomic decrement on a
+ * counter which is usually private to the calling thread's cache line.  Read
+ * sections may nest, and may be entered from any number of threads without
+ * registration.  They must be short, since reclamation waits for them.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+struct epoch_domain;
+
+/**
+ * An entry waiting to be reclaimed.  Embed this in the objects to be retired.
+ */
+struct epoch_entry {
+    /**
+     * The next entry on the list.  Managed by the epoch domain.
+     */
+    struct epoch_entry *next;
+
+    /**
+     * The function which frees the object containing this entry.
+     */
+    void (*free_fn)(struct epoch_entry *entry);
+};
+
+/**
+ * Allocate an epoch domain.
+ *
+ * @return              NULL on OOM; the epoch domain otherwise.
+ */
+struct epoch_domain *epoch_domain_alloc(void);
+
+/**
+ * Free an epoch domain.  Every entry which is still waiting to be reclaimed
+ * is freed.
+ *
+ * There must be no readers in the domain when this is called.
+ *
+ * @param ed            The epoch domain.
+ */
+void epoch_domain_free(struct epoch_domain *ed);
+
+/**
+ * Enter a read section.
+ *
+ * Objects which were reachable when the read section was entered will not be
+ * freed until it is exited.
+ *
+ * @param ed            The epoch domain.
+ *
+ * @return              A token to pass to epoch_exit.
+ */
+int epoch_enter(struct epoch_domain *ed);
+
+/**
+ * Exit a read section.
+ *
+ * This must be called on the same thread that called epoch_enter.
+ *
+ * @param ed            The epoch domain.
+ * @param token         The token returned by epoch_enter.
+ */
+void epoch_exit(struct epoch_domain *ed, int token);
+
+/**
+ * Retire an object.  The object must already be unreachable for new readers.
+ * It will be freed once all current readers have exited.
+ *
+ * This never waits for readers.  It may free previously retired objects
+ * whose readers have all exited.  It may be called from inside a read
+ * section; objects retired there are not freed until the section exits.
+ *
+ * @param ed            The epoch domain.
+ * @param entry         The entry embedded in the object.
+ * @param free_fn       The function which frees the object.
+ */
+void epoch_retire(struct epoch_domain *ed, struct epoch_entry *entry,
+                  void (*free_fn)(struct epoch_entry *entry));
+
+/**
+ * Wait for all current readers to exit, and free all the objects which were
+ * retired before this call.
+ *
+ * This must not be called from inside a read section.
+ *
+ * @param ed            The epoch domain.
+ */
+void epoch_synchronize(struct epoch_domain *ed);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,73 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_FILE_WATCH_H
+#define APACHE_HTRACE_UTIL_FILE_WATCH_H
+
+/**
+ * @file file_watch.h
+ *
+ * Watches a file for changes.
+ *
+ * A background thread calls a callback whenever the watched file is written
+ * and closed, or renamed into place.  The file does not need to exist when the
+ * watch starts.  On Linux, we use inotify on the directory containing the
+ * file.  Elsewhere, we poll the file's modification time.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+struct file_watch;
+struct htrace_log;
+
+/**
+ * A callback which is invoked when the watched file changes.
+ *
+ * @param ctx           The context pointer passed to file_watch_alloc.
+ * @param path          The path of the watched file.
+ */
+typedef void (*file_watch_fn_t)(void *ctx, const char *path);
+
+/**
+ * Start watching a file.
+ *
+ * @param lg            The log to use for error messages.
+ * @param path          The path of the file to watch.
+ * @param fn            The callback to invoke when the file changes.  It will
+ *                          be invoked from the watch thread.
+ * @param ctx           The context pointer to pass to the callback.
+ *
+ * @return              NULL on failure; the file watch otherwise.  Errors
+ *                          will be logged.
+ */
+struct file_watch *file_watch_alloc(struct htrace_log *lg, const char *path,
+                                    file_watch_fn_t fn, void *ctx);
+
+/**
+ * Stop watching a file and free the watch.
+ *
+ * Waits for the watch thread to exit.  Once this returns, the callback will
+ * not be invoked again.  This must not be called from inside the callback.
+ *
+ * @param fw            The file watch, or NULL.
+ */
+void file_watch_free(struct file_watch *fw);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,268 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/file_watch.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/**
+ * @file file_watch_linux.c
+ *
+ * A Linux implementation of the file watch, using inotify.
+ *
+ * We watch the directory containing the file rather than the file itself.
+ * Editors and configuration management tools usually replace files by
+ * renaming a new file over the old one, which would silently end an inotify
+ * watch on the old file.  A pipe is used to wake the watch thread when it is
+ * time to shut down.
+ */
+
+/**
+ * The inotify events we care about.
+ */
+#define FILE_WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+struct file_watch {
+    /**
+     * The log to use.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * The full path of the watched file.
+     */
+    char *path;
+
+    /**
+     * The final path component of the watched file.  Points into path.
+     */
+    const char *base;
+
+    /**
+     * The inotify file descriptor.
+     */
+    int ifd;
+
+    /**
+     * The pipe used to wake the watch thread.  The thread exits when the
+     * write end is closed.
+     */
+    int pipefd[2];
+
+    /**
+     * The callback and its context.
+     */
+    file_watch_fn_t fn;
+    void *ctx;
+
+    /**
+     * The watch thread.
+     */
+    pthread_t thread;
+};
+
+/**
+ * Read the pending inotify events.
+ *
+ * @return      1 if the watched file changed; 0 otherwise.
+ */
+static int file_watch_read_events(struct file_watch *fw)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t res;
+    char *ptr;
+    int changed = 0;
+
+    while (1) {
+        res = read(fw->ifd, buf, sizeof(buf));
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN means we have drained everything.
+            return changed;
+        }
+        for (ptr = buf; ptr < buf + res;
+                ptr += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)ptr;
+            if ((ev->len > 0) && (strcmp(ev->name, fw->base) == 0)) {
+                changed = 1;
+            }
+        }
+    }
+}
+
+static void *file_watch_run(void *data)
+{
+    struct file_watch *fw = data;
+    struct pollfd pfd[2];
+    int ret;
+
+    pfd[0].fd = fw->ifd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = fw->pipefd[0];
+    pfd[1].events = POLLIN;
+    while (1) {
+        ret = poll(pfd, 2, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = errno;
+            htrace_logl(fw->lg, HTRACE_LOG_ERROR,
+                        "file_watch_run(%s): poll failed: %s.  "
+                        "No longer watching.\n", fw->path, terror(ret));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        if (pfd[0].revents & POLLIN) {
+            if (file_watch_read_events(fw)) {
+                fw->fn(fw->ctx, fw->path);
+            }
+        }
+    }
+    return NULL;
+}
+
+struct file_watch *file_watch_alloc(struct htrace_log *lg, const char *path,
+                                    file_watch_fn_t fn, void *ctx)
+{
+    struct file_watch *fw;
+    char *dir = NULL;
+    char *slash;
+    int ret;
+
+    fw = calloc(1, sizeof(*fw));
+    if (!fw) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "file_watch_alloc(%s): OOM\n", path);
+        return NULL;
+    }
+    fw->lg = lg;
+    fw->ifd = -1;
+    fw->pipefd[0] = -1;
+    fw->pipefd[1] = -1;
+    fw->fn = fn;
+    fw->ctx = ctx;
+    fw->path = strdup(path);
+    if (!fw->path) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "file_watch_alloc(%s): OOM\n", path);
+        goto error;
+    }
+    slash = strrchr(fw->path, '/');
+    if (!slash) {
+        dir = strdup(".");
+        fw->base = fw->path;
+    } else if (slash == fw->path) {
+        dir = strdup("/");
+        fw->base = slash + 1;
+    } else {
+        dir = strndup(fw->path, slash - fw->path);
+        fw->base = slash + 1;
+    }
+    if (!dir) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "file_watch_alloc(%s): OOM\n", path);
+        goto error;
+    }
+    if (fw->base[0] == '\0') {
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "file_watch_alloc(%s): the path names a "
+                    "directory, not a file.\n", path);
+        goto error;
+    }
+    fw->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fw->ifd < 0) {
+        ret = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "file_watch_alloc(%s): inotify_init1 failed: %s\n", path,
+                    terror(ret));
+        goto error;
+    }
+    if (inotify_add_watch(fw->ifd, dir, FILE_WATCH_EVENTS) < 0) {
+        ret = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "file_watch_alloc(%s): failed to watch %s: %s\n", path,
+                    dir, terror(ret));
+        goto error;
+    }
+    if (pipe2(fw->pipefd, O_CLOEXEC) < 0) {
+        ret = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "file_watch_alloc(%s): pipe2 failed: %s\n", path,
+                    terror(ret));
+        goto error;
+    }
+    ret = pthread_create(&fw->thread, NULL, file_watch_run, fw);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "file_watch_alloc(%s): failed to create the watch "
+                    "thread: %s\n", path, terror(ret));
+        goto error;
+    }
+    free(dir);
+    return fw;
+
+error:
+    free(dir);
+    if (fw->pipefd[0] >= 0) {
+        close(fw->pipefd[0]);
+        close(fw->pipefd[1]);
+    }
+    if (fw->ifd >= 0) {
+        close(fw->ifd);
+    }
+    free(fw->path);
+    free(fw);
+    return NULL;
+}
+
+void file_watch_free(struct file_watch *fw)
+{
+    int ret;
+
+    if (!fw) {
+        return;
+    }
+    // Closing the write end of the pipe makes the read end readable, which
+    // wakes the watch thread.
+    close(fw->pipefd[1]);
+    ret = pthread_join(fw->thread, NULL);
+    if (ret) {
+        htrace_logl(fw->lg, HTRACE_LOG_ERROR,
+                    "file_watch_free(%s): pthread_join failed: %s\n",
+                    fw->path, terror(ret));
+    }
+    close(fw->pipefd[0]);
+    close(fw->ifd);
+    free(fw->path);
+    free(fw);
+}
+
+// vim: ts=4:sw=4:tw=79:et
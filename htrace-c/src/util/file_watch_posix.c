@@ -0,0 +1,202 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/file_watch.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @file file_watch_posix.c
+ *
+ * A POSIX implementation of the file watch.  There is no portable way to be
+ * notified of file changes, so we poll the file's modification time, size,
+ * and inode number.
+ */
+
+/**
+ * How often to poll the watched file.
+ */
+#define FILE_WATCH_POLL_MS 1000
+
+struct file_watch {
+    /**
+     * The log to use.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * The path of the watched file.
+     */
+    char *path;
+
+    /**
+     * The callback and its context.
+     */
+    file_watch_fn_t fn;
+    void *ctx;
+
+    /**
+     * Protects shutdown.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Signalled when it is time to shut down.
+     */
+    pthread_cond_t cond;
+
+    /**
+     * Nonzero if the watch thread should exit.
+     */
+    int shutdown;
+
+    /**
+     * The watch thread.
+     */
+    pthread_t thread;
+};
+
+/**
+ * What we know about the watched file.  All zeroes if it doesn't exist.
+ */
+struct file_watch_stat {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+static void file_watch_stat(const char *path, struct file_watch_stat *fst)
+{
+    struct stat st;
+
+    memset(fst, 0, sizeof(*fst));
+    if (stat(path, &st) < 0) {
+        return;
+    }
+    fst->dev = st.st_dev;
+    fst->ino = st.st_ino;
+    fst->size = st.st_size;
+    fst->mtime = st.st_mtime;
+}
+
+static void *file_watch_run(void *data)
+{
+    struct file_watch *fw = data;
+    struct file_watch_stat prev, cur;
+    struct timespec deadline;
+    struct timeval tv;
+
+    file_watch_stat(fw->path, &prev);
+    pthread_mutex_lock(&fw->lock);
+    while (!fw->shutdown) {
+        gettimeofday(&tv, NULL);
+        deadline.tv_sec = tv.tv_sec + (FILE_WATCH_POLL_MS / 1000);
+        deadline.tv_nsec = (tv.tv_usec * 1000LL) +
+            ((FILE_WATCH_POLL_MS % 1000) * 1000000LL);
+        if (deadline.tv_nsec >= 1000000000LL) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000LL;
+        }
+        pthread_cond_timedwait(&fw->cond, &fw->lock, &deadline);
+        if (fw->shutdown) {
+            break;
+        }
+        pthread_mutex_unlock(&fw->lock);
+        file_watch_stat(fw->path, &cur);
+        if (memcmp(&prev, &cur, sizeof(cur)) != 0) {
+            prev = cur;
+            if (cur.ino) {
+                fw->fn(fw->ctx, fw->path);
+            }
+        }
+        pthread_mutex_lock(&fw->lock);
+    }
+    pthread_mutex_unlock(&fw->lock);
+    return NULL;
+}
+
+struct file_watch *file_watch_alloc(struct htrace_log *lg, const char *path,
+                                    file_watch_fn_t fn, void *ctx)
+{
+    struct file_watch *fw;
+    int ret;
+
+    fw = calloc(1, sizeof(*fw));
+    if (!fw) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "file_watch_alloc(%s): OOM\n", path);
+        return NULL;
+    }
+    fw->lg = lg;
+    fw->fn = fn;
+    fw->ctx = ctx;
+    fw->path = strdup(path);
+    if (!fw->path) {
+        htrace_logl(lg, HTRACE_LOG_ERROR, "file_watch_alloc(%s): OOM\n", path);
+        free(fw);
+        return NULL;
+    }
+    pthread_mutex_init(&fw->lock, NULL);
+    pthread_cond_init(&fw->cond, NULL);
+    ret = pthread_create(&fw->thread, NULL, file_watch_run, fw);
+    if (ret) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "file_watch_alloc(%s): failed to create the watch "
+                    "thread: %s\n", path, terror(ret));
+        pthread_cond_destroy(&fw->cond);
+        pthread_mutex_destroy(&fw->lock);
+        free(fw->path);
+        free(fw);
+        return NULL;
+    }
+    return fw;
+}
+
+void file_watch_free(struct file_watch *fw)
+{
+    int ret;
+
+    if (!fw) {
+        return;
+    }
+    pthread_mutex_lock(&fw->lock);
+    fw->shutdown = 1;
+    pthread_cond_signal(&fw->cond);
+    pthread_mutex_unlock(&fw->lock);
+    ret = pthread_join(fw->thread, NULL);
+    if (ret) {
+        htrace_logl(fw->lg, HTRACE_LOG_ERROR,
+                    "file_watch_free(%s): pthread_join failed: %s\n",
+                    fw->path, terror(ret));
+    }
+    pthread_cond_destroy(&fw->cond);
+    pthread_mutex_destroy(&fw->lock);
+    free(fw->path);
+    free(fw);
+}
+
+// vim: ts=4:sw=4:tw=79:et
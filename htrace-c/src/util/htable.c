@@ -27,7 +27,20 @@
 /**
  * @file htable.c
  *
- * Implements a hash table that uses probing.
+ * Implements a hash table that uses Robin Hood hashing.
+ *
+ * We use open addressing with linear probing.  On insert, an entry which is
+ * further from its home slot than the entry currently occupying a slot takes
+ * that slot, and the displaced entry continues probing.  This keeps the
+ * variance of the probe lengths low, and lets a lookup stop as soon as it
+ * reaches an entry which is closer to its home slot than the key being
+ * searched for would be.
+ *
+ * The full 32-bit hash of every entry is stored in a separate array.  Probes
+ * scan this dense array and only call the equality function when the hashes
+ * match, so mismatched keys are almost never dereferenced.  A stored hash of
+ * 0 marks an empty slot.  The distance of an entry from its home slot is
+ * computed from its stored hash, so it does not need to be stored as well.
  */
 
 struct htable_pair {
@@ -36,65 +49,120 @@ struct htable_pair {
 };
 
 /**
- * A hash table which uses linear probing.
+ * A hash table which uses Robin Hood hashing.
  */
 struct htable {
     uint32_t capacity;
     uint32_t used;
     htable_hash_fn_t hash_fun;
     htable_eq_fn_t eq_fun;
+    uint32_t *hashes;
     struct htable_pair *elem;
 };
 
+/**
+ * The maximum load factor, expressed as a fraction of HTABLE_LOAD_DENOM.
+ *
+ * Robin Hood hashing keeps probe sequences short even when the table is
+ * mostly full, so we can let it get to 85% full before growing.
+ */
+#define HTABLE_LOAD_NUMER 17
+#define HTABLE_LOAD_DENOM 20
+
+/**
+ * Get the hash code we store for a key.  This is never 0, since 0 marks empty
+ * slots.
+ */
+static inline uint32_t htable_hash(const struct htable *htable,
+                                   const void *key)
+{
+    uint32_t hash = htable->hash_fun(key);
+    return hash ? hash : 1;
+}
+
+/**
+ * Get the distance between a slot and the home slot of the entry in it.
+ */
+static inline uint32_t htable_probe_dist(uint32_t hash, uint32_t idx,
+                                         uint32_t mask)
+{
+    return (idx - (hash & mask)) & mask;
+}
+
 /**
  * An internal function for inserting a value into the hash table.
  *
  * Note: this function assumes that you have made enough space in the table.
  *
- * @param nelem         The new element to insert.
- * @param capacity      The capacity of the hash table.
- * @param hash_fun      The hash function to use.
+ * @param hashes        The hash code array.
+ * @param nelem         The element array.
+ * @param capacity      The capacity of the hash table.  A power of 2.
+ * @param hash          The hash code of the key.
  * @param key           The key to insert.
  * @param val           The value to insert.
  */
-static void htable_insert_internal(struct htable_pair *nelem,
-        uint32_t capacity, htable_hash_fn_t hash_fun, void *key,
-        void *val)
+static void htable_insert_internal(uint32_t *hashes,
+        struct htable_pair *nelem, uint32_t capacity, uint32_t hash,
+        void *key, void *val)
 {
-    uint32_t i;
+    uint32_t mask = capacity - 1;
+    uint32_t idx, dist, cur_dist, tmp_hash;
+    void *tmp;
 
-    i = hash_fun(key, capacity);
+    idx = hash & mask;
+    dist = 0;
     while (1) {
-        if (!nelem[i].key) {
-            nelem[i].key = key;
-            nelem[i].val = val;
+        if (!hashes[idx]) {
+            hashes[idx] = hash;
+            nelem[idx].key = key;
+            nelem[idx].val = val;
             return;
         }
-        i++;
-        if (i == capacity) {
-            i = 0;
+        cur_dist = htable_probe_dist(hashes[idx], idx, mask);
+        if (cur_dist < dist) {
+            // The current occupant is closer to home than we are.  Take its
+            // slot, and keep going with the occupant instead.
+            tmp_hash = hashes[idx];
+            hashes[idx] = hash;
+            hash = tmp_hash;
+            tmp = nelem[idx].key;
+            nelem[idx].key = key;
+            key = tmp;
+            tmp = nelem[idx].val;
+            nelem[idx].val = val;
+            val = tmp;
+            dist = cur_dist;
         }
+        idx = (idx + 1) & mask;
+        dist++;
     }
 }
 
 static int htable_realloc(struct htable *htable, uint32_t new_capacity)
 {
     struct htable_pair *nelem;
+    uint32_t *nhashes;
     uint32_t i, old_capacity = htable->capacity;
-    htable_hash_fn_t hash_fun = htable->hash_fun;
 
+    nhashes = calloc(new_capacity, sizeof(uint32_t));
+    if (!nhashes) {
+        return ENOMEM;
+    }
     nelem = calloc(new_capacity, sizeof(struct htable_pair));
     if (!nelem) {
+        free(nhashes);
         return ENOMEM;
     }
     for (i = 0; i < old_capacity; i++) {
-        struct htable_pair *pair = htable->elem + i;
-        if (pair->key) {
-            htable_insert_internal(nelem, new_capacity, hash_fun,
-                                   pair->key, pair->val);
+        if (htable->hashes[i]) {
+            htable_insert_internal(nhashes, nelem, new_capacity,
+                    htable->hashes[i], htable->elem[i].key,
+                    htable->elem[i].val);
         }
     }
+    free(htable->hashes);
     free(htable->elem);
+    htable->hashes = nhashes;
     htable->elem = nelem;
     htable->capacity = new_capacity;
     return 0;
@@ -140,8 +208,8 @@ void htable_visit(struct htable *htable, visitor_fn_t fun, void *ctx)
     uint32_t i;
 
     for (i = 0; i != htable->capacity; ++i) {
-        struct htable_pair *elem = htable->elem + i;
-        if (elem->key) {
+        if (htable->hashes[i]) {
+            struct htable_pair *elem = htable->elem + i;
             fun(ctx, elem->key, elem->val);
         }
     }
@@ -150,6 +218,7 @@ void htable_visit(struct htable *htable, visitor_fn_t fun, void *ctx)
 void htable_free(struct htable *htable)
 {
     if (htable) {
+        free(htable->hashes);
         free(htable->elem);
         free(htable);
     }
@@ -158,11 +227,9 @@ void htable_free(struct htable *htable)
 int htable_put(struct htable *htable, void *key, void *val)
 {
     int ret;
-    uint32_t nused;
+    uint64_t nused;
 
     // NULL is not a valid key value.
-    // This helps us implement htable_get_internal efficiently, since we know
-    // that we can stop when we encounter the first NULL key.
     if (!key) {
         return EINVAL;
     }
@@ -172,15 +239,19 @@ int htable_put(struct htable *htable, void *key, void *val)
     if (!val) {
         return EINVAL;
     }
-    // Re-hash if we have used more than half of the hash table
+    // Re-hash if we would go over the maximum load factor.
     nused = htable->used + 1;
-    if (nused >= (htable->capacity / 2)) {
+    if ((nused * HTABLE_LOAD_DENOM) >
+            ((uint64_t)htable->capacity * HTABLE_LOAD_NUMER)) {
+        if (htable->capacity >= 0x80000000U) {
+            return EFBIG;
+        }
         ret = htable_realloc(htable, htable->capacity * 2);
         if (ret)
             return ret;
     }
-    htable_insert_internal(htable->elem, htable->capacity,
-                                htable->hash_fun, key, val);
+    htable_insert_internal(htable->hashes, htable->elem, htable->capacity,
+                           htable_hash(htable, key), key, val);
     htable->used++;
     return 0;
 }
@@ -188,28 +259,30 @@ int htable_put(struct htable *htable, void *key, void *val)
 static int htable_get_internal(const struct htable *htable,
                                const void *key, uint32_t *out)
 {
-    uint32_t start_idx, idx;
+    uint32_t mask = htable->capacity - 1;
+    uint32_t hash, idx, dist, cur;
 
-    start_idx = htable->hash_fun(key, htable->capacity);
-    idx = start_idx;
+    hash = htable_hash(htable, key);
+    idx = hash & mask;
+    dist = 0;
     while (1) {
-        struct htable_pair *pair = htable->elem + idx;
-        if (!pair->key) {
-            // We always maintain the invariant that the entries corresponding
-            // to a given key are stored in a contiguous block, not separated
-            // by any NULLs.  So if we encounter a NULL, our search is over.
+        cur = htable->hashes[idx];
+        if (!cur) {
             return ENOENT;
-        } else if (htable->eq_fun(pair->key, key)) {
-            *out = idx;
-            return 0;
-        }
-        idx++;
-        if (idx == htable->capacity) {
-            idx = 0;
         }
-        if (idx == start_idx) {
+        // If this entry is closer to its home slot than we are to ours, then
+        // our key would have displaced it during insertion.  So the key is
+        // not present.  Since the table is never full, we always reach either
+        // an empty slot or such an entry.
+        if (htable_probe_dist(cur, idx, mask) < dist) {
             return ENOENT;
         }
+        if ((cur == hash) && htable->eq_fun(htable->elem[idx].key, key)) {
+            *out = idx;
+            return 0;
+        }
+        idx = (idx + 1) & mask;
+        dist++;
     }
 }
 
@@ -226,38 +299,33 @@ void *htable_get(const struct htable *htable, const void *key)
 void htable_pop(struct htable *htable, const void *key,
                 void **found_key, void **found_val)
 {
-    uint32_t hole, i;
-    const void *nkey;
+    uint32_t mask = htable->capacity - 1;
+    uint32_t hole, next;
 
     if (htable_get_internal(htable, key, &hole)) {
         *found_key = NULL;
         *found_val = NULL;
         return;
     }
-    i = hole;
+    *found_key = htable->elem[hole].key;
+    *found_val = htable->elem[hole].val;
     htable->used--;
-    // We need to maintain the compactness invariant used in
-    // htable_get_internal.  This invariant specifies that the entries for any
-    // given key are never separated by NULLs (although they may be separated
-    // by entries for other keys.)
+    // Shift the following entries back by one slot, until we reach an empty
+    // slot or an entry which is already in its home slot.  This keeps the
+    // Robin Hood invariant without needing tombstones.
     while (1) {
-        i++;
-        if (i == htable->capacity) {
-            i = 0;
-        }
-        nkey = htable->elem[i].key;
-        if (!nkey) {
-            *found_key = htable->elem[hole].key;
-            *found_val = htable->elem[hole].val;
-            htable->elem[hole].key = NULL;
-            htable->elem[hole].val = NULL;
-            return;
-        } else if (htable->eq_fun(key, nkey)) {
-            htable->elem[hole].key = htable->elem[i].key;
-            htable->elem[hole].val = htable->elem[i].val;
-            hole = i;
+        next = (hole + 1) & mask;
+        if ((!htable->hashes[next]) ||
+                (htable_probe_dist(htable->hashes[next], next, mask) == 0)) {
+            break;
         }
+        htable->hashes[hole] = htable->hashes[next];
+        htable->elem[hole] = htable->elem[next];
+        hole = next;
     }
+    htable->hashes[hole] = 0;
+    htable->elem[hole].key = NULL;
+    htable->elem[hole].val = NULL;
 }
 
 uint32_t htable_used(const struct htable *htable)
@@ -270,16 +338,25 @@ uint32_t htable_capacity(const struct htable *htable)
     return htable->capacity;
 }
 
-uint32_t ht_hash_string(const void *str, uint32_t max)
+uint32_t ht_hash_string(const void *str)
 {
-    const char *s = str;
-    uint32_t hash = 0;
+    const uint8_t *s = str;
+    uint32_t hash = 2166136261U;
 
+    // 32-bit FNV-1a.
     while (*s) {
-        hash = (hash * 31) + *s;
+        hash ^= *s;
+        hash *= 16777619U;
         s++;
     }
-    return hash % max;
+    // FNV-1a mixes the low bits poorly for short strings, and we use the low
+    // bits to pick the home slot.  Finish with the MurmurHash3 finalizer.
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+    return hash;
 }
 
 int ht_compare_string(const void *a, const void *b)
@@ -22,7 +22,7 @@
 /**
  * @file htable.h
  *
- * Interfaces for a hash table that uses probing.
+ * Interfaces for a hash table that uses Robin Hood probing.
  *
  * This is an internal header, not intended for external use.
  */
@@ -38,12 +38,15 @@ struct htable;
 /**
  * An HTable hash function.
  *
+ * The hash table picks slots using the low bits of the hash code, and stores
+ * the whole hash code to avoid comparing keys whose hash codes differ.  So
+ * all 32 bits should be well-distributed.
+ *
  * @param key       The key.
- * @param capacity  The total capacity.
  *
- * @return          The hash slot.  Must be less than the capacity.
+ * @return          The 32-bit hash code.
  */
-typedef uint32_t (*htable_hash_fn_t)(const void *key, uint32_t capacity);
+typedef uint32_t (*htable_hash_fn_t)(const void *key);
 
 /**
  * An HTable equality function.  Compares two keys.
@@ -148,11 +151,10 @@ uint32_t htable_capacity(const struct htable *htable);
  * Hash a string.
  *
  * @param str       The string.
- * @param max       Maximum hash value
  *
- * @return          A number less than max.
+ * @return          The 32-bit hash code.
  */
-uint32_t ht_hash_string(const void *str, uint32_t max);
+uint32_t ht_hash_string(const void *str);
 
 /**
  * Compare two strings.
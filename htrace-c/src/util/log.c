@@ -19,13 +19,81 @@
 #include "core/conf.h"
 #include "core/htrace.h"
 #include "util/log.h"
+#include "util/membudget.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @file log.c
+ *
+ * Implementation of the HTrace client log.
+ *
+ * By default, messages are written to the log file synchronously, under a
+ * mutex.  In asynchronous mode, each logging thread instead formats its
+ * messages into its own single-producer, single-consumer ring buffer.  A
+ * background thread drains the rings into the log file.  Logging threads
+ * never take a lock, except once to register their ring.  If a ring is full,
+ * the message is dropped and counted.  The background thread only takes the
+ * lock to unlink the rings of dead threads, never while writing the file.
+ *
+ * Rate-limited message sites which have suppressed messages are kept on a
+ * global list, so that their counts can be reported even if no later message
+ * from the same site gets through.
+ */
+
+/**
+ * The number of messages in each asynchronous log ring.
+ */
+#define HTRACE_LOG_RING_SLOTS 64
+
+/**
+ * The maximum length of a message in asynchronous mode, including the
+ * terminating null.  Longer messages are truncated.
+ */
+#define HTRACE_LOG_MSG_MAX 256
+
+/**
+ * How often the background thread drains the rings.
+ */
+#define HTRACE_LOG_DRAIN_INTERVAL_MS 100
+
+struct htrace_log_ring {
+    /**
+     * The next ring in the log's list.  Changed under the log lock, but read
+     * by the background thread without it.
+     */
+    struct htrace_log_ring *next;
+
+    /**
+     * The number of messages written.  Only the owning thread writes this.
+     */
+    uint64_t head;
+
+    /**
+     * The number of messages drained.  Only the background thread writes
+     * this.
+     */
+    uint64_t tail;
+
+    /**
+     * 1 once the owning thread has exited; 2 once the background thread
+     * has drained the ring for the last time.
+     */
+    int dead;
+
+    /**
+     * The messages.
+     */
+    char msgs[HTRACE_LOG_RING_SLOTS][HTRACE_LOG_MSG_MAX];
+};
 
 struct htrace_log {
     /**
@@ -42,43 +110,321 @@ struct htrace_log {
      * Nonzero if we should close this file when closing the log.
      */
     int should_close;
+
+    /**
+     * The most verbose level we log at.
+     */
+    int level;
+
+    /**
+     * Nonzero if we are logging asynchronously.  The fields below are only
+     * used in asynchronous mode.
+     */
+    int async;
+
+    /**
+     * Key for each thread's ring.
+     */
+    pthread_key_t ring_key;
+
+    /**
+     * The list of rings.  Changed under the lock.  Only the background thread
+     * removes rings, so it may read the list without the lock.
+     */
+    struct htrace_log_ring *rings;
+
+    /**
+     * The number of messages dropped because a ring was full.
+     */
+    uint64_t dropped;
+
+    /**
+     * Nonzero when the background thread should exit.  Protected by the lock.
+     */
+    int shutdown;
+
+    /**
+     * Signalled to wake the background thread for shutdown.
+     */
+    pthread_cond_t cond;
+
+    /**
+     * The background thread.
+     */
+    pthread_t thread;
 };
 
+static int htrace_log_parse_level(const char *str)
+{
+    if (!str) {
+        return HTRACE_LOG_INFO;
+    } else if (!strcmp(str, "error")) {
+        return HTRACE_LOG_ERROR;
+    } else if (!strcmp(str, "warn")) {
+        return HTRACE_LOG_WARN;
+    } else if (!strcmp(str, "debug")) {
+        return HTRACE_LOG_DEBUG;
+    }
+    return HTRACE_LOG_INFO;
+}
+
+static uint64_t htrace_log_monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t)ts.tv_sec) * 1000ULL) + (ts.tv_nsec / 1000000ULL);
+}
+
+/**
+ * The rate-limited message sites which have suppressed messages at some
+ * point.  Sites are static, so they are never removed.
+ */
+static struct htrace_log_rl *g_htrace_log_rl_sites;
+
+static void htrace_log_rl_register(struct htrace_log_rl *rl)
+{
+    struct htrace_log_rl *head;
+    int expected = 0;
+
+    if (!__atomic_compare_exchange_n(&rl->registered, &expected, 1, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    head = __atomic_load_n(&g_htrace_log_rl_sites, __ATOMIC_RELAXED);
+    do {
+        rl->next = head;
+    } while (!__atomic_compare_exchange_n(&g_htrace_log_rl_sites, &head, rl,
+                        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Log the counts of suppressed messages from sites which last wrote to this
+ * log.
+ *
+ * @param lg            The log.
+ * @param all           If nonzero, log every count.  Otherwise, only log the
+ *                          counts of sites whose interval has passed.
+ */
+static void htrace_log_flush_suppressed(struct htrace_log *lg, int all)
+{
+    struct htrace_log_rl *rl;
+    uint64_t now = 0, suppressed;
+    const char *fmt;
+    int len;
+
+    if (!all) {
+        now = htrace_log_monotonic_ms();
+    }
+    for (rl = __atomic_load_n(&g_htrace_log_rl_sites, __ATOMIC_ACQUIRE);
+            rl; rl = rl->next) {
+        if (__atomic_load_n(&rl->lg, __ATOMIC_RELAXED) != lg) {
+            continue;
+        }
+        if (!all && (now < __atomic_load_n(&rl->next_ms, __ATOMIC_RELAXED))) {
+            continue;
+        }
+        suppressed = __atomic_exchange_n(&rl->suppressed, 0,
+                                         __ATOMIC_RELAXED);
+        if (!suppressed) {
+            continue;
+        }
+        // The arguments are long gone, so show the format string.
+        fmt = __atomic_load_n(&rl->fmt, __ATOMIC_RELAXED);
+        len = strcspn(fmt, "\n");
+        htrace_logl(lg, __atomic_load_n(&rl->level, __ATOMIC_RELAXED),
+                    "(suppressed %" PRIu64 " message(s) like \"%.*s\")\n",
+                    suppressed, len, fmt);
+    }
+}
+
+static void htrace_log_ring_release(void *arg)
+{
+    struct htrace_log_ring *ring = arg;
+
+    // The background thread will free the ring once it has been drained.
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write out everything in the rings.  Only called from the background
+ * thread, without the lock held.
+ */
+static void htrace_log_drain(struct htrace_log *lg)
+{
+    struct htrace_log_ring *ring, **prev, *reaped = NULL;
+    uint64_t head, tail, dropped;
+    int num_dead = 0;
+
+    for (ring = __atomic_load_n(&lg->rings, __ATOMIC_ACQUIRE); ring;
+            ring = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE)) {
+        // Check whether the thread is dead before looking at the head, so
+        // that we can't miss its last messages.
+        if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) == 1) {
+            // Mark the ring as drained for the last time.
+            __atomic_store_n(&ring->dead, 2, __ATOMIC_RELAXED);
+            num_dead++;
+        }
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail != head; tail++) {
+            fputs(ring->msgs[tail % HTRACE_LOG_RING_SLOTS], lg->fp);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    dropped = __atomic_exchange_n(&lg->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        fprintf(lg->fp, "htrace_log: dropped %" PRIu64 " message(s) "
+                "because the log ring was full.\n", dropped);
+    }
+    fflush(lg->fp);
+    if (!num_dead) {
+        return;
+    }
+    // Registration walks the list under the lock, so unlink the dead rings
+    // under it too.  Free them afterwards.
+    pthread_mutex_lock(&lg->lock);
+    prev = &lg->rings;
+    while ((ring = *prev)) {
+        if (__atomic_load_n(&ring->dead, __ATOMIC_RELAXED) == 2) {
+            __atomic_store_n(prev, ring->next, __ATOMIC_RELEASE);
+            ring->next = reaped;
+            reaped = ring;
+        } else {
+            prev = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&lg->lock);
+    while ((ring = reaped)) {
+        reaped = ring->next;
+        free(ring);
+        membudget_release(sizeof(*ring));
+    }
+}
+
+static void *htrace_log_thread(void *arg)
+{
+    struct htrace_log *lg = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&lg->lock);
+    while (!lg->shutdown) {
+        pthread_mutex_unlock(&lg->lock);
+        htrace_log_flush_suppressed(lg, 0);
+        htrace_log_drain(lg);
+        pthread_mutex_lock(&lg->lock);
+        if (lg->shutdown) {
+            break;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += HTRACE_LOG_DRAIN_INTERVAL_MS * 1000000LL;
+        if (deadline.tv_nsec >= 1000000000LL) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000LL;
+        }
+        pthread_cond_timedwait(&lg->cond, &lg->lock, &deadline);
+    }
+    pthread_mutex_unlock(&lg->lock);
+    htrace_log_drain(lg);
+    return NULL;
+}
+
+/**
+ * Set up asynchronous logging.
+ *
+ * @return              0 on success; the error number otherwise.
+ */
+static int htrace_log_start_async(struct htrace_log *lg)
+{
+    int ret;
+
+    ret = pthread_key_create(&lg->ring_key, htrace_log_ring_release);
+    if (ret) {
+        return ret;
+    }
+    ret = pthread_cond_init(&lg->cond, NULL);
+    if (ret) {
+        pthread_key_delete(lg->ring_key);
+        return ret;
+    }
+    ret = pthread_create(&lg->thread, NULL, htrace_log_thread, lg);
+    if (ret) {
+        pthread_cond_destroy(&lg->cond);
+        pthread_key_delete(lg->ring_key);
+        return ret;
+    }
+    lg->async = 1;
+    return 0;
+}
+
 struct htrace_log *htrace_log_alloc(const struct htrace_conf *conf)
 {
     struct htrace_log *lg;
-    const char *path;
+    const char *path, *async;
+    int ret;
 
     lg = calloc(1, sizeof(*lg));
     if (!lg) {
         fprintf(stderr, "htrace_log_alloc: out of memory.\n");
         return NULL;
     }
+    if (pthread_mutex_init(&lg->lock, NULL)) {
+        fprintf(stderr, "htrace_log_alloc: pthread_mutex_init failed.\n");
+        free(lg);
+        return NULL;
+    }
+    lg->level = htrace_log_parse_level(
+            htrace_conf_get(conf, HTRACE_LOG_LEVEL_KEY));
     path = htrace_conf_get(conf, HTRACE_LOG_PATH_KEY);
     if (!path) {
         lg->fp = stderr;
-        return lg;
-    }
-    lg->fp = fopen(path, "a");
-    if (!lg->fp) {
-        int err = errno;
-        fprintf(stderr, "htrace_log_alloc: failed to open %s for "
-                "append: %d (%s).\n",
-                path, err, terror(err));
-        lg->fp = stderr;
-        return lg;
+    } else {
+        lg->fp = fopen(path, "a");
+        if (!lg->fp) {
+            int err = errno;
+            fprintf(stderr, "htrace_log_alloc: failed to open %s for "
+                    "append: %d (%s).\n",
+                    path, err, terror(err));
+            lg->fp = stderr;
+        } else {
+            // If we're logging to a file, we need to close the file when we
+            // close the log.
+            lg->should_close = 1;
+        }
+    }
+    async = htrace_conf_get(conf, HTRACE_LOG_ASYNC_KEY);
+    if (async && (!strcmp(async, "true"))) {
+        ret = htrace_log_start_async(lg);
+        if (ret) {
+            fprintf(lg->fp, "htrace_log_alloc: failed to start the "
+                    "asynchronous log thread: %d (%s).  Logging "
+                    "synchronously.\n", ret, terror(ret));
+        }
     }
-    // If we're logging to a file, we need to close the file when we close the
-    // log.
-    lg->should_close = 1;
     return lg;
 }
 
 void htrace_log_free(struct htrace_log *lg)
 {
+    struct htrace_log_ring *ring;
+
     if (!lg) {
         return;
     }
+    htrace_log_flush_suppressed(lg, 1);
+    if (lg->async) {
+        pthread_mutex_lock(&lg->lock);
+        lg->shutdown = 1;
+        pthread_cond_signal(&lg->cond);
+        pthread_mutex_unlock(&lg->lock);
+        pthread_join(lg->thread, NULL);
+        pthread_key_delete(lg->ring_key);
+        while ((ring = lg->rings)) {
+            lg->rings = ring->next;
+            free(ring);
+            membudget_release(sizeof(*ring));
+        }
+        pthread_cond_destroy(&lg->cond);
+    }
     pthread_mutex_destroy(&lg->lock);
     if (lg->should_close) {
         fclose(lg->fp);
@@ -86,8 +432,61 @@ void htrace_log_free(struct htrace_log *lg)
     free(lg);
 }
 
+static struct htrace_log_ring *htrace_log_get_ring(struct htrace_log *lg)
+{
+    struct htrace_log_ring *ring, **prev;
+
+    ring = pthread_getspecific(lg->ring_key);
+    if (ring) {
+        return ring;
+    }
+    if (!membudget_reserve(sizeof(*ring))) {
+        return NULL;
+    }
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        membudget_release(sizeof(*ring));
+        return NULL;
+    }
+    if (pthread_setspecific(lg->ring_key, ring)) {
+        free(ring);
+        membudget_release(sizeof(*ring));
+        return NULL;
+    }
+    // Keep the rings in registration order, so that the order in which they
+    // are drained is predictable.
+    pthread_mutex_lock(&lg->lock);
+    prev = &lg->rings;
+    while (*prev) {
+        prev = &(*prev)->next;
+    }
+    __atomic_store_n(prev, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lg->lock);
+    return ring;
+}
+
 static void htrace_logv(struct htrace_log *lg, const char *fmt, va_list ap)
 {
+    struct htrace_log_ring *ring;
+    uint64_t head;
+
+    if (lg->async) {
+        ring = htrace_log_get_ring(lg);
+        if (!ring) {
+            __atomic_add_fetch(&lg->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+                HTRACE_LOG_RING_SLOTS) {
+            __atomic_add_fetch(&lg->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        vsnprintf(ring->msgs[head % HTRACE_LOG_RING_SLOTS],
+                  HTRACE_LOG_MSG_MAX, fmt, ap);
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        return;
+    }
     pthread_mutex_lock(&lg->lock);
     vfprintf(lg->fp, fmt, ap);
     pthread_mutex_unlock(&lg->lock);
@@ -96,9 +495,60 @@ static void htrace_logv(struct htrace_log *lg, const char *fmt, va_list ap)
 void htrace_log(struct htrace_log *lg, const char *fmt, ...)
 {
     va_list ap;
+
+    if (lg->level < HTRACE_LOG_INFO) {
+        return;
+    }
+    va_start(ap, fmt);
+    htrace_logv(lg, fmt, ap);
+    va_end(ap);
+}
+
+void htrace_logl(struct htrace_log *lg, int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (lg->level < level) {
+        return;
+    }
     va_start(ap, fmt);
     htrace_logv(lg, fmt, ap);
     va_end(ap);
 }
 
+int htrace_log_enabled(const struct htrace_log *lg, int level)
+{
+    return lg->level >= level;
+}
+
+void htrace_log_rl(struct htrace_log *lg, struct htrace_log_rl *rl,
+                   int level, uint64_t interval_ms, const char *fmt, ...)
+{
+    uint64_t now, next, suppressed;
+    va_list ap;
+
+    if (lg->level < level) {
+        return;
+    }
+    now = htrace_log_monotonic_ms();
+    next = __atomic_load_n(&rl->next_ms, __ATOMIC_RELAXED);
+    if ((now < next) || (!__atomic_compare_exchange_n(&rl->next_ms, &next,
+                now + interval_ms, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {
+        __atomic_add_fetch(&rl->suppressed, 1, __ATOMIC_RELAXED);
+        htrace_log_rl_register(rl);
+        return;
+    }
+    __atomic_store_n(&rl->fmt, fmt, __ATOMIC_RELAXED);
+    __atomic_store_n(&rl->level, level, __ATOMIC_RELAXED);
+    __atomic_store_n(&rl->lg, lg, __ATOMIC_RELAXED);
+    va_start(ap, fmt);
+    htrace_logv(lg, fmt, ap);
+    va_end(ap);
+    suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed) {
+        htrace_logl(lg, level, "(suppressed %" PRIu64 " similar message(s) "
+                    "since the last one)\n", suppressed);
+    }
+}
+
 // vim: ts=4:sw=4:et
@@ -27,8 +27,61 @@
  * This is an internal header, not intended for external use.
  */
 
+#include <stdint.h>
+
 struct htrace_conf;
 
+/**
+ * Log levels, from most to least severe.
+ */
+#define HTRACE_LOG_ERROR 0
+#define HTRACE_LOG_WARN 1
+#define HTRACE_LOG_INFO 2
+#define HTRACE_LOG_DEBUG 3
+
+/**
+ * The state of a rate-limited log message site.  See HTRACE_LOG_RATE_LIMITED.
+ */
+struct htrace_log_rl {
+    /**
+     * The earliest monotonic time in milliseconds at which we will log this
+     * message again.
+     */
+    uint64_t next_ms;
+
+    /**
+     * The number of messages suppressed since we last logged.
+     */
+    uint64_t suppressed;
+
+    /**
+     * The format string of the message, used when reporting suppressed
+     * messages without a new message to attach them to.
+     */
+    const char *fmt;
+
+    /**
+     * The log level of the message.
+     */
+    int level;
+
+    /**
+     * The log which this site last wrote to.  Suppressed messages are
+     * reported to it.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * Nonzero once this site is on the global list of sites.
+     */
+    int registered;
+
+    /**
+     * The next site on the global list of sites.
+     */
+    struct htrace_log_rl *next;
+};
+
 /**
  * Allocate a new htrace_log.
  *
@@ -64,6 +117,63 @@ void htrace_log_free(struct htrace_log *lg);
 void htrace_log(struct htrace_log *lg, const char *fmt, ...)
       __attribute__((format(printf, 2, 3)));
 
+/**
+ * Create an htrace log message at a given level.
+ *
+ * htrace_log logs at HTRACE_LOG_INFO.
+ *
+ * @param lg            The log to use.
+ * @param level         The log level.
+ * @param fmt           The format string to use.
+ * @param ...           Printf-style variable length arguments.
+ */
+void htrace_logl(struct htrace_log *lg, int level, const char *fmt, ...)
+      __attribute__((format(printf, 3, 4)));
+
+/**
+ * Determine whether messages at a given level will be logged.
+ *
+ * @param lg            The log to use.
+ * @param level         The log level.
+ *
+ * @return              1 if the messages will be logged; 0 otherwise.
+ */
+int htrace_log_enabled(const struct htrace_log *lg, int level);
+
+/**
+ * Create a rate-limited htrace log message.
+ *
+ * Use HTRACE_LOG_RATE_LIMITED rather than calling this directly.
+ *
+ * @param lg            The log to use.
+ * @param rl            The state of the message site.
+ * @param level         The log level.
+ * @param interval_ms   The minimum interval between messages.
+ * @param fmt           The format string to use.
+ * @param ...           Printf-style variable length arguments.
+ */
+void htrace_log_rl(struct htrace_log *lg, struct htrace_log_rl *rl,
+                   int level, uint64_t interval_ms, const char *fmt, ...)
+      __attribute__((format(printf, 5, 6)));
+
+/**
+ * Log a message at most once per interval from this call site.
+ *
+ * Messages which are suppressed are counted.  The count is logged along with
+ * the next message which gets through.  Otherwise, it is logged once the
+ * interval has passed, by the asynchronous log thread, or when the log is
+ * freed.
+ *
+ * @param lg            The log to use.
+ * @param level         The log level.
+ * @param interval_ms   The minimum interval between messages.
+ * @param ...           The format string, and printf-style arguments.
+ */
+#define HTRACE_LOG_RATE_LIMITED(lg, level, interval_ms, ...) do { \
+    static struct htrace_log_rl htrace_log_rl_site; \
+    htrace_log_rl(lg, &htrace_log_rl_site, level, interval_ms, __VA_ARGS__); \
+} while (0)
+
 #endif
 
 // vim: ts=4:sw=4:et
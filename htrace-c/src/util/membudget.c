@@ -0,0 +1,371 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "util/log.h"
+#include "util/membudget.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file membudget.c
+ *
+ * Implementation of the process-wide tracing memory budget.
+ *
+ * The hot paths are a single atomic add to reserve and a single atomic load
+ * to check for pressure, so every allocation site can afford to use them.
+ */
+
+/**
+ * cgroup limits at or above this are treated as "no limit."  cgroup v1
+ * reports an unlimited group as a huge page-aligned number.
+ */
+#define MEMBUDGET_CGROUP_UNLIMITED (1ULL << 62)
+
+/**
+ * The cgroup filesystem mount point.
+ */
+#define MEMBUDGET_CGROUP_ROOT "/sys/fs/cgroup"
+
+/**
+ * The budget in bytes.
+ */
+static uint64_t g_membudget_limit = UINT64_MAX;
+
+/**
+ * The usage past which we are under pressure.
+ */
+static uint64_t g_membudget_watermark = UINT64_MAX;
+
+/**
+ * The statistics.  limit is not used here.
+ */
+static struct membudget_stats g_membudget_stats;
+
+/**
+ * A budget configured by one or more tracers.
+ */
+struct membudget_claim {
+    /**
+     * The next claim.
+     */
+    struct membudget_claim *next;
+
+    /**
+     * The budget in bytes.
+     */
+    uint64_t limit;
+
+    /**
+     * The number of tracers which configured this budget.
+     */
+    int refcnt;
+};
+
+/**
+ * Protects the list of claims, and serializes changes to the budget.
+ */
+static pthread_mutex_t g_membudget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The budgets configured by live tracers.  The smallest one is in effect.
+ * Protected by g_membudget_lock.
+ */
+static struct membudget_claim *g_membudget_claims;
+
+uint64_t membudget_parse_cgroup_limit(const char *str)
+{
+    unsigned long long val;
+    char *end;
+
+    if (strncmp(str, "max", 3) == 0) {
+        return 0;
+    }
+    errno = 0;
+    val = strtoull(str, &end, 10);
+    if (errno || (end == str) || ((*end != '\0') && (*end != '\n'))) {
+        return 0;
+    }
+    if (val >= MEMBUDGET_CGROUP_UNLIMITED) {
+        return 0;
+    }
+    return val;
+}
+
+static uint64_t membudget_read_limit_file(const char *path)
+{
+    char buf[64];
+    FILE *fp;
+    size_t res;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    res = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[res] = '\0';
+    return membudget_parse_cgroup_limit(buf);
+}
+
+/**
+ * Find the memory limit of the cgroup we are in.
+ *
+ * @return              The limit in bytes, or 0 if there is none.
+ */
+static uint64_t membudget_cgroup_limit(void)
+{
+    char line[4096], path[4200];
+    uint64_t limit = 0;
+    char *cpath;
+    FILE *fp;
+
+    // /proc/self/cgroup has lines like "0::/foo" for cgroup v2 and
+    // "4:memory:/foo" for the cgroup v1 memory controller.
+    fp = fopen("/proc/self/cgroup", "r");
+    if (fp) {
+        while ((!limit) && fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\n")] = '\0';
+            cpath = strchr(line, ':');
+            if (!cpath) {
+                continue;
+            }
+            cpath++;
+            if (strncmp(cpath, ":/", 2) == 0) {
+                snprintf(path, sizeof(path), "%s%s/memory.max",
+                         MEMBUDGET_CGROUP_ROOT, cpath + 1);
+                limit = membudget_read_limit_file(path);
+            } else if (strncmp(cpath, "memory:/", 8) == 0) {
+                snprintf(path, sizeof(path), "%s/memory%s/"
+                         "memory.limit_in_bytes", MEMBUDGET_CGROUP_ROOT,
+                         cpath + 7);
+                limit = membudget_read_limit_file(path);
+            }
+        }
+        fclose(fp);
+    }
+    // Inside a container, our own cgroup is usually mounted at the root.
+    if (!limit) {
+        limit = membudget_read_limit_file(MEMBUDGET_CGROUP_ROOT
+                                          "/memory.max");
+    }
+    if (!limit) {
+        limit = membudget_read_limit_file(MEMBUDGET_CGROUP_ROOT
+                                          "/memory/memory.limit_in_bytes");
+    }
+    return limit;
+}
+
+/**
+ * Put the smallest claimed budget into effect.
+ *
+ * Must be called with g_membudget_lock held.
+ */
+static void membudget_apply(struct htrace_log *lg)
+{
+    struct membudget_claim *claim;
+    uint64_t limit = UINT64_MAX;
+
+    for (claim = g_membudget_claims; claim; claim = claim->next) {
+        if (claim->limit < limit) {
+            limit = claim->limit;
+        }
+    }
+    if (limit == g_membudget_limit) {
+        return;
+    }
+    if (limit == UINT64_MAX) {
+        __atomic_store_n(&g_membudget_limit, limit, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_membudget_watermark, UINT64_MAX,
+                         __ATOMIC_RELAXED);
+        htrace_log(lg, "membudget_configure: there is no longer a tracing "
+                   "memory budget.\n");
+        return;
+    }
+    // Lower the watermark before the limit, and raise the limit before the
+    // watermark, so that the watermark never passes the limit.
+    if (limit < g_membudget_limit) {
+        __atomic_store_n(&g_membudget_watermark,
+                         (limit / 100) * MEMBUDGET_HIGH_WATERMARK_PCT,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&g_membudget_limit, limit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&g_membudget_limit, limit, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_membudget_watermark,
+                         (limit / 100) * MEMBUDGET_HIGH_WATERMARK_PCT,
+                         __ATOMIC_RELAXED);
+    }
+    htrace_log(lg, "membudget_configure: the tracing memory budget is "
+               "now %" PRId64 " bytes.\n", limit);
+}
+
+uint64_t membudget_configure(struct htrace_log *lg,
+                             const struct htrace_conf *cnf)
+{
+    struct membudget_claim *claim;
+    uint64_t limit, cgroup_limit;
+    double fraction;
+
+    limit = htrace_conf_get_u64(lg, cnf, HTRACE_MEMORY_BUDGET_KEY);
+    if (!limit) {
+        fraction = htrace_conf_get_double(lg, cnf,
+                        HTRACE_MEMORY_BUDGET_CGROUP_FRACTION_KEY);
+        if ((fraction <= 0) || (fraction > 1)) {
+            return UINT64_MAX;
+        }
+        cgroup_limit = membudget_cgroup_limit();
+        if (!cgroup_limit) {
+            return UINT64_MAX;
+        }
+        limit = cgroup_limit * fraction;
+    }
+    pthread_mutex_lock(&g_membudget_lock);
+    for (claim = g_membudget_claims; claim; claim = claim->next) {
+        if (claim->limit == limit) {
+            break;
+        }
+    }
+    if (claim) {
+        claim->refcnt++;
+    } else {
+        claim = malloc(sizeof(*claim));
+        if (!claim) {
+            pthread_mutex_unlock(&g_membudget_lock);
+            htrace_logl(lg, HTRACE_LOG_ERROR, "membudget_configure: OOM.  "
+                        "Not applying the tracing memory budget of %"
+                        PRId64 " bytes.\n", limit);
+            return UINT64_MAX;
+        }
+        claim->limit = limit;
+        claim->refcnt = 1;
+        claim->next = g_membudget_claims;
+        g_membudget_claims = claim;
+    }
+    membudget_apply(lg);
+    pthread_mutex_unlock(&g_membudget_lock);
+    return limit;
+}
+
+void membudget_unconfigure(struct htrace_log *lg, uint64_t limit)
+{
+    struct membudget_claim *claim, **prev;
+
+    if (limit == UINT64_MAX) {
+        return;
+    }
+    pthread_mutex_lock(&g_membudget_lock);
+    for (prev = &g_membudget_claims; (claim = *prev); prev = &claim->next) {
+        if (claim->limit == limit) {
+            if (--claim->refcnt == 0) {
+                *prev = claim->next;
+                free(claim);
+            }
+            break;
+        }
+    }
+    membudget_apply(lg);
+    pthread_mutex_unlock(&g_membudget_lock);
+}
+
+static void membudget_update_peak(uint64_t used)
+{
+    uint64_t peak;
+
+    peak = __atomic_load_n(&g_membudget_stats.peak, __ATOMIC_RELAXED);
+    while (used > peak) {
+        if (__atomic_compare_exchange_n(&g_membudget_stats.peak, &peak, used,
+                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+int membudget_reserve(uint64_t bytes)
+{
+    uint64_t used, watermark;
+
+    used = __atomic_add_fetch(&g_membudget_stats.used, bytes,
+                              __ATOMIC_RELAXED);
+    if (used > __atomic_load_n(&g_membudget_limit, __ATOMIC_RELAXED)) {
+        __atomic_sub_fetch(&g_membudget_stats.used, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&g_membudget_stats.denied, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    watermark = __atomic_load_n(&g_membudget_watermark, __ATOMIC_RELAXED);
+    if ((used > watermark) && (used - bytes <= watermark)) {
+        __atomic_add_fetch(&g_membudget_stats.pressure_events, 1,
+                           __ATOMIC_RELAXED);
+    }
+    membudget_update_peak(used);
+    return 1;
+}
+
+int membudget_reserve_below_watermark(uint64_t bytes)
+{
+    uint64_t used;
+
+    used = __atomic_add_fetch(&g_membudget_stats.used, bytes,
+                              __ATOMIC_RELAXED);
+    if (used > __atomic_load_n(&g_membudget_watermark, __ATOMIC_RELAXED)) {
+        __atomic_sub_fetch(&g_membudget_stats.used, bytes, __ATOMIC_RELAXED);
+        return 0;
+    }
+    membudget_update_peak(used);
+    return 1;
+}
+
+void membudget_release(uint64_t bytes)
+{
+    __atomic_sub_fetch(&g_membudget_stats.used, bytes, __ATOMIC_RELAXED);
+}
+
+int membudget_under_pressure(void)
+{
+    return __atomic_load_n(&g_membudget_stats.used, __ATOMIC_RELAXED) >
+        __atomic_load_n(&g_membudget_watermark, __ATOMIC_RELAXED);
+}
+
+int membudget_throttle(void)
+{
+    if (!membudget_under_pressure()) {
+        return 0;
+    }
+    __atomic_add_fetch(&g_membudget_stats.throttled, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void membudget_get_stats(struct membudget_stats *stats)
+{
+    stats->limit = __atomic_load_n(&g_membudget_limit, __ATOMIC_RELAXED);
+    stats->used = __atomic_load_n(&g_membudget_stats.used, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&g_membudget_stats.peak, __ATOMIC_RELAXED);
+    stats->denied = __atomic_load_n(&g_membudget_stats.denied,
+                                    __ATOMIC_RELAXED);
+    stats->pressure_events = __atomic_load_n(
+            &g_membudget_stats.pressure_events, __ATOMIC_RELAXED);
+    stats->throttled = __atomic_load_n(&g_membudget_stats.throttled,
+                                       __ATOMIC_RELAXED);
+}
+
+// vim: ts=4:sw=4:tw=79:et
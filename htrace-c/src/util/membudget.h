@@ -0,0 +1,178 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_MEMBUDGET_H
+#define APACHE_HTRACE_UTIL_MEMBUDGET_H
+
+/**
+ * @file membudget.h
+ *
+ * A process-wide budget for the memory which tracing uses.
+ *
+ * Every tracer in the process shares one budget, so that several libraries
+ * which each create their own tracer can't add up to more memory than the
+ * process is willing to spend on tracing.  Buffers and queues reserve their
+ * memory against the budget before allocating it, and fail the allocation if
+ * the reservation is denied.
+ *
+ * Once the memory in use passes the high watermark, the budget is "under
+ * pressure."  Samplers stop starting new traces, and receivers give back the
+ * memory they are not using, until usage falls again.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+struct htrace_conf;
+struct htrace_log;
+
+/**
+ * The fraction of the budget, in percent, past which the budget is under
+ * pressure.
+ */
+#define MEMBUDGET_HIGH_WATERMARK_PCT 80
+
+struct membudget_stats {
+    /**
+     * The budget in bytes, or UINT64_MAX if there is none.
+     */
+    uint64_t limit;
+
+    /**
+     * The number of bytes currently reserved.
+     */
+    uint64_t used;
+
+    /**
+     * The largest number of bytes which have been reserved at once.
+     */
+    uint64_t peak;
+
+    /**
+     * The number of reservations which were denied.
+     */
+    uint64_t denied;
+
+    /**
+     * The number of times usage has crossed the high watermark.
+     */
+    uint64_t pressure_events;
+
+    /**
+     * The number of traces which were not started because of pressure.
+     */
+    uint64_t throttled;
+};
+
+/**
+ * Add a budget from a configuration.
+ *
+ * If HTRACE_MEMORY_BUDGET_KEY is set, that is the budget.  Otherwise, the
+ * budget is a fraction of the cgroup memory limit, if there is one.  Each
+ * tracer adds its own budget, and the smallest budget of all the live
+ * tracers is in effect.
+ *
+ * @param lg            The log to use.
+ * @param cnf           The configuration.
+ *
+ * @return              The budget which was added, to be passed to
+ *                          membudget_unconfigure.  UINT64_MAX if the
+ *                          configuration has no budget.
+ */
+uint64_t membudget_configure(struct htrace_log *lg,
+                             const struct htrace_conf *cnf);
+
+/**
+ * Remove a budget added with membudget_configure.
+ *
+ * If it was the smallest budget, the next smallest one takes effect.
+ *
+ * @param lg            The log to use.
+ * @param limit         The value returned by membudget_configure.
+ */
+void membudget_unconfigure(struct htrace_log *lg, uint64_t limit);
+
+/**
+ * Reserve memory against the budget.
+ *
+ * @param bytes         The number of bytes to reserve.
+ *
+ * @return              1 if the memory was reserved; 0 if it would exceed
+ *                          the budget.
+ */
+int membudget_reserve(uint64_t bytes);
+
+/**
+ * Reserve memory against the budget, unless that would put the budget under
+ * pressure.
+ *
+ * This is for memory which is allocated ahead of need and never given back
+ * while it is in use, such as prefaulted buffers.  If that memory could push
+ * usage past the high watermark, new traces would be throttled for good.
+ *
+ * @param bytes         The number of bytes to reserve.
+ *
+ * @return              1 if the memory was reserved; 0 if it would put usage
+ *                          past the high watermark.
+ */
+int membudget_reserve_below_watermark(uint64_t bytes);
+
+/**
+ * Release memory reserved with membudget_reserve.
+ *
+ * @param bytes         The number of bytes to release.
+ */
+void membudget_release(uint64_t bytes);
+
+/**
+ * Determine whether the budget is under pressure.
+ *
+ * @return              1 if usage is past the high watermark; 0 otherwise.
+ */
+int membudget_under_pressure(void);
+
+/**
+ * Determine whether to throttle the start of a new trace.  Counts the
+ * throttled traces.
+ *
+ * @return              1 if the new trace should not be started; 0
+ *                          otherwise.
+ */
+int membudget_throttle(void);
+
+/**
+ * Get the budget statistics.
+ *
+ * @param stats         (out param) The statistics.
+ */
+void membudget_get_stats(struct membudget_stats *stats);
+
+/**
+ * Parse the contents of a cgroup memory limit file.
+ *
+ * @param str           The file contents: a number of bytes, or "max".
+ *
+ * @return              The limit in bytes, or 0 if there is no limit or the
+ *                          contents could not be parsed.
+ */
+uint64_t membudget_parse_cgroup_limit(const char *str);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
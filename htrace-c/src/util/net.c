@@ -0,0 +1,189 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/log.h"
+#include "util/net.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * @file net.c
+ *
+ * Socket helpers shared by the HRPC and HTTP clients.
+ */
+
+/**
+ * The maximum number of buffers to pass to a single sendmsg call.
+ */
+#ifdef IOV_MAX
+#define NET_IOV_MAX IOV_MAX
+#else
+#define NET_IOV_MAX 16
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static int net_set_port(struct htrace_log *lg, struct sockaddr *addr,
+                        int ai_family, int port, const char *addr_str)
+{
+    switch (ai_family) {
+    case AF_INET: {
+        struct sockaddr_in *in4 = (struct sockaddr_in*)addr;
+        in4->sin_port = htons(port);
+        return 1;
+    }
+    case AF_INET6: {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6*)addr;
+        in6->sin6_port = htons(port);
+        return 1;
+    }
+    default:
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "net_socket_create(%s): set_port %d failed: unknown "
+                    "ai_family %d\n", addr_str, port, ai_family);
+        return 0;
+    }
+}
+
+static int net_set_timeouts(struct htrace_log *lg, int sock,
+                            uint64_t write_timeo_ms, uint64_t read_timeo_ms)
+{
+    struct timeval tv;
+
+    ms_to_timeval(read_timeo_ms, &tv);
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        int e = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "setsockopt(%d, SO_RCVTIMEO, %"PRId64") failed: "
+                    "error %d (%s)\n", sock, read_timeo_ms, e, terror(e));
+        return 0;
+    }
+
+    ms_to_timeval(write_timeo_ms, &tv);
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        int e = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "setsockopt(%d, SO_SNDTIMEO, %"PRId64") failed: "
+                    "error %d (%s)\n", sock, write_timeo_ms, e, terror(e));
+        return 0;
+    }
+    return 1;
+}
+
+int net_socket_create(struct htrace_log *lg, struct addrinfo *p, int port,
+                      uint64_t write_timeo_ms, uint64_t read_timeo_ms,
+                      char *addr_str, size_t addr_str_len)
+{
+    int e, sock = -1;
+    char ip[INET6_ADDRSTRLEN];
+
+    e = getnameinfo(p->ai_addr, p->ai_addrlen,
+                ip, sizeof(ip), 0, 0, NI_NUMERICHOST);
+    if (e) {
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "net_socket_create: getnameinfo failed.  error "
+                    "%d: %s\n", e, gai_strerror(e));
+        return -1;
+    }
+    snprintf(addr_str, addr_str_len, "%s:%d", ip, port);
+    if (!net_set_port(lg, p->ai_addr, p->ai_family, port, addr_str)) {
+        goto error;
+    }
+    sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (sock < 0) {
+        e = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "net_socket_create(%s): failed to create new "
+                    "socket: error %d (%s)\n", addr_str, e, terror(e));
+        goto error;
+    }
+    if (fcntl(sock, F_SETFD, FD_CLOEXEC) < 0) {
+        e = errno;
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "net_socket_create(%s): fcntl(FD_CLOEXEC) "
+                    "failed: error %d (%s)\n", addr_str, e, terror(e));
+        goto error;
+    }
+    if (!net_set_timeouts(lg, sock, write_timeo_ms, read_timeo_ms)) {
+        goto error;
+    }
+    return sock;
+
+error:
+    if (sock >= 0) {
+        close(sock);
+    }
+    return -1;
+}
+
+int net_writev_fully(int sock, struct iovec *iov, int iov_cnt)
+{
+    struct msghdr msg;
+    ssize_t res;
+    int e;
+
+    while (1) {
+        // Skip over buffers which have been completely written.
+        while ((iov_cnt > 0) && (iov->iov_len == 0)) {
+            iov++;
+            iov_cnt--;
+        }
+        if (iov_cnt == 0) {
+            return 0;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (iov_cnt < NET_IOV_MAX) ? iov_cnt : NET_IOV_MAX;
+        res = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (res < 0) {
+            e = errno;
+            if (e == EINTR) {
+                continue;
+            }
+            return e;
+        }
+        while (res > 0) {
+            if (iov->iov_len <= (size_t)res) {
+                res -= iov->iov_len;
+                iov->iov_len = 0;
+                iov++;
+                iov_cnt--;
+            } else {
+                iov->iov_base = ((char*)iov->iov_base) + res;
+                iov->iov_len -= res;
+                res = 0;
+            }
+        }
+    }
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,83 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_NET_H
+#define APACHE_HTRACE_UTIL_NET_H
+
+/**
+ * @file net.h
+ *
+ * Socket helpers shared by the HRPC and HTTP clients.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <netinet/in.h> /* for INET6_ADDRSTRLEN */
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uint64_t */
+
+struct addrinfo;
+struct htrace_log;
+struct iovec;
+
+/**
+ * The size of a buffer which can hold any "ip:port" string.
+ */
+#define NET_ADDR_STR_MAX (2 + INET6_ADDRSTRLEN + sizeof(":65536"))
+
+/**
+ * Create a TCP socket for one of the addresses returned by getaddrinfo, ready
+ * to be connected.
+ *
+ * The socket is close-on-exec, and has the given send and receive timeouts.
+ * The port is written into p->ai_addr.
+ *
+ * @param lg                The log to write errors to.
+ * @param p                 The address.
+ * @param port              The port to connect to.
+ * @param write_timeo_ms    The send timeout in milliseconds.
+ * @param read_timeo_ms     The receive timeout in milliseconds.
+ * @param addr_str          (out param) The "ip:port" string for the address,
+ *                              for error messages.
+ * @param addr_str_len      The size of addr_str.  NET_ADDR_STR_MAX is always
+ *                              enough.
+ *
+ * @return                  The socket, or -1 on error.
+ */
+int net_socket_create(struct htrace_log *lg, struct addrinfo *p, int port,
+                      uint64_t write_timeo_ms, uint64_t read_timeo_ms,
+                      char *addr_str, size_t addr_str_len);
+
+/**
+ * Write out every byte in an array of buffers.
+ *
+ * We use sendmsg rather than writev so that a connection which the peer has
+ * closed gives us EPIPE rather than SIGPIPE.
+ *
+ * @param sock          The socket.
+ * @param iov           The buffers.  This array will be modified as the
+ *                          buffers are written.
+ * @param iov_cnt       The number of buffers.
+ *
+ * @return              0 on success; the error code otherwise.
+ */
+int net_writev_fully(int sock, struct iovec *iov, int iov_cnt);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
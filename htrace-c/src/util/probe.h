@@ -0,0 +1,77 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_PROBE_H
+#define APACHE_HTRACE_UTIL_PROBE_H
+
+/**
+ * @file probe.h
+ *
+ * USDT (SystemTap / DTrace style) static probe points.
+ *
+ * External tools such as bpftrace, perf and stap can attach to these probes
+ * in a running process without any change to the HTrace configuration.  A
+ * probe which nothing is attached to is a single nop instruction.  The
+ * probes are compiled in when sys/sdt.h is available, unless the build is
+ * configured with -DHTRACE_USDT=OFF.
+ *
+ * All probes belong to the "htrace" provider:
+ *
+ *   span__start(id_high, id_low, desc, begin_us)
+ *      A span was opened.
+ *   span__unsampled(desc)
+ *      The sampler decided not to trace an operation.  For
+ *      htrace_start_spanf, the argument is the format string.
+ *   span__close(id_high, id_low, desc, begin_us, end_us)
+ *      A span was closed, just before it is handed to the span receiver.
+ *   htraced__xmit(num_spans, num_bytes, success)
+ *      The htraced receiver finished sending a buffer.
+ *   htraced__drop(id_high, id_low, desc, reason)
+ *      The htraced receiver dropped a span instead of buffering it.  The
+ *      reason is a string.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include "util/build.h"
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define HTRACE_PROBE1(name, a1) \
+    DTRACE_PROBE1(htrace, name, a1)
+#define HTRACE_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(htrace, name, a1, a2, a3)
+#define HTRACE_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(htrace, name, a1, a2, a3, a4)
+#define HTRACE_PROBE5(name, a1, a2, a3, a4, a5) \
+    DTRACE_PROBE5(htrace, name, a1, a2, a3, a4, a5)
+
+#else
+
+#define HTRACE_PROBE1(name, a1) do { } while (0)
+#define HTRACE_PROBE3(name, a1, a2, a3) do { } while (0)
+#define HTRACE_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#define HTRACE_PROBE5(name, a1, a2, a3, a4, a5) do { } while (0)
+
+#endif
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
@@ -58,6 +58,18 @@ uint32_t random_u32(struct random_src *rnd);
  */
 uint64_t random_u64(struct random_src *rnd);
 
+/**
+ * Fills an array with random 64-bit numbers from the random source.
+ *
+ * This is cheaper than calling random_u64 repeatedly when many numbers are
+ * needed at once.
+ *
+ * @param rnd     The random source.
+ * @param vals    The array to fill.
+ * @param num     The number of elements to fill.
+ */
+void random_u64_fill(struct random_src *rnd, uint64_t *vals, int num);
+
 #endif
 
 // vim: ts=4:sw=4:et
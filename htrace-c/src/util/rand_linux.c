@@ -39,6 +39,9 @@
  * random numbers from /dev/urandom.  To avoid reading from /dev/urandom too
  * often, we have a thread-local cache of random data.  This is done using ELF
  * TLS.
+ *
+ * /dev/urandom is opened the first time we need random data, so that
+ * processes which never create a span don't pay for it.
  */
 
 struct random_src {
@@ -48,7 +51,8 @@ struct random_src {
     struct htrace_log *lg;
 
     /**
-     * File descriptor for /dev/urandom.
+     * File descriptor for /dev/urandom, or -1 if it hasn't been opened yet.
+     * Accessed atomically.
      */
     int urandom_fd;
 };
@@ -63,51 +67,91 @@ static __thread uint32_t g_rnd_cache[PSAMP_THREAD_LOCAL_BUF_LEN];
  */
 static __thread int g_rnd_cache_idx = PSAMP_THREAD_LOCAL_BUF_LEN;
 
-static void refill_rand_cache(struct random_src *rnd)
+/**
+ * Get the /dev/urandom file descriptor, opening it if necessary.
+ *
+ * @param rnd       The random source.
+ *
+ * @return          The file descriptor, or a negative error number.
+ */
+static int get_urandom_fd(struct random_src *rnd)
+{
+    int fd, expected = -1;
+
+    fd = __atomic_load_n(&rnd->urandom_fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0) {
+        return fd;
+    }
+    fd = open(URANDOM_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (!__atomic_compare_exchange_n(&rnd->urandom_fd, &expected, fd, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // Another thread opened it first.
+        close(fd);
+        fd = expected;
+    }
+    return fd;
+}
+
+/**
+ * Read random bytes from /dev/urandom.
+ *
+ * @param rnd       The random source.
+ * @param buf       The buffer to fill.
+ * @param len       The number of bytes to read.
+ *
+ * @return          0 on success; the error number otherwise.
+ */
+static int read_urandom(struct random_src *rnd, void *buf, size_t len)
 {
     size_t total = 0;
+    int fd;
 
-    while (1) {
+    fd = get_urandom_fd(rnd);
+    if (fd < 0) {
+        return -fd;
+    }
+    while (total < len) {
         ssize_t res;
-        ssize_t rem = (PSAMP_THREAD_LOCAL_BUF_LEN * sizeof(uint32_t)) - total;
-        if (rem == 0) {
-            break;
-        }
-        res = read(rnd->urandom_fd, ((uint8_t*)&g_rnd_cache) + total, rem);
+        res = read(fd, ((uint8_t*)buf) + total, len - total);
         if (res < 0) {
             int err = errno;
             if (err == EINTR) {
                 continue;
             }
-            htrace_log(rnd->lg, "refill_rand_cache: error refilling "
-                       "random cache: %d (%s)\n", err,
-                       terror(err));
-            return;
+            return err;
         }
         total += res;
     }
+    return 0;
+}
+
+static void refill_rand_cache(struct random_src *rnd)
+{
+    int err;
+
+    err = read_urandom(rnd, g_rnd_cache, sizeof(g_rnd_cache));
+    if (err) {
+        htrace_logl(rnd->lg, HTRACE_LOG_ERROR,
+                    "refill_rand_cache: error refilling "
+                    "random cache: %d (%s)\n", err, terror(err));
+        return;
+    }
     g_rnd_cache_idx = 0;
 }
 
 struct random_src *random_src_alloc(struct htrace_log *lg)
 {
     struct random_src *rnd;
-    int err;
 
     rnd = calloc(1, sizeof(*rnd));
     if (!rnd) {
-        htrace_log(lg, "random_src_alloc: OOM\n");
-        return NULL;
-    }
-    rnd->urandom_fd = open(URANDOM_PATH, O_RDONLY);
-    if (rnd->urandom_fd < 0) {
-        err = errno;
-        htrace_log(lg, "random_src_alloc: failed to open "
-                   URANDOM_PATH ": error %d (%s)\n", err,
-                   terror(err));
-        free(rnd);
+        htrace_logl(lg, HTRACE_LOG_ERROR, "random_src_alloc: OOM\n");
         return NULL;
     }
+    rnd->urandom_fd = -1;
     rnd->lg = lg;
     return rnd;
 }
@@ -117,10 +161,11 @@ void random_src_free(struct random_src *rnd)
     if (!rnd) {
         return;
     }
-    if (close(rnd->urandom_fd)) {
+    if ((rnd->urandom_fd >= 0) && close(rnd->urandom_fd)) {
         int err = errno;
-        htrace_log(rnd->lg, "linux_prob_sampler_free: close error: "
-                   "%d (%s)\n", err, terror(err));
+        htrace_logl(rnd->lg, HTRACE_LOG_ERROR,
+                    "linux_prob_sampler_free: close error: "
+                    "%d (%s)\n", err, terror(err));
     }
     free(rnd);
 }
@@ -140,4 +185,25 @@ uint64_t random_u64(struct random_src *rnd)
     return val | random_u32(rnd);
 }
 
+void random_u64_fill(struct random_src *rnd, uint64_t *vals, int num)
+{
+    size_t len = num * sizeof(uint64_t);
+    int i, err;
+
+    // Large requests would drain the thread-local cache several times over.
+    // Read them directly instead, in a single system call.
+    if (len >= sizeof(g_rnd_cache)) {
+        err = read_urandom(rnd, vals, len);
+        if (!err) {
+            return;
+        }
+        htrace_logl(rnd->lg, HTRACE_LOG_ERROR,
+                    "random_u64_fill: error reading %zu random "
+                    "bytes: %d (%s)\n", len, err, terror(err));
+    }
+    for (i = 0; i < num; i++) {
+        vals[i] = random_u64(rnd);
+    }
+}
+
 // vim: ts=4:sw=4:tw=79:et
@@ -59,13 +59,14 @@ struct random_src *random_src_alloc(struct htrace_log *lg)
 
     rnd = calloc(1, sizeof(*rnd));
     if (!rnd) {
-        htrace_log(lg, "random_src_alloc: OOM\n");
+        htrace_logl(lg, HTRACE_LOG_ERROR, "random_src_alloc: OOM\n");
         return NULL;
     }
     ret = pthread_mutex_init(&rnd->lock, NULL);
     if (ret) {
-        htrace_log(lg, "random_src_alloc: pthread_mutex_create "
-                   "failed: error %d (%s)\n", ret, terror(ret));
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "random_src_alloc: pthread_mutex_create "
+                    "failed: error %d (%s)\n", ret, terror(ret));
         free(rnd);
         return NULL;
     }
@@ -97,10 +98,13 @@ uint32_t random_u32(struct random_src *rnd)
     return val;
 }
 
-uint64_t random_u64(struct random_src *rnd)
+/**
+ * Generate a 64-bit random value.  Must be called with rnd->lock held.
+ */
+static inline uint64_t random_u64_locked(struct random_src *rnd)
 {
     uint64_t val = 0;
-    pthread_mutex_lock(&rnd->lock);
+
     // rand_r gives at least 15 bits of randomness.
     // So we need to xor it 5 times to get 64 bits' worth.
     val ^= rand_r(&rnd->rand_state);
@@ -113,8 +117,29 @@ uint64_t random_u64(struct random_src *rnd)
     val <<= 15;
     val ^= rand_r(&rnd->rand_state);
     val <<= 15;
+    return val;
+}
+
+uint64_t random_u64(struct random_src *rnd)
+{
+    uint64_t val;
+
+    pthread_mutex_lock(&rnd->lock);
+    val = random_u64_locked(rnd);
     pthread_mutex_unlock(&rnd->lock);
     return val;
 }
 
+void random_u64_fill(struct random_src *rnd, uint64_t *vals, int num)
+{
+    int i;
+
+    // Take the lock once for the whole batch.
+    pthread_mutex_lock(&rnd->lock);
+    for (i = 0; i < num; i++) {
+        vals[i] = random_u64_locked(rnd);
+    }
+    pthread_mutex_unlock(&rnd->lock);
+}
+
 // vim: ts=4:sw=4:tw=79:et
@@ -97,8 +97,9 @@ int validate_json_string(struct htrace_log *lg, const char *str)
         // doesn't support them directly (they have to be encoded with UCS-2
         // surrogate pairs).  TODO: teach htraced to do that encoding.
         if (lg) {
-            htrace_log(lg, "validate_json_string(%s): byte %d (0x%02x) "
-                       "was problematic.\n", str, off, b[0]);
+            htrace_logl(lg, HTRACE_LOG_WARN,
+                        "validate_json_string(%s): byte %d (0x%02x) "
+                        "was problematic.\n", str, off, b[0]);
         }
         return 0;
     }
@@ -117,8 +118,9 @@ int parse_endpoint(struct htrace_log *lg, const char *endpoint,
         remotestr = endpoint + 1;
         remote_len = strcspn(remotestr, "]");
         if (remotestr[remote_len] != ']') {
-            htrace_log(lg, "parse_hostport: found open square bracket, but "
-                       "not matching close square bracket.\n");
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "parse_hostport: found open square bracket, but "
+                        "not matching close square bracket.\n");
             return 0;
         }
         if (remotestr[remote_len + 1] == ':') {
@@ -137,8 +139,9 @@ int parse_endpoint(struct htrace_log *lg, const char *endpoint,
     }
     remote = malloc(remote_len + 1);
     if (!remote) {
-        htrace_log(lg, "parse_hostport: unable to allocate %d-byte string.\n",
-                   remote_len);
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "parse_hostport: unable to allocate %d-byte string.\n",
+                    remote_len);
         return 0;
     }
     memcpy(remote, remotestr, remote_len);
@@ -149,8 +152,8 @@ int parse_endpoint(struct htrace_log *lg, const char *endpoint,
         int p = atoi(portstr);
         if ((p <= 0) || (p > 0xffff)) {
             free(remote);
-            htrace_log(lg, "parse_hostport: parse port string '%s'\n",
-                       portstr);
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "parse_hostport: parse port string '%s'\n", portstr);
             return 0;
         }
         *port = p;
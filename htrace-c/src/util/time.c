@@ -20,6 +20,7 @@
 #include "util/time.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -70,8 +71,9 @@ uint64_t now_ms(struct htrace_log *lg)
     if (clock_gettime(CLOCK_REALTIME, &ts)) {
         err = errno;
         if (lg) {
-            htrace_log(lg, "clock_gettime(CLOCK_REALTIME) error: %d (%s)\n",
-                       err, terror(err));
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "clock_gettime(CLOCK_REALTIME) error: %d (%s)\n", err,
+                        terror(err));
         }
         return 0;
     }
@@ -86,8 +88,9 @@ uint64_t now_us(struct htrace_log *lg)
     if (clock_gettime(CLOCK_REALTIME, &ts)) {
         err = errno;
         if (lg) {
-            htrace_log(lg, "clock_gettime(CLOCK_REALTIME) error: %d (%s)\n",
-                       err, terror(err));
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "clock_gettime(CLOCK_REALTIME) error: %d (%s)\n", err,
+                        terror(err));
         }
         return 0;
     }
@@ -102,8 +105,9 @@ uint64_t monotonic_now_ms(struct htrace_log *lg)
     if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
         err = errno;
         if (lg) {
-            htrace_log(lg, "clock_gettime(CLOCK_MONOTONIC) error: %d (%s)\n",
-                       err, terror(err));
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "clock_gettime(CLOCK_MONOTONIC) error: %d (%s)\n",
+                        err, terror(err));
         }
         return 0;
     }
@@ -127,4 +131,21 @@ void sleep_ms(uint64_t ms)
     } while (0);
 }
 
+int monotonic_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    int ret;
+
+    ret = pthread_condattr_init(&attr);
+    if (ret) {
+        return ret;
+    }
+    ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (!ret) {
+        ret = pthread_cond_init(cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+    return ret;
+}
+
 // vim: ts=4:sw=4:et
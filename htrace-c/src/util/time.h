@@ -27,6 +27,7 @@
  * This is an internal header, not intended for external use.
  */
 
+#include <pthread.h>
 #include <stdint.h>
 
 struct htrace_log;
@@ -103,6 +104,17 @@ uint64_t monotonic_now_ms(struct htrace_log *log);
  */
 void sleep_ms(uint64_t ms);
 
+/**
+ * Initialize a condition variable whose timed waits use the monotonic clock,
+ * so that deadlines from monotonic_now_ms can be passed to
+ * pthread_cond_timedwait.
+ *
+ * @param cond          The condition variable to initialize.
+ *
+ * @return              0 on success; the error code otherwise.
+ */
+int monotonic_cond_init(pthread_cond_t *cond);
+
 #endif
 
 // vim: ts=4:sw=4:et
@@ -22,6 +22,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <ifaddrs.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,6 +55,18 @@ enum ip_addr_type {
 static int handle_process_subst_var(struct htrace_log *lg, char **out,
                                     const char *var, const char *tname);
 
+/**
+ * Lock protecting g_best_ip.
+ */
+static pthread_mutex_t g_best_ip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The best IP address for this node, or the empty string if we haven't
+ * looked it up yet.  Enumerating the network interfaces is slow, so we only
+ * do it once per process, rather than once per tracer.
+ */
+static char g_best_ip[128];
+
 enum ip_addr_type get_ipv4_addr_type(const struct sockaddr_in *ip);
 
 enum ip_addr_type get_ipv6_addr_type(const struct sockaddr_in6 *ip);
@@ -146,15 +159,17 @@ char *calculate_tracer_id(struct htrace_log *lg, const char *fmt,
     }
     out[j] = '\0';
     if (v > 0) {
-      htrace_log(lg, "calculate_tracer_id(%s): unterminated process ID "
-                 "substitution variable at the end of the format string.",
-                 fmt);
+      htrace_logl(lg, HTRACE_LOG_WARN,
+                  "calculate_tracer_id(%s): unterminated process ID "
+                  "substitution variable at the end of the format string.",
+                  fmt);
     }
     free(var);
     return out;
 
 oom:
-    htrace_log(lg, "calculate_tracer_id(tname=%s): OOM\n", tname);
+    htrace_logl(lg, HTRACE_LOG_ERROR,
+                "calculate_tracer_id(tname=%s): OOM\n", tname);
     free(out);
     free(var);
     return NULL;
@@ -167,7 +182,8 @@ static int handle_process_subst_var(struct htrace_log *lg, char **out,
 
     if (strcmp(var, "%{tname}") == 0) {
         if (asprintf(&nout, "%s%s", *out, tname) < 0) {
-            htrace_log(lg, "handle_process_subst_var(var=%s): OOM", var);
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "handle_process_subst_var(var=%s): OOM", var);
             return 0;
         }
         free(*out);
@@ -176,7 +192,8 @@ static int handle_process_subst_var(struct htrace_log *lg, char **out,
         char ip_str[256];
         get_best_ip(lg, ip_str, sizeof(ip_str));
         if (asprintf(&nout, "%s%s", *out, ip_str) < 0) {
-            htrace_log(lg, "handle_process_subst_var(var=%s): OOM", var);
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "handle_process_subst_var(var=%s): OOM", var);
             return 0;
         }
         free(*out);
@@ -187,14 +204,16 @@ static int handle_process_subst_var(struct htrace_log *lg, char **out,
 
         snprintf(pid_str, sizeof(pid_str), "%lld", (long long)pid);
         if (asprintf(&nout, "%s%s", *out, pid_str) < 0) {
-            htrace_log(lg, "handle_process_subst_var(var=%s): OOM", var);
+            htrace_logl(lg, HTRACE_LOG_ERROR,
+                        "handle_process_subst_var(var=%s): OOM", var);
             return 0;
         }
         free(*out);
         *out = nout;
     } else {
-        htrace_log(lg, "handle_process_subst_var(var=%s): unknown process "
-                   "ID substitution variable.\n", var);
+        htrace_logl(lg, HTRACE_LOG_WARN,
+                    "handle_process_subst_var(var=%s): unknown process "
+                    "ID substitution variable.\n", var);
     }
     return 1;
 }
@@ -211,7 +230,8 @@ static int handle_process_subst_var(struct htrace_log *lg, char **out,
  * order.  This should ensure that we at least consistently call each node
  * by a single name.
  */
-void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
+static void get_best_ip_impl(struct htrace_log *lg, char *ip_str,
+                            size_t ip_str_len)
 {
     struct ifaddrs *head, *ifa;
     enum ip_addr_type ty = ADDR_TYPE_IPV4_LOOPBACK, nty;
@@ -220,7 +240,8 @@ void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
     snprintf(ip_str, ip_str_len, "%s", "127.0.0.1");
     if (getifaddrs(&head) < 0) {
         int res = errno;
-        htrace_log(lg, "get_best_ip: getifaddrs failed: %s\n", terror(res));
+        htrace_logl(lg, HTRACE_LOG_ERROR,
+                    "get_best_ip: getifaddrs failed: %s\n", terror(res));
         return;
     }
     for (ifa = head; ifa; ifa = ifa->ifa_next){
@@ -236,8 +257,9 @@ void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
             }
             if (!inet_ntop(AF_INET, &addr->sin_addr, temp_ip_str,
                            sizeof(temp_ip_str))) {
-                htrace_log(lg, "get_best_ip_impl: inet_ntop(%s, AF_INET) "
-                           "failed\n", ifa->ifa_name);
+                htrace_logl(lg, HTRACE_LOG_WARN,
+                            "get_best_ip_impl: inet_ntop(%s, AF_INET) "
+                            "failed\n", ifa->ifa_name);
                 continue;
             }
             if ((nty == ty) && (strcmp(temp_ip_str, ip_str) > 0)) {
@@ -254,8 +276,9 @@ void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
             }
             if (!inet_ntop(AF_INET6, &addr->sin6_addr, temp_ip_str,
                            sizeof(temp_ip_str))) {
-                htrace_log(lg, "get_best_ip_impl: inet_ntop(%s, AF_INET6) "
-                           "failed\n", ifa->ifa_name);
+                htrace_logl(lg, HTRACE_LOG_WARN,
+                            "get_best_ip_impl: inet_ntop(%s, AF_INET6) "
+                            "failed\n", ifa->ifa_name);
                 continue;
             }
             if ((nty == ty) && (strcmp(temp_ip_str, ip_str) > 0)) {
@@ -268,6 +291,16 @@ void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
     freeifaddrs(head);
 }
 
+void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
+{
+    pthread_mutex_lock(&g_best_ip_lock);
+    if (!g_best_ip[0]) {
+        get_best_ip_impl(lg, g_best_ip, sizeof(g_best_ip));
+    }
+    snprintf(ip_str, ip_str_len, "%s", g_best_ip);
+    pthread_mutex_unlock(&g_best_ip_lock);
+}
+
 enum ip_addr_type get_ipv4_addr_type(const struct sockaddr_in *ip)
 {
     union {
@@ -47,6 +47,9 @@ char *calculate_tracer_id(struct htrace_log *lg, const char *fmt,
 /**
  * Get the best IP address representing this host.
  *
+ * The address is looked up the first time this is called, and cached for the
+ * life of the process.
+ *
  * @param lg                A log object which will be used to report warnings.
  * @param ip_str            (out param) output string
  * @param ip_str_len        Length of output string